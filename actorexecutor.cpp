@@ -0,0 +1,204 @@
+#include "actorexecutor.h"
+#include "rtmpexception.h"
+#include "metrics.h"
+#include "log.h"
+
+ActorQueue::ActorQueue(ActorExecutor* executor):
+    executor_(executor),
+    scheduled_(false)
+{
+}
+
+void ActorQueue::post(const boost::function<void()>& task)
+{
+    bool schedule = false;
+
+    Metrics::add(MET_ActorTasks);
+    {
+        boost::lock_guard<boost::mutex> lk(mt_);
+        tasks_.push_back(task);
+
+        if(!scheduled_)
+        {
+            scheduled_ = true;
+            schedule = true;
+        }
+    }
+
+    if(schedule)
+    {
+        executor_->schedule(shared_from_this());
+    }
+}
+
+void ActorQueue::run()
+{
+    for(int i = 0; i < BATCH; i++)
+    {
+        boost::function<void()> task;
+        {
+            boost::lock_guard<boost::mutex> lk(mt_);
+            if(tasks_.empty())
+            {
+                scheduled_ = false;
+                return;
+            }
+
+            task.swap(tasks_.front());
+            tasks_.pop_front();
+        }
+        Metrics::sub(MET_ActorTasks);
+
+        try
+        {
+            task();
+        }
+        catch(RtmpException& e)
+        {
+            RTMP_LOG(LEVERROR, "actor task failed: %s\n", e.what());
+        }
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lk(mt_);
+        if(tasks_.empty())
+        {
+            scheduled_ = false;
+            return;
+        }
+    }
+
+    // to the back of the line, still scheduled
+    executor_->schedule(shared_from_this());
+}
+
+ActorExecutor::ActorExecutor(int threads):
+    current_(keepWorker),
+    next_(0),
+    ready_(0),
+    stop_(false)
+{
+    if(threads < 1)
+    {
+        throw RtmpInvalidArg("executor needs a thread");
+    }
+
+    for(int i = 0; i < threads; i++)
+    {
+        workers_.push_back(new Worker());
+    }
+
+    for(int i = 0; i < threads; i++)
+    {
+        threads_.create_thread(boost::bind(&ActorExecutor::loop, this, i));
+    }
+}
+
+ActorExecutor::~ActorExecutor()
+{
+    {
+        boost::lock_guard<boost::mutex> lk(idleMt_);
+        stop_ = true;
+    }
+    idleCv_.notify_all();
+
+    threads_.join_all();
+
+    for(size_t i = 0; i < workers_.size(); i++)
+    {
+        delete workers_[i];
+    }
+}
+
+// workers are owned by the executor, not by their threads
+void ActorExecutor::keepWorker(Worker*)
+{
+}
+
+ActorQueuePtr ActorExecutor::createQueue()
+{
+    return ActorQueuePtr(new ActorQueue(this));
+}
+
+void ActorExecutor::schedule(const ActorQueuePtr& queue)
+{
+    Worker* w = current_.get();
+    if(!w)
+    {
+        w = workers_[next_.fetch_add(1, boost::memory_order_relaxed) % workers_.size()];
+    }
+
+    // counted before it can be taken, or take() would drop ready_ below 0
+    {
+        boost::lock_guard<boost::mutex> lk(idleMt_);
+        ready_.fetch_add(1);
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lk(w->mt);
+        w->ready.push_back(queue);
+    }
+    idleCv_.notify_one();
+}
+
+ActorQueuePtr ActorExecutor::take(int self)
+{
+    ActorQueuePtr queue;
+    int count = workers_.size();
+
+    for(int i = 0; i < count && !queue; i++)
+    {
+        Worker* w = workers_[(self + i) % count];
+        boost::lock_guard<boost::mutex> lk(w->mt);
+
+        if(w->ready.empty())
+        {
+            continue;
+        }
+
+        // the own deque from the front, the others' from the back
+        if(i == 0)
+        {
+            queue = w->ready.front();
+            w->ready.pop_front();
+        }
+        else
+        {
+            queue = w->ready.back();
+            w->ready.pop_back();
+        }
+    }
+
+    if(queue)
+    {
+        ready_.fetch_sub(1);
+    }
+
+    return queue;
+}
+
+void ActorExecutor::loop(int self)
+{
+    current_.reset(workers_[self]);
+
+    while(true)
+    {
+        ActorQueuePtr queue = take(self);
+        if(queue)
+        {
+            queue->run();
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> lk(idleMt_);
+        while(ready_.load() == 0 && !stop_)
+        {
+            idleCv_.wait(lk);
+        }
+
+        if(ready_.load() == 0)
+        {
+            return;
+        }
+    }
+}
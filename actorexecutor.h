@@ -0,0 +1,90 @@
+#ifndef ACTOR_EXECUTOR_H
+#define ACTOR_EXECUTOR_H
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+class ActorExecutor;
+
+/*
+ * the tasks of one stream, run one at a time in the order they were
+ * posted, on whichever executor thread picks the queue up
+ */
+class ActorQueue : public boost::enable_shared_from_this<ActorQueue>
+{
+    private:
+        // tasks run before the queue lets the other queues have a turn
+        const static int BATCH = 32;
+
+        ActorExecutor* executor_;
+        boost::mutex mt_;
+        deque< boost::function<void()> > tasks_;
+        // ready in an executor thread or running
+        bool scheduled_;
+
+        friend class ActorExecutor;
+        void run();
+
+    public:
+        ActorQueue(ActorExecutor* executor);
+
+        void post(const boost::function<void()>& task);
+};
+
+typedef boost::shared_ptr<ActorQueue> ActorQueuePtr;
+
+/*
+ * threads that run ActorQueues. every thread takes the queues that are
+ * ready from the front of its own deque and steals from the back of the
+ * others' when it has none. a queue made ready on an executor thread
+ * stays on that thread
+ */
+class ActorExecutor
+{
+    private:
+        struct Worker
+        {
+            boost::mutex mt;
+            deque<ActorQueuePtr> ready;
+        };
+
+        vector<Worker*> workers_;
+        boost::thread_group threads_;
+        boost::thread_specific_ptr<Worker> current_;
+        boost::atomic<unsigned> next_;
+
+        boost::mutex idleMt_;
+        boost::condition_variable idleCv_;
+        // queues in the deques or about to be pushed, raised under idleMt_
+        // before the push
+        boost::atomic<int> ready_;
+        bool stop_;
+
+        ActorExecutor(const ActorExecutor&);
+        ActorExecutor& operator=(const ActorExecutor&);
+
+        static void keepWorker(Worker* worker);
+
+        friend class ActorQueue;
+        void schedule(const ActorQueuePtr& queue);
+        ActorQueuePtr take(int self);
+        void loop(int self);
+
+    public:
+        ActorExecutor(int threads);
+        // runs what is still queued, then joins the threads
+        ~ActorExecutor();
+
+        ActorQueuePtr createQueue();
+};
+
+typedef boost::shared_ptr<ActorExecutor> ActorExecutorPtr;
+
+#endif
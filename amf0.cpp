@@ -1,116 +1,315 @@
 #include "amf0.h"
+#include "amf0value.h"
 #include "utility.h"
 #include "rtmpexception.h"
 
-AMF0Parser::AMF0Parser(ReadBufferPtr& ptr):
-    rb_(ptr)
+//-----------------------------------------------------------------
+//                       AMF0Reader
+
+AMF0Reader::AMF0Reader(const uint8_t* data, int size):
+    data_(data), size_(size), pos_(0), depth_(0)
+{
+}
+
+void AMF0Reader::enter()
+{
+    if(++depth_ > AMF0Reader::MAX_DEPTH)
+    {
+        throw RtmpInvalidAMFData("amf0 data is nested too deep");
+    }
+}
+
+void AMF0Reader::leave()
+{
+    depth_--;
+}
+
+bool AMF0Reader::isNextNumber()
+{
+    need(1);
+
+    if(data_[pos_] == AMF0_AvmPlusObject)
+    {
+        need(2);
+        return data_[pos_ + 1] == AMF3_Integer || data_[pos_ + 1] == AMF3_Double;
+    }
+
+    return data_[pos_] == AMF0_Number;
+}
+
+bool AMF0Reader::isAvmPlus()
+{
+    return pos_ < size_ && data_[pos_] == AMF0_AvmPlusObject;
+}
+
+AMF3Reader& AMF0Reader::beginAMF3()
+{
+    expect(AMF0_AvmPlusObject, "expect AVM+ object");
+
+    if(!amf3_)
+    {
+        amf3_.emplace(data_, size_);
+    }
+
+    amf3_->seek(pos_);
+
+    return *amf3_;
+}
+
+void AMF0Reader::endAMF3()
+{
+    pos_ = amf3_->getPos();
+}
+
+void AMF0Reader::need(int bytes)
+{
+    if(size_ - pos_ < bytes)
+    {
+        throw RtmpNoEnoughData();
+    }
+}
+
+uint16_t AMF0Reader::readU16()
 {
+    need(2);
+    uint16_t v = (data_[pos_] << 8) | data_[pos_ + 1];
+    pos_ += 2;
+
+    return v;
 }
 
-string AMF0Parser::parseAsString()
+void AMF0Reader::expect(AMF0Types t, const char* errorMsg)
 {
-    uint8_t tp = rb_->readByte();
+    need(1);
 
-    if(tp != AMF0_String)
+    if(data_[pos_] != t)
     {
-        throw RtmpInvalidAMFData("expect string");
+        throw RtmpInvalidAMFData(errorMsg);
     }
 
-    uint16_t strLen = rb_->read<uint16_t>(ReadBuffer::BIG);
-    char* strData = rb_->readChars(strLen);
+    pos_++;
+}
+
+uint32_t AMF0Reader::readU32()
+{
+    need(4);
+    uint32_t v = ((uint32_t)data_[pos_] << 24) | (data_[pos_ + 1] << 16) |
+                 (data_[pos_ + 2] << 8) | data_[pos_ + 3];
+    pos_ += 4;
 
-    string ret(strData);
-    delete[] strData;
+    return v;
+}
+
+double AMF0Reader::readDouble()
+{
+    need(8);
+
+    uint64_t bits = 0;
+    for(int i = 0; i < 8; i++)
+    {
+        bits = (bits << 8) | data_[pos_ + i];
+    }
+    pos_ += 8;
+
+    double ret;
+    memcpy(&ret, &bits, 8);
 
     return ret;
 }
 
-string AMF0Parser::parseObjectKey()
+StrRef AMF0Reader::readString()
 {
-    uint16_t strLen = rb_->read<uint16_t>(ReadBuffer::BIG);
-    char* strData = rb_->readChars(strLen);
+    if(isAvmPlus())
+    {
+        StrRef ret = beginAMF3().readString();
+        endAMF3();
 
-    string ret(strData);
-    delete[] strData;
+        return ret;
+    }
+
+    expect(AMF0_String, "expect string");
+
+    return readObjectKey();
+}
+
+StrRef AMF0Reader::readLongString()
+{
+    expect(AMF0_LongString, "expect long string");
+
+    uint32_t strLen = readU32();
+    if(strLen > (uint32_t)(size_ - pos_))
+    {
+        throw RtmpNoEnoughData();
+    }
+
+    StrRef ret((const char*)data_ + pos_, strLen);
+    pos_ += strLen;
 
     return ret;
 }
 
-bool AMF0Parser::parseAsBool()
+StrRef AMF0Reader::readXmlDocument()
 {
-    uint8_t tp = rb_->readByte();
+    expect(AMF0_XmlDocument, "expect xml document");
 
-    if(tp != AMF0_Boolean)
+    uint32_t strLen = readU32();
+    if(strLen > (uint32_t)(size_ - pos_))
     {
-        throw RtmpInvalidAMFData("expect bool");
+        throw RtmpNoEnoughData();
     }
 
-    return rb_->readByte() != 0;
+    StrRef ret((const char*)data_ + pos_, strLen);
+    pos_ += strLen;
+
+    return ret;
 }
 
-double AMF0Parser::parseAsNumber() 
+double AMF0Reader::readDate(int16_t* timezone)
 {
-    uint8_t tp = rb_->readByte();
+    expect(AMF0_Date, "expect date");
+
+    double ret = readDouble();
+    int16_t tz = (int16_t)readU16();
 
-    if(tp != AMF0_Number)
+    if(timezone)
     {
-        throw RtmpInvalidAMFData("expect number");
+        *timezone = tz;
     }
 
-    uint8_t* bytes = rb_->readBytes(8);
-    Utility::reverseBytes(bytes, 8);
+    return ret;
+}
+
+uint16_t AMF0Reader::readReference()
+{
+    expect(AMF0_Reference, "expect reference");
 
-    double ret = *((double *)bytes);
-    delete[] bytes;
+    return readU16();
+}
+
+void AMF0Reader::readUnsupported()
+{
+    expect(AMF0_Unsupported, "expect unsupported");
+}
+
+uint32_t AMF0Reader::readEcmaArrayStart()
+{
+    expect(AMF0_EcmaArray, "expect ecma array");
+
+    return readU32();
+}
+
+uint32_t AMF0Reader::readStrictArrayStart()
+{
+    expect(AMF0_StrictArray, "expect strict array");
+
+    return readU32();
+}
+
+StrRef AMF0Reader::readTypedObjectStart()
+{
+    expect(AMF0_TypedObjectMake, "expect typed object");
+
+    // class name
+    return readObjectKey();
+}
+
+StrRef AMF0Reader::readObjectKey()
+{
+    uint16_t strLen = readU16();
+    need(strLen);
+
+    StrRef ret((const char*)data_ + pos_, strLen);
+    pos_ += strLen;
 
     return ret;
 }
 
-void AMF0Parser::parseNull()
+bool AMF0Reader::readBool()
 {
-    uint8_t tp = rb_->readByte();
+    if(isAvmPlus())
+    {
+        bool ret = beginAMF3().readBool();
+        endAMF3();
+
+        return ret;
+    }
+
+    expect(AMF0_Boolean, "expect bool");
+    need(1);
 
-    if(tp != AMF0_Null)
+    return data_[pos_++] != 0;
+}
+
+double AMF0Reader::readNumber()
+{
+    if(isAvmPlus())
     {
-        throw RtmpInvalidAMFData("expect null");
+        double ret = beginAMF3().readNumber();
+        endAMF3();
+
+        return ret;
     }
+
+    expect(AMF0_Number, "expect number");
+
+    return readDouble();
 }
 
-void AMF0Parser::parseUndefined()
+void AMF0Reader::readNull()
 {
-    uint8_t tp = rb_->readByte();
+    if(isAvmPlus())
+    {
+        beginAMF3().readNull();
+        endAMF3();
+
+        return;
+    }
 
-    if(tp != AMF0_Undefined)
+    expect(AMF0_Null, "expect null");
+}
+
+void AMF0Reader::readUndefined()
+{
+    if(isAvmPlus())
     {
-        throw RtmpInvalidAMFData("expect undefined");
+        beginAMF3().readUndefined();
+        endAMF3();
+
+        return;
     }
+
+    expect(AMF0_Undefined, "expect undefined");
 }
 
-void AMF0Parser::skipObjectStart()
+void AMF0Reader::skipObjectStart()
 {
-    rb_->skip(1);
-} 
+    need(1);
+    pos_ += 1;
+}
 
-void AMF0Parser::skipEcmaArrayStart()
+void AMF0Reader::skipEcmaArrayStart()
 {
     // type + length
-    rb_->skip(5);
+    need(5);
+    pos_ += 5;
 }
 
-void AMF0Parser::skipObjectEnd()
+void AMF0Reader::skipObjectEnd()
 {
-    rb_->skip(3);
+    need(3);
+    pos_ += 3;
 }
 
-AMF0Types AMF0Parser::getNextType(bool parsingObject)
+AMF0Types AMF0Reader::getNextType(bool parsingObject)
 {
-    uint8_t p = rb_->peek<uint8_t>(ReadBuffer::BIG);
+    need(1);
+    uint8_t p = data_[pos_];
 
     if(parsingObject && p == 0)
     {
-        int32_t endMark = rb_->peek<int32_t>(ReadBuffer::BIG, 3);
+        need(3);
 
-        if(endMark == 0x0009)
+        if(data_[pos_ + 1] == 0 && data_[pos_ + 2] == AMF0_ObjectEnd)
         {
             return AMF0_ObjectEnd; 
         }
@@ -119,102 +318,255 @@ AMF0Types AMF0Parser::getNextType(bool parsingObject)
     return (AMF0Types)p;
 }
 
-bool AMF0Parser::isFinished()
+bool AMF0Reader::isFinished()
 {
-    return rb_->getUnReadSize() == 0;
+    return pos_ == size_;
 }
 
-void AMF0Parser::skip(AMF0Types t)
+int AMF0Reader::getPos()
+{
+    return pos_;
+}
+
+const uint8_t* AMF0Reader::getPtr()
+{
+    return data_ + pos_;
+}
+
+int AMF0Reader::getUnReadSize()
+{
+    return size_ - pos_;
+}
+
+void AMF0Reader::skip(AMF0Types t)
 {
     switch(t)
     {
         case AMF0_Number:
-            parseAsNumber();
+            readNumber();
             break;
         case AMF0_Boolean:
-            parseAsBool();
+            readBool();
             break;
         case AMF0_String:
-            parseAsString();
+            readString();
             break;
         case AMF0_Object:
             skipObject();
             break;
         case AMF0_Null:
-            parseNull();
+            readNull();
             break;
         case AMF0_Undefined:
-            parseUndefined();
+            readUndefined();
+            break;
+        case AMF0_Reference:
+            readReference();
+            break;
+        case AMF0_EcmaArray:
+            readEcmaArrayStart();
+            skipProperties();
+            break;
+        case AMF0_StrictArray:
+            {
+                uint32_t count = readStrictArrayStart();
+
+                enter();
+                for(uint32_t i = 0; i < count; i++)
+                {
+                    skipValue();
+                }
+                leave();
+            }
+            break;
+        case AMF0_Date:
+            readDate(NULL);
+            break;
+        case AMF0_LongString:
+            readLongString();
+            break;
+        case AMF0_Unsupported:
+            readUnsupported();
+            break;
+        case AMF0_XmlDocument:
+            readXmlDocument();
+            break;
+        case AMF0_TypedObjectMake:
+            readTypedObjectStart();
+            skipProperties();
+            break;
+        case AMF0_AvmPlusObject:
+            beginAMF3().skipValue();
+            endAMF3();
             break;
         default:
-            throw RtmpNotImplemented("AMF0Parser::skip()"); 
+            // movieclip and recordset are reserved, nobody sends them
+            throw RtmpInvalidAMFData("AMF0Reader::skip(), unknown type"); 
     }
 }
 
-void AMF0Parser::skipObject()
+void AMF0Reader::skipValue()
 {
-    skipObjectStart();
+    skip(getNextType(false));
+}
 
-    AMF0Types t;
-    bool parsingKey = true;
-    while((t = getNextType(true)) != AMF0_ObjectEnd)
+void AMF0Reader::skipProperties()
+{
+    enter();
+    while(getNextType(true) != AMF0_ObjectEnd)
     {
-        if(parsingKey)
-        {
-            parseObjectKey();
-        }
-        else
-        {
-            skip(t);
-        }
-
-        parsingKey = !parsingKey;
+        readObjectKey();
+        skipValue();
     }
+    leave();
 
     skipObjectEnd();
 }
 
+void AMF0Reader::skipObject()
+{
+    skipObjectStart();
+    skipProperties();
+}
+
 //-----------------------------------------------------------------
 //                       AMF0Serializer                                          
 
-AMF0Serializer::AMF0Serializer(WriteBuffer* wb):
+template <class Buffer>
+BasicAMF0Serializer<Buffer>::BasicAMF0Serializer(Buffer* wb):
     wb_(wb)
 {
 }
 
-void AMF0Serializer::writeString(string v)
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeString(const string& v)
 {
     wb_->writeB((uint8_t)AMF0_String);
     wb_->writeB((uint16_t)v.length());
     wb_->writeBytes((uint8_t*)v.c_str(), v.length());
 }
 
-void AMF0Serializer::writeNumber(double v)
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeString(const StrRef& v)
+{
+    wb_->writeB((uint8_t)AMF0_String);
+    writeStringBody(v.data, v.len);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeStringBody(const char* data, int len)
+{
+    wb_->writeB((uint16_t)len);
+    wb_->writeBytes((uint8_t*)data, len);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeLongString(const StrRef& v)
+{
+    wb_->writeB((uint8_t)AMF0_LongString);
+    wb_->writeB((uint32_t)v.len);
+    wb_->writeBytes((uint8_t*)v.data, v.len);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeXmlDocument(const StrRef& v)
+{
+    wb_->writeB((uint8_t)AMF0_XmlDocument);
+    wb_->writeB((uint32_t)v.len);
+    wb_->writeBytes((uint8_t*)v.data, v.len);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeDouble(double v)
 {
-    wb_->writeB((uint8_t)AMF0_Number);
     uint8_t* tmp = (uint8_t*)&v;
     Utility::reverseBytes(tmp, 8);
     wb_->writeBytes(tmp, 8);
 }
 
-void AMF0Serializer::writeObjectStart()
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeNumber(double v)
+{
+    wb_->writeB((uint8_t)AMF0_Number);
+    writeDouble(v);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeDate(double v, int16_t timezone)
+{
+    wb_->writeB((uint8_t)AMF0_Date);
+    writeDouble(v);
+    wb_->writeB(timezone);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeReference(uint16_t v)
+{
+    wb_->writeB((uint8_t)AMF0_Reference);
+    wb_->writeB(v);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeUnsupported()
+{
+    wb_->writeB((uint8_t)AMF0_Unsupported);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeAvmPlusObject()
+{
+    wb_->writeB((uint8_t)AMF0_AvmPlusObject);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeEcmaArrayStart(uint32_t count)
+{
+    wb_->writeB((uint8_t)AMF0_EcmaArray);
+    wb_->writeB(count);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeStrictArrayStart(uint32_t count)
+{
+    wb_->writeB((uint8_t)AMF0_StrictArray);
+    wb_->writeB(count);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeTypedObjectStart(const StrRef& className)
+{
+    wb_->writeB((uint8_t)AMF0_TypedObjectMake);
+    writeStringBody(className.data, className.len);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeObjectStart()
 {
     wb_->writeB((uint8_t)AMF0_Object);
 }
 
-void AMF0Serializer::writeObjectEnd()
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeObjectEnd()
 {
     wb_->writeB((uint16_t)0);
     wb_->writeB((uint8_t)AMF0_ObjectEnd);
 }
 
-void AMF0Serializer::writeObjectKey(string v)
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeObjectKey(const string& v)
 {
     wb_->writeB((uint16_t)v.length());
     wb_->writeBytes((uint8_t*)v.c_str(), v.length());
 }
 
-void AMF0Serializer::writeBool(bool v)
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeObjectKey(const StrRef& v)
+{
+    writeStringBody(v.data, v.len);
+}
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeBool(bool v)
 {
     uint8_t b = (uint8_t)v;
 
@@ -222,12 +574,97 @@ void AMF0Serializer::writeBool(bool v)
     wb_->writeB(b);
 }
 
-void AMF0Serializer::writeNull()
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeNull()
 {
     wb_->writeB((uint8_t)AMF0_Null);
 }
 
-void AMF0Serializer::writeUndefined()
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeUndefined()
 {
     wb_->writeB((uint8_t)AMF0_Undefined);
 }
+
+template <class Buffer>
+void BasicAMF0Serializer<Buffer>::writeValue(const AMF0Value* v)
+{
+    if(v->raw)
+    {
+        wb_->writeBytes((uint8_t*)v->raw, v->rawSize);
+        return;
+    }
+
+    switch(v->type)
+    {
+        case AMF0_Number:
+            writeNumber(v->number);
+            break;
+        case AMF0_Boolean:
+            writeBool(v->boolean);
+            break;
+        case AMF0_String:
+            writeString(v->str);
+            break;
+        case AMF0_Null:
+            writeNull();
+            break;
+        case AMF0_Undefined:
+            writeUndefined();
+            break;
+        case AMF0_Reference:
+            writeReference(v->reference);
+            break;
+        case AMF0_Date:
+            writeDate(v->number, v->timezone);
+            break;
+        case AMF0_LongString:
+            writeLongString(v->str);
+            break;
+        case AMF0_Unsupported:
+            writeUnsupported();
+            break;
+        case AMF0_XmlDocument:
+            writeXmlDocument(v->str);
+            break;
+        case AMF0_StrictArray:
+            writeStrictArrayStart(v->count);
+            for(int i = 0; i < v->count; i++)
+            {
+                writeValue(v->items[i]);
+            }
+            break;
+        case AMF0_Object:
+        case AMF0_EcmaArray:
+        case AMF0_TypedObjectMake:
+            {
+                if(v->type == AMF0_Object)
+                {
+                    writeObjectStart();
+                }
+                else if(v->type == AMF0_EcmaArray)
+                {
+                    writeEcmaArrayStart(v->count);
+                }
+                else
+                {
+                    writeTypedObjectStart(v->str);
+                }
+
+                const AMF0Property* p = v->props;
+                for(; p; p = p->next)
+                {
+                    writeObjectKey(p->key);
+                    writeValue(p->value);
+                }
+
+                writeObjectEnd();
+            }
+            break;
+        default:
+            throw RtmpInvalidAMFData("AMF0Serializer::writeValue(), unknown type");
+    }
+}
+
+template class BasicAMF0Serializer<WriteBuffer>;
+template class BasicAMF0Serializer<ChunkWriter>;
@@ -3,7 +3,11 @@
 
 #include "readbuffer.h"
 #include "writebuffer.h"
+#include "strref.h"
+#include "amf3.h"
+#include "chunkwriter.h"
 #include <boost/shared_ptr.hpp>
+#include <boost/optional.hpp>
 
 enum AMF0Types
 {
@@ -23,50 +27,126 @@ enum AMF0Types
     AMF0_Unsupported,
     AMF0_Recordset,
     AMF0_XmlDocument,
-    AMF0_TypedObjectMake
+    AMF0_TypedObjectMake,
+    // the next value is AMF3
+    AMF0_AvmPlusObject
 };
 
-class AMF0Parser
+/*
+ * cursor over an AMF0 encoded message body
+ *
+ * nothing is copied, strings and keys are returned as views into the
+ * body, so the body must outlive them
+ */
+class AMF0Reader
 {
     private:
-        ReadBufferPtr rb_;
+        const static int MAX_DEPTH = 64;
+
+        const uint8_t* data_;
+        int size_;
+        int pos_;
+        int depth_;
+
+        // created on the first AVM+ marker, its reference tables are
+        // shared by all AMF3 values of the message
+        boost::optional<AMF3Reader> amf3_;
+
+        bool isAvmPlus();
+        void need(int bytes);
+        void expect(AMF0Types t, const char* errorMsg);
+        double readDouble();
+        void skipProperties();
+
     public:
-        AMF0Parser(ReadBufferPtr& ptr);
-        string parseAsString();
-        string parseObjectKey();
-        bool parseAsBool();
-        double parseAsNumber();
+        AMF0Reader(const uint8_t* data, int size);
+        uint16_t readU16();
+        uint32_t readU32();
+        StrRef readString();
+        StrRef readLongString();
+        StrRef readXmlDocument();
+        StrRef readObjectKey();
+        bool readBool();
+        double readNumber();
+        // milliseconds since epoch, timezone is reserved and should be 0
+        double readDate(int16_t* timezone);
+        uint16_t readReference();
+        void readNull();
+        void readUndefined();
+        void readUnsupported();
+        bool isNextNumber();
+        // returns the count in the header, it may be wrong, the end mark is what counts
+        uint32_t readEcmaArrayStart();
+        uint32_t readStrictArrayStart();
+        StrRef readTypedObjectStart();
         void skipEcmaArrayStart();
         void skipObjectStart();
         void skipObjectEnd();
         AMF0Types getNextType(bool parsingObject);
         bool isFinished();
-        void parseNull();
-        void parseUndefined();
         void skipObject();
-        void skipEcmaArray();
         void skip(AMF0Types t);
+        // skip whatever value is next
+        void skipValue();
+
+        // nesting guard for who walks objects and arrays
+        void enter();
+        void leave();
+
+        // for values behind an AVM+ marker, the AMF3 reader is positioned
+        // after the marker, endAMF3() continues after the AMF3 value
+        AMF3Reader& beginAMF3();
+        void endAMF3();
+
+        int getPos();
+        const uint8_t* getPtr();
+        int getUnReadSize();
 };
 
-typedef boost::shared_ptr<AMF0Parser> AMF0ParserPtr;
+struct AMF0Value;
 
-class AMF0Serializer
+/*
+ * Buffer is WriteBuffer, or ChunkWriter to write a message body
+ * straight into the connection's chunked output
+ */
+template <class Buffer>
+class BasicAMF0Serializer
 {
     private:
-        WriteBuffer* wb_;
+        Buffer* wb_;
+
+        void writeDouble(double v);
+        void writeStringBody(const char* data, int len);
     public:
-        AMF0Serializer(WriteBuffer* wb);
-        void writeString(string v);
+        BasicAMF0Serializer(Buffer* wb);
+        void writeString(const string& v);
+        void writeString(const StrRef& v);
+        void writeLongString(const StrRef& v);
+        void writeXmlDocument(const StrRef& v);
         void writeNumber(double v);
+        void writeDate(double v, int16_t timezone);
+        void writeReference(uint16_t v);
+        void writeUnsupported();
+        // an AMF3 value written with AMF3Serializer follows
+        void writeAvmPlusObject();
+        void writeEcmaArrayStart(uint32_t count);
+        void writeStrictArrayStart(uint32_t count);
+        void writeTypedObjectStart(const StrRef& className);
 
         void writeObjectStart();
         void writeObjectEnd();
-        void writeObjectKey(string v);
+        void writeObjectKey(const string& v);
+        void writeObjectKey(const StrRef& v);
         void writeBool(bool v);
         void writeNull();
         void writeUndefined();
+
+        // parsed values are copied from their raw bytes
+        void writeValue(const AMF0Value* v);
 };
 
+typedef BasicAMF0Serializer<WriteBuffer> AMF0Serializer;
+typedef BasicAMF0Serializer<ChunkWriter> AMF0ChunkSerializer;
 typedef boost::shared_ptr<AMF0Serializer> AMF0SerializerPtr;
 
 #endif
@@ -0,0 +1,251 @@
+#include "amf0value.h"
+#include "rtmpexception.h"
+
+AMF0Value* AMF0Value::get(const StrRef& key)
+{
+    if(type == AMF0_Reference && target)
+    {
+        return target->get(key);
+    }
+
+    AMF0Property* p = props;
+    for(; p; p = p->next)
+    {
+        if(p->key.equals(key.data, key.len))
+        {
+            return p->value;
+        }
+    }
+
+    return NULL;
+}
+
+AMF0Value* AMF0Value::get(const char* key)
+{
+    return get(StrRef(key, strlen(key)));
+}
+
+//-----------------------------------------------------------------
+//                       AMF0ValueParser
+
+AMF0ValueParser::AMF0ValueParser(AMF0Reader& rd, Arena& arena):
+    rd_(rd), arena_(arena), refs_(NULL), refCount_(0), refCap_(0)
+{
+}
+
+void AMF0ValueParser::addRef(AMF0Value* v)
+{
+    if(refCount_ == refCap_)
+    {
+        // the old table stays in the arena, it is small
+        int cap = refCap_ ? refCap_ * 2 : 8;
+        AMF0Value** refs = arena_.makeArray<AMF0Value*>(cap);
+        for(int i = 0; i < refCount_; i++)
+        {
+            refs[i] = refs_[i];
+        }
+
+        refs_ = refs;
+        refCap_ = cap;
+    }
+
+    refs_[refCount_++] = v;
+}
+
+void AMF0ValueParser::parseProperties(AMF0Value* v)
+{
+    AMF0Property* last = NULL;
+
+    rd_.enter();
+    while(rd_.getNextType(true) != AMF0_ObjectEnd)
+    {
+        AMF0Property* p = arena_.make<AMF0Property>();
+        p->key = rd_.readObjectKey();
+        p->value = parse();
+
+        if(last)
+        {
+            last->next = p;
+        }
+        else
+        {
+            v->props = p;
+        }
+
+        last = p;
+        v->count++;
+    }
+    rd_.leave();
+
+    rd_.skipObjectEnd();
+}
+
+AMF0Value* AMF0ValueParser::parse()
+{
+    AMF0Value* v = arena_.make<AMF0Value>();
+
+    int start = rd_.getPos();
+    v->raw = rd_.getPtr();
+    v->type = rd_.getNextType(false);
+
+    switch(v->type)
+    {
+        case AMF0_Number:
+            v->number = rd_.readNumber();
+            break;
+        case AMF0_Boolean:
+            v->boolean = rd_.readBool();
+            break;
+        case AMF0_String:
+            v->str = rd_.readString();
+            break;
+        case AMF0_Object:
+            addRef(v);
+            rd_.skipObjectStart();
+            parseProperties(v);
+            break;
+        case AMF0_Null:
+            rd_.readNull();
+            break;
+        case AMF0_Undefined:
+            rd_.readUndefined();
+            break;
+        case AMF0_Reference:
+            v->reference = rd_.readReference();
+            if(v->reference < refCount_)
+            {
+                v->target = refs_[v->reference];
+            }
+            break;
+        case AMF0_EcmaArray:
+            addRef(v);
+            rd_.readEcmaArrayStart();
+            parseProperties(v);
+            break;
+        case AMF0_StrictArray:
+            {
+                addRef(v);
+                uint32_t count = rd_.readStrictArrayStart();
+
+                // every item takes at least one byte
+                if(count > (uint32_t)rd_.getUnReadSize())
+                {
+                    throw RtmpNoEnoughData();
+                }
+
+                v->count = count;
+                v->items = arena_.makeArray<AMF0Value*>(count);
+
+                rd_.enter();
+                for(uint32_t i = 0; i < count; i++)
+                {
+                    v->items[i] = parse();
+                }
+                rd_.leave();
+            }
+            break;
+        case AMF0_Date:
+            v->number = rd_.readDate(&v->timezone);
+            break;
+        case AMF0_LongString:
+            v->str = rd_.readLongString();
+            break;
+        case AMF0_Unsupported:
+            rd_.readUnsupported();
+            break;
+        case AMF0_XmlDocument:
+            v->str = rd_.readXmlDocument();
+            break;
+        case AMF0_TypedObjectMake:
+            addRef(v);
+            v->str = rd_.readTypedObjectStart();
+            parseProperties(v);
+            break;
+        case AMF0_AvmPlusObject:
+            // kept as raw bytes only
+            rd_.skip(v->type);
+            break;
+        default:
+            throw RtmpInvalidAMFData("AMF0ValueParser::parse(), unknown type");
+    }
+
+    v->rawSize = rd_.getPos() - start;
+
+    return v;
+}
+
+//-----------------------------------------------------------------
+//                       AMF0Document
+
+AMF0Document::AMF0Document(const uint8_t* data, int size):
+    arena_(), data_(data), size_(size), values_(NULL), count_(0), parsed_(false)
+{
+}
+
+void AMF0Document::parse()
+{
+    parsed_ = true;
+
+    AMF0Reader rd(data_, size_);
+    AMF0ValueParser vp(rd, arena_);
+
+    int cap = 0;
+    while(!rd.isFinished())
+    {
+        if(count_ == cap)
+        {
+            cap = cap ? cap * 2 : 4;
+            AMF0Value** values = arena_.makeArray<AMF0Value*>(cap);
+            for(int i = 0; i < count_; i++)
+            {
+                values[i] = values_[i];
+            }
+            values_ = values;
+        }
+
+        values_[count_++] = vp.parse();
+    }
+}
+
+int AMF0Document::getCount()
+{
+    if(!parsed_)
+    {
+        parse();
+    }
+
+    return count_;
+}
+
+AMF0Value* AMF0Document::get(int i)
+{
+    if(i < 0 || i >= getCount())
+    {
+        return NULL;
+    }
+
+    return values_[i];
+}
+
+AMF0Value* AMF0Document::getProperty(const char* key)
+{
+    for(int i = 0; i < getCount(); i++)
+    {
+        if(values_[i]->isObject())
+        {
+            return values_[i]->get(key);
+        }
+    }
+
+    return NULL;
+}
+
+const uint8_t* AMF0Document::getData()
+{
+    return data_;
+}
+
+int AMF0Document::getSize()
+{
+    return size_;
+}
@@ -0,0 +1,124 @@
+#ifndef AMF0_VALUE_H
+#define AMF0_VALUE_H
+
+#include "amf0.h"
+#include "arena.h"
+#include "strref.h"
+#include <boost/shared_ptr.hpp>
+
+struct AMF0Value;
+
+struct AMF0Property
+{
+    StrRef key;
+    AMF0Value* value;
+    AMF0Property* next;
+
+    AMF0Property(): key(), value(NULL), next(NULL)
+    {
+    }
+};
+
+/*
+ * generic AMF0 value, lives in an Arena
+ *
+ * parsed values keep the bytes they were decoded from in raw, strings
+ * and keys point into the same bytes. a value that has raw is written
+ * back by copying raw, if a parsed value is changed, raw has to be
+ * cleared on it and on all of its parents
+ */
+struct AMF0Value
+{
+    AMF0Types type;
+
+    // AvmPlusObject values are only available here
+    const uint8_t* raw;
+    int rawSize;
+
+    // Number, Date
+    double number;
+    bool boolean;
+    // Date
+    int16_t timezone;
+    // Reference, target is set when it points to a value of the same document
+    uint16_t reference;
+    AMF0Value* target;
+    // String, LongString, XmlDocument, class name of TypedObject
+    StrRef str;
+
+    // Object, EcmaArray, TypedObject
+    AMF0Property* props;
+    // StrictArray
+    AMF0Value** items;
+    // properties or items
+    int count;
+
+    AMF0Value():
+        type(AMF0_Undefined), raw(NULL), rawSize(0), number(0), boolean(false),
+        timezone(0), reference(0), target(NULL), str(), props(NULL), items(NULL), count(0)
+    {
+    }
+
+    bool isObject()
+    {
+        return type == AMF0_Object || type == AMF0_EcmaArray || type == AMF0_TypedObjectMake;
+    }
+
+    AMF0Value* get(const StrRef& key);
+    AMF0Value* get(const char* key);
+};
+
+/*
+ * builds AMF0Value trees from a reader, every node is taken from the arena
+ */
+class AMF0ValueParser
+{
+    private:
+        AMF0Reader& rd_;
+        Arena& arena_;
+
+        // complex values seen so far, for references
+        AMF0Value** refs_;
+        int refCount_;
+        int refCap_;
+
+        void addRef(AMF0Value* v);
+        void parseProperties(AMF0Value* v);
+
+    public:
+        AMF0ValueParser(AMF0Reader& rd, Arena& arena);
+        AMF0Value* parse();
+};
+
+/*
+ * all values of one AMF0 payload, for example @setDataFrame's onMetaData
+ *
+ * the bytes are borrowed, nothing is decoded until a value is asked for
+ */
+class AMF0Document
+{
+    private:
+        Arena arena_;
+        const uint8_t* data_;
+        int size_;
+        AMF0Value** values_;
+        int count_;
+        bool parsed_;
+
+        void parse();
+
+    public:
+        AMF0Document(const uint8_t* data, int size);
+
+        int getCount();
+        AMF0Value* get(int i);
+        // property of the first object like value
+        AMF0Value* getProperty(const char* key);
+
+        const uint8_t* getData();
+        int getSize();
+};
+
+typedef boost::shared_ptr<AMF0Document> AMF0DocumentPtr;
+
+#endif
@@ -0,0 +1,592 @@
+#include "amf3.h"
+#include "utility.h"
+#include <string.h>
+
+AMF3Reader::AMF3Reader(const uint8_t* data, int size):
+    data_(data), size_(size), pos_(0), depth_(0)
+{
+}
+
+void AMF3Reader::need(int bytes)
+{
+    if(bytes < 0 || size_ - pos_ < bytes)
+    {
+        throw RtmpNoEnoughData();
+    }
+}
+
+void AMF3Reader::expect(AMF3Types t, const char* errorMsg)
+{
+    need(1);
+
+    if(data_[pos_] != t)
+    {
+        throw RtmpInvalidAMFData(errorMsg);
+    }
+
+    pos_++;
+}
+
+void AMF3Reader::skipBytes(uint32_t bytes)
+{
+    if(bytes > (uint32_t)(size_ - pos_))
+    {
+        throw RtmpNoEnoughData();
+    }
+
+    pos_ += bytes;
+}
+
+void AMF3Reader::enter()
+{
+    if(++depth_ > MAX_DEPTH)
+    {
+        throw RtmpInvalidAMFData("AMF3 value is nested too deep");
+    }
+}
+
+void AMF3Reader::leave()
+{
+    depth_--;
+}
+
+uint32_t AMF3Reader::readU29()
+{
+    uint32_t v = 0;
+
+    // 7 bits in each of the first 3 bytes, all 8 bits in the 4th
+    for(int i = 0; i < 3; i++)
+    {
+        need(1);
+        uint8_t b = data_[pos_++];
+
+        v = (v << 7) | (b & 0x7f);
+        if(!(b & 0x80))
+        {
+            return v;
+        }
+    }
+
+    need(1);
+    return (v << 8) | data_[pos_++];
+}
+
+StrRef AMF3Reader::readStringBody()
+{
+    uint32_t ref = readU29();
+
+    if(!(ref & 1))
+    {
+        return strings_.get(ref >> 1);
+    }
+
+    uint32_t len = ref >> 1;
+    if(len > (uint32_t)(size_ - pos_))
+    {
+        throw RtmpNoEnoughData();
+    }
+
+    StrRef ret((const char*)data_ + pos_, len);
+    pos_ += len;
+
+    // the empty string is never sent by reference
+    if(len)
+    {
+        strings_.add(ret);
+    }
+
+    return ret;
+}
+
+double AMF3Reader::readDoubleBody()
+{
+    need(8);
+
+    uint64_t bits = 0;
+    for(int i = 0; i < 8; i++)
+    {
+        bits = (bits << 8) | data_[pos_ + i];
+    }
+    pos_ += 8;
+
+    double ret;
+    memcpy(&ret, &bits, 8);
+
+    return ret;
+}
+
+AMF3Types AMF3Reader::getNextType()
+{
+    need(1);
+
+    return (AMF3Types)data_[pos_];
+}
+
+StrRef AMF3Reader::readString()
+{
+    expect(AMF3_String, "expect AMF3 string");
+
+    return readStringBody();
+}
+
+int32_t AMF3Reader::readInteger()
+{
+    expect(AMF3_Integer, "expect AMF3 integer");
+
+    uint32_t v = readU29();
+
+    // sign extend the 29 bits
+    if(v & 0x10000000)
+    {
+        v |= 0xe0000000;
+    }
+
+    return (int32_t)v;
+}
+
+double AMF3Reader::readDouble()
+{
+    expect(AMF3_Double, "expect AMF3 double");
+
+    return readDoubleBody();
+}
+
+double AMF3Reader::readNumber()
+{
+    if(getNextType() == AMF3_Integer)
+    {
+        return readInteger();
+    }
+
+    return readDouble();
+}
+
+bool AMF3Reader::isNextNumber()
+{
+    AMF3Types t = getNextType();
+
+    return t == AMF3_Integer || t == AMF3_Double;
+}
+
+bool AMF3Reader::readBool()
+{
+    AMF3Types t = getNextType();
+
+    if(t != AMF3_True && t != AMF3_False)
+    {
+        throw RtmpInvalidAMFData("expect AMF3 bool");
+    }
+
+    pos_++;
+    return t == AMF3_True;
+}
+
+void AMF3Reader::readNull()
+{
+    expect(AMF3_Null, "expect AMF3 null");
+}
+
+void AMF3Reader::readUndefined()
+{
+    expect(AMF3_Undefined, "expect AMF3 undefined");
+}
+
+int AMF3Reader::readTraits(uint32_t ref)
+{
+    if(!(ref & 1))
+    {
+        traits_.get(ref >> 1);
+        return ref >> 1;
+    }
+
+    ref >>= 1;
+
+    AMF3Traits t;
+    t.externalizable = ref & 1;
+    t.dynamic = (ref >> 1) & 1;
+    t.sealedCount = ref >> 2;
+    t.className = readStringBody();
+
+    // every name takes at least one byte
+    if(t.sealedCount > size_ - pos_)
+    {
+        throw RtmpNoEnoughData();
+    }
+
+    t.sealedStart = members_.size();
+    for(int i = 0; i < t.sealedCount; i++)
+    {
+        members_.add(readStringBody());
+    }
+
+    traits_.add(t);
+
+    return traits_.size() - 1;
+}
+
+bool AMF3Reader::readObjectStart(AMF3ObjectCursor& oc)
+{
+    int start = pos_;
+    expect(AMF3_Object, "expect AMF3 object");
+
+    oc.traits = -1;
+    oc.sealedIndex = 0;
+    oc.done = true;
+
+    uint32_t ref = readU29();
+    if(!(ref & 1))
+    {
+        objects_.get(ref >> 1);
+        return false;
+    }
+
+    // members may refer to the object itself
+    objects_.add(start);
+
+    oc.traits = readTraits(ref >> 1);
+    if(traits_.get(oc.traits).externalizable)
+    {
+        // the class decides the encoding, nothing to decode it with
+        throw RtmpInvalidAMFData("externalizable AMF3 object is not supported");
+    }
+
+    oc.done = false;
+    enter();
+
+    return true;
+}
+
+bool AMF3Reader::nextProperty(AMF3ObjectCursor& oc, StrRef& key)
+{
+    if(oc.done)
+    {
+        return false;
+    }
+
+    AMF3Traits& t = traits_.get(oc.traits);
+    if(oc.sealedIndex < t.sealedCount)
+    {
+        key = members_.get(t.sealedStart + oc.sealedIndex++);
+        return true;
+    }
+
+    if(t.dynamic)
+    {
+        key = readStringBody();
+        if(key.len)
+        {
+            return true;
+        }
+    }
+
+    oc.done = true;
+    leave();
+
+    return false;
+}
+
+AMF3Traits& AMF3Reader::getTraits(const AMF3ObjectCursor& oc)
+{
+    return traits_.get(oc.traits);
+}
+
+void AMF3Reader::skipValue()
+{
+    int start = pos_;
+    AMF3Types t = getNextType();
+
+    if(t == AMF3_String)
+    {
+        readString();
+        return;
+    }
+    else if(t == AMF3_Object)
+    {
+        AMF3ObjectCursor oc;
+        StrRef key;
+        if(readObjectStart(oc))
+        {
+            while(nextProperty(oc, key))
+            {
+                skipValue();
+            }
+        }
+        return;
+    }
+    else if(t > AMF3_Dictionary)
+    {
+        throw RtmpInvalidAMFData("AMF3Reader::skipValue(), unknown type");
+    }
+
+    pos_++;
+    switch(t)
+    {
+        case AMF3_Undefined:
+        case AMF3_Null:
+        case AMF3_False:
+        case AMF3_True:
+            return;
+        case AMF3_Integer:
+            readU29();
+            return;
+        case AMF3_Double:
+            readDoubleBody();
+            return;
+        default:
+            break;
+    }
+
+    // the rest start with a reference or an inline length
+    uint32_t ref = readU29();
+    if(!(ref & 1))
+    {
+        objects_.get(ref >> 1);
+        return;
+    }
+
+    objects_.add(start);
+    uint32_t count = ref >> 1;
+
+    switch(t)
+    {
+        case AMF3_XmlDocument:
+        case AMF3_Xml:
+        case AMF3_ByteArray:
+            skipBytes(count);
+            break;
+        case AMF3_Date:
+            readDoubleBody();
+            break;
+        case AMF3_Array:
+            enter();
+            // associative part, ends with the empty key
+            while(readStringBody().len)
+            {
+                skipValue();
+            }
+
+            if(count > (uint32_t)(size_ - pos_))
+            {
+                throw RtmpNoEnoughData();
+            }
+
+            for(uint32_t i = 0; i < count; i++)
+            {
+                skipValue();
+            }
+            leave();
+            break;
+        case AMF3_VectorInt:
+        case AMF3_VectorUInt:
+            // fixed flag
+            skipBytes(1);
+            skipBytes(count * 4);
+            break;
+        case AMF3_VectorDouble:
+            skipBytes(1);
+            skipBytes(count * 8);
+            break;
+        case AMF3_VectorObject:
+            skipBytes(1);
+            // item type name
+            readStringBody();
+
+            if(count > (uint32_t)(size_ - pos_))
+            {
+                throw RtmpNoEnoughData();
+            }
+
+            enter();
+            for(uint32_t i = 0; i < count; i++)
+            {
+                skipValue();
+            }
+            leave();
+            break;
+        case AMF3_Dictionary:
+            // weak keys flag
+            skipBytes(1);
+
+            if(count > (uint32_t)(size_ - pos_))
+            {
+                throw RtmpNoEnoughData();
+            }
+
+            enter();
+            for(uint32_t i = 0; i < count; i++)
+            {
+                skipValue();
+                skipValue();
+            }
+            leave();
+            break;
+        default:
+            throw RtmpInvalidAMFData("AMF3Reader::skipValue(), unknown type");
+    }
+}
+
+void AMF3Reader::seek(int pos)
+{
+    if(pos < 0 || pos > size_)
+    {
+        throw RtmpNoEnoughData();
+    }
+
+    pos_ = pos;
+}
+
+int AMF3Reader::getPos()
+{
+    return pos_;
+}
+
+bool AMF3Reader::isFinished()
+{
+    return pos_ == size_;
+}
+
+//-----------------------------------------------------------------
+//                       AMF3Serializer
+
+AMF3Serializer::AMF3Serializer(WriteBuffer* wb):
+    wb_(wb)
+{
+}
+
+void AMF3Serializer::writeU29(uint32_t v)
+{
+    v &= 0x1fffffff;
+
+    if(v < 0x80)
+    {
+        wb_->writeB((uint8_t)v);
+    }
+    else if(v < 0x4000)
+    {
+        wb_->writeB((uint8_t)((v >> 7) | 0x80));
+        wb_->writeB((uint8_t)(v & 0x7f));
+    }
+    else if(v < 0x200000)
+    {
+        wb_->writeB((uint8_t)((v >> 14) | 0x80));
+        wb_->writeB((uint8_t)(((v >> 7) & 0x7f) | 0x80));
+        wb_->writeB((uint8_t)(v & 0x7f));
+    }
+    else
+    {
+        wb_->writeB((uint8_t)((v >> 22) | 0x80));
+        wb_->writeB((uint8_t)(((v >> 15) & 0x7f) | 0x80));
+        wb_->writeB((uint8_t)(((v >> 8) & 0x7f) | 0x80));
+        wb_->writeB((uint8_t)(v & 0xff));
+    }
+}
+
+void AMF3Serializer::writeStringBody(const char* data, int len)
+{
+    if(len == 0)
+    {
+        writeU29(1);
+        return;
+    }
+
+    uint8_t* base = wb_->getBufferPtr();
+    for(int i = 0; i < strings_.size(); i++)
+    {
+        StringRef& s = strings_.get(i);
+        if(s.len == len && memcmp(base + s.offset, data, len) == 0)
+        {
+            writeU29(i << 1);
+            return;
+        }
+    }
+
+    writeU29((len << 1) | 1);
+
+    StringRef s;
+    s.offset = wb_->getBufferCount();
+    s.len = len;
+
+    wb_->writeBytes((uint8_t*)data, len);
+    strings_.add(s);
+}
+
+void AMF3Serializer::writeUndefined()
+{
+    wb_->writeB((uint8_t)AMF3_Undefined);
+}
+
+void AMF3Serializer::writeNull()
+{
+    wb_->writeB((uint8_t)AMF3_Null);
+}
+
+void AMF3Serializer::writeBool(bool v)
+{
+    wb_->writeB((uint8_t)(v ? AMF3_True : AMF3_False));
+}
+
+void AMF3Serializer::writeInteger(int32_t v)
+{
+    if(v < -0x10000000 || v > 0x0fffffff)
+    {
+        writeDouble(v);
+        return;
+    }
+
+    wb_->writeB((uint8_t)AMF3_Integer);
+    writeU29((uint32_t)v);
+}
+
+void AMF3Serializer::writeDouble(double v)
+{
+    wb_->writeB((uint8_t)AMF3_Double);
+
+    uint8_t* tmp = (uint8_t*)&v;
+    Utility::reverseBytes(tmp, 8);
+    wb_->writeBytes(tmp, 8);
+}
+
+void AMF3Serializer::writeNumber(double v)
+{
+    if(v >= -0x10000000 && v <= 0x0fffffff && v == (int32_t)v)
+    {
+        writeInteger((int32_t)v);
+    }
+    else
+    {
+        writeDouble(v);
+    }
+}
+
+void AMF3Serializer::writeString(const string& v)
+{
+    wb_->writeB((uint8_t)AMF3_String);
+    writeStringBody(v.c_str(), v.length());
+}
+
+void AMF3Serializer::writeObjectStart()
+{
+    wb_->writeB((uint8_t)AMF3_Object);
+    // inline object, inline traits, dynamic, no sealed members
+    writeU29(0x0b);
+    // anonymous class
+    writeStringBody("", 0);
+}
+
+void AMF3Serializer::writeObjectKey(const string& v)
+{
+    writeStringBody(v.c_str(), v.length());
+}
+
+void AMF3Serializer::writeObjectEnd()
+{
+    writeStringBody("", 0);
+}
+
+void AMF3Serializer::writeArrayStart(uint32_t count)
+{
+    wb_->writeB((uint8_t)AMF3_Array);
+    writeU29((count << 1) | 1);
+    // no associative part
+    writeStringBody("", 0);
+}
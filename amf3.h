@@ -0,0 +1,228 @@
+#ifndef AMF3_H
+#define AMF3_H
+
+#include <stdint.h>
+#include "writebuffer.h"
+#include "strref.h"
+#include "rtmpexception.h"
+
+enum AMF3Types
+{
+    AMF3_Undefined = 0,
+    AMF3_Null,
+    AMF3_False,
+    AMF3_True,
+    AMF3_Integer,
+    AMF3_Double,
+    AMF3_String,
+    AMF3_XmlDocument,
+    AMF3_Date,
+    AMF3_Array,
+    AMF3_Object,
+    AMF3_Xml,
+    AMF3_ByteArray,
+    AMF3_VectorInt,
+    AMF3_VectorUInt,
+    AMF3_VectorDouble,
+    AMF3_VectorObject,
+    AMF3_Dictionary
+};
+
+/*
+ * reference table of one message
+ *
+ * the first N entries live inside the table, so usual commands never
+ * allocate, bigger payloads grow it on the heap
+ */
+template <class T, int N>
+class AMF3RefTable
+{
+    private:
+        T inline_[N];
+        T* items_;
+        int count_;
+        int capacity_;
+
+        AMF3RefTable(const AMF3RefTable&);
+        AMF3RefTable& operator=(const AMF3RefTable&);
+
+    public:
+        AMF3RefTable(): items_(inline_), count_(0), capacity_(N)
+        {
+        }
+
+        ~AMF3RefTable()
+        {
+            if(items_ != inline_)
+            {
+                delete[] items_;
+            }
+        }
+
+        void add(const T& v)
+        {
+            if(count_ == capacity_)
+            {
+                T* items = new T[capacity_ * 2];
+                for(int i = 0; i < count_; i++)
+                {
+                    items[i] = items_[i];
+                }
+
+                if(items_ != inline_)
+                {
+                    delete[] items_;
+                }
+
+                items_ = items;
+                capacity_ *= 2;
+            }
+
+            items_[count_++] = v;
+        }
+
+        T& get(uint32_t i)
+        {
+            if(i >= (uint32_t)count_)
+            {
+                throw RtmpInvalidAMFData("AMF3 reference out of range");
+            }
+
+            return items_[i];
+        }
+
+        int size()
+        {
+            return count_;
+        }
+};
+
+struct AMF3Traits
+{
+    StrRef className;
+    bool dynamic;
+    bool externalizable;
+    // sealed member names are kept in the reader's member table
+    int sealedStart;
+    int sealedCount;
+};
+
+// walks the members of an object, sealed ones first, then dynamic ones
+struct AMF3ObjectCursor
+{
+    int traits;
+    int sealedIndex;
+    bool done;
+};
+
+/*
+ * cursor over AMF3 values, the counterpart of AMF0Reader
+ *
+ * strings and keys are views into the body. string, object and traits
+ * reference tables are flat arrays that live as long as the reader, which
+ * is one message
+ */
+class AMF3Reader
+{
+    private:
+        const static int MAX_DEPTH = 64;
+
+        const uint8_t* data_;
+        int size_;
+        int pos_;
+        int depth_;
+
+        AMF3RefTable<StrRef, 16> strings_;
+        // body offset of every complex value
+        AMF3RefTable<int, 16> objects_;
+        AMF3RefTable<AMF3Traits, 8> traits_;
+        AMF3RefTable<StrRef, 32> members_;
+
+        void need(int bytes);
+        void expect(AMF3Types t, const char* errorMsg);
+        double readDoubleBody();
+        void skipBytes(uint32_t bytes);
+        // returns the traits index, the inline flag has been taken off ref
+        int readTraits(uint32_t ref);
+        void skipObjectBody(uint32_t ref);
+
+        AMF3Reader(const AMF3Reader&);
+        AMF3Reader& operator=(const AMF3Reader&);
+
+    public:
+        AMF3Reader(const uint8_t* data, int size);
+
+        uint32_t readU29();
+        // UTF-8-vr, object keys and class names
+        StrRef readStringBody();
+
+        AMF3Types getNextType();
+        StrRef readString();
+        int32_t readInteger();
+        double readDouble();
+        // integer or double
+        double readNumber();
+        bool readBool();
+        void readNull();
+        void readUndefined();
+        bool isNextNumber();
+
+        // false when the value refers to an object that was read before
+        bool readObjectStart(AMF3ObjectCursor& oc);
+        // false at the end of the object, the value follows the key
+        bool nextProperty(AMF3ObjectCursor& oc, StrRef& key);
+        AMF3Traits& getTraits(const AMF3ObjectCursor& oc);
+
+        void skipValue();
+
+        void enter();
+        void leave();
+
+        void seek(int pos);
+        int getPos();
+        bool isFinished();
+};
+
+/*
+ * writes AMF3 values, strings that were written before are sent as
+ * references. the table keeps offsets into the buffer, so the strings
+ * passed in do not need to stay alive
+ */
+class AMF3Serializer
+{
+    private:
+        WriteBuffer* wb_;
+
+        struct StringRef
+        {
+            int offset;
+            int len;
+        };
+
+        AMF3RefTable<StringRef, 16> strings_;
+
+    public:
+        AMF3Serializer(WriteBuffer* wb);
+
+        void writeU29(uint32_t v);
+        void writeStringBody(const char* data, int len);
+
+        void writeUndefined();
+        void writeNull();
+        void writeBool(bool v);
+        // numbers out of the 29 bits range are written as double
+        void writeInteger(int32_t v);
+        void writeDouble(double v);
+        void writeNumber(double v);
+        void writeString(const string& v);
+
+        // anonymous dynamic object, key value pairs follow
+        void writeObjectStart();
+        void writeObjectKey(const string& v);
+        void writeObjectEnd();
+
+        // dense array, count values follow
+        void writeArrayStart(uint32_t count);
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "amfkeys.h"
+#include <ctype.h>
+
+// length and first char of a key packed into one switch label
+#define KEY_SLOT(len, c) (((len) << 8) | (uint8_t)(c))
+#define KEY_IS(name, lit) (name).equals(lit, sizeof(lit) - 1)
+#define KEY_IIS(name, lit) (name).iequals(lit, sizeof(lit) - 1)
+
+AMF0Commands AMFKeys::lookupCommand(const StrRef& name)
+{
+    if(name.len == 0)
+    {
+        return AMF0_UnknownCmd;
+    }
+
+    switch(KEY_SLOT(name.len, name.data[0]))
+    {
+        case KEY_SLOT(7, 'c'):
+            if(KEY_IS(name, "connect")) return AMF0_Connect;
+            break;
+        case KEY_SLOT(7, 'p'):
+            if(KEY_IS(name, "publish")) return AMF0_Publish;
+            break;
+        case KEY_SLOT(9, 'F'):
+            if(KEY_IS(name, "FCPublish")) return AMF0_FCPublish;
+            break;
+        case KEY_SLOT(12, 'c'):
+            if(KEY_IS(name, "createStream")) return AMF0_CreateStream;
+            break;
+        case KEY_SLOT(13, 'r'):
+            if(KEY_IS(name, "releaseStream")) return AMF0_ReleaseStream;
+            break;
+    }
+
+    return AMF0_UnknownCmd;
+}
+
+AMF0DataTypes AMFKeys::lookupDataType(const StrRef& name)
+{
+    if(KEY_IS(name, "@setDataFrame"))
+    {
+        return AMF0_DATA_SetDataFrame;
+    }
+
+    return AMF0_DATA_Unknown;
+}
+
+ConnectCmdObjKey AMFKeys::lookupConnectKey(const StrRef& name)
+{
+    if(name.len == 0)
+    {
+        return CCK_Unknown;
+    }
+
+    switch(KEY_SLOT(name.len, tolower((unsigned char)name.data[0])))
+    {
+        case KEY_SLOT(3, 'a'):
+            if(KEY_IIS(name, "app")) return CCK_App;
+            break;
+        case KEY_SLOT(4, 't'):
+            if(KEY_IIS(name, "type")) return CCK_Type;
+            break;
+        case KEY_SLOT(4, 'f'):
+            if(KEY_IIS(name, "fpad")) return CCK_Fpad;
+            break;
+        case KEY_SLOT(5, 't'):
+            if(KEY_IIS(name, "tcUrl")) return CCK_TcUrl;
+            break;
+        case KEY_SLOT(6, 's'):
+            if(KEY_IIS(name, "swfUrl")) return CCK_SwfUrl;
+            break;
+        case KEY_SLOT(7, 'p'):
+            if(KEY_IIS(name, "pageUrl")) return CCK_PageUrl;
+            break;
+        case KEY_SLOT(8, 'f'):
+            if(KEY_IIS(name, "flashver")) return CCK_Flashver;
+            break;
+        case KEY_SLOT(11, 'a'):
+            if(KEY_IIS(name, "audioCodecs")) return CCK_AudioCodecs;
+            break;
+        case KEY_SLOT(11, 'v'):
+            if(KEY_IIS(name, "videoCodecs")) return CCK_VideoCodecs;
+            break;
+        case KEY_SLOT(14, 'o'):
+            if(KEY_IIS(name, "objectEncoding")) return CCK_ObjectEncoding;
+            break;
+    }
+
+    return CCK_Unknown;
+}
+
+MetaDataKey AMFKeys::lookupMetaDataKey(const StrRef& name)
+{
+    if(name.len == 0)
+    {
+        return MDK_Unknown;
+    }
+
+    switch(KEY_SLOT(name.len, name.data[0]))
+    {
+        case KEY_SLOT(5, 't'):
+            if(KEY_IS(name, "title")) return MDK_Title;
+            break;
+        case KEY_SLOT(5, 'w'):
+            if(KEY_IS(name, "width")) return MDK_Width;
+            break;
+        case KEY_SLOT(6, 'a'):
+            if(KEY_IS(name, "author")) return MDK_Author;
+            break;
+        case KEY_SLOT(6, 'r'):
+            if(KEY_IS(name, "rating")) return MDK_Rating;
+            break;
+        case KEY_SLOT(6, 'h'):
+            if(KEY_IS(name, "height")) return MDK_Height;
+            break;
+        case KEY_SLOT(8, 'k'):
+            if(KEY_IS(name, "keywords")) return MDK_Keywords;
+            break;
+        case KEY_SLOT(8, 'a'):
+            if(KEY_IS(name, "avclevel")) return MDK_Avclevel;
+            break;
+        case KEY_SLOT(9, 'c'):
+            if(KEY_IS(name, "copyright")) return MDK_Copyright;
+            break;
+        case KEY_SLOT(9, 'f'):
+            if(KEY_IS(name, "framerate")) return MDK_Framerate;
+            break;
+        case KEY_SLOT(10, 'p'):
+            if(KEY_IS(name, "presetname")) return MDK_Presetname;
+            break;
+        case KEY_SLOT(10, 'a'):
+            if(KEY_IS(name, "avcprofile")) return MDK_Avcprofile;
+            break;
+        case KEY_SLOT(11, 'd'):
+            if(KEY_IS(name, "description")) return MDK_Description;
+            break;
+        case KEY_SLOT(11, 'v'):
+            if(KEY_IS(name, "videodevice")) return MDK_Videodevice;
+            break;
+        case KEY_SLOT(11, 'a'):
+            if(KEY_IS(name, "audiodevice")) return MDK_Audiodevice;
+            break;
+        case KEY_SLOT(12, 'c'):
+            if(KEY_IS(name, "creationdate")) return MDK_Creationdate;
+            break;
+        case KEY_SLOT(12, 'v'):
+            if(KEY_IS(name, "videocodecid")) return MDK_Videocodecid;
+            break;
+        case KEY_SLOT(12, 'a'):
+            if(KEY_IS(name, "audiocodecid")) return MDK_Audiocodecid;
+            break;
+        case KEY_SLOT(13, 'v'):
+            if(KEY_IS(name, "videodatarate")) return MDK_Videodatarate;
+            break;
+        case KEY_SLOT(13, 'a'):
+            if(KEY_IS(name, "audiochannels")) return MDK_Audiochannels;
+            if(KEY_IS(name, "audiodatarate")) return MDK_Audiodatarate;
+            break;
+        case KEY_SLOT(15, 'a'):
+            if(KEY_IS(name, "audiosamplerate")) return MDK_Audiosamplerate;
+            break;
+        case KEY_SLOT(16, 'a'):
+            if(KEY_IS(name, "audioinputvolume")) return MDK_Audioinputvolume;
+            break;
+        case KEY_SLOT(23, 'v'):
+            if(KEY_IS(name, "videokeyframe_frequency")) return MDK_VideokeyframeFrequency;
+            break;
+    }
+
+    return MDK_Unknown;
+}
@@ -0,0 +1,23 @@
+#ifndef AMF_KEYS_H
+#define AMF_KEYS_H
+
+#include "rtmpmsg.h"
+#include "strref.h"
+
+/*
+ * name to enum dispatch for command names, connect keys and onMetaData keys
+ *
+ * every lookup is a single switch on (length, first char) followed by
+ * at most two compares, nothing is allocated
+ */
+class AMFKeys
+{
+public:
+    static AMF0Commands lookupCommand(const StrRef& name);
+    static AMF0DataTypes lookupDataType(const StrRef& name);
+    // case insensitive, some clients send flashVer, some flashver
+    static ConnectCmdObjKey lookupConnectKey(const StrRef& name);
+    static MetaDataKey lookupMetaDataKey(const StrRef& name);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "arena.h"
+#include <stdlib.h>
+#include "rtmpexception.h"
+
+Arena::Arena(int blockSize):
+    head_(NULL), blockSize_(blockSize), allocated_(0)
+{
+}
+
+Arena::~Arena()
+{
+    while(head_)
+    {
+        Block* next = head_->next;
+        free(head_);
+        head_ = next;
+    }
+}
+
+Arena::Block* Arena::newBlock(int minSize)
+{
+    int size = blockSize_;
+    while(size < minSize)
+    {
+        size *= 2;
+    }
+
+    Block* b = (Block*)malloc(sizeof(Block) + size);
+    if(!b)
+    {
+        throw RtmpOutOfMemory("arena alloc failed");
+    }
+
+    b->size = size;
+    b->used = 0;
+    b->next = head_;
+    head_ = b;
+    allocated_ += sizeof(Block) + size;
+
+    return b;
+}
+
+void* Arena::alloc(int size)
+{
+    // keep everything 8 bytes aligned
+    size = (size + 7) & ~7;
+
+    Block* b = head_;
+    if(!b || b->size - b->used < size)
+    {
+        b = newBlock(size);
+    }
+
+    void* p = (uint8_t*)(b + 1) + b->used;
+    b->used += size;
+
+    return p;
+}
+
+void Arena::reset()
+{
+    // keep the newest block, it is the largest one
+    if(!head_)
+    {
+        return;
+    }
+
+    Block* b = head_->next;
+    while(b)
+    {
+        Block* next = b->next;
+        allocated_ -= sizeof(Block) + b->size;
+        free(b);
+        b = next;
+    }
+
+    head_->next = NULL;
+    head_->used = 0;
+}
+
+int Arena::getAllocated()
+{
+    return allocated_;
+}
@@ -0,0 +1,63 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+
+/*
+ * bump allocator, everything allocated from it is freed at once
+ * when the arena is reset or destroyed. destructors are not called,
+ * so only put plain structs in it
+ */
+class Arena
+{
+    private:
+        struct Block
+        {
+            Block* next;
+            int size;
+            int used;
+        };
+
+        const static int DEFAULT_BLOCK_SIZE = 4096;
+
+        Block* head_;
+        int blockSize_;
+        int allocated_;
+
+        Block* newBlock(int minSize);
+
+        Arena(const Arena&);
+        Arena& operator=(const Arena&);
+
+    public:
+        Arena(int blockSize = DEFAULT_BLOCK_SIZE);
+        ~Arena();
+
+        void* alloc(int size);
+        void reset();
+
+        // bytes taken from the system
+        int getAllocated();
+
+        template <class T>
+        T* make()
+        {
+            return new(alloc(sizeof(T))) T();
+        }
+
+        template <class T>
+        T* makeArray(int count)
+        {
+            T* p = (T*)alloc(sizeof(T) * count);
+            for(int i = 0; i < count; i++)
+            {
+                new(p + i) T();
+            }
+
+            return p;
+        }
+};
+
+#endif
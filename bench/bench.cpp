@@ -0,0 +1,636 @@
+/*
+ * microbenchmarks of the buffers, the chunk parser and the AMF codecs
+ *
+ * usage: tvie_rtmp_bench [-f filter] [-t milliseconds]
+ *
+ * one JSON object per line on stdout, so results of two releases can be
+ * compared by a script:
+ *   {"benchmark": name, "iterations": n, "ns_per_op": x,
+ *    "bytes_per_sec": y, "allocs_per_op": z}
+ */
+#include "../readbuffer.h"
+#include "../writebuffer.h"
+#include "../rtmpparser.h"
+#include "../amf0.h"
+#include "../amf0value.h"
+#include "../log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+#include <vector>
+#include <boost/atomic.hpp>
+
+using namespace std;
+
+static boost::atomic<uint64_t> allocations(0);
+
+// out of line, or gcc sees free() on what operator new returned and warns
+static void __attribute__((noinline)) release(void* p)
+{
+    free(p);
+}
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, boost::memory_order_relaxed);
+
+    void* p = malloc(size ? size : 1);
+    if(!p)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+    release(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    release(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+    release(p);
+}
+
+void operator delete[](void* p, size_t) throw()
+{
+    release(p);
+}
+
+static int64_t nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// keeps results alive so the compiler can not drop the work
+static volatile uint64_t sink;
+
+class Benchmark
+{
+    public:
+        virtual ~Benchmark() {}
+
+        virtual const char* getName() = 0;
+        // bytes handled by one op, 0 if it means nothing
+        virtual int64_t getBytesPerOp() = 0;
+        virtual void run(int64_t iterations) = 0;
+};
+
+class ReadBufferBench : public Benchmark
+{
+    private:
+        const static int WORDS = 1024;
+        uint8_t data_[WORDS * 4];
+        ReadBuffer rb_;
+
+    public:
+        ReadBufferBench(): rb_(WORDS * 8)
+        {
+            for(int i = 0; i < (int)sizeof(data_); i++)
+            {
+                data_[i] = i;
+            }
+        }
+
+        const char* getName() { return "readbuffer_append_read_u32"; }
+        int64_t getBytesPerOp() { return sizeof(data_); }
+
+        void run(int64_t iterations)
+        {
+            uint64_t sum = 0;
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                rb_.appendData(data_, sizeof(data_));
+                for(int w = 0; w < WORDS; w++)
+                {
+                    sum += rb_.read<uint32_t>(ReadBuffer::BIG);
+                }
+                rb_.reset();
+            }
+            sink = sum;
+        }
+};
+
+class WriteBufferBench : public Benchmark
+{
+    private:
+        const static int WORDS = 1024;
+        WriteBuffer wb_;
+
+    public:
+        WriteBufferBench(): wb_(WORDS * 4)
+        {
+        }
+
+        const char* getName() { return "writebuffer_writeB_u32"; }
+        int64_t getBytesPerOp() { return WORDS * 4; }
+
+        void run(int64_t iterations)
+        {
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                wb_.reInit();
+                for(int w = 0; w < WORDS; w++)
+                {
+                    wb_.writeB((uint32_t)w);
+                }
+            }
+            sink = wb_.getBufferCount();
+        }
+};
+
+/*
+ * a publisher's stream: audio on chunk stream 4, video on 6, every
+ * message with a type 0 header. when interleaved the chunks of an audio
+ * and a video message alternate, like encoders do with large video frames.
+ * with a read size the stream arrives in pieces of that size, like recv()
+ * hands it to the connection
+ */
+class ParserBench : public Benchmark
+{
+    private:
+        const static int MESSAGES = 64;
+        string name_;
+        int chunkSize_;
+        int readSize_;
+        vector<uint8_t> stream_;
+        int messages_;
+        int64_t bodyBytes_;
+
+        struct Pending
+        {
+            int chunkStreamId;
+            int typeId;
+            vector<uint8_t> body;
+            int offset;
+        };
+
+        void writeChunk(Pending& m, uint32_t timestamp)
+        {
+            if(m.offset == 0)
+            {
+                int len = m.body.size();
+                stream_.push_back(m.chunkStreamId);
+                stream_.push_back(timestamp >> 16);
+                stream_.push_back(timestamp >> 8);
+                stream_.push_back(timestamp);
+                stream_.push_back(len >> 16);
+                stream_.push_back(len >> 8);
+                stream_.push_back(len);
+                stream_.push_back(m.typeId);
+                // stream id, little endian
+                stream_.push_back(1);
+                stream_.push_back(0);
+                stream_.push_back(0);
+                stream_.push_back(0);
+            }
+            else
+            {
+                stream_.push_back(0xc0 | m.chunkStreamId);
+            }
+
+            int n = m.body.size() - m.offset;
+            if(n > chunkSize_)
+            {
+                n = chunkSize_;
+            }
+
+            stream_.insert(stream_.end(), m.body.begin() + m.offset, m.body.begin() + m.offset + n);
+            m.offset += n;
+        }
+
+        // the read loop of RtmpConnection
+        uint64_t runPieces(ReadBuffer& rb, RtmpParser& parser)
+        {
+            uint64_t bytes = 0;
+
+            for(int offset = 0; offset < (int)stream_.size(); offset += readSize_)
+            {
+                int n = stream_.size() - offset;
+                rb.appendData(&stream_[offset], n < readSize_ ? n : readSize_);
+
+                while(rb.getUnReadSize() > 0)
+                {
+                    rb.snapStart();
+                    RtmpMsgHeaderPtr mh = parser.parseMsgHeader(chunkSize_);
+                    if(!mh)
+                    {
+                        rb.snapStop();
+                        break;
+                    }
+                    rb.snapClear();
+
+                    bytes += mh->length;
+                }
+            }
+
+            return bytes;
+        }
+
+    public:
+        ParserBench(const char* name, int chunkSize, bool interleaved, int readSize = 0):
+            name_(name), chunkSize_(chunkSize), readSize_(readSize), messages_(0), bodyBytes_(0)
+        {
+            Pending audio;
+            audio.chunkStreamId = 4;
+            audio.typeId = MST_Audio;
+            audio.body.assign(200, 0xaf);
+
+            Pending video;
+            video.chunkStreamId = 6;
+            video.typeId = MST_Video;
+            video.body.assign(6000, 0x17);
+
+            for(int i = 0; i < MESSAGES / 2; i++)
+            {
+                audio.offset = 0;
+                video.offset = 0;
+
+                if(interleaved)
+                {
+                    while(audio.offset < (int)audio.body.size() || video.offset < (int)video.body.size())
+                    {
+                        if(video.offset < (int)video.body.size())
+                        {
+                            writeChunk(video, i * 40);
+                        }
+                        if(audio.offset < (int)audio.body.size())
+                        {
+                            writeChunk(audio, i * 40);
+                        }
+                    }
+                }
+                else
+                {
+                    while(video.offset < (int)video.body.size())
+                    {
+                        writeChunk(video, i * 40);
+                    }
+                    while(audio.offset < (int)audio.body.size())
+                    {
+                        writeChunk(audio, i * 40);
+                    }
+                }
+            }
+
+            messages_ = MESSAGES;
+            bodyBytes_ = (int64_t)(audio.body.size() + video.body.size()) * MESSAGES / 2;
+        }
+
+        const char* getName() { return name_.c_str(); }
+        int64_t getBytesPerOp() { return stream_.size(); }
+
+        void run(int64_t iterations)
+        {
+            ReadBuffer rb(stream_.size());
+            RtmpParser parser(&rb);
+            uint64_t bytes = 0;
+
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                if(readSize_ > 0)
+                {
+                    bytes += runPieces(rb, parser);
+                    continue;
+                }
+
+                rb.appendData(&stream_[0], stream_.size());
+                for(int m = 0; m < messages_; m++)
+                {
+                    bytes += parser.parseMsgHeader(chunkSize_)->length;
+                }
+                rb.reset();
+            }
+
+            if((int64_t)bytes != bodyBytes_ * iterations)
+            {
+                fprintf(stderr, "%s: parsed %llu body bytes, expected %lld\n", name_.c_str(),
+                        (unsigned long long)bytes, (long long)(bodyBytes_ * iterations));
+            }
+            sink = bytes;
+        }
+};
+
+static RtmpMsgHeaderPtr makeMessage(int typeId, WriteBuffer& wb)
+{
+    RtmpMsgHeaderPtr mh(new RtmpMsgHeader());
+    mh->typeId = typeId;
+    mh->length = wb.getBufferCount();
+    mh->allocBody(mh->length, MemAccountPtr());
+    memcpy(mh->body, wb.getBufferPtr(), mh->length);
+
+    return mh;
+}
+
+// what FMLE sends
+static void writeConnect(AMF0Serializer& s)
+{
+    s.writeString("connect");
+    s.writeNumber(1);
+    s.writeObjectStart();
+    s.writeObjectKey("app");
+    s.writeString("live");
+    s.writeObjectKey("flashVer");
+    s.writeString("FMLE/3.0 (compatible; FMSc/1.0)");
+    s.writeObjectKey("swfUrl");
+    s.writeString("rtmp://127.0.0.1/live");
+    s.writeObjectKey("tcUrl");
+    s.writeString("rtmp://127.0.0.1/live");
+    s.writeObjectKey("type");
+    s.writeString("nonprivate");
+    s.writeObjectKey("fpad");
+    s.writeBool(false);
+    s.writeObjectKey("capabilities");
+    s.writeNumber(15);
+    s.writeObjectKey("audioCodecs");
+    s.writeNumber(3191);
+    s.writeObjectKey("videoCodecs");
+    s.writeNumber(252);
+    s.writeObjectKey("videoFunction");
+    s.writeNumber(1);
+    s.writeObjectKey("objectEncoding");
+    s.writeNumber(0);
+    s.writeObjectEnd();
+}
+
+static void writeMetaData(AMF0Serializer& s)
+{
+    s.writeString("@setDataFrame");
+    s.writeString("onMetaData");
+    s.writeEcmaArrayStart(14);
+
+    const char* numbers[] = {"duration", "width", "height", "videodatarate", "framerate",
+        "videocodecid", "audiodatarate", "audiosamplerate", "audiosamplesize", "audiochannels",
+        "audiocodecid", "filesize"};
+    double values[] = {0, 1280, 720, 2500, 25, 7, 128, 44100, 16, 2, 10, 0};
+
+    for(int i = 0; i < (int)(sizeof(values) / sizeof(values[0])); i++)
+    {
+        s.writeObjectKey(numbers[i]);
+        s.writeNumber(values[i]);
+    }
+
+    s.writeObjectKey("stereo");
+    s.writeBool(true);
+    s.writeObjectKey("encoder");
+    s.writeString("Lavf58.76.100");
+    s.writeObjectEnd();
+}
+
+class ConnectBench : public Benchmark
+{
+    private:
+        RtmpMsgHeaderPtr mh_;
+
+    public:
+        ConnectBench()
+        {
+            WriteBuffer wb(1024);
+            AMF0Serializer s(&wb);
+            writeConnect(s);
+            mh_ = makeMessage(MST_CmdAMF0, wb);
+        }
+
+        const char* getName() { return "parser_connect_cmd"; }
+        int64_t getBytesPerOp() { return mh_->length; }
+
+        void run(int64_t iterations)
+        {
+            ReadBuffer rb(16);
+            RtmpParser parser(&rb);
+
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                sink = parser.parseConnectCmd(mh_)->app.size();
+            }
+        }
+};
+
+class MetaDataBench : public Benchmark
+{
+    private:
+        RtmpMsgHeaderPtr mh_;
+
+    public:
+        MetaDataBench()
+        {
+            WriteBuffer wb(1024);
+            AMF0Serializer s(&wb);
+            writeMetaData(s);
+            mh_ = makeMessage(MST_DataAMF0, wb);
+        }
+
+        const char* getName() { return "parser_metadata"; }
+        int64_t getBytesPerOp() { return mh_->length; }
+
+        void run(int64_t iterations)
+        {
+            ReadBuffer rb(16);
+            RtmpParser parser(&rb);
+
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                sink = (uint64_t)parser.parseMetaData(mh_)->width;
+            }
+        }
+};
+
+// walks every value without building anything
+class AMF0SkipBench : public Benchmark
+{
+    private:
+        vector<uint8_t> data_;
+
+    public:
+        AMF0SkipBench()
+        {
+            WriteBuffer wb(1024);
+            AMF0Serializer s(&wb);
+            writeConnect(s);
+            writeMetaData(s);
+            data_.assign(wb.getBufferPtr(), wb.getBufferPtr() + wb.getBufferCount());
+        }
+
+        const char* getName() { return "amf0_reader_skip"; }
+        int64_t getBytesPerOp() { return data_.size(); }
+
+        void run(int64_t iterations)
+        {
+            uint64_t values = 0;
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                AMF0Reader r(&data_[0], data_.size());
+                while(!r.isFinished())
+                {
+                    r.skipValue();
+                    values++;
+                }
+            }
+            sink = values;
+        }
+};
+
+// builds the value tree in the arena and looks up one key
+class AMF0DocumentBench : public Benchmark
+{
+    private:
+        vector<uint8_t> data_;
+
+    public:
+        AMF0DocumentBench()
+        {
+            WriteBuffer wb(1024);
+            AMF0Serializer s(&wb);
+            writeMetaData(s);
+            data_.assign(wb.getBufferPtr(), wb.getBufferPtr() + wb.getBufferCount());
+        }
+
+        const char* getName() { return "amf0_document_property"; }
+        int64_t getBytesPerOp() { return data_.size(); }
+
+        void run(int64_t iterations)
+        {
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                AMF0Document doc(&data_[0], data_.size());
+                const AMF0Value* v = doc.getProperty("height");
+                sink = v ? (uint64_t)v->number : 0;
+            }
+        }
+};
+
+class AMF0SerializeBench : public Benchmark
+{
+    private:
+        WriteBuffer wb_;
+        int size_;
+
+    public:
+        AMF0SerializeBench(): wb_(1024), size_(0)
+        {
+            AMF0Serializer s(&wb_);
+            writeConnect(s);
+            size_ = wb_.getBufferCount();
+        }
+
+        const char* getName() { return "amf0_serialize_connect"; }
+        int64_t getBytesPerOp() { return size_; }
+
+        void run(int64_t iterations)
+        {
+            AMF0Serializer s(&wb_);
+            for(int64_t i = 0; i < iterations; i++)
+            {
+                wb_.reInit();
+                writeConnect(s);
+            }
+            sink = wb_.getBufferCount();
+        }
+};
+
+static void measure(Benchmark* b, int64_t minNanos)
+{
+    // warm up, and find how many iterations take about minNanos
+    int64_t iterations = 1;
+    int64_t elapsed = 0;
+    while(true)
+    {
+        int64_t start = nowNanos();
+        b->run(iterations);
+        elapsed = nowNanos() - start;
+
+        if(elapsed >= minNanos / 10 || iterations >= ((int64_t)1 << 40))
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    iterations = elapsed > 0 ? iterations * minNanos / elapsed : iterations;
+    if(iterations < 1)
+    {
+        iterations = 1;
+    }
+
+    uint64_t allocStart = allocations.load();
+    int64_t start = nowNanos();
+    b->run(iterations);
+    elapsed = nowNanos() - start;
+    uint64_t allocs = allocations.load() - allocStart;
+
+    double nsPerOp = (double)elapsed / iterations;
+    double bytesPerSec = b->getBytesPerOp() ? b->getBytesPerOp() * 1e9 / nsPerOp : 0;
+
+    printf("{\"benchmark\": \"%s\", \"iterations\": %lld, \"ns_per_op\": %.2f, "
+            "\"bytes_per_sec\": %.0f, \"allocs_per_op\": %.3f}\n",
+            b->getName(), (long long)iterations, nsPerOp, bytesPerSec, (double)allocs / iterations);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* filter = NULL;
+    int64_t minNanos = 500 * 1000000LL;
+    int c;
+
+    while((c = getopt(argc, argv, "f:t:")) != -1)
+    {
+        switch(c)
+        {
+            case 'f':
+                filter = optarg;
+                break;
+            case 't':
+                minNanos = atoll(optarg) * 1000000;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f filter] [-t milliseconds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // the parser logs per chunk at debug
+    Log::setLevel(LEVWARN);
+
+    vector<Benchmark*> benchmarks;
+    benchmarks.push_back(new ReadBufferBench());
+    benchmarks.push_back(new WriteBufferBench());
+    benchmarks.push_back(new ParserBench("parser_chunk128", 128, false));
+    benchmarks.push_back(new ParserBench("parser_chunk4096", 4096, false));
+    benchmarks.push_back(new ParserBench("parser_chunk128_interleaved", 128, true));
+    benchmarks.push_back(new ParserBench("parser_chunk4096_read1460", 4096, false, 1460));
+    benchmarks.push_back(new ConnectBench());
+    benchmarks.push_back(new MetaDataBench());
+    benchmarks.push_back(new AMF0SkipBench());
+    benchmarks.push_back(new AMF0DocumentBench());
+    benchmarks.push_back(new AMF0SerializeBench());
+
+    for(size_t i = 0; i < benchmarks.size(); i++)
+    {
+        if(!filter || strstr(benchmarks[i]->getName(), filter))
+        {
+            measure(benchmarks[i], minNanos);
+        }
+
+        delete benchmarks[i];
+    }
+
+    return 0;
+}
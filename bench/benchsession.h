@@ -0,0 +1,148 @@
+#ifndef BENCH_SESSION_H
+#define BENCH_SESSION_H
+
+#include "../rtmpactor.h"
+#include "../rtmpmsg.h"
+#include "../writebuffer.h"
+#include "../chunkwriter.h"
+#include "../amf0.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * takes every command and drops the media, a bench overrides the callback
+ * it measures
+ */
+class StubActor : public RtmpActor
+{
+    public:
+        bool onConnect(ConnectCmdPtr)
+        {
+            return true;
+        }
+
+        void onDisconnect()
+        {
+        }
+
+        bool onPublish(int, string)
+        {
+            return true;
+        }
+
+        bool onCreateStream(int)
+        {
+            return true;
+        }
+
+        bool onMetaData(int, MetaDataMsgPtr)
+        {
+            return true;
+        }
+
+        bool onReceiveStream(int, bool, RtmpMsgHeaderPtr)
+        {
+            return true;
+        }
+};
+
+/*
+ * what a publisher sends, chunked with ChunkWriter and AMF0ChunkSerializer
+ * like tvie_rtmp_loadgen does it, in the default chunk size
+ */
+class SessionWriter
+{
+    private:
+        const static int CHUNK_SIZE = 128;
+
+        WriteBuffer wb_;
+        ChunkWriter cw_;
+
+        SessionWriter(const SessionWriter&);
+        SessionWriter& operator=(const SessionWriter&);
+
+        void beginMessage(int chunkStreamId, int typeId, int streamId)
+        {
+            wb_.reInit();
+
+            // type 0 header, the length is filled in by ChunkWriter::end()
+            wb_.writeByte(chunkStreamId);
+            wb_.writeB(0, 24);
+            int lengthPos = wb_.getBufferCount();
+            wb_.writeB(0, 24);
+            wb_.writeByte(typeId);
+            wb_.writeL(streamId, 32);
+
+            cw_.begin(CHUNK_SIZE, chunkStreamId, lengthPos);
+        }
+
+        void endMessage(vector<uint8_t>& out)
+        {
+            cw_.end();
+            out.insert(out.end(), wb_.getBufferPtr(), wb_.getBufferPtr() + wb_.getBufferCount());
+        }
+
+    public:
+        SessionWriter():
+            wb_(4096), cw_(&wb_)
+        {
+        }
+
+        void writeMessage(vector<uint8_t>& out, int chunkStreamId, int typeId, int streamId,
+                const uint8_t* data, int size)
+        {
+            beginMessage(chunkStreamId, typeId, streamId);
+            cw_.writeBytes(data, size);
+            endMessage(out);
+        }
+
+        // C2 and connect, then createStream and publish once connect is answered
+        void writeSession(vector<uint8_t>& connect, vector<uint8_t>& publish, const string& name)
+        {
+            // C2, not checked
+            connect.assign(1536, 0);
+
+            beginMessage(3, MST_CmdAMF0, 0);
+            {
+                AMF0ChunkSerializer s(&cw_);
+                s.writeString("connect");
+                s.writeNumber(1);
+                s.writeObjectStart();
+                s.writeObjectKey("app");
+                s.writeString("live");
+                s.writeObjectKey("flashVer");
+                s.writeString("FMLE/3.0 (compatible; FMSc/1.0)");
+                s.writeObjectKey("tcUrl");
+                s.writeString("rtmp://127.0.0.1/live");
+                s.writeObjectKey("type");
+                s.writeString("nonprivate");
+                s.writeObjectEnd();
+            }
+            endMessage(connect);
+
+            beginMessage(3, MST_CmdAMF0, 0);
+            {
+                AMF0ChunkSerializer s(&cw_);
+                s.writeString("createStream");
+                s.writeNumber(2);
+                s.writeNull();
+            }
+            endMessage(publish);
+
+            beginMessage(4, MST_CmdAMF0, 1);
+            {
+                AMF0ChunkSerializer s(&cw_);
+                s.writeString("publish");
+                s.writeNumber(3);
+                s.writeNull();
+                s.writeString(name);
+                s.writeString("live");
+            }
+            endMessage(publish);
+        }
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * resident memory of idle publishers
+ *
+ * usage: tvie_rtmp_idlebench [-n connections] [-l]
+ *
+ * takes n connections through the handshake, connect, createStream and
+ * publish in this process, fed and drained the way the io_uring backend
+ * does it, then leaves them idle with their timers armed on one wheel.
+ * -l turns on RtmpConnection::setLowFootprint(). prints one JSON object:
+ *   {"connections": n, "low_footprint": b, "rss_bytes": r,
+ *    "bytes_per_connection": x, "accounted_bytes": a, "timers": t}
+ *
+ * kernel socket buffers are not in the process, the threads backend adds
+ * a thread stack per client on top of this
+ *   tvie_rtmp_idlebench -n 50000 -l
+ */
+#include "../rtmpconnection.h"
+#include "../memaccount.h"
+#include "../log.h"
+#include "../utility.h"
+#include "benchsession.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int published = 0;
+
+class IdleActor : public StubActor
+{
+    public:
+        bool onPublish(int, string)
+        {
+            published++;
+            return true;
+        }
+};
+
+// the replies are sent and their buffer dropped, like an idle uring client
+static void drain(RtmpConnectionPtr& conn)
+{
+    vector<uint8_t> out;
+    conn->takeOutput(out);
+}
+
+static int64_t residentBytes()
+{
+    long pages = 0;
+    long resident = 0;
+
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(!f)
+    {
+        return 0;
+    }
+
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(f);
+
+    return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char* argv[])
+{
+    int count = 50000;
+    bool lowFootprint = false;
+    int c;
+
+    while((c = getopt(argc, argv, "n:l")) != -1)
+    {
+        switch(c)
+        {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'l':
+                lowFootprint = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n connections] [-l]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    Log::setLevel(LEVWARN);
+    RtmpConnection::setLowFootprint(lowFootprint);
+
+    vector<uint8_t> hello(1 + 1536, 0);
+    hello[0] = 3;
+    vector<uint8_t> connect;
+    vector<uint8_t> publish;
+    SessionWriter writer;
+    writer.writeSession(connect, publish, "idle");
+
+    vector<RtmpConnectionPtr> conns;
+    conns.reserve(count);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+
+    int64_t before = residentBytes();
+    TimerWheel wheel(10, Utility::getMonotonicMicros());
+
+    for(int i = 0; i < count; i++)
+    {
+        RtmpConnectionPtr conn(new RtmpConnection(-1, addr, RtmpActorPtr(new IdleActor())));
+        conn->setDeferredSend(true);
+        conn->setTimerWheel(&wheel, boost::function<void()>());
+
+        conn->onReceive(&hello[0], hello.size());
+        drain(conn);
+        conn->onReceive(&connect[0], connect.size());
+        drain(conn);
+        conn->onReceive(&publish[0], publish.size());
+        drain(conn);
+
+        if(conn->isDisconnected())
+        {
+            fprintf(stderr, "connection %d closed while publishing\n", i);
+            return 1;
+        }
+
+        conns.push_back(conn);
+    }
+
+    int64_t rss = residentBytes() - before;
+
+    if(published != count)
+    {
+        fprintf(stderr, "%d of %d connections published\n", published, count);
+        return 1;
+    }
+
+    printf("{\"connections\": %d, \"low_footprint\": %s, \"rss_bytes\": %lld, "
+            "\"bytes_per_connection\": %lld, \"accounted_bytes\": %lld, \"timers\": %d}\n",
+            count, lowFootprint ? "true" : "false", (long long)rss,
+            (long long)(rss / count), (long long)MemAccount::getStats().globalUsed, wheel.getCount());
+
+    return 0;
+}
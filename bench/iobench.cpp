@@ -0,0 +1,146 @@
+/*
+ * ingest cost of the io backends of RtmpServer
+ *
+ * usage: tvie_rtmp_iobench [-b threads|uring] [-w workers] [-e actor threads] [-p port] [-d seconds] [-l]
+ *
+ * serves publishers with an actor that only counts, for -d seconds after
+ * the first client connects, then prints one JSON object:
+ *   {"backend": b, "seconds": s, "connections": n, "messages": m,
+ *    "bytes": x, "cpu_user": u, "cpu_sys": y, "cpu_us_per_mb": z,
+ *    "voluntary_switches": v}
+ * -l turns on RtmpConnection::setLowFootprint()
+ *
+ * drive it with the load generator and run it once per backend:
+ *   tvie_rtmp_iobench -b uring -w 2 -p 19350 -d 20 &
+ *   tvie_rtmp_loadgen -p 19350 -n 500 -t 4 -b 2000 -d 25
+ */
+#include "../rtmpserver.h"
+#include "../metrics.h"
+#include "../log.h"
+#include "benchsession.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <boost/atomic.hpp>
+
+using namespace std;
+
+static boost::atomic<int64_t> connections(0);
+
+class CountingActor : public StubActor
+{
+    public:
+        bool onPublish(int, string)
+        {
+            connections.fetch_add(1, boost::memory_order_relaxed);
+            return true;
+        }
+
+        static RtmpActor* createActor()
+        {
+            return new CountingActor();
+        }
+};
+
+static void serve(RtmpServer* server)
+{
+    try
+    {
+        server->start();
+    }
+    catch(RtmpException& e)
+    {
+        fprintf(stderr, "server failed: %s\n", e.what());
+        exit(1);
+    }
+}
+
+static double seconds(const struct timeval& tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    RtmpIoBackend backend = IOB_Threads;
+    int workers = 1;
+    int actorThreads = 0;
+    int port = 1935;
+    int duration = 10;
+    int c;
+
+    while((c = getopt(argc, argv, "b:w:e:p:d:l")) != -1)
+    {
+        switch(c)
+        {
+            case 'b':
+                backend = strcmp(optarg, "uring") == 0 ? IOB_Uring : IOB_Threads;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'e':
+                actorThreads = atoi(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'l':
+                RtmpConnection::setLowFootprint(true);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b threads|uring] [-w workers] [-e actor threads] [-p port] [-d seconds] [-l]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    Log::setLevel(LEVWARN);
+
+    RtmpServer server(port, CountingActor::createActor);
+    server.setIoBackend(backend, workers);
+    if(actorThreads > 0)
+    {
+        server.setActorThreads(actorThreads);
+    }
+    boost::thread(boost::bind(serve, &server)).detach();
+
+    while(connections.load() == 0)
+    {
+        usleep(1000);
+    }
+
+    int64_t before[MET_Count];
+    int64_t after[MET_Count];
+    struct rusage usageBefore;
+    struct rusage usageAfter;
+
+    Metrics::collect(before);
+    getrusage(RUSAGE_SELF, &usageBefore);
+
+    sleep(duration);
+
+    Metrics::collect(after);
+    getrusage(RUSAGE_SELF, &usageAfter);
+
+    double user = seconds(usageAfter.ru_utime) - seconds(usageBefore.ru_utime);
+    double sys = seconds(usageAfter.ru_stime) - seconds(usageBefore.ru_stime);
+    int64_t bytes = after[MET_BytesReceived] - before[MET_BytesReceived];
+    int64_t messages = after[MET_MsgAudio] + after[MET_MsgVideo] - before[MET_MsgAudio] - before[MET_MsgVideo];
+
+    printf("{\"backend\": \"%s\", \"seconds\": %d, \"connections\": %lld, \"messages\": %lld, "
+            "\"bytes\": %lld, \"cpu_user\": %.3f, \"cpu_sys\": %.3f, \"cpu_us_per_mb\": %.1f, "
+            "\"voluntary_switches\": %ld}\n",
+            backend == IOB_Uring ? "uring" : "threads", duration, (long long)after[MET_Connections],
+            (long long)messages, (long long)bytes, user, sys,
+            bytes > 0 ? (user + sys) * 1000000 / (bytes / 1000000.0) : 0.0,
+            usageAfter.ru_nvcsw - usageBefore.ru_nvcsw);
+
+    // the server thread never returns
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,322 @@
+/*
+ * what the socket options of a listener do to latency, see TcpTuning
+ *
+ * usage: tvie_rtmp_tcpbench [-b threads|uring] [-p port] [-n connects] [-f frames]
+ *            [-s frame bytes] [-N] [-C] [-r rcvbuf] [-w sndbuf] [-D seconds]
+ *            [-L lowat] [-P busy poll us]
+ *
+ * serves on 127.0.0.1 in this process with the options given:
+ *   -N TCP_NODELAY, -C TCP_CORK around the replies, -r SO_RCVBUF,
+ *   -w SO_SNDBUF, -D TCP_DEFER_ACCEPT, -L TCP_NOTSENT_LOWAT, -P SO_BUSY_POLL
+ * then opens n connections one after the other, each from connect() until
+ * the result of the connect command, the server's replies included. one
+ * publisher then sends f video frames, one at a time, and each is timed
+ * from send() until the actor has it. prints one JSON object:
+ *   {"backend": b, "tuning": t, "connects": n, "connect_us_p50": c50,
+ *    "connect_us_p99": c99, "frames": f, "frame_bytes": s,
+ *    "frame_us_p50": f50, "frame_us_p99": f99}
+ *
+ * compare kernel defaults with a tuned listener:
+ *   tvie_rtmp_tcpbench -p 19351 -n 2000 -f 5000
+ *   tvie_rtmp_tcpbench -p 19352 -n 2000 -f 5000 -N -C -D 5
+ */
+#include "../rtmpserver.h"
+#include "../log.h"
+#include "../utility.h"
+#include "benchsession.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+// one frame in flight, the client waits for the actor
+static boost::mutex mt;
+static boost::condition_variable cv;
+static vector<double> frameMicros;
+
+class TimingActor : public StubActor
+{
+    public:
+        // the client put its send time after the AVC packet header
+        bool onReceiveStream(int, bool, RtmpMsgHeaderPtr msg)
+        {
+            int64_t now = Utility::getMonotonicMicros();
+            int64_t sent;
+            if(msg->length < 5 + (int)sizeof(sent))
+            {
+                return true;
+            }
+            memcpy(&sent, msg->body + 5, sizeof(sent));
+
+            boost::lock_guard<boost::mutex> lk(mt);
+            frameMicros.push_back(now - sent);
+            cv.notify_one();
+
+            return true;
+        }
+
+        static RtmpActor* createActor()
+        {
+            return new TimingActor();
+        }
+};
+
+static void serve(RtmpServer* server)
+{
+    try
+    {
+        server->start();
+    }
+    catch(RtmpException& e)
+    {
+        fprintf(stderr, "server failed: %s\n", e.what());
+        exit(1);
+    }
+}
+
+static void sendAll(int sock, const vector<uint8_t>& data)
+{
+    size_t sent = 0;
+    while(sent < data.size())
+    {
+        ssize_t n = send(sock, &data[sent], data.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            fprintf(stderr, "send failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        sent += n;
+    }
+}
+
+// reads until at least size bytes came, or until what came holds needle
+static void receive(int sock, vector<uint8_t>& in, size_t size, const char* needle)
+{
+    uint8_t buffer[16384];
+    size_t needleSize = needle ? strlen(needle) : 0;
+
+    while(true)
+    {
+        if(needle ? search(in.begin(), in.end(), needle, needle + needleSize) != in.end()
+                : in.size() >= size)
+        {
+            return;
+        }
+
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if(n <= 0)
+        {
+            fprintf(stderr, "receive failed: %s\n", n == 0 ? "closed" : strerror(errno));
+            exit(1);
+        }
+        in.insert(in.end(), buffer, buffer + n);
+    }
+}
+
+static int connectServer(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock != -1 && ::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(sock);
+        sock = -1;
+    }
+
+    return sock;
+}
+
+// the client side has no options of its own, only the server's are compared
+static int openSession(int port, const vector<uint8_t>& connect)
+{
+    int sock = connectServer(port);
+    if(sock == -1)
+    {
+        fprintf(stderr, "connect failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    vector<uint8_t> hello(1 + 1536, 0);
+    hello[0] = 3;
+    sendAll(sock, hello);
+
+    vector<uint8_t> in;
+    receive(sock, in, 1 + 1536 * 2, NULL);
+    in.erase(in.begin(), in.begin() + 1 + 1536 * 2);
+
+    sendAll(sock, connect);
+    receive(sock, in, 0, "_result");
+
+    return sock;
+}
+
+static double percentile(vector<double>& v, double p)
+{
+    if(v.empty())
+    {
+        return 0;
+    }
+
+    sort(v.begin(), v.end());
+    return v[(size_t)(p * (v.size() - 1))];
+}
+
+int main(int argc, char* argv[])
+{
+    RtmpIoBackend backend = IOB_Threads;
+    int port = 1935;
+    int connects = 1000;
+    int frames = 2000;
+    int frameBytes = 4096;
+    TcpTuning tuning;
+    string options;
+    int c;
+
+    while((c = getopt(argc, argv, "b:p:n:f:s:NCr:w:D:L:P:")) != -1)
+    {
+        switch(c)
+        {
+            case 'b':
+                backend = strcmp(optarg, "uring") == 0 ? IOB_Uring : IOB_Threads;
+                continue;
+            case 'p':
+                port = atoi(optarg);
+                continue;
+            case 'n':
+                connects = atoi(optarg);
+                continue;
+            case 'f':
+                frames = atoi(optarg);
+                continue;
+            case 's':
+                frameBytes = atoi(optarg);
+                continue;
+            case 'N':
+                tuning.noDelay = true;
+                break;
+            case 'C':
+                tuning.cork = true;
+                break;
+            case 'r':
+                tuning.recvBuffer = atoi(optarg);
+                break;
+            case 'w':
+                tuning.sendBuffer = atoi(optarg);
+                break;
+            case 'D':
+                tuning.deferAcceptSeconds = atoi(optarg);
+                break;
+            case 'L':
+                tuning.notSentLowat = atoi(optarg);
+                break;
+            case 'P':
+                tuning.busyPollMicros = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b threads|uring] [-p port] [-n connects] [-f frames] "
+                        "[-s frame bytes] [-N] [-C] [-r rcvbuf] [-w sndbuf] [-D seconds] "
+                        "[-L lowat] [-P busy poll us]\n", argv[0]);
+                return 1;
+        }
+
+        // only the tuning options are named in the result
+        options += options.empty() ? "-" : " -";
+        options += (char)c;
+        if(strchr("rwDLP", c))
+        {
+            options += optarg;
+        }
+    }
+
+    if(frameBytes < 5 + (int)sizeof(int64_t) || connects < 1)
+    {
+        fprintf(stderr, "frames need %d bytes and one connect is made at least\n", 5 + (int)sizeof(int64_t));
+        return 1;
+    }
+
+    Log::setLevel(LEVWARN);
+
+    RtmpServer server(port, TimingActor::createActor);
+    server.setIoBackend(backend, 1);
+    server.setTcpTuning(tuning);
+    boost::thread(boost::bind(serve, &server)).detach();
+
+    vector<uint8_t> connect;
+    vector<uint8_t> publish;
+    SessionWriter writer;
+    writer.writeSession(connect, publish, "tcpbench");
+
+    // start() listens on another thread, the probe is not timed
+    int probe;
+    for(int i = 0; (probe = connectServer(port)) == -1; i++)
+    {
+        if(i == 500)
+        {
+            fprintf(stderr, "server does not listen on %d\n", port);
+            return 1;
+        }
+        usleep(10000);
+    }
+    close(probe);
+
+    vector<double> connectMicros;
+    for(int i = 0; i < connects; i++)
+    {
+        int64_t start = Utility::getMonotonicMicros();
+        int sock = openSession(port, connect);
+        connectMicros.push_back(Utility::getMonotonicMicros() - start);
+        close(sock);
+    }
+
+    int sock = openSession(port, connect);
+    vector<uint8_t> in;
+    sendAll(sock, publish);
+    receive(sock, in, 0, "NetStream.Publish.Start");
+
+    // an AVC inter frame, the send time goes where the NALUs would start
+    vector<uint8_t> body(frameBytes, 0);
+    body[0] = 0x27;
+    body[1] = 1;
+
+    vector<uint8_t> out;
+    for(int i = 0; i < frames; i++)
+    {
+        int64_t now = Utility::getMonotonicMicros();
+        memcpy(&body[5], &now, sizeof(now));
+
+        out.clear();
+        writer.writeMessage(out, 6, MST_Video, 1, &body[0], body.size());
+
+        boost::unique_lock<boost::mutex> lk(mt);
+        size_t done = frameMicros.size();
+        lk.unlock();
+
+        sendAll(sock, out);
+
+        lk.lock();
+        while(frameMicros.size() == done)
+        {
+            cv.wait(lk);
+        }
+    }
+
+    // the actor does not append anymore, every frame is in
+    printf("{\"backend\": \"%s\", \"tuning\": \"%s\", \"connects\": %d, \"connect_us_p50\": %.1f, "
+            "\"connect_us_p99\": %.1f, \"frames\": %d, \"frame_bytes\": %d, "
+            "\"frame_us_p50\": %.1f, \"frame_us_p99\": %.1f}\n",
+            backend == IOB_Uring ? "uring" : "threads", options.c_str(), connects,
+            percentile(connectMicros, 0.5), percentile(connectMicros, 0.99), frames, frameBytes,
+            percentile(frameMicros, 0.5), percentile(frameMicros, 0.99));
+
+    // the server thread never returns
+    fflush(stdout);
+    _exit(0);
+}
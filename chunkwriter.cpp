@@ -0,0 +1,78 @@
+#include "chunkwriter.h"
+#include "rtmpexception.h"
+
+ChunkWriter::ChunkWriter(WriteBuffer* wb):
+    wb_(wb), chunkSize_(0), lengthPos_(-1), bodySize_(0), chunkLeft_(0), type3Size_(0)
+{
+}
+
+void ChunkWriter::begin(int chunkSize, int chunkStreamId, int lengthPos)
+{
+    if(chunkSize <= 0)
+    {
+        throw RtmpInvalidArg("chunkSize");
+    }
+
+    chunkSize_ = chunkSize;
+    lengthPos_ = lengthPos;
+    bodySize_ = 0;
+    chunkLeft_ = chunkSize;
+
+    // basic header of type 3, same as the first chunk's stream id
+    if(chunkStreamId < 64)
+    {
+        type3_[0] = 0xc0 | chunkStreamId;
+        type3Size_ = 1;
+    }
+    else if(chunkStreamId <= 319)
+    {
+        type3_[0] = 0xc0;
+        type3_[1] = chunkStreamId - 64;
+        type3Size_ = 2;
+    }
+    else
+    {
+        type3_[0] = 0xc1;
+        type3_[1] = (chunkStreamId - 64) & 0xff;
+        type3_[2] = (chunkStreamId - 64) >> 8;
+        type3Size_ = 3;
+    }
+}
+
+void ChunkWriter::writeBytes(const uint8_t* data, int size)
+{
+    while(size > 0)
+    {
+        if(chunkLeft_ == 0)
+        {
+            wb_->writeBytes(type3_, type3Size_);
+            chunkLeft_ = chunkSize_;
+        }
+
+        int n = size < chunkLeft_ ? size : chunkLeft_;
+        wb_->writeBytes((uint8_t*)data, n);
+
+        data += n;
+        size -= n;
+        chunkLeft_ -= n;
+        bodySize_ += n;
+    }
+}
+
+void ChunkWriter::end()
+{
+    if(bodySize_ > 0xffffff)
+    {
+        throw RtmpInternalError("message is too large");
+    }
+
+    uint8_t* p = wb_->getBufferPtr() + lengthPos_;
+    p[0] = bodySize_ >> 16;
+    p[1] = bodySize_ >> 8;
+    p[2] = bodySize_;
+}
+
+int ChunkWriter::getBodySize()
+{
+    return bodySize_;
+}
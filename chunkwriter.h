@@ -0,0 +1,49 @@
+#ifndef CHUNK_WRITER_H
+#define CHUNK_WRITER_H
+
+#include <stdint.h>
+#include "writebuffer.h"
+
+/*
+ * writes the body of one message straight into the output buffer
+ *
+ * the chunk header is already in the buffer, a type 3 header is put in
+ * before every chunkSize bytes of body, end() fills in the message length
+ */
+class ChunkWriter
+{
+    private:
+        WriteBuffer* wb_;
+        int chunkSize_;
+        int lengthPos_;
+        int bodySize_;
+        int chunkLeft_;
+
+        uint8_t type3_[3];
+        int type3Size_;
+
+    public:
+        ChunkWriter(WriteBuffer* wb);
+
+        // lengthPos is where the 24 bits length of the header is
+        void begin(int chunkSize, int chunkStreamId, int lengthPos);
+        void end();
+
+        void writeBytes(const uint8_t* data, int size);
+
+        template <class T>
+        void writeB(T s)
+        {
+            uint8_t tmp[sizeof(T)];
+            for(int i = 0; i < (int)sizeof(T); i++)
+            {
+                tmp[i] = (uint8_t)(s >> ((sizeof(T) - 1 - i) * 8));
+            }
+
+            writeBytes(tmp, sizeof(T));
+        }
+
+        int getBodySize();
+};
+
+#endif
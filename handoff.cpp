@@ -0,0 +1,332 @@
+#include "handoff.h"
+#include "log.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace
+{
+
+const int HEADER_SIZE = 8;
+
+void fillAddr(const string& path, struct sockaddr_un& addr)
+{
+    if(path.size() >= sizeof(addr.sun_path))
+    {
+        throw RtmpInvalidArg("upgrade path is too long");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+}
+
+// the other end runs as this process does, it gets or gives every client
+bool isOwnPeer(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    {
+        return false;
+    }
+
+    return cred.uid == geteuid();
+}
+
+void checkDirectory(const string& path)
+{
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+
+    if(mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        throw RtmpInternalError("create upgrade directory failed", errno);
+    }
+
+    struct stat st;
+    if(stat(dir.c_str(), &st) == -1)
+    {
+        throw RtmpInternalError("stat upgrade directory failed", errno);
+    }
+
+    if(!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        throw RtmpInvalidArg("upgrade directory must be owned by this user and not writable by others");
+    }
+}
+
+void sendAll(int sock, const uint8_t* data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t n = ::send(sock, data, size, MSG_NOSIGNAL);
+        if(n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            throw RtmpInternalError("send handoff record failed", errno);
+        }
+
+        data += n;
+        size -= n;
+    }
+}
+
+// false if the stream ends before the first byte
+bool recvAll(int sock, uint8_t* data, size_t size)
+{
+    size_t got = 0;
+    while(got < size)
+    {
+        ssize_t n = ::recv(sock, data + got, size - got, 0);
+        if(n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n == 0 && got == 0)
+        {
+            return false;
+        }
+        if(n <= 0)
+        {
+            throw RtmpInternalError("receive handoff record failed", errno);
+        }
+
+        got += n;
+    }
+
+    return true;
+}
+
+}
+
+HandoffChannel::HandoffChannel(int sock):
+    sock_(sock)
+{
+}
+
+HandoffChannel::~HandoffChannel()
+{
+    close(sock_);
+}
+
+// the descriptor rides on the header, the blob follows as plain bytes
+void HandoffChannel::send(HandoffKind kind, int fd, const vector<uint8_t>& data)
+{
+    uint8_t header[HEADER_SIZE];
+    uint32_t fields[2] = {(uint32_t)kind, (uint32_t)data.size()};
+    for(int i = 0; i < 2; i++)
+    {
+        header[i * 4] = fields[i] >> 24;
+        header[i * 4 + 1] = fields[i] >> 16;
+        header[i * 4 + 2] = fields[i] >> 8;
+        header[i * 4 + 3] = fields[i];
+    }
+
+    struct iovec iov;
+    iov.iov_base = header;
+    iov.iov_len = HEADER_SIZE;
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(fd != -1)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    boost::lock_guard<boost::mutex> lk(mt_);
+
+    ssize_t n;
+    do
+    {
+        n = sendmsg(sock_, &msg, MSG_NOSIGNAL);
+    }
+    while(n == -1 && errno == EINTR);
+
+    if(n <= 0)
+    {
+        throw RtmpInternalError("send handoff record failed", errno);
+    }
+
+    sendAll(sock_, header + n, HEADER_SIZE - n);
+    if(!data.empty())
+    {
+        sendAll(sock_, &data[0], data.size());
+    }
+}
+
+bool HandoffChannel::receive(HandoffKind& kind, int& fd, vector<uint8_t>& data)
+{
+    uint8_t header[HEADER_SIZE];
+
+    struct iovec iov;
+    iov.iov_base = header;
+    iov.iov_len = HEADER_SIZE;
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg(sock_, &msg, MSG_CMSG_CLOEXEC);
+    }
+    while(n == -1 && errno == EINTR);
+
+    if(n == 0)
+    {
+        return false;
+    }
+    if(n < 0)
+    {
+        throw RtmpInternalError("receive handoff record failed", errno);
+    }
+
+    fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if(msg.msg_flags & MSG_CTRUNC)
+    {
+        throw RtmpInternalError("handoff descriptor was dropped");
+    }
+
+    if(!recvAll(sock_, header + n, HEADER_SIZE - n))
+    {
+        throw RtmpInternalError("handoff record is cut short");
+    }
+
+    uint32_t fields[2];
+    for(int i = 0; i < 2; i++)
+    {
+        fields[i] = ((uint32_t)header[i * 4] << 24) | ((uint32_t)header[i * 4 + 1] << 16)
+            | ((uint32_t)header[i * 4 + 2] << 8) | header[i * 4 + 3];
+    }
+
+    kind = (HandoffKind)fields[0];
+    data.resize(fields[1]);
+    if(!data.empty() && !recvAll(sock_, &data[0], data.size()))
+    {
+        throw RtmpInternalError("handoff record is cut short");
+    }
+
+    return true;
+}
+
+int HandoffChannel::listen(const string& path)
+{
+    struct sockaddr_un addr;
+    fillAddr(path, addr);
+    checkDirectory(path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1)
+    {
+        throw RtmpInternalError("create upgrade socket failed", errno);
+    }
+
+    // the file bound gets the mode of the socket, not only the umask
+    unlink(path.c_str());
+    if(fchmod(sock, 0600) == -1 || ::bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1
+       || chmod(path.c_str(), 0600) == -1 || ::listen(sock, 1) == -1)
+    {
+        int err = errno;
+        close(sock);
+        throw RtmpInternalError("listen on upgrade socket failed", err);
+    }
+
+    return sock;
+}
+
+int HandoffChannel::connect(const string& path)
+{
+    struct sockaddr_un addr;
+    fillAddr(path, addr);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1)
+    {
+        throw RtmpInternalError("create upgrade socket failed", errno);
+    }
+
+    if(::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        int err = errno;
+        close(sock);
+
+        if(err == ENOENT || err == ECONNREFUSED)
+        {
+            return -1;
+        }
+        throw RtmpInternalError("connect to upgrade socket failed", err);
+    }
+
+    if(!isOwnPeer(sock))
+    {
+        close(sock);
+        throw RtmpInternalError("upgrade socket is served by another user");
+    }
+
+    return sock;
+}
+
+int HandoffChannel::accept(int listenSock)
+{
+    while(true)
+    {
+        int sock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC);
+        if(sock == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            throw RtmpInternalError("accept on upgrade socket failed", errno);
+        }
+
+        if(isOwnPeer(sock))
+        {
+            return sock;
+        }
+
+        RTMP_LOG(LEVWARN, "refuse upgrade from a process of another user\n");
+        close(sock);
+    }
+}
@@ -0,0 +1,148 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include "rtmpexception.h"
+
+using namespace std;
+
+enum HandoffKind
+{
+    // the listening socket, the first record
+    HOK_Listen = 1,
+    // an established client and the state of its connection
+    HOK_Client = 2
+};
+
+/*
+ * the unix socket between a server and the one that replaces it, see
+ * RtmpServer::setUpgradePath(). a record is a kind, a descriptor passed
+ * with SCM_RIGHTS and a blob
+ */
+class HandoffChannel
+{
+    private:
+        int sock_;
+        // records from several threads do not interleave
+        boost::mutex mt_;
+
+        HandoffChannel(const HandoffChannel&);
+        HandoffChannel& operator=(const HandoffChannel&);
+
+    public:
+        explicit HandoffChannel(int sock);
+        ~HandoffChannel();
+
+        // the descriptor stays open in this process, -1 sends none
+        void send(HandoffKind kind, int fd, const vector<uint8_t>& data);
+        // false when the other side closed, fd is -1 when none came
+        bool receive(HandoffKind& kind, int& fd, vector<uint8_t>& data);
+
+        // the directory of path is made 0700 if it is missing and must not
+        // be writable by others. the socket is 0600, a file left by a
+        // server that is gone is removed first
+        static int listen(const string& path);
+        // a peer of another user is closed and the next one is waited for
+        static int accept(int listenSock);
+        // -1 when no server listens on path. throws RtmpInternalError when
+        // the one that listens is of another user
+        static int connect(const string& path);
+};
+
+typedef boost::shared_ptr<HandoffChannel> HandoffChannelPtr;
+
+// big endian fields of a state blob
+class StateWriter
+{
+    private:
+        vector<uint8_t>& out_;
+
+    public:
+        explicit StateWriter(vector<uint8_t>& out): out_(out)
+        {
+        }
+
+        void writeU32(uint32_t v)
+        {
+            out_.push_back(v >> 24);
+            out_.push_back(v >> 16);
+            out_.push_back(v >> 8);
+            out_.push_back(v);
+        }
+
+        void writeI64(int64_t v)
+        {
+            writeU32((uint64_t)v >> 32);
+            writeU32((uint32_t)v);
+        }
+
+        void writeBytes(const uint8_t* data, int size)
+        {
+            writeU32(size);
+            out_.insert(out_.end(), data, data + size);
+        }
+
+        void writeString(const string& s)
+        {
+            writeBytes((const uint8_t*)s.data(), s.size());
+        }
+};
+
+// throws RtmpBadProtocalData when the blob ends early
+class StateReader
+{
+    private:
+        const uint8_t* data_;
+        int size_;
+        int pos_;
+
+        void need(int n)
+        {
+            if(n < 0 || size_ - pos_ < n)
+            {
+                throw RtmpBadProtocalData("connection state is cut short");
+            }
+        }
+
+    public:
+        StateReader(const uint8_t* data, int size): data_(data), size_(size), pos_(0)
+        {
+        }
+
+        uint32_t readU32()
+        {
+            need(4);
+            const uint8_t* p = data_ + pos_;
+            pos_ += 4;
+            return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+
+        int64_t readI64()
+        {
+            uint64_t high = readU32();
+            return (int64_t)((high << 32) | readU32());
+        }
+
+        // points into the blob, size is set to its length
+        const uint8_t* readBytes(int& size)
+        {
+            size = (int)readU32();
+            need(size);
+            const uint8_t* p = data_ + pos_;
+            pos_ += size;
+            return p;
+        }
+
+        string readString()
+        {
+            int size;
+            const uint8_t* p = readBytes(size);
+            return string((const char*)p, size);
+        }
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include "iouring.h"
+#include "rtmpexception.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+namespace
+{
+
+int sysSetup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+int sysRegister(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+}
+
+IoUring::IoUring(unsigned entries, int bufCount, int bufSize):
+    fd_(-1), sqRing_(MAP_FAILED), sqRingSize_(0), cqRing_(MAP_FAILED), cqRingSize_(0),
+    sqes_((struct io_uring_sqe*)MAP_FAILED), sqesSize_(0),
+    sqHead_(NULL), sqTail_(NULL), sqMask_(0), sqEntries_(0), sqArray_(NULL),
+    sqLocalTail_(0), toSubmit_(0),
+    cqHead_(NULL), cqTail_(NULL), cqMask_(0), cqes_(NULL),
+    bufRing_((struct io_uring_buf*)MAP_FAILED), bufRingSize_(0), bufData_(NULL),
+    bufCount_(bufCount), bufSize_(bufSize), bufTail_(0)
+{
+    // the buffer ring is indexed with a mask
+    if(bufCount <= 0 || (bufCount & (bufCount - 1)) || bufCount > 32768)
+    {
+        throw RtmpInternalError("buffer count must be a power of 2");
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    if((fd_ = sysSetup(entries, &p)) < 0)
+    {
+        throw RtmpInternalError("io_uring_setup failed", errno);
+    }
+
+    sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sqRingSize_ = cqRingSize_ = sqRingSize_ > cqRingSize_ ? sqRingSize_ : cqRingSize_;
+    }
+
+    sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if(sqRing_ == MAP_FAILED)
+    {
+        destroy();
+        throw RtmpInternalError("map submission ring failed", errno);
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cqRing_ = sqRing_;
+    }
+    else
+    {
+        cqRing_ = mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if(cqRing_ == MAP_FAILED)
+        {
+            destroy();
+            throw RtmpInternalError("map completion ring failed", errno);
+        }
+    }
+
+    sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe*)mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd_, IORING_OFF_SQES);
+    if(sqes_ == MAP_FAILED)
+    {
+        destroy();
+        throw RtmpInternalError("map sqes failed", errno);
+    }
+
+    uint8_t* sq = (uint8_t*)sqRing_;
+    sqHead_ = (unsigned*)(sq + p.sq_off.head);
+    sqTail_ = (unsigned*)(sq + p.sq_off.tail);
+    sqMask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sqEntries_ = p.sq_entries;
+    sqArray_ = (unsigned*)(sq + p.sq_off.array);
+    sqLocalTail_ = *sqTail_;
+
+    uint8_t* cq = (uint8_t*)cqRing_;
+    cqHead_ = (unsigned*)(cq + p.cq_off.head);
+    cqTail_ = (unsigned*)(cq + p.cq_off.tail);
+    cqMask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // the ring of buffer descriptors must be page aligned, mmap gives that
+    bufRingSize_ = bufCount_ * sizeof(struct io_uring_buf);
+    bufRing_ = (struct io_uring_buf*)mmap(NULL, bufRingSize_, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(bufRing_ == MAP_FAILED)
+    {
+        destroy();
+        throw RtmpInternalError("map buffer ring failed", errno);
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing_;
+    reg.ring_entries = bufCount_;
+    reg.bgid = BUFFER_GROUP;
+
+    if(sysRegister(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int err = errno;
+        destroy();
+        throw RtmpInternalError("register buffer ring failed", err);
+    }
+
+    bufData_ = new uint8_t[(size_t)bufCount_ * bufSize_];
+    for(int i = 0; i < bufCount_; i++)
+    {
+        recycleBuffer(i);
+    }
+}
+
+IoUring::~IoUring()
+{
+    destroy();
+}
+
+void IoUring::destroy()
+{
+    // closing the ring unregisters the buffers and cancels what is in flight
+    if(fd_ != -1)
+    {
+        close(fd_);
+        fd_ = -1;
+    }
+
+    if(bufRing_ != MAP_FAILED)
+    {
+        munmap(bufRing_, bufRingSize_);
+        bufRing_ = (struct io_uring_buf*)MAP_FAILED;
+    }
+
+    if(sqes_ != MAP_FAILED)
+    {
+        munmap(sqes_, sqesSize_);
+        sqes_ = (struct io_uring_sqe*)MAP_FAILED;
+    }
+
+    if(cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+    {
+        munmap(cqRing_, cqRingSize_);
+    }
+    cqRing_ = MAP_FAILED;
+
+    if(sqRing_ != MAP_FAILED)
+    {
+        munmap(sqRing_, sqRingSize_);
+        sqRing_ = MAP_FAILED;
+    }
+
+    delete[] bufData_;
+    bufData_ = NULL;
+}
+
+struct io_uring_sqe* IoUring::getSqe()
+{
+    if(sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_)
+    {
+        submit(0);
+    }
+
+    unsigned index = sqLocalTail_ & sqMask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqArray_[index] = index;
+    sqLocalTail_++;
+    toSubmit_++;
+
+    return sqe;
+}
+
+int IoUring::submit(unsigned waitNr)
+{
+    __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+
+    int ret;
+    do
+    {
+        ret = sysEnter(fd_, toSubmit_, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while(ret < 0 && errno == EINTR);
+
+    if(ret < 0)
+    {
+        // the completions that are due are still reaped
+        if(errno == EBUSY || errno == EAGAIN)
+        {
+            return 0;
+        }
+
+        throw RtmpInternalError("io_uring_enter failed", errno);
+    }
+
+    toSubmit_ -= ret;
+    return ret;
+}
+
+struct io_uring_cqe* IoUring::peekCqe()
+{
+    unsigned head = *cqHead_;
+    if(head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return &cqes_[head & cqMask_];
+}
+
+void IoUring::advance()
+{
+    __atomic_store_n(cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t* IoUring::getBuffer(int bufferId)
+{
+    return bufData_ + (size_t)bufferId * bufSize_;
+}
+
+int IoUring::getBufferSize()
+{
+    return bufSize_;
+}
+
+void IoUring::recycleBuffer(int bufferId)
+{
+    struct io_uring_buf* buf = &bufRing_[bufTail_ & (bufCount_ - 1)];
+    buf->addr = (uint64_t)(uintptr_t)getBuffer(bufferId);
+    buf->len = bufSize_;
+    buf->bid = bufferId;
+
+    // the tail shares its place with resv of the first descriptor
+    bufTail_++;
+    __atomic_store_n(&bufRing_[0].resv, bufTail_, __ATOMIC_RELEASE);
+}
+
+void IoUring::prepRecvMultishot(int fd, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = userData;
+}
+
+void IoUring::prepAcceptMultishot(int fd, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = userData;
+}
+
+void IoUring::prepSend(int fd, const uint8_t* data, int size, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData;
+}
+
+void IoUring::prepCancel(uint64_t targetUserData, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = targetUserData;
+    sqe->user_data = userData;
+}
+
+void IoUring::prepRead(int fd, void* data, int size, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = size;
+    // the current position, for files that have none
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = userData;
+}
+
+void IoUring::prepTimeout(struct __kernel_timespec* ts, uint64_t userData)
+{
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ts;
+    sqe->len = 1;
+    // 0, only the time ends it
+    sqe->off = 0;
+    sqe->user_data = userData;
+}
+
+bool IoUring::isSupported()
+{
+    struct utsname u;
+    int major = 0;
+    int minor = 0;
+
+    if(uname(&u) != 0 || sscanf(u.release, "%d.%d", &major, &minor) != 2 || major < 6)
+    {
+        return false;
+    }
+
+    // seccomp or io_uring_disabled can still refuse it
+    try
+    {
+        IoUring probe(2, 1, 64);
+    }
+    catch(RtmpInternalError& e)
+    {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * a submission and completion ring on the raw io_uring syscalls, with one
+ * ring of provided buffers that multishot receives pick from
+ *
+ * only the thread that owns it may use it
+ */
+class IoUring
+{
+    private:
+        int fd_;
+
+        void* sqRing_;
+        size_t sqRingSize_;
+        void* cqRing_;
+        size_t cqRingSize_;
+        struct io_uring_sqe* sqes_;
+        size_t sqesSize_;
+
+        unsigned* sqHead_;
+        unsigned* sqTail_;
+        unsigned sqMask_;
+        unsigned sqEntries_;
+        unsigned* sqArray_;
+        // sqes filled but not yet submitted
+        unsigned sqLocalTail_;
+        unsigned toSubmit_;
+
+        unsigned* cqHead_;
+        unsigned* cqTail_;
+        unsigned cqMask_;
+        struct io_uring_cqe* cqes_;
+
+        // provided buffers
+        struct io_uring_buf* bufRing_;
+        size_t bufRingSize_;
+        uint8_t* bufData_;
+        int bufCount_;
+        int bufSize_;
+        uint16_t bufTail_;
+
+        IoUring(const IoUring&);
+        IoUring& operator=(const IoUring&);
+
+        void destroy();
+
+    public:
+        // buffer group of the provided buffers
+        const static int BUFFER_GROUP = 0;
+
+        // throws RtmpInternalError when the kernel does not support it
+        IoUring(unsigned entries, int bufCount, int bufSize);
+        ~IoUring();
+
+        // submits what is pending when the ring is full
+        struct io_uring_sqe* getSqe();
+        // submits the pending sqes and waits for at least waitNr completions
+        int submit(unsigned waitNr);
+
+        // NULL when there is none, advance() releases it
+        struct io_uring_cqe* peekCqe();
+        void advance();
+
+        uint8_t* getBuffer(int bufferId);
+        int getBufferSize();
+        // hands a buffer of a completed receive back to the kernel
+        void recycleBuffer(int bufferId);
+
+        void prepRecvMultishot(int fd, uint64_t userData);
+        void prepAcceptMultishot(int fd, uint64_t userData);
+        void prepSend(int fd, const uint8_t* data, int size, uint64_t userData);
+        void prepCancel(uint64_t targetUserData, uint64_t userData);
+        void prepRead(int fd, void* data, int size, uint64_t userData);
+        // completes with -ETIME once ts has passed, ts must live until then
+        void prepTimeout(struct __kernel_timespec* ts, uint64_t userData);
+
+        // multishot receive with provided buffer rings, linux 6.0
+        static bool isSupported();
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "latency.h"
+#include <stdio.h>
+#include <boost/thread.hpp>
+
+namespace
+{
+
+const char* stageNames[LS_Count] =
+{
+    "recv_to_actor",
+    "queue",
+    "demux",
+    "sink_write"
+};
+
+const double quantiles[] = {0.5, 0.99, 0.999};
+const char* quantileNames[] = {"0.5", "0.99", "0.999"};
+
+boost::mutex registryMt;
+list<StreamLatency*> registry;
+
+string escapeLabel(const string& value)
+{
+    string r;
+    for(size_t i = 0; i < value.size(); i++)
+    {
+        char c = value[i];
+        if(c == '\\' || c == '"')
+        {
+            r += '\\';
+            r += c;
+        }
+        else if(c == '\n')
+        {
+            r += "\\n";
+        }
+        else
+        {
+            r += c;
+        }
+    }
+
+    return r;
+}
+
+void appendSeconds(stringstream& s, uint64_t micros)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6f", micros / 1000000.0);
+    s << buf;
+}
+
+}
+
+LatencyHistogram::LatencyHistogram():
+    count_(0), sum_(0), max_(0)
+{
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        counts_[i].store(0, boost::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::getIndex(uint64_t micros)
+{
+    if(micros < (uint64_t)SUB_COUNT)
+    {
+        return micros;
+    }
+
+    if(micros >> MAX_BITS)
+    {
+        return BUCKET_COUNT - 1;
+    }
+
+    int bits = 63 - __builtin_clzll(micros);
+    int sub = (micros >> (bits - SUB_BITS)) - SUB_COUNT;
+
+    return SUB_COUNT + (bits - SUB_BITS) * SUB_COUNT + sub;
+}
+
+uint64_t LatencyHistogram::getBucketValue(int index)
+{
+    if(index < SUB_COUNT)
+    {
+        return index;
+    }
+
+    int bits = (index - SUB_COUNT) / SUB_COUNT + SUB_BITS;
+    uint64_t sub = (index - SUB_COUNT) % SUB_COUNT;
+    int shift = bits - SUB_BITS;
+
+    return ((SUB_COUNT + sub) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t LatencyHistogram::getPercentile(double p)
+{
+    uint64_t counts[BUCKET_COUNT];
+    uint64_t total = 0;
+
+    // the count_ field may be ahead of the buckets, use what the buckets say
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        counts[i] = counts_[i].load(boost::memory_order_relaxed);
+        total += counts[i];
+    }
+
+    if(total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * total + 0.5);
+    if(rank < 1)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += counts[i];
+        if(seen >= rank)
+        {
+            uint64_t v = getBucketValue(i);
+            uint64_t max = getMax();
+            return v < max ? v : max;
+        }
+    }
+
+    return getMax();
+}
+
+uint64_t LatencyHistogram::getCount()
+{
+    return count_.load(boost::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getSum()
+{
+    return sum_.load(boost::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getMax()
+{
+    return max_.load(boost::memory_order_relaxed);
+}
+
+StreamLatency::StreamLatency(const string& name):
+    name_(name)
+{
+    boost::lock_guard<boost::mutex> lk(registryMt);
+    registryIt_ = registry.insert(registry.end(), this);
+}
+
+StreamLatency::~StreamLatency()
+{
+    boost::lock_guard<boost::mutex> lk(registryMt);
+    registry.erase(registryIt_);
+}
+
+LatencyHistogram& StreamLatency::getHistogram(LatencyStage stage)
+{
+    return stages_[stage];
+}
+
+const string& StreamLatency::getName()
+{
+    return name_;
+}
+
+void StreamLatency::format(stringstream& s)
+{
+    boost::lock_guard<boost::mutex> lk(registryMt);
+
+    s << "# HELP rtmp_stage_latency_seconds Latency of each stage a media message goes through\n";
+    s << "# TYPE rtmp_stage_latency_seconds summary\n";
+
+    list<StreamLatency*>::iterator it = registry.begin();
+    for(; it != registry.end(); it++)
+    {
+        string stream = escapeLabel((*it)->name_);
+
+        for(int i = 0; i < LS_Count; i++)
+        {
+            LatencyHistogram& h = (*it)->stages_[i];
+            string labels = "stream=\"" + stream + "\",stage=\"" + stageNames[i] + "\"";
+
+            for(int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++)
+            {
+                s << "rtmp_stage_latency_seconds{" << labels << ",quantile=\"" << quantileNames[q] << "\"} ";
+                appendSeconds(s, h.getPercentile(quantiles[q]));
+                s << "\n";
+            }
+
+            s << "rtmp_stage_latency_seconds_sum{" << labels << "} ";
+            appendSeconds(s, h.getSum());
+            s << "\n";
+            s << "rtmp_stage_latency_seconds_count{" << labels << "} " << h.getCount() << "\n";
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <string>
+#include <sstream>
+#include <list>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+
+using namespace std;
+
+/*
+ * log-linear histogram of microseconds, like HdrHistogram: every power
+ * of 2 is split into 16 linear buckets, so a value is known within 1/16
+ *
+ * one thread records, any thread reads. a read during a record may miss
+ * that one value, which is fine for percentiles
+ */
+class LatencyHistogram
+{
+    public:
+        const static int SUB_BITS = 4;
+        const static int SUB_COUNT = 1 << SUB_BITS;
+        // values above 2^40 us, about 12 days, are clamped
+        const static int MAX_BITS = 40;
+        const static int BUCKET_COUNT = SUB_COUNT + (MAX_BITS - SUB_BITS) * SUB_COUNT;
+
+    private:
+        boost::atomic<uint64_t> counts_[BUCKET_COUNT];
+        boost::atomic<uint64_t> count_;
+        boost::atomic<uint64_t> sum_;
+        boost::atomic<uint64_t> max_;
+
+        LatencyHistogram(const LatencyHistogram&);
+        LatencyHistogram& operator=(const LatencyHistogram&);
+
+        static void bump(boost::atomic<uint64_t>& v, uint64_t n)
+        {
+            v.store(v.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+        }
+
+    public:
+        LatencyHistogram();
+
+        static int getIndex(uint64_t micros);
+        // the highest value that falls into the bucket
+        static uint64_t getBucketValue(int index);
+
+        void record(int64_t micros)
+        {
+            uint64_t v = micros < 0 ? 0 : micros;
+
+            bump(counts_[getIndex(v)], 1);
+            bump(count_, 1);
+            bump(sum_, v);
+            if(v > max_.load(boost::memory_order_relaxed))
+            {
+                max_.store(v, boost::memory_order_relaxed);
+            }
+        }
+
+        // p in [0, 1]
+        uint64_t getPercentile(double p);
+        uint64_t getCount();
+        uint64_t getSum();
+        uint64_t getMax();
+};
+
+enum LatencyStage
+{
+    // recv() that completed the message to the actor
+    LS_RecvToActor,
+    // the message's bytes waiting in the stream buffer for the demuxer
+    LS_Queue,
+    // one av_read_frame
+    LS_Demux,
+    // one av_interleaved_write_frame
+    LS_SinkWrite,
+    LS_Count
+};
+
+/*
+ * the histograms of one published stream, every stage is recorded by
+ * one thread only. all live streams are exported with the metrics
+ */
+class StreamLatency
+{
+    private:
+        string name_;
+        LatencyHistogram stages_[LS_Count];
+        list<StreamLatency*>::iterator registryIt_;
+
+        StreamLatency(const StreamLatency&);
+        StreamLatency& operator=(const StreamLatency&);
+
+    public:
+        StreamLatency(const string& name);
+        ~StreamLatency();
+
+        void record(LatencyStage stage, int64_t micros)
+        {
+            stages_[stage].record(micros);
+        }
+
+        LatencyHistogram& getHistogram(LatencyStage stage);
+        const string& getName();
+
+        // p50, p99, p999, sum and count of every stage as a prometheus summary
+        static void format(stringstream& s);
+};
+
+typedef boost::shared_ptr<StreamLatency> StreamLatencyPtr;
+
+#endif
@@ -1,4 +1,7 @@
 #include "livereceiveractor.h"
+#include "metrics.h"
+#include "trace.h"
+#include "reaper.h"
 
 bool LiveReceiverActor::initialized = false;
 string LiveReceiverActor::urlPrefix = "";
@@ -23,7 +26,7 @@ void StreamSetupInfo::writeFlvHeader()
     flv[4] = flag;
     flv[8] = 9; // header size
     
-    rb_.appendData(flv, 9);
+    append(flv, 9);
     writeTagSize(0);
 
     flvHeaderWritten_ = true;
@@ -49,13 +52,67 @@ void StreamSetupInfo::writeTagSize(int32_t tagSize)
     wb_.reInit();
     wb_.writeB((int32_t)tagSize);
 
-    rb_.appendData(wb_.getBufferPtr(), wb_.getBufferCount());
+    append(wb_.getBufferPtr(), wb_.getBufferCount());
+}
+
+void StreamSetupInfo::append(uint8_t* data, int size)
+{
+    rb_.appendData(data, size);
+    bytesQueued_ += size;
+}
+
+void StreamSetupInfo::setLatency(StreamLatencyPtr latency)
+{
+    latency_ = latency;
+}
+
+// called with mt_ held by the push thread, size bytes are handed to ffmpeg
+void StreamSetupInfo::onFed(int size)
+{
+    bytesFed_ += size;
+
+    if(!latency_)
+    {
+        queued_.clear();
+        return;
+    }
+
+    int64_t now = -1;
+    while(!queued_.empty() && queued_.front().first <= bytesFed_)
+    {
+        if(now == -1)
+        {
+            now = Utility::getMonotonicMicros();
+        }
+
+        latency_->record(LS_Queue, now - queued_.front().second);
+        queued_.pop_front();
+    }
 }
 
 void StreamSetupInfo::writeData(RtmpMsgHeaderPtr& msg)
 {
     boost::lock_guard<boost::mutex> lk(mt_);
 
+    writeTag(msg);
+}
+
+void StreamSetupInfo::writeData(const RtmpMediaMsg* msgs, int count)
+{
+    boost::lock_guard<boost::mutex> lk(mt_);
+
+    for(int i = 0; i < count; i++)
+    {
+        if(msgs[i].streamId == streamId)
+        {
+            writeTag(msgs[i].msg);
+        }
+    }
+}
+
+// called with mt_ held
+void StreamSetupInfo::writeTag(const RtmpMsgHeaderPtr& msg)
+{
     wb_.reInit();
     wb_.writeB(0, 3);
     wb_.writeB(msg->typeId, 5);
@@ -67,7 +124,12 @@ void StreamSetupInfo::writeData(RtmpMsgHeaderPtr& msg)
     wb_.writeBytes(msg->body, msg->length);
     wb_.writeB((int32_t)(msg->length + 11));
 
-    rb_.appendData(wb_.getBufferPtr(), wb_.getBufferCount());
+    append(wb_.getBufferPtr(), wb_.getBufferCount());
+
+    if(latency_)
+    {
+        queued_.push_back(make_pair(bytesQueued_, Utility::getMonotonicMicros()));
+    }
 }
 
 void StreamSetupInfo::writeMetaData(MetaDataMsgPtr& meta)
@@ -85,7 +147,7 @@ void StreamSetupInfo::writeMetaData(MetaDataMsgPtr& meta)
     wb_.writeBytes(meta->metadata, meta->metadata_size);
     wb_.writeB((int32_t)(meta->metadata_size + 11));
 
-    rb_.appendData(wb_.getBufferPtr(), wb_.getBufferCount());
+    append(wb_.getBufferPtr(), wb_.getBufferCount());
 }
 
 void StreamSetupInfo::setEndOfFile()
@@ -125,7 +187,8 @@ int StreamSetupInfo::feedData(uint8_t *buf, int buf_size)
 
             if(wait_time > 10000000) // 10 seconds
             {
-                RTMP_LOG(LEVERROR, "wait data timeout\n");
+                RTMP_LOG_RATE(LEVERROR, 10, "wait data timeout\n");
+                Metrics::add(MET_ActorErrors);
                 return -1;
             }
             continue;
@@ -135,12 +198,14 @@ int StreamSetupInfo::feedData(uint8_t *buf, int buf_size)
             memcpy(buf, rb_.getUnReadBufferNoCopy(), size);
             // all data is read 
             rb_.reset();
+            onFed(size);
             return size;
         }
         else
         {
             memcpy(buf, rb_.getUnReadBufferNoCopy(), buf_size);
             rb_.skip(buf_size);
+            onFed(buf_size);
             return buf_size;
         }
     }
@@ -176,42 +241,25 @@ void LiveReceiverActor::Init(string urlPrefix, string fmt)
     LiveReceiverActor::initialized = true;
 }
 
-void LiveReceiverActor::notifyPushThreadDone()
-{
-    boost::lock_guard<boost::mutex> gl(mt_);
-
-    isPushThreadDone_ = true;
-}
-
-bool LiveReceiverActor::isPushThreadDone()
-{
-    boost::lock_guard<boost::mutex> gl(mt_);
-
-    return isPushThreadDone_;
-}
-
-//global urlPrefix: path
-LiveReceiverActor::LiveReceiverActor():
+PushSession::PushSession(StreamSetupInfoPtr info, StreamLatencyPtr latency):
+    info_(info),
+    latency_(latency),
     ctx_(NULL),
-    streamInfoCount_(0),
-    avStreamIndex_(0),
     headerWritten_(false),
     startTime_(-1),
-    th_(NULL),
     pkt_(NULL),
+    th_(NULL),
+    started_(false),
     mt_(),
-    isPushThreadDone_(false)
-
+    done_(false),
+    abortAt_(0)
 {
-    if(!LiveReceiverActor::initialized)
-    {
-        throw RtmpInternalError("LiveReceiverActor is not initialized, pleace call LiveReceiverActor::Init first!");
-    }
 }
 
-LiveReceiverActor::~LiveReceiverActor()
+// may run on any thread, the output is closed already unless open() threw
+PushSession::~PushSession()
 {
-    delete th_;
+    closeOutput();
 
     if(pkt_)
     {
@@ -222,15 +270,90 @@ LiveReceiverActor::~LiveReceiverActor()
         delete pkt_;
     }
 
-    for(int i = 0; i < streamInfoCount_; i++)
+    delete th_;
+}
+
+void PushSession::open(const string& url)
+{
+    ctx_ = avformat_alloc_context();
+    if(ctx_ == NULL)
+    {
+        throw RtmpInternalError("alloc output context failed");
+    }
+
+    ctx_->interrupt_callback.callback = &PushSession::checkInterrupt;
+    ctx_->interrupt_callback.opaque = this;
+
+    if(avio_open2(&ctx_->pb, url.c_str(), AVIO_FLAG_WRITE, &ctx_->interrupt_callback, NULL) < 0)
+    {
+        throw RtmpInternalError(("failed to open: " + url).c_str());
+    }
+
+    if((ctx_->oformat = av_guess_format(NULL, url.c_str(), NULL))
+       == NULL)
+    {
+        throw RtmpInternalError("failed to guess format");
+    }
+}
+
+void PushSession::start()
+{
+    started_ = true;
+    th_ = new boost::thread(boost::bind(&PushSession::run, shared_from_this()));
+}
+
+bool PushSession::isStarted()
+{
+    return started_;
+}
+
+bool PushSession::isDone()
+{
+    boost::lock_guard<boost::mutex> gl(mt_);
+
+    return done_;
+}
+
+void PushSession::finish()
+{
+    info_->setEndOfFile();
+
+    if(abortAt_.load() == 0)
     {
-        delete streamInfos_[i];
-        streamInfos_[i] = NULL; 
+        abortAt_.store(Utility::getMonotonicMicros() + (int64_t)FINISH_TIMEOUT * 1000);
     }
+}
+
+void PushSession::release(PushSessionPtr push)
+{
+    push->finish();
 
+    // a running thread closes the output itself
+    if(!push->isStarted())
+    {
+        Reaper::post(boost::bind(&PushSession::closeOutput, push));
+    }
+}
+
+// ffmpeg polls it while it blocks on the output
+int PushSession::checkInterrupt(void* opaque)
+{
+    PushSession* push = (PushSession*)opaque;
+    int64_t abortAt = push->abortAt_.load();
+
+    return abortAt != 0 && Utility::getMonotonicMicros() > abortAt;
+}
+
+void PushSession::closeOutput()
+{
     if(headerWritten_)
     {
-        av_write_trailer(ctx_);
+        if(av_write_trailer(ctx_) < 0)
+        {
+            RTMP_LOG_RATE(LEVERROR, 10, "write trailer failed\n");
+            Metrics::add(MET_ActorErrors);
+        }
+        headerWritten_ = false;
     }
 
     if(ctx_)
@@ -245,6 +368,33 @@ LiveReceiverActor::~LiveReceiverActor()
     }
 }
 
+// on the reaper thread, the push thread has posted it on its way out
+void PushSession::reap(PushSessionPtr push)
+{
+    push->th_->join();
+    delete push->th_;
+    push->th_ = NULL;
+}
+
+//global urlPrefix: path
+LiveReceiverActor::LiveReceiverActor():
+    streamInfoCount_(0)
+{
+    if(!LiveReceiverActor::initialized)
+    {
+        throw RtmpInternalError("LiveReceiverActor is not initialized, pleace call LiveReceiverActor::Init first!");
+    }
+}
+
+// returns at once, the push session ends on its own thread or the reaper
+LiveReceiverActor::~LiveReceiverActor()
+{
+    if(push_)
+    {
+        PushSession::release(push_);
+    }
+}
+
 RtmpActor* LiveReceiverActor::createActor()
 {
     return new LiveReceiverActor();
@@ -258,26 +408,28 @@ bool LiveReceiverActor::onConnect(ConnectCmdPtr cmd)
 
 void LiveReceiverActor::onDisconnect()
 {
-    if(streamInfos_[0])
+    if(push_)
     {
-        streamInfos_[0]->setEndOfFile();
+        push_->finish();
     }
-
-    if(th_)
+    else if(streamInfos_[0])
     {
-        // wait for 500 milliseconds at most, otherwise we kill the thread
-        th_->timed_join(boost::posix_time::milliseconds(500));
-        th_->interrupt();
+        streamInfos_[0]->setEndOfFile();
     }
 }
 
+void LiveReceiverActor::setMemAccount(MemAccountPtr account)
+{
+    account_ = account;
+}
+
 StreamSetupInfo* LiveReceiverActor::findStreamSetupInfo(int streamId)
 {
     for(int i = 0; i < streamInfoCount_; i++)
     {
         if(streamInfos_[i]->streamId == streamId)
         {
-            return streamInfos_[i];
+            return streamInfos_[i].get();
         }
     }
 
@@ -319,7 +471,7 @@ bool LiveReceiverActor::onPublish(int streamId, string publishUrl)
     }
 
     //TODO: currently we only handle one stream
-    if(info != streamInfos_[0])
+    if(info != streamInfos_[0].get())
     {
         return true;
     }
@@ -328,19 +480,11 @@ bool LiveReceiverActor::onPublish(int streamId, string publishUrl)
                        + connectInfo_->app + "/" + publishUrl 
                        + LiveReceiverActor::fmt;
 
-      
-    ctx_ = avformat_alloc_context();
+    latency_.reset(new StreamLatency(connectInfo_->app + "/" + publishUrl));
+    info->setLatency(latency_);
 
-    if(avio_open(&ctx_->pb, outputUrl_.c_str(), AVIO_FLAG_WRITE) != 0)
-    {
-        throw RtmpInternalError(("failed to open: " + outputUrl_).c_str());
-    }
-    
-    if((ctx_->oformat = av_guess_format(NULL, outputUrl_.c_str(), NULL))
-       == NULL)
-    {
-        throw RtmpInternalError("failed to guess format");
-    }
+    push_.reset(new PushSession(streamInfos_[0], latency_));
+    push_->open(outputUrl_);
 
     return true;
 }
@@ -352,7 +496,7 @@ bool LiveReceiverActor::onCreateStream(int nextStreamId)
         throw RtmpInternalError("too many streams");
     }
 
-    streamInfos_[streamInfoCount_++] = new StreamSetupInfo(nextStreamId);
+    streamInfos_[streamInfoCount_++].reset(new StreamSetupInfo(nextStreamId, account_));
     return true;
 }
 
@@ -366,7 +510,7 @@ bool LiveReceiverActor::onMetaData(int streamId, MetaDataMsgPtr metaData)
     }
 
     //TODO: currently we only handle one stream
-    if(info != streamInfos_[0])
+    if(info != streamInfos_[0].get())
     {
         return true;
     }
@@ -380,24 +524,54 @@ bool LiveReceiverActor::onMetaData(int streamId, MetaDataMsgPtr metaData)
 
 bool LiveReceiverActor::onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg)
 {
+    RtmpMediaMsg m;
+    m.streamId = streamId;
+    m.isVideo = isVideo;
+    m.msg = msg;
+
+    return onReceiveStreams(&m, 1);
+}
+
+bool LiveReceiverActor::onReceiveStreams(const RtmpMediaMsg* msgs, int count)
+{
+    if(latency_)
+    {
+        int64_t now = Utility::getMonotonicMicros();
+        for(int i = 0; i < count; i++)
+        {
+            if(msgs[i].msg->recvTime)
+            {
+                latency_->record(LS_RecvToActor, now - msgs[i].msg->recvTime);
+            }
+        }
+    }
+
     // write thread is done, we do not need more data. so exit!
-    if(isPushThreadDone())
+    if(push_ && push_->isDone())
     {
         throw RtmpInternalError("Write ends, no more data needed");
     }
 
-    StreamSetupInfo* info = NULL;
-    if(!(info = findStreamSetupInfo(streamId)))
+    bool forFirst = false;
+    for(int i = 0; i < count; i++)
     {
-        throw RtmpInternalError("onReceiveStream, failed to find streamId");
+        StreamSetupInfo* info = NULL;
+        if(!(info = findStreamSetupInfo(msgs[i].streamId)))
+        {
+            throw RtmpInternalError("onReceiveStream, failed to find streamId");
+        }
+
+        forFirst = forFirst || info == streamInfos_[0].get();
     }
 
     //TODO: currently we only handle one stream
-    if(info != streamInfos_[0])
+    if(!forFirst)
     {
         return true;
     }
 
+    StreamSetupInfo* info = streamInfos_[0].get();
+
     if(!info->isFlvHeaderWritten())
     {
         info->writeFlvHeader();
@@ -406,17 +580,17 @@ bool LiveReceiverActor::onReceiveStream(int streamId, bool isVideo, RtmpMsgHeade
         info->writeMetaData(metaData_);
     }
 
-    if(!th_)
+    if(push_ && !push_->isStarted())
     {
-        th_ = new boost::thread(boost::bind(&LiveReceiverActor::pushThread, this));
+        push_->start();
     }
 
-    info->writeData(msg);
+    info->writeData(msgs, count);
 
     return true;
 }
 
-bool LiveReceiverActor::setOutputCtx(AVFormatContext* inCtx)
+bool PushSession::setOutputCtx(AVFormatContext* inCtx)
 {
     AVStream* inVideoStream = NULL;
     AVStream* inAudioStream = NULL;
@@ -515,11 +689,13 @@ bool LiveReceiverActor::setOutputCtx(AVFormatContext* inCtx)
     return true;
 }
 
-void LiveReceiverActor::pushThread()
+void PushSession::run()
 {
     // stream info is already done
     //
-    StreamSetupInfo* info = streamInfos_[0];
+    Metrics::add(MET_PushThreads);
+
+    StreamSetupInfo* info = info_.get();
     info->createInput();
 
     AVFormatContext* context = info->getFormatContext();
@@ -527,11 +703,13 @@ void LiveReceiverActor::pushThread()
     if(avformat_open_input(&context, NULL, NULL, NULL) < 0)
     {
         RTMP_LOG(LEVERROR, "open input failed\n");
+        Metrics::add(MET_ActorErrors);
     }
 
     if(avformat_find_stream_info(context, NULL) < 0)
     {
         RTMP_LOG(LEVERROR, "find stream info error\n");
+        Metrics::add(MET_ActorErrors);
     }
     
     //copy context
@@ -540,6 +718,7 @@ void LiveReceiverActor::pushThread()
     if(avformat_write_header(ctx_, NULL) < 0)
     {
         RTMP_LOG(LEVERROR, "write header failed\n");
+        Metrics::add(MET_ActorErrors);
     }
 
     headerWritten_ = true;
@@ -553,7 +732,15 @@ void LiveReceiverActor::pushThread()
     while(true)
     {
         av_init_packet(pkt_);
-        if((ret = av_read_frame(context, pkt_)) != 0)
+
+        int64_t readStart = Utility::getMonotonicMicros();
+        ret = av_read_frame(context, pkt_);
+        if(latency_)
+        {
+            latency_->record(LS_Demux, Utility::getMonotonicMicros() - readStart);
+        }
+
+        if(ret != 0)
         {
             if(ret == AVERROR(EAGAIN))
             {
@@ -562,7 +749,8 @@ void LiveReceiverActor::pushThread()
 
             if(ret != AVERROR_EOF)
             {
-                RTMP_LOG(LEVERROR, "read frame error\n");
+                RTMP_LOG_RATE(LEVERROR, 10, "read frame error\n");
+                Metrics::add(MET_ActorErrors);
             }
             else
             {
@@ -584,17 +772,36 @@ void LiveReceiverActor::pushThread()
         pkt_->duration = av_rescale_q(pkt_->duration, inStream->time_base, outStream->time_base);
         pkt_->stream_index = streamMap_[pkt_->stream_index];
 
-        if(av_interleaved_write_frame(ctx_, pkt_) < 0)
+        RTMP_TRACE4(push_write, this, pkt_->stream_index, pkt_->size, pkt_->dts);
+        int64_t writeStart = Utility::getMonotonicMicros();
+        ret = av_interleaved_write_frame(ctx_, pkt_);
+        RTMP_TRACE3(push_write_done, this, ret, Utility::getMonotonicMicros() - writeStart);
+        if(latency_)
+        {
+            latency_->record(LS_SinkWrite, Utility::getMonotonicMicros() - writeStart);
+        }
+
+        if(ret < 0)
         {
             av_free_packet(pkt_);
-            RTMP_LOG(LEVERROR, "write frame error\n");
+            RTMP_LOG_RATE(LEVERROR, 10, "write frame error\n");
+            Metrics::add(MET_ActorErrors);
             break;
         }
 
         av_free_packet(pkt_);
+        Metrics::add(MET_PushFrames);
+    }
+
+    closeOutput();
+
+    {
+        boost::lock_guard<boost::mutex> gl(mt_);
+        done_ = true;
     }
 
-    notifyPushThreadDone();
+    Metrics::sub(MET_PushThreads);
+    Reaper::post(boost::bind(&PushSession::reap, shared_from_this()));
 }
 
 // it will be called when we read data from our customed AVIOContext
@@ -602,5 +809,5 @@ int RtmpPushProtol::read_packet(void *opaque, uint8_t* buf, int buf_size)
 {
     StreamSetupInfo* info = (StreamSetupInfo*)opaque;
 
-    info->feedData(buf, buf_size);
+    return info->feedData(buf, buf_size);
 }
@@ -2,9 +2,13 @@
 #define LIVE_RECEIVER_ACTOR_H
 
 #include "tviertmp.h"
+#include "latency.h"
 #include <string>
 #include <list>
+#include <deque>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/atomic.hpp>
 
 extern "C"
 {
@@ -33,13 +37,16 @@ public:
     void writeFlvHeader();
     void writeMetaData(MetaDataMsgPtr& meta);
     void writeData(RtmpMsgHeaderPtr& msg);
+    // the messages of this stream among msgs, under one lock
+    void writeData(const RtmpMediaMsg* msgs, int count);
     int feedData(uint8_t *buf, int buf_size);
     void createInput();
     void setEndOfFile();
+    void setLatency(StreamLatencyPtr latency);
 
     AVFormatContext* getFormatContext();
 
-    StreamSetupInfo(int streamId):
+    StreamSetupInfo(int streamId, MemAccountPtr account):
         streamId(streamId),
         ffVideoIndex(-1),
         ffAudioIndex(-1),
@@ -53,8 +60,12 @@ public:
         inputIOBuffer_(NULL),
         mt_(),
         endOfFile_(false),
-        error_(false)
+        error_(false),
+        bytesQueued_(0),
+        bytesFed_(0)
     {
+        rb_.setMemAccount(account);
+        wb_.setMemAccount(account);
     }
 
     ~StreamSetupInfo();
@@ -70,7 +81,17 @@ private:
     boost::mutex mt_;
     bool endOfFile_;
     bool error_;
+
+    StreamLatencyPtr latency_;
+    // end offset and enqueue time of every message still in rb_
+    deque< pair<uint64_t, int64_t> > queued_;
+    uint64_t bytesQueued_;
+    uint64_t bytesFed_;
+
     void writeTagSize(int32_t tagSize);
+    void writeTag(const RtmpMsgHeaderPtr& msg);
+    void append(uint8_t* data, int size);
+    void onFed(int size);
 };
 
 struct RtmpPushProtol
@@ -79,6 +100,67 @@ struct RtmpPushProtol
 };
 
 typedef boost::shared_ptr<AVPacket> AVPacketPtr;
+typedef boost::shared_ptr<StreamSetupInfo> StreamSetupInfoPtr;
+
+/*
+ * demuxes the flv fed to a StreamSetupInfo and writes it to the output
+ * on a thread of its own, and may outlive the actor
+ *
+ * finish() ends the input, the thread drains what is queued, writes the
+ * trailer, closes the output and hands itself to the Reaper to be joined.
+ * output i/o is interrupted FINISH_TIMEOUT after finish(), nobody waits
+ */
+class PushSession : public boost::enable_shared_from_this<PushSession>
+{
+    private:
+        const static int STREAM_COUNT = 10;
+        // milliseconds the output has to take the rest of the stream
+        const static int FINISH_TIMEOUT = 3000;
+
+        StreamSetupInfoPtr info_;
+        StreamLatencyPtr latency_;
+        AVFormatContext* ctx_;
+        int streamMap_[PushSession::STREAM_COUNT];
+        bool headerWritten_;
+        int64_t startTime_;
+        AVPacket* pkt_;
+        boost::thread* th_;
+        // th_ is reset by the reaper, this one only by the owner
+        bool started_;
+
+        boost::mutex mt_;
+        bool done_;
+        // monotonic microseconds, 0 until finish()
+        boost::atomic<int64_t> abortAt_;
+
+        PushSession(const PushSession&);
+        PushSession& operator=(const PushSession&);
+
+        bool setOutputCtx(AVFormatContext* inCtx);
+        void run();
+        // trailer and close, on the push or the reaper thread
+        void closeOutput();
+
+        static int checkInterrupt(void* opaque);
+        static void reap(boost::shared_ptr<PushSession> push);
+
+    public:
+        PushSession(StreamSetupInfoPtr info, StreamLatencyPtr latency);
+        ~PushSession();
+
+        // throws RtmpInternalError when the output can not be opened
+        void open(const string& url);
+        void start();
+        bool isStarted();
+        bool isDone();
+        // ends the input, returns at once
+        void finish();
+
+        // finish, and close the output on the reaper when the thread never ran
+        static void release(boost::shared_ptr<PushSession> push);
+};
+
+typedef boost::shared_ptr<PushSession> PushSessionPtr;
 
 class LiveReceiverActor : public RtmpActor
 {
@@ -87,29 +169,18 @@ class LiveReceiverActor : public RtmpActor
         static string urlPrefix;
         static string fmt;
         static bool initialized;
-        
 
-        AVFormatContext* ctx_;         
         ConnectCmdPtr connectInfo_;
-        StreamSetupInfo* streamInfos_[LiveReceiverActor::STREAM_COUNT];
-        int streamMap_[LiveReceiverActor::STREAM_COUNT];
+        StreamSetupInfoPtr streamInfos_[LiveReceiverActor::STREAM_COUNT];
         int streamInfoCount_;
         string outputUrl_;
-        int avStreamIndex_;
-        bool headerWritten_;
 
-        int64_t startTime_;
-        boost::thread* th_;
         MetaDataMsgPtr metaData_;
-        AVPacket* pkt_;
-        boost::mutex mt_;
-        bool isPushThreadDone_;
+        MemAccountPtr account_;
+        StreamLatencyPtr latency_;
+        PushSessionPtr push_;
 
         StreamSetupInfo* findStreamSetupInfo(int streamId);
-        bool setOutputCtx(AVFormatContext* inCtx);
-
-        void notifyPushThreadDone();
-        bool isPushThreadDone(); 
 
     public:
 
@@ -126,7 +197,8 @@ class LiveReceiverActor : public RtmpActor
 
         bool onMetaData(int streamId, MetaDataMsgPtr metaData);
         bool onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg);
-        void pushThread(); 
+        bool onReceiveStreams(const RtmpMediaMsg* msgs, int count);
+        void setMemAccount(MemAccountPtr account);
 };
 
 
@@ -0,0 +1,725 @@
+#include "log.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <vector>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+boost::atomic<int> Log::level_(DEFAULTLOGLEVEL);
+
+namespace
+{
+
+const int MAX_ARGS = 16;
+const int TEXT_SIZE = 192;
+// records per thread, power of 2. about 11 KB, every thread that logs has
+// one and the writer is woken by the first record
+const int RING_SIZE = 32;
+const int LINE_SIZE = 1024;
+
+union LogSlot
+{
+    long long i;
+    unsigned long long u;
+    double d;
+    const void* p;
+    struct
+    {
+        uint16_t offset;
+        uint16_t len;
+    } s;
+};
+
+/*
+ * one message before formatting, fmt must be a literal, strings are
+ * copied into text
+ */
+struct LogRecord
+{
+    const char* fmt;
+    int argc;
+    int textUsed;
+    LogSlot args[MAX_ARGS];
+    char text[TEXT_SIZE];
+};
+
+// single producer, the thread that owns it, single consumer, the writer thread
+struct LogRing
+{
+    LogRecord records[RING_SIZE];
+    boost::atomic<uint32_t> head;
+    boost::atomic<uint32_t> tail;
+    boost::atomic<bool> closed;
+
+    LogRing(): head(0), tail(0), closed(false)
+    {
+    }
+};
+
+enum LogArgClass
+{
+    LAC_None,
+    LAC_Int,
+    LAC_UInt,
+    LAC_Char,
+    LAC_Double,
+    LAC_String,
+    LAC_Pointer,
+    LAC_Count
+};
+
+struct LogSpec
+{
+    // at '%'
+    const char* start;
+    // at '.' or at the length modifier when there is no precision
+    const char* precisionStart;
+    const char* lengthStart;
+    const char* lengthEnd;
+    // after the conversion
+    const char* end;
+
+    bool widthStar;
+    bool precisionStar;
+    int precision;
+    char conv;
+};
+
+// the writer thread and the queues are never freed, they outlive exit()
+boost::once_flag startFlag = BOOST_ONCE_INIT;
+boost::mutex* ringsMutex;
+vector<LogRing*>* rings;
+boost::thread_specific_ptr<LogRing>* threadRing;
+boost::atomic<uint64_t> passes(0);
+boost::atomic<uint64_t> dropped(0);
+// the writer blocks on wakeFd once sleeping is set and a pass found nothing
+int wakeFd = -1;
+boost::atomic<bool> sleeping(false);
+
+/*
+ * finds the next conversion, the literal text before it is [p, spec.start)
+ */
+bool nextSpec(const char* p, LogSpec& spec)
+{
+    for(; *p; p++)
+    {
+        if(*p != '%')
+        {
+            continue;
+        }
+
+        spec.start = p++;
+        spec.widthStar = false;
+        spec.precisionStar = false;
+        spec.precision = -1;
+
+        while(*p && strchr("-+ #0'", *p))
+        {
+            p++;
+        }
+
+        if(*p == '*')
+        {
+            spec.widthStar = true;
+            p++;
+        }
+        else
+        {
+            while(*p >= '0' && *p <= '9')
+            {
+                p++;
+            }
+        }
+
+        spec.precisionStart = p;
+        if(*p == '.')
+        {
+            p++;
+            if(*p == '*')
+            {
+                spec.precisionStar = true;
+                p++;
+            }
+            else
+            {
+                spec.precision = 0;
+                while(*p >= '0' && *p <= '9')
+                {
+                    spec.precision = spec.precision * 10 + (*p - '0');
+                    p++;
+                }
+            }
+        }
+
+        spec.lengthStart = p;
+        while(*p && strchr("hlLqjzt", *p))
+        {
+            p++;
+        }
+        spec.lengthEnd = p;
+
+        spec.conv = *p;
+        spec.end = *p ? p + 1 : p;
+
+        return true;
+    }
+
+    return false;
+}
+
+bool hasLength(const LogSpec& spec, const char* mod)
+{
+    int len = strlen(mod);
+    return spec.lengthEnd - spec.lengthStart == len && strncmp(spec.lengthStart, mod, len) == 0;
+}
+
+LogArgClass getArgClass(const LogSpec& spec)
+{
+    switch(spec.conv)
+    {
+        case 'd':
+        case 'i':
+            return LAC_Int;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            return LAC_UInt;
+        case 'c':
+            return LAC_Char;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            return LAC_Double;
+        case 's':
+            return LAC_String;
+        case 'p':
+            return LAC_Pointer;
+        case 'n':
+            return LAC_Count;
+        default:
+            return LAC_None;
+    }
+}
+
+long long readInt(va_list* ap, const LogSpec& spec)
+{
+    if(hasLength(spec, "l"))
+    {
+        return va_arg(*ap, long);
+    }
+    else if(hasLength(spec, "ll") || hasLength(spec, "q"))
+    {
+        return va_arg(*ap, long long);
+    }
+    else if(hasLength(spec, "j"))
+    {
+        return va_arg(*ap, intmax_t);
+    }
+    else if(hasLength(spec, "z"))
+    {
+        return va_arg(*ap, ssize_t);
+    }
+    else if(hasLength(spec, "t"))
+    {
+        return va_arg(*ap, ptrdiff_t);
+    }
+
+    // char and short are promoted
+    return va_arg(*ap, int);
+}
+
+unsigned long long readUInt(va_list* ap, const LogSpec& spec)
+{
+    if(hasLength(spec, "l"))
+    {
+        return va_arg(*ap, unsigned long);
+    }
+    else if(hasLength(spec, "ll") || hasLength(spec, "q"))
+    {
+        return va_arg(*ap, unsigned long long);
+    }
+    else if(hasLength(spec, "j"))
+    {
+        return va_arg(*ap, uintmax_t);
+    }
+    else if(hasLength(spec, "z"))
+    {
+        return va_arg(*ap, size_t);
+    }
+    else if(hasLength(spec, "t"))
+    {
+        return va_arg(*ap, ptrdiff_t);
+    }
+
+    return va_arg(*ap, unsigned int);
+}
+
+int argsNeeded(const LogSpec& spec)
+{
+    LogArgClass c = getArgClass(spec);
+
+    return spec.widthStar + spec.precisionStar + (c == LAC_None ? 0 : 1);
+}
+
+void capture(LogRecord& r, va_list* ap)
+{
+    LogSpec spec;
+    const char* p = r.fmt;
+
+    while(nextSpec(p, spec))
+    {
+        p = spec.end;
+
+        // the rest of the format is printed as it is
+        if(r.argc + argsNeeded(spec) > MAX_ARGS)
+        {
+            break;
+        }
+
+        if(spec.widthStar)
+        {
+            r.args[r.argc++].i = va_arg(*ap, int);
+        }
+
+        int precision = spec.precision;
+        if(spec.precisionStar)
+        {
+            precision = va_arg(*ap, int);
+            r.args[r.argc++].i = precision;
+        }
+
+        LogSlot& slot = r.args[r.argc];
+        switch(getArgClass(spec))
+        {
+            case LAC_Int:
+            case LAC_Char:
+                slot.i = readInt(ap, spec);
+                break;
+            case LAC_UInt:
+                slot.u = readUInt(ap, spec);
+                break;
+            case LAC_Double:
+                if(hasLength(spec, "L"))
+                {
+                    slot.d = (double)va_arg(*ap, long double);
+                }
+                else
+                {
+                    slot.d = va_arg(*ap, double);
+                }
+                break;
+            case LAC_String:
+                {
+                    const char* s = va_arg(*ap, const char*);
+                    if(!s)
+                    {
+                        s = "(null)";
+                    }
+
+                    // %.*s views are not terminated, never read past the precision
+                    int room = TEXT_SIZE - r.textUsed;
+                    if(precision >= 0 && precision < room)
+                    {
+                        room = precision;
+                    }
+
+                    int len = strnlen(s, room);
+                    memcpy(r.text + r.textUsed, s, len);
+                    slot.s.offset = r.textUsed;
+                    slot.s.len = len;
+                    r.textUsed += len;
+                }
+                break;
+            case LAC_Pointer:
+            case LAC_Count:
+                slot.p = va_arg(*ap, void*);
+                break;
+            case LAC_None:
+                continue;
+        }
+
+        r.argc++;
+    }
+}
+
+template <class T>
+int formatOne(char* out, int size, const char* spec, const int* stars, int starCount, T v)
+{
+    if(starCount == 0)
+    {
+        return snprintf(out, size, spec, v);
+    }
+    else if(starCount == 1)
+    {
+        return snprintf(out, size, spec, stars[0], v);
+    }
+
+    return snprintf(out, size, spec, stars[0], stars[1], v);
+}
+
+void append(char* out, int size, int& n, const char* data, int len)
+{
+    if(len > size - 1 - n)
+    {
+        len = size - 1 - n;
+    }
+
+    memcpy(out + n, data, len);
+    n += len;
+}
+
+int format(const LogRecord& r, char* out, int size)
+{
+    int n = 0;
+    int ai = 0;
+    const char* p = r.fmt;
+    LogSpec spec;
+
+    while(nextSpec(p, spec))
+    {
+        append(out, size, n, p, spec.start - p);
+
+        if(spec.conv == '%')
+        {
+            append(out, size, n, "%", 1);
+            p = spec.end;
+            continue;
+        }
+
+        if(ai + argsNeeded(spec) > r.argc)
+        {
+            // not captured, print as it is
+            p = spec.start;
+            break;
+        }
+
+        p = spec.end;
+
+        int stars[2];
+        int starCount = 0;
+        if(spec.widthStar)
+        {
+            stars[starCount++] = r.args[ai++].i;
+        }
+
+        // flags and width are kept, length modifiers are replaced
+        char specBuf[64];
+        int headLen = spec.precisionStart - spec.start;
+        int keepLen = spec.lengthStart - spec.start;
+        if(keepLen > (int)sizeof(specBuf) - 8)
+        {
+            continue;
+        }
+
+        LogArgClass c = getArgClass(spec);
+        if(c == LAC_String)
+        {
+            if(spec.precisionStar)
+            {
+                ai++;
+            }
+
+            memcpy(specBuf, spec.start, headLen);
+            strcpy(specBuf + headLen, ".*s");
+        }
+        else
+        {
+            if(spec.precisionStar)
+            {
+                stars[starCount++] = r.args[ai++].i;
+            }
+
+            memcpy(specBuf, spec.start, keepLen);
+            specBuf[keepLen] = 0;
+
+            if(c == LAC_Int || c == LAC_UInt)
+            {
+                strcat(specBuf, "ll");
+            }
+
+            int len = strlen(specBuf);
+            specBuf[len] = spec.conv;
+            specBuf[len + 1] = 0;
+        }
+
+        if(c == LAC_None)
+        {
+            continue;
+        }
+
+        const LogSlot& slot = r.args[ai++];
+        int room = size - n;
+        int ret = 0;
+
+        switch(c)
+        {
+            case LAC_Int:
+                ret = formatOne(out + n, room, specBuf, stars, starCount, slot.i);
+                break;
+            case LAC_UInt:
+                ret = formatOne(out + n, room, specBuf, stars, starCount, slot.u);
+                break;
+            case LAC_Char:
+                ret = formatOne(out + n, room, specBuf, stars, starCount, (int)slot.i);
+                break;
+            case LAC_Double:
+                ret = formatOne(out + n, room, specBuf, stars, starCount, slot.d);
+                break;
+            case LAC_String:
+                stars[starCount++] = slot.s.len;
+                ret = formatOne(out + n, room, specBuf, stars, starCount, r.text + slot.s.offset);
+                break;
+            case LAC_Pointer:
+                ret = formatOne(out + n, room, specBuf, stars, starCount, slot.p);
+                break;
+            default:
+                break;
+        }
+
+        if(ret > 0)
+        {
+            n += ret < room - 1 ? ret : room - 1;
+        }
+    }
+
+    append(out, size, n, p, strlen(p));
+    out[n] = 0;
+
+    return n;
+}
+
+void wake()
+{
+    uint64_t one = 1;
+    if(write(wakeFd, &one, sizeof(one)) == -1)
+    {
+        // the counter is full, the writer is woken anyway
+    }
+}
+
+// after a record is added, the writer may have looked at the ring before
+void wakeIfSleeping()
+{
+    if(sleeping.load() && sleeping.exchange(false))
+    {
+        wake();
+    }
+}
+
+// one pass over the rings, whether anything was written
+bool writeRings(char* line)
+{
+    bool wrote = false;
+
+    {
+        boost::lock_guard<boost::mutex> lock(*ringsMutex);
+
+        vector<LogRing*>::iterator it = rings->begin();
+        while(it != rings->end())
+        {
+            LogRing* ring = *it;
+            // read closed first, nothing is added after it is set
+            bool closed = ring->closed.load(boost::memory_order_acquire);
+            uint32_t head = ring->head.load(boost::memory_order_relaxed);
+            uint32_t tail = ring->tail.load();
+
+            for(; head != tail; head++)
+            {
+                int n = format(ring->records[head & (RING_SIZE - 1)], line, LINE_SIZE);
+                fwrite(line, 1, n, stdout);
+                wrote = true;
+            }
+            ring->head.store(head, boost::memory_order_release);
+
+            if(closed)
+            {
+                delete ring;
+                it = rings->erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    if(wrote)
+    {
+        fflush(stdout);
+    }
+
+    passes.fetch_add(1);
+
+    return wrote;
+}
+
+void writerLoop()
+{
+    char line[LINE_SIZE];
+
+    for(;;)
+    {
+        if(writeRings(line))
+        {
+            continue;
+        }
+
+        // a record added after this store wakes the writer, one added
+        // before it is seen by the pass that follows
+        sleeping.store(true);
+        if(writeRings(line))
+        {
+            sleeping.store(false);
+            continue;
+        }
+
+        uint64_t n;
+        if(read(wakeFd, &n, sizeof(n)) == -1 && errno != EINTR)
+        {
+            usleep(2000);
+        }
+        sleeping.store(false);
+    }
+}
+
+void closeRing(LogRing* ring)
+{
+    // the writer frees it once it is drained
+    ring->closed.store(true, boost::memory_order_release);
+    wake();
+}
+
+void flushAtExit()
+{
+    Log::flush();
+}
+
+void start()
+{
+    // without it the writer looks every 2 ms, see writerLoop()
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+
+    ringsMutex = new boost::mutex();
+    rings = new vector<LogRing*>();
+    threadRing = new boost::thread_specific_ptr<LogRing>(closeRing);
+
+    boost::thread writer(writerLoop);
+    writer.detach();
+
+    atexit(flushAtExit);
+}
+
+LogRing* getRing()
+{
+    boost::call_once(startFlag, start);
+
+    LogRing* ring = threadRing->get();
+    if(!ring)
+    {
+        ring = new LogRing();
+        threadRing->reset(ring);
+
+        boost::lock_guard<boost::mutex> lock(*ringsMutex);
+        rings->push_back(ring);
+    }
+
+    return ring;
+}
+
+}
+
+void Log::setLevel(int level)
+{
+    level_.store(level);
+}
+
+int Log::getLevel()
+{
+    return level_.load();
+}
+
+void Log::write(int, const char* fmt, ...)
+{
+    LogRing* ring = getRing();
+
+    uint32_t tail = ring->tail.load(boost::memory_order_relaxed);
+    if(tail - ring->head.load(boost::memory_order_acquire) == (uint32_t)RING_SIZE)
+    {
+        dropped.fetch_add(1, boost::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord& r = ring->records[tail & (RING_SIZE - 1)];
+    r.fmt = fmt;
+    r.argc = 0;
+    r.textUsed = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    capture(r, &ap);
+    va_end(ap);
+
+    // ordered against the store of sleeping by the writer
+    ring->tail.store(tail + 1);
+    wakeIfSleeping();
+}
+
+void Log::flush()
+{
+    if(!rings)
+    {
+        return;
+    }
+
+    // a full pass started after this point has seen every record
+    uint64_t target = passes.load() + 2;
+    while(passes.load() < target)
+    {
+        wake();
+        usleep(1000);
+    }
+}
+
+uint64_t Log::getDropped()
+{
+    return dropped.load();
+}
+
+LogRateLimit::LogRateLimit(int perSecond):
+    perSecond_(perSecond), second_(0), count_(0), suppressed_(0)
+{
+}
+
+bool LogRateLimit::allow(int* suppressed)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    int64_t now = ts.tv_sec;
+    int64_t second = second_.load(boost::memory_order_relaxed);
+    if(now != second && second_.compare_exchange_strong(second, now))
+    {
+        count_.store(0);
+    }
+
+    if(count_.fetch_add(1) < perSecond_)
+    {
+        *suppressed = suppressed_.exchange(0);
+        return true;
+    }
+
+    suppressed_.fetch_add(1);
+    return false;
+}
@@ -2,20 +2,92 @@
 #define LOG_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <boost/atomic.hpp>
 
 #define LEVDEBUG 0
 #define LEVINFO 1
 #define LEVWARN 2
 #define LEVERROR 3
 
-#define DEFAULTLOGLEVEL LEVDEBUG
+// levels below this are compiled out, build with -DRTMP_LOG_MIN_LEVEL=1 to drop debug
+#ifndef RTMP_LOG_MIN_LEVEL
+#define RTMP_LOG_MIN_LEVEL LEVDEBUG
+#endif
+
+// level at start, Log::setLevel() changes it at run time
+#define DEFAULTLOGLEVEL LEVINFO
+
+/*
+ * the caller only copies the arguments into a per thread ring, a
+ * background thread does the formatting and the writing to stdout
+ */
+#define RTMP_LOG(logLevel, fmt, ...)                        \
+    do {                                                    \
+        if(logLevel >= RTMP_LOG_MIN_LEVEL &&                \
+                Log::isEnabled(logLevel))                   \
+        {                                                   \
+            Log::write(logLevel, fmt, ##__VA_ARGS__);       \
+        }                                                   \
+    } while(0)                                              \
+
+// for messages that come per frame or per read, at most perSecond a second
+#define RTMP_LOG_RATE(logLevel, perSecond, fmt, ...)                            \
+    do {                                                                        \
+        if(logLevel >= RTMP_LOG_MIN_LEVEL &&                                    \
+                Log::isEnabled(logLevel))                                       \
+        {                                                                       \
+            static LogRateLimit rtmpLogLimit(perSecond);                        \
+            int rtmpLogSuppressed = 0;                                          \
+            if(rtmpLogLimit.allow(&rtmpLogSuppressed))                          \
+            {                                                                   \
+                if(rtmpLogSuppressed)                                           \
+                {                                                               \
+                    Log::write(logLevel, "%d similar messages suppressed\n",    \
+                            rtmpLogSuppressed);                                 \
+                }                                                               \
+                Log::write(logLevel, fmt, ##__VA_ARGS__);                       \
+            }                                                                   \
+        }                                                                       \
+    } while(0)                                                                  \
+
+class Log
+{
+    private:
+        static boost::atomic<int> level_;
+
+    public:
+        static void setLevel(int level);
+        static int getLevel();
+
+        static bool isEnabled(int level)
+        {
+            return level >= level_.load(boost::memory_order_relaxed);
+        }
+
+        // never blocks, messages are dropped when the thread's ring is full
+        static void write(int level, const char* fmt, ...)
+            __attribute__((format(printf, 2, 3)));
+
+        // returns when everything logged before the call is written
+        static void flush();
+
+        static uint64_t getDropped();
+};
+
+class LogRateLimit
+{
+    private:
+        int perSecond_;
+        boost::atomic<int64_t> second_;
+        boost::atomic<int> count_;
+        boost::atomic<int> suppressed_;
+
+    public:
+        LogRateLimit(int perSecond);
 
-#define RTMP_LOG(logLevel, fmt, ...)     \
-    do {                                 \
-        if(logLevel >= DEFAULTLOGLEVEL)  \
-        {                                \
-            printf(fmt, ##__VA_ARGS__);  \
-        }                                \
-    } while(0)                           \
+        // suppressed is set to how many were dropped since the last one allowed
+        bool allow(int* suppressed);
+};
 
 #endif
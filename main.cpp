@@ -1,5 +1,6 @@
 #include "tviertmp.h"
 #include <iostream>
+#include <stdlib.h>
 
 #include "livereceiveractor.h"
 
@@ -17,7 +18,39 @@ int main(int argc, char* argv[])
 {
     //LiveReceiverActor::Init("http://10.33.0.56:10080/live", ".ismv");
     LiveReceiverActor::Init("http://10.33.0.56:10080/live", ".ismv");
+    Metrics::serve(9935);
     RtmpServer s(1935, LiveReceiverActor::createActor);
+    // opening the output and writing its header and trailer block, keep
+    // them off the threads that read the sockets
+    s.setActorThreads(4);
+    // TVIE_RTMP_UPGRADE=/run/tvie_rtmp/upgrade.sock: a new tvie_rtmp takes
+    // over the port and the clients of this one. the directory is private
+    // to the user both run as
+    const char* upgradePath = getenv("TVIE_RTMP_UPGRADE");
+    if(upgradePath && *upgradePath)
+    {
+        s.setUpgradePath(upgradePath);
+    }
+
+    // TVIE_RTMP_CAPTURE=dir: what every client sends goes to a file in dir,
+    // see tvie_rtmp_replay
+    const char* captureDir = getenv("TVIE_RTMP_CAPTURE");
+    if(captureDir && *captureDir)
+    {
+        WireCapture::enable(captureDir);
+    }
+    // replies leave at once and in full segments, the handshake comes
+    // with the accepted socket
+    TcpTuning tuning;
+    tuning.noDelay = true;
+    tuning.cork = true;
+    tuning.deferAcceptSeconds = 5;
+    s.setTcpTuning(tuning);
+    // tvie_rtmp uring [workers]
+    if(argc > 1 && strcmp(argv[1], "uring") == 0)
+    {
+        s.setIoBackend(IOB_Uring, argc > 2 ? atoi(argv[2]) : 1);
+    }
     s.start();
 
     return 0;
@@ -0,0 +1,234 @@
+#include "memaccount.h"
+#include "rtmpexception.h"
+#include "log.h"
+
+boost::atomic<int64_t> MemAccount::globalUsed_(0);
+boost::atomic<int64_t> MemAccount::globalPeak_(0);
+boost::atomic<uint32_t> MemAccount::refused_(0);
+boost::atomic<uint32_t> MemAccount::evictedCount_(0);
+boost::atomic<int64_t> MemAccount::leaving_(0);
+int64_t MemAccount::globalLimit_ = 0;
+int64_t MemAccount::connectionLimit_ = 0;
+boost::mutex MemAccount::registryMt_;
+boost::condition_variable MemAccount::evictCv_;
+list<MemAccount*> MemAccount::registry_;
+
+MemAccount::MemAccount():
+    used_(0), peak_(0), evicted_(false), leavingUsed_(0), evicting_(false)
+{
+    boost::lock_guard<boost::mutex> lk(registryMt_);
+    registryIt_ = registry_.insert(registry_.end(), this);
+}
+
+MemAccount::~MemAccount()
+{
+    {
+        boost::unique_lock<boost::mutex> lk(registryMt_);
+        waitEvicting(lk);
+        registry_.erase(registryIt_);
+    }
+
+    // whatever is not released by the owner goes away with the account
+    leave(leavingUsed_.load());
+    globalUsed_.fetch_sub(used_.load());
+}
+
+void MemAccount::waitEvicting(boost::unique_lock<boost::mutex>& lk)
+{
+    while(evicting_)
+    {
+        evictCv_.wait(lk);
+    }
+}
+
+void MemAccount::leave(int64_t bytes)
+{
+    int64_t left = leavingUsed_.load();
+    int64_t n;
+    do
+    {
+        n = bytes < left ? bytes : left;
+        if(n <= 0)
+        {
+            return;
+        }
+    } while(!leavingUsed_.compare_exchange_weak(left, left - n));
+
+    leaving_.fetch_sub(n);
+}
+
+void MemAccount::updatePeak(boost::atomic<int64_t>& peak, int64_t v)
+{
+    int64_t p = peak.load(boost::memory_order_relaxed);
+    while(v > p && !peak.compare_exchange_weak(p, v, boost::memory_order_relaxed))
+    {
+    }
+}
+
+void MemAccount::charge(int64_t bytes)
+{
+    if(bytes <= 0)
+    {
+        return;
+    }
+
+    if(connectionLimit_ > 0 && used_.load(boost::memory_order_relaxed) + bytes > connectionLimit_)
+    {
+        throw RtmpOutOfMemory("connection memory limit exceeded");
+    }
+
+    int64_t global = globalUsed_.fetch_add(bytes) + bytes;
+    int64_t used = used_.fetch_add(bytes) + bytes;
+
+    if(globalLimit_ > 0 && global > globalLimit_)
+    {
+        evictLargest(global - globalLimit_);
+
+        if(isEvicted())
+        {
+            used_.fetch_sub(bytes);
+            globalUsed_.fetch_sub(bytes);
+            throw RtmpOutOfMemory("process memory limit exceeded");
+        }
+    }
+
+    updatePeak(peak_, used);
+    updatePeak(globalPeak_, global);
+}
+
+void MemAccount::release(int64_t bytes)
+{
+    if(bytes <= 0)
+    {
+        return;
+    }
+
+    used_.fetch_sub(bytes);
+    globalUsed_.fetch_sub(bytes);
+
+    if(isEvicted())
+    {
+        leave(bytes);
+    }
+}
+
+int64_t MemAccount::getUsed()
+{
+    return used_.load(boost::memory_order_relaxed);
+}
+
+int64_t MemAccount::getPeak()
+{
+    return peak_.load(boost::memory_order_relaxed);
+}
+
+bool MemAccount::isEvicted()
+{
+    return evicted_.load(boost::memory_order_relaxed);
+}
+
+void MemAccount::setOnEvict(const boost::function<void()>& fn)
+{
+    boost::unique_lock<boost::mutex> lk(registryMt_);
+    waitEvicting(lk);
+    onEvict_ = fn;
+}
+
+void MemAccount::evictLargest(int64_t overshoot)
+{
+    // one overshoot must not take several connections with it. what the
+    // evicted ones hold is about to be freed, no need to walk the registry
+    if(leaving_.load() >= overshoot)
+    {
+        return;
+    }
+
+    MemAccount* largest = NULL;
+    boost::function<void()> onEvict;
+    {
+        boost::lock_guard<boost::mutex> lk(registryMt_);
+
+        // another thread may have evicted one meanwhile
+        if(leaving_.load() >= overshoot)
+        {
+            return;
+        }
+
+        list<MemAccount*>::iterator it = registry_.begin();
+        for(; it != registry_.end(); it++)
+        {
+            if(!(*it)->isEvicted() && (!largest || (*it)->getUsed() > largest->getUsed()))
+            {
+                largest = *it;
+            }
+        }
+
+        if(!largest)
+        {
+            return;
+        }
+
+        int64_t used = largest->getUsed();
+        RTMP_LOG(LEVWARN, "memory limit %lld exceeded, evict connection holding %lld bytes\n",
+                (long long)globalLimit_, (long long)used);
+        largest->leavingUsed_ = used;
+        leaving_.fetch_add(used);
+        largest->evicted_ = true;
+        evictedCount_++;
+
+        // the account stays until evicting_ is cleared, see waitEvicting()
+        onEvict = largest->onEvict_;
+        largest->evicting_ = (bool)onEvict;
+    }
+
+    if(onEvict)
+    {
+        onEvict();
+
+        boost::lock_guard<boost::mutex> lk(registryMt_);
+        largest->evicting_ = false;
+        evictCv_.notify_all();
+    }
+}
+
+void MemAccount::setLimits(int64_t connectionLimit, int64_t globalLimit)
+{
+    connectionLimit_ = connectionLimit;
+    globalLimit_ = globalLimit;
+}
+
+bool MemAccount::canAccept()
+{
+    return globalLimit_ <= 0 || globalUsed_.load(boost::memory_order_relaxed) < globalLimit_;
+}
+
+void MemAccount::onRefused()
+{
+    refused_++;
+}
+
+MemStats MemAccount::getStats()
+{
+    MemStats s;
+    s.globalUsed = globalUsed_.load();
+    s.globalPeak = globalPeak_.load();
+    s.globalLimit = globalLimit_;
+    s.connectionLimit = connectionLimit_;
+    s.refusedConnections = refused_.load();
+    s.evictedConnections = evictedCount_.load();
+    s.largestUsed = 0;
+
+    boost::lock_guard<boost::mutex> lk(registryMt_);
+    s.accountCount = registry_.size();
+
+    list<MemAccount*>::iterator it = registry_.begin();
+    for(; it != registry_.end(); it++)
+    {
+        if((*it)->getUsed() > s.largestUsed)
+        {
+            s.largestUsed = (*it)->getUsed();
+        }
+    }
+
+    return s;
+}
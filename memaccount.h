@@ -0,0 +1,96 @@
+#ifndef MEM_ACCOUNT_H
+#define MEM_ACCOUNT_H
+
+#include <stdint.h>
+#include <list>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+
+using namespace std;
+
+struct MemStats
+{
+    int64_t globalUsed;
+    int64_t globalPeak;
+    int64_t globalLimit;
+    int64_t connectionLimit;
+    int32_t accountCount;
+    int64_t largestUsed;
+    uint32_t refusedConnections;
+    uint32_t evictedConnections;
+};
+
+/*
+ * byte accounting of the buffers owned by one connection
+ *
+ * ReadBuffer, WriteBuffer and message bodies charge the bytes they
+ * allocate to an account, every account is also summed into the
+ * process wide counters. 0 as limit means unlimited
+ */
+class MemAccount
+{
+    private:
+        boost::atomic<int64_t> used_;
+        boost::atomic<int64_t> peak_;
+        boost::atomic<bool> evicted_;
+        // what leaving_ holds of this account, set once it is evicted
+        boost::atomic<int64_t> leavingUsed_;
+        list<MemAccount*>::iterator registryIt_;
+        // under registryMt_
+        boost::function<void()> onEvict_;
+        // onEvict_ runs without registryMt_, clearing it waits on evictCv_
+        bool evicting_;
+
+        static boost::atomic<int64_t> globalUsed_;
+        static boost::atomic<int64_t> globalPeak_;
+        static boost::atomic<uint32_t> refused_;
+        static boost::atomic<uint32_t> evictedCount_;
+        // bytes held by evicted accounts that are not freed yet
+        static boost::atomic<int64_t> leaving_;
+        static int64_t globalLimit_;
+        static int64_t connectionLimit_;
+        static boost::mutex registryMt_;
+        static boost::condition_variable evictCv_;
+        static list<MemAccount*> registry_;
+
+        static void updatePeak(boost::atomic<int64_t>& peak, int64_t v);
+        // evicted accounts that still hold bytes count against overshoot
+        static void evictLargest(int64_t overshoot);
+        // takes up to bytes of this account out of leaving_
+        void leave(int64_t bytes);
+        // under registryMt_
+        void waitEvicting(boost::unique_lock<boost::mutex>& lk);
+
+        MemAccount(const MemAccount&);
+        MemAccount& operator=(const MemAccount&);
+
+    public:
+        MemAccount();
+        ~MemAccount();
+
+        // throws RtmpOutOfMemory when limit is exceeded
+        void charge(int64_t bytes);
+        void release(int64_t bytes);
+
+        int64_t getUsed();
+        int64_t getPeak();
+
+        // set when the process is over its limit and this account is the largest
+        bool isEvicted();
+        // runs once when the account is evicted, from the thread that
+        // charged, to end the connection without waiting for its next
+        // read. an empty fn clears it, it does not run after that returns
+        void setOnEvict(const boost::function<void()>& fn);
+
+        static void setLimits(int64_t connectionLimit, int64_t globalLimit);
+        // whether a new connection should be accepted
+        static bool canAccept();
+        static void onRefused();
+        static MemStats getStats();
+};
+
+typedef boost::shared_ptr<MemAccount> MemAccountPtr;
+
+#endif
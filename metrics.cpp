@@ -0,0 +1,376 @@
+#include "metrics.h"
+#include "memaccount.h"
+#include "latency.h"
+#include "rtmpexception.h"
+#include "log.h"
+#include <list>
+#include <sstream>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+
+struct MetricInfo
+{
+    const char* name;
+    const char* labels;
+    const char* help;
+    bool isGauge;
+};
+
+// items of the same name must be next to each other
+const MetricInfo infos[MET_Count] =
+{
+    {"rtmp_received_bytes_total", "", "Bytes read from client sockets", false},
+    {"rtmp_sent_bytes_total", "", "Bytes written to client sockets", false},
+    {"rtmp_received_chunks_total", "", "RTMP chunks parsed", false},
+    {"rtmp_received_messages_total", "type=\"audio\"", "RTMP messages handled by type", false},
+    {"rtmp_received_messages_total", "type=\"video\"", "", false},
+    {"rtmp_received_messages_total", "type=\"command\"", "", false},
+    {"rtmp_received_messages_total", "type=\"data\"", "", false},
+    {"rtmp_received_messages_total", "type=\"control\"", "", false},
+    {"rtmp_received_messages_total", "type=\"other\"", "", false},
+    {"rtmp_parser_restarts_total", "", "Reads that ended before a message was complete", false},
+    {"rtmp_connection_errors_total", "reason=\"protocol\"", "Connections closed on an error", false},
+    {"rtmp_connection_errors_total", "reason=\"unsupported\"", "", false},
+    {"rtmp_connection_errors_total", "reason=\"state\"", "", false},
+    {"rtmp_connection_errors_total", "reason=\"internal\"", "", false},
+    {"rtmp_connections", "", "Open client connections", true},
+    {"rtmp_actor_errors_total", "", "Errors of the actors while demuxing or writing", false},
+    {"rtmp_push_threads", "", "Running push threads", true},
+    {"rtmp_pushed_frames_total", "", "Frames written to the output by push threads", false},
+    {"rtmp_actor_queued_tasks", "", "Actor callbacks waiting on the executor", true},
+    {"rtmp_connection_timeouts_total", "reason=\"handshake\"", "Connections closed by a timer", false},
+    {"rtmp_connection_timeouts_total", "reason=\"idle\"", "", false},
+    {"rtmp_ping_responses_total", "", "Ping responses that matched the last ping request", false},
+    {"rtmp_ping_rtt_microseconds_total", "", "Round trip times of the matched pings summed", false},
+    {"rtmp_handoff_connections_total", "direction=\"out\"", "Connections moved to or from another server process", false},
+    {"rtmp_handoff_connections_total", "direction=\"in\"", "", false},
+    {"rtmp_refused_connections_total", "", "Connections refused over the memory limit", false},
+    {"rtmp_evicted_connections_total", "", "Connections closed to get back under the memory limit", false},
+    {"rtmp_log_dropped_records_total", "", "Log records dropped on a full ring", false}
+};
+
+// the registry is never freed, threads may exit after main returns
+boost::once_flag initFlag = BOOST_ONCE_INIT;
+boost::mutex* slotsMutex;
+list<MetricsSlot*>* slots;
+// what threads that are gone left behind
+int64_t* retired;
+boost::thread_specific_ptr<MetricsSlot>* threadSlot;
+
+void retireSlot(MetricsSlot* slot)
+{
+    boost::lock_guard<boost::mutex> lock(*slotsMutex);
+
+    for(int i = 0; i < MET_Count; i++)
+    {
+        retired[i] += slot->values[i].load(boost::memory_order_relaxed);
+    }
+
+    slots->remove(slot);
+    delete slot;
+}
+
+void init()
+{
+    slotsMutex = new boost::mutex();
+    slots = new list<MetricsSlot*>();
+    retired = new int64_t[MET_Count]();
+    threadSlot = new boost::thread_specific_ptr<MetricsSlot>(retireSlot);
+}
+
+void appendMetric(stringstream& s, int id, int64_t value)
+{
+    const MetricInfo& info = infos[id];
+
+    if(id == 0 || strcmp(infos[id - 1].name, info.name) != 0)
+    {
+        s << "# HELP " << info.name << " " << info.help << "\n";
+        s << "# TYPE " << info.name << " " << (info.isGauge ? "gauge" : "counter") << "\n";
+    }
+
+    s << info.name;
+    if(info.labels[0])
+    {
+        s << "{" << info.labels << "}";
+    }
+    s << " " << value << "\n";
+}
+
+void appendGauge(stringstream& s, const char* name, const char* help, int64_t value)
+{
+    s << "# HELP " << name << " " << help << "\n";
+    s << "# TYPE " << name << " gauge\n";
+    s << name << " " << value << "\n";
+}
+
+bool sendAll(int sock, const char* data, int size)
+{
+    while(size > 0)
+    {
+        int n = send(sock, data, size, MSG_NOSIGNAL);
+        if(n <= 0)
+        {
+            return false;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+void handleScrape(int sock)
+{
+    char request[1024];
+    int used = 0;
+
+    // only the request line matters, stop at the end of the headers
+    while(used < (int)sizeof(request) - 1)
+    {
+        int n = recv(sock, request + used, sizeof(request) - 1 - used, 0);
+        if(n <= 0)
+        {
+            return;
+        }
+
+        used += n;
+        request[used] = 0;
+
+        if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+        {
+            break;
+        }
+    }
+    request[used] = 0;
+
+    string body;
+    const char* status;
+    if(strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+    {
+        status = "200 OK";
+        body = Metrics::format();
+    }
+    else
+    {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+
+    stringstream s;
+    s << "HTTP/1.0 " << status << "\r\n"
+      << "Content-Type: text/plain; version=0.0.4\r\n"
+      << "Content-Length: " << body.size() << "\r\n"
+      << "Connection: close\r\n\r\n"
+      << body;
+
+    string response = s.str();
+    sendAll(sock, response.data(), response.size());
+}
+
+// the listening socket, -1 once stop() let go of the port
+boost::mutex listenMt;
+int listenSock = -1;
+bool stopped = false;
+
+bool bindPort(int serverSock, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    return ::bind(serverSock, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        listen(serverSock, 4) == 0;
+}
+
+void serveLoop(int serverSock, int port, bool bound)
+{
+    // a server that is taken over holds the port until it drains
+    if(!bound)
+    {
+        RTMP_LOG(LEVWARN, "metrics port %d is in use, retry until it is free\n", port);
+    }
+
+    while(!bound)
+    {
+        usleep(100000);
+
+        boost::lock_guard<boost::mutex> lk(listenMt);
+        if(stopped)
+        {
+            listenSock = -1;
+            close(serverSock);
+            return;
+        }
+
+        if(bindPort(serverSock, port))
+        {
+            bound = true;
+        }
+        else if(errno != EADDRINUSE)
+        {
+            RTMP_LOG(LEVERROR, "metrics bind failed, errno %d\n", errno);
+            listenSock = -1;
+            close(serverSock);
+            return;
+        }
+    }
+
+    RTMP_LOG(LEVINFO, "Metrics on http://127.0.0.1:%d/metrics\n", port);
+
+    while(true)
+    {
+        int sock = accept(serverSock, NULL, NULL);
+        if(sock == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            boost::lock_guard<boost::mutex> lk(listenMt);
+            if(!stopped)
+            {
+                RTMP_LOG(LEVERROR, "metrics accept failed, errno %d\n", errno);
+            }
+            listenSock = -1;
+            break;
+        }
+
+        // a scraper that stalls must not hold the endpoint forever
+        struct timeval tv = {5, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        handleScrape(sock);
+        close(sock);
+    }
+
+    close(serverSock);
+}
+
+}
+
+MetricsSlot::MetricsSlot()
+{
+    for(int i = 0; i < MET_Count; i++)
+    {
+        values[i].store(0, boost::memory_order_relaxed);
+    }
+}
+
+MetricsSlot* Metrics::getSlot()
+{
+    boost::call_once(initFlag, init);
+
+    MetricsSlot* slot = threadSlot->get();
+    if(!slot)
+    {
+        slot = new MetricsSlot();
+        threadSlot->reset(slot);
+
+        boost::lock_guard<boost::mutex> lock(*slotsMutex);
+        slots->push_back(slot);
+    }
+
+    return slot;
+}
+
+void Metrics::collect(int64_t* values)
+{
+    boost::call_once(initFlag, init);
+
+    boost::lock_guard<boost::mutex> lock(*slotsMutex);
+
+    for(int i = 0; i < MET_Count; i++)
+    {
+        values[i] = retired[i];
+    }
+
+    list<MetricsSlot*>::iterator it = slots->begin();
+    for(; it != slots->end(); it++)
+    {
+        for(int i = 0; i < MET_Count; i++)
+        {
+            values[i] += (*it)->values[i].load(boost::memory_order_relaxed);
+        }
+    }
+}
+
+string Metrics::format()
+{
+    int64_t values[MET_Count];
+    collect(values);
+
+    MemStats stats = MemAccount::getStats();
+    values[MET_RefusedConnections] = stats.refusedConnections;
+    values[MET_EvictedConnections] = stats.evictedConnections;
+    values[MET_LogDropped] = Log::getDropped();
+
+    stringstream s;
+    for(int i = 0; i < MET_Count; i++)
+    {
+        appendMetric(s, i, values[i]);
+    }
+
+    appendGauge(s, "rtmp_memory_used_bytes", "Bytes held by connection buffers", stats.globalUsed);
+    appendGauge(s, "rtmp_memory_peak_bytes", "Peak of rtmp_memory_used_bytes", stats.globalPeak);
+
+    StreamLatency::format(s);
+
+    return s.str();
+}
+
+void Metrics::serve(int port)
+{
+    int serverSock;
+    if((serverSock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        throw RtmpInternalError("create metrics socket failed", errno);
+    }
+
+    int reuseSock = 1;
+    setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR, &reuseSock, sizeof(int));
+
+    // no SO_REUSEPORT, the scrapes of two processes would be mixed. the
+    // loop binds once the server it takes over calls stop()
+    bool bound = bindPort(serverSock, port);
+    if(!bound && errno != EADDRINUSE)
+    {
+        int err = errno;
+        close(serverSock);
+        throw RtmpInternalError("metrics bind failed", err);
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lk(listenMt);
+        listenSock = serverSock;
+        stopped = false;
+    }
+
+    boost::thread th(boost::bind(serveLoop, serverSock, port, bound));
+    th.detach();
+}
+
+void Metrics::stop()
+{
+    boost::lock_guard<boost::mutex> lk(listenMt);
+    stopped = true;
+    if(listenSock != -1)
+    {
+        // wakes accept(), the loop closes the socket
+        shutdown(listenSock, SHUT_RDWR);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string>
+#include <boost/atomic.hpp>
+
+using namespace std;
+
+enum MetricId
+{
+    MET_BytesReceived,
+    MET_BytesSent,
+    MET_ChunksReceived,
+    MET_MsgAudio,
+    MET_MsgVideo,
+    MET_MsgCommand,
+    MET_MsgData,
+    MET_MsgControl,
+    MET_MsgOther,
+    MET_ParserRestarts,
+    MET_ErrorProtocol,
+    MET_ErrorUnsupported,
+    MET_ErrorState,
+    MET_ErrorInternal,
+    MET_Connections,
+    MET_ActorErrors,
+    MET_PushThreads,
+    MET_PushFrames,
+    MET_ActorTasks,
+    MET_TimeoutHandshake,
+    MET_TimeoutIdle,
+    MET_PingResponses,
+    MET_PingRttMicros,
+    MET_HandoffOut,
+    MET_HandoffIn,
+    // nobody adds to these, format() reads them from MemAccount and Log
+    MET_RefusedConnections,
+    MET_EvictedConnections,
+    MET_LogDropped,
+    MET_Count
+};
+
+/*
+ * the values of one thread, only that thread writes them, so an update is
+ * a plain load and store. aligned so two threads never share a cache line
+ */
+struct MetricsSlot
+{
+    boost::atomic<int64_t> values[MET_Count];
+
+    MetricsSlot();
+} __attribute__((aligned(64)));
+
+/*
+ * process wide counters and gauges
+ *
+ * every thread updates its own slot, the slots are only summed when
+ * somebody asks, see collect(). a gauge is the sum of what all threads
+ * added and removed
+ */
+class Metrics
+{
+    private:
+        static MetricsSlot* getSlot();
+
+    public:
+        static void add(MetricId id, int64_t n = 1)
+        {
+            boost::atomic<int64_t>& v = getSlot()->values[id];
+            v.store(v.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+        }
+
+        static void sub(MetricId id, int64_t n = 1)
+        {
+            add(id, -n);
+        }
+
+        // values must hold MET_Count items
+        static void collect(int64_t* values);
+
+        // prometheus text exposition format
+        static string format();
+
+        // serves GET /metrics on 127.0.0.1:port from a background thread.
+        // a port in use is retried, it may be held by a server being taken over
+        static void serve(int port);
+
+        // lets go of the port for the server that takes over
+        static void stop();
+};
+
+#endif
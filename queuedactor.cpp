@@ -0,0 +1,177 @@
+#include "queuedactor.h"
+#include "metrics.h"
+#include "log.h"
+#include <boost/bind.hpp>
+
+int64_t QueuedActor::queueLimit_ = QueuedActor::DEFAULT_QUEUE_LIMIT;
+
+QueuedActor::QueuedActor(RtmpActorPtr actor, ActorQueuePtr queue):
+    state_(new State()),
+    queue_(queue)
+{
+    state_->actor = actor;
+    state_->failed = false;
+    state_->queued = 0;
+}
+
+// run or dropped with the task
+QueuedActor::Batch::~Batch()
+{
+    state->queued.fetch_sub(bytes);
+    if(state->account)
+    {
+        state->account->release(overhead);
+    }
+}
+
+void QueuedActor::setQueueLimit(int64_t bytes)
+{
+    queueLimit_ = bytes;
+}
+
+QueuedActor::~QueuedActor()
+{
+    queue_->post(boost::bind(&QueuedActor::release, state_));
+}
+
+void QueuedActor::call(StatePtr state, boost::function<bool(RtmpActor*)> fn, const char* name)
+{
+    if(state->failed)
+    {
+        return;
+    }
+
+    try
+    {
+        if(fn(state->actor.get()))
+        {
+            return;
+        }
+
+        RTMP_LOG(LEVERROR, "actor failed on %s\n", name);
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "actor failed on %s: %s\n", name, e.what());
+    }
+
+    Metrics::add(MET_ActorErrors);
+    state->failed = true;
+}
+
+void QueuedActor::disconnect(StatePtr state)
+{
+    try
+    {
+        state->actor->onDisconnect();
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "actor failed on onDisconnect: %s\n", e.what());
+    }
+}
+
+// after every task that came before, on an executor thread
+void QueuedActor::release(StatePtr state)
+{
+    state->actor.reset();
+}
+
+bool QueuedActor::receive(RtmpActor* actor, BatchPtr batch)
+{
+    return actor->onReceiveStreams(&batch->msgs[0], batch->msgs.size());
+}
+
+void QueuedActor::post(boost::function<bool(RtmpActor*)> fn, const char* name)
+{
+    queue_->post(boost::bind(&QueuedActor::call, state_, fn, name));
+}
+
+bool QueuedActor::onConnect(ConnectCmdPtr cmd)
+{
+    post(boost::bind(&RtmpActor::onConnect, _1, cmd), "onConnect");
+    return !state_->failed;
+}
+
+void QueuedActor::onDisconnect()
+{
+    queue_->post(boost::bind(&QueuedActor::disconnect, state_));
+}
+
+bool QueuedActor::onPublish(int streamId, string publishUrl)
+{
+    post(boost::bind(&RtmpActor::onPublish, _1, streamId, publishUrl), "onPublish");
+    return !state_->failed;
+}
+
+bool QueuedActor::onCreateStream(int nextStreamId)
+{
+    post(boost::bind(&RtmpActor::onCreateStream, _1, nextStreamId), "onCreateStream");
+    return !state_->failed;
+}
+
+bool QueuedActor::onMetaData(int streamId, MetaDataMsgPtr metaData)
+{
+    post(boost::bind(&RtmpActor::onMetaData, _1, streamId, metaData), "onMetaData");
+    return !state_->failed;
+}
+
+// a batch of one, so that it is bounded the same way
+bool QueuedActor::onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg)
+{
+    RtmpMediaMsg m;
+    m.streamId = streamId;
+    m.isVideo = isVideo;
+    m.msg = msg;
+
+    return onReceiveStreams(&m, 1);
+}
+
+bool QueuedActor::onReceiveStreams(const RtmpMediaMsg* msgs, int count)
+{
+    if(state_->failed)
+    {
+        return false;
+    }
+
+    int64_t bytes = 0;
+    for(int i = 0; i < count; i++)
+    {
+        bytes += msgs[i].msg->length;
+    }
+
+    int64_t queued = state_->queued.load();
+    if(queueLimit_ > 0 && queued + bytes > queueLimit_)
+    {
+        RTMP_LOG_RATE(LEVERROR, 1, "actor is behind by %lld bytes, close the connection\n", (long long)queued);
+        Metrics::add(MET_ActorErrors);
+        state_->failed = true;
+        return false;
+    }
+
+    BatchPtr batch(new Batch());
+    batch->msgs.assign(msgs, msgs + count);
+    batch->bytes = 0;
+    batch->overhead = 0;
+    batch->state = state_;
+
+    // throws RtmpOutOfMemory, the connection closes then
+    int64_t overhead = sizeof(Batch) + count * sizeof(RtmpMediaMsg);
+    if(state_->account)
+    {
+        state_->account->charge(overhead);
+        batch->overhead = overhead;
+    }
+    state_->queued.fetch_add(bytes);
+    batch->bytes = bytes;
+
+    post(boost::bind(&QueuedActor::receive, _1, batch), "onReceiveStreams");
+    return !state_->failed;
+}
+
+// called before the first callback, nothing runs on the queue yet
+void QueuedActor::setMemAccount(MemAccountPtr account)
+{
+    state_->account = account;
+    state_->actor->setMemAccount(account);
+}
@@ -0,0 +1,81 @@
+#ifndef QUEUED_ACTOR_H
+#define QUEUED_ACTOR_H
+
+#include "rtmpactor.h"
+#include "actorexecutor.h"
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+
+/*
+ * runs the callbacks of another actor on an ActorQueue, away from the
+ * thread that reads the socket, so a slow output open or trailer write
+ * stalls only this stream
+ *
+ * a callback returns true at once. when one fails or throws on the
+ * queue, the callbacks after it return false and the connection closes,
+ * the actor itself only gets onDisconnect then
+ *
+ * media waiting on the queue is bounded, see setQueueLimit(). a stalled
+ * actor no longer pushes back on TCP, past the limit the media callback
+ * fails and the connection closes instead
+ */
+class QueuedActor : public RtmpActor
+{
+    private:
+        // what the tasks share, they may outlive this object
+        struct State
+        {
+            RtmpActorPtr actor;
+            boost::atomic<bool> failed;
+            // media bytes posted and not yet run or dropped
+            boost::atomic<int64_t> queued;
+            MemAccountPtr account;
+        };
+        typedef boost::shared_ptr<State> StatePtr;
+
+        // the media of one call while it waits on the queue. the bodies are
+        // charged by the parser already, the account gets the copy itself
+        struct Batch
+        {
+            StatePtr state;
+            vector<RtmpMediaMsg> msgs;
+            int64_t bytes;
+            int64_t overhead;
+
+            ~Batch();
+        };
+        typedef boost::shared_ptr<Batch> BatchPtr;
+
+        static int64_t queueLimit_;
+
+        StatePtr state_;
+        ActorQueuePtr queue_;
+
+        static void call(StatePtr state, boost::function<bool(RtmpActor*)> fn, const char* name);
+        static void disconnect(StatePtr state);
+        static void release(StatePtr state);
+        static bool receive(RtmpActor* actor, BatchPtr batch);
+
+        void post(boost::function<bool(RtmpActor*)> fn, const char* name);
+
+    public:
+        const static int64_t DEFAULT_QUEUE_LIMIT = 16 * 1024 * 1024;
+
+        QueuedActor(RtmpActorPtr actor, ActorQueuePtr queue);
+        // the actor is freed on the queue too
+        ~QueuedActor();
+
+        bool onConnect(ConnectCmdPtr cmd);
+        void onDisconnect();
+        bool onPublish(int streamId, string publishUrl);
+        bool onCreateStream(int nextStreamId);
+        bool onMetaData(int streamId, MetaDataMsgPtr metaData);
+        bool onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg);
+        bool onReceiveStreams(const RtmpMediaMsg* msgs, int count);
+        void setMemAccount(MemAccountPtr account);
+
+        // media bytes a connection may have waiting on its queue, 0 for no limit
+        static void setQueueLimit(int64_t bytes);
+};
+
+#endif
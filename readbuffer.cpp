@@ -6,7 +6,8 @@
 ReadBuffer::ReadBuffer(int capacity)
 {
     capacity_ = capacity;
-    buffer_ = new uint8_t[capacity];
+    // allocated by the first append when 0
+    buffer_ = capacity > 0 ? new uint8_t[capacity] : NULL;
     cout_ = 0;
     bi_ = 0;
     inSnap_ = false;
@@ -15,19 +16,63 @@ ReadBuffer::ReadBuffer(int capacity)
 
 ReadBuffer::~ReadBuffer()
 {
+    if(account_)
+    {
+        account_->release(capacity_);
+    }
+
     delete[] buffer_;
     capacity_ = 0;
     cout_ = 0;
     bi_ = 0;
 }
 
+void ReadBuffer::setMemAccount(MemAccountPtr account)
+{
+    if(account)
+    {
+        account->charge(capacity_);
+    }
+
+    if(account_)
+    {
+        account_->release(capacity_);
+    }
+
+    account_ = account;
+}
+
+int ReadBuffer::getCapacity()
+{
+    return capacity_;
+}
+
 void ReadBuffer::reset()
 {
     cout_ = 0;
     bi_ = 0;
 }
 
-void ReadBuffer::appendData(uint8_t* data, int size)
+void ReadBuffer::release()
+{
+    if(inSnap_ || cout_ != bi_ || buffer_ == NULL)
+    {
+        return;
+    }
+
+    if(account_)
+    {
+        account_->release(capacity_);
+    }
+
+    delete[] buffer_;
+    buffer_ = NULL;
+    capacity_ = 0;
+    cout_ = 0;
+    bi_ = 0;
+}
+
+void ReadBuffer::appendData(const uint8_t* data, int size)
 {
     if(inSnap_)
     {
@@ -35,13 +80,14 @@ void ReadBuffer::appendData(uint8_t* data, int size)
     }
 
     bool realloc = false;
-    while((cout_ + size) > capacity_)
+    int newCapacity = capacity_;
+    while((cout_ + size) > newCapacity)
     {
         realloc = true;
 
-        if((cout_ - bi_ + size) > capacity_)
+        if((cout_ - bi_ + size) > newCapacity)
         {
-            capacity_ *= 2;
+            newCapacity = newCapacity > 0 ? newCapacity * 2 : size;
         }
         else
         {
@@ -51,6 +97,14 @@ void ReadBuffer::appendData(uint8_t* data, int size)
 
     if(realloc)
     {
+        if(account_ && newCapacity != capacity_)
+        {
+            // may throw, nothing is changed yet
+            account_->charge(newCapacity);
+            account_->release(capacity_);
+        }
+        capacity_ = newCapacity;
+
         uint8_t* new_buf = new uint8_t[capacity_];
         memset(new_buf, 0, capacity_);
 
@@ -166,3 +220,11 @@ void ReadBuffer::snapClear()
 {
     inSnap_ = false;
 }
+
+void ReadBuffer::snapCommit()
+{
+    if(inSnap_)
+    {
+        snapBi_ = bi_;
+    }
+}
@@ -2,6 +2,7 @@
 #define READ_BUFFER_H
 
 #include "rtmpexception.h"
+#include "memaccount.h"
 #include <stdint.h>
 #include <boost/shared_ptr.hpp>
 
@@ -16,6 +17,8 @@ class ReadBuffer
         bool inSnap_;
         int snapBi_;
 
+        MemAccountPtr account_;
+
     public:
         enum Mode
         {
@@ -36,7 +39,11 @@ class ReadBuffer
         ReadBuffer(int capacity);
         ~ReadBuffer();
 
-        void appendData(uint8_t* data, int size);
+        // charge the allocated capacity to account from now on
+        void setMemAccount(MemAccountPtr account);
+        int getCapacity();
+
+        void appendData(const uint8_t* data, int size);
 
         uint8_t readByte();
         uint8_t* readBytes(int size);
@@ -54,9 +61,26 @@ class ReadBuffer
         template <class T>
         static T read(uint8_t* data, int size, ReadBuffer::Mode mode)
         {
-            boost::shared_ptr<ReadBuffer> rp(new ReadBuffer(size));
-            rp->appendData(data, size);
-            return rp->read<T>(mode);
+            int bytes = sizeof(T);
+            if(size < bytes)
+            {
+                throw RtmpNoEnoughData();
+            }
+
+            T v = 0;
+            for(int i = 0; i < bytes; i++)
+            {
+                if(mode == ReadBuffer::BIG)
+                {
+                    v |= (T)data[i] << (8 * (bytes - i - 1));
+                }
+                else
+                {
+                    v |= (T)data[i] << (8 * i);
+                }
+            }
+
+            return v;
         }
 
         template <class T>
@@ -143,8 +167,12 @@ class ReadBuffer
         void snapStop();
         // clear snap
         void snapClear();
+        // keep what was read so far when the snap is stopped
+        void snapCommit();
 
         void reset();
+        // frees the storage if everything is read, the next append allocates it again
+        void release();
 };
 
 typedef boost::shared_ptr<ReadBuffer> ReadBufferPtr;
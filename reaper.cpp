@@ -0,0 +1,78 @@
+#include "reaper.h"
+#include "rtmpexception.h"
+#include "log.h"
+#include <deque>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace
+{
+
+// never freed, threads may post after main returns
+boost::once_flag initFlag = BOOST_ONCE_INIT;
+boost::mutex* mt;
+boost::condition_variable* cv;
+deque< boost::function<void()> >* tasks;
+
+void run()
+{
+    while(true)
+    {
+        boost::function<void()> task;
+        {
+            boost::unique_lock<boost::mutex> lk(*mt);
+            while(tasks->empty())
+            {
+                cv->wait(lk);
+            }
+
+            task.swap(tasks->front());
+        }
+
+        try
+        {
+            task();
+        }
+        catch(RtmpException& e)
+        {
+            RTMP_LOG(LEVERROR, "reaper task failed: %s\n", e.what());
+        }
+
+        // what the task holds is freed here too, then it counts as done
+        task.clear();
+
+        boost::lock_guard<boost::mutex> lk(*mt);
+        tasks->pop_front();
+    }
+}
+
+void init()
+{
+    mt = new boost::mutex();
+    cv = new boost::condition_variable();
+    tasks = new deque< boost::function<void()> >();
+
+    boost::thread(run).detach();
+}
+
+}
+
+void Reaper::post(const boost::function<void()>& fn)
+{
+    boost::call_once(initFlag, init);
+
+    {
+        boost::lock_guard<boost::mutex> lk(*mt);
+        tasks->push_back(fn);
+    }
+    cv->notify_one();
+}
+
+int Reaper::getPending()
+{
+    boost::call_once(initFlag, init);
+
+    boost::lock_guard<boost::mutex> lk(*mt);
+    return tasks->size();
+}
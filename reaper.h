@@ -0,0 +1,20 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <boost/function.hpp>
+
+/*
+ * a background thread for the end of things that nobody should wait
+ * for: joining threads that are done and freeing what they used
+ */
+class Reaper
+{
+    public:
+        // fn runs on the reaper thread, in the order it was posted
+        static void post(const boost::function<void()>& fn);
+
+        // tasks posted and not yet run
+        static int getPending();
+};
+
+#endif
@@ -2,11 +2,20 @@
 #define RTMP_ACTOR_H
 
 #include "rtmpmsg.h"
+#include "memaccount.h"
 #include <boost/shared_ptr.hpp>
 #include <string>
 
 using namespace std;
 
+// an audio or video message handed to the actor
+struct RtmpMediaMsg
+{
+    int streamId;
+    bool isVideo;
+    RtmpMsgHeaderPtr msg;
+};
+
 class RtmpActor
 {
     public:
@@ -19,6 +28,24 @@ class RtmpActor
 
     virtual bool onMetaData(int streamId, MetaDataMsgPtr metaData) = 0;
     virtual bool onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg) = 0;
+
+    // the audio and video messages of one socket read, in order. actors
+    // that lock or queue per message can do it once per batch instead
+    virtual bool onReceiveStreams(const RtmpMediaMsg* msgs, int count)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(!onReceiveStream(msgs[i].streamId, msgs[i].isVideo, msgs[i].msg))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // buffers the actor keeps for the connection can be charged to account
+    virtual void setMemAccount(MemAccountPtr) {}
 };
 
 typedef boost::shared_ptr<RtmpActor> RtmpActorPtr;
@@ -1,21 +1,47 @@
 #include "rtmpconnection.h"
 #include "log.h"
 #include "utility.h"
+#include "trace.h"
 #include <iostream>
 #include <boost/bind.hpp>
 #include <string>
+#include <poll.h>
+#include <errno.h>
+#include <netinet/tcp.h>
 
 using namespace std;
 
+int RtmpConnection::announcedChunkSize_ = 1024;
+int RtmpConnection::maxChunkSize_ = 65536;
+int RtmpConnection::announcedWindowAckSize_ = 2500000;
+bool RtmpConnection::lowFootprint_ = false;
+int RtmpConnection::handshakeTimeout_ = 10000;
+int RtmpConnection::idleTimeout_ = 60000;
+int RtmpConnection::pingInterval_ = 30000;
+int RtmpConnection::ackInterval_ = 1000;
+
 RtmpConnection::RtmpConnection(int sockfd, struct sockaddr_in clientAddr, RtmpActorPtr actor):
+    account_(new MemAccount()),
     sockfd_(sockfd), clientAddr_(clientAddr), isDisconnected_(false), c1_handled(false), chunkSize_(128), 
-    windowAckSize_(-1), outChunkSize_(128), streamIndex_(1), rb_(RtmpConnection::READ_BUFFER_INIT_SIZE),
-    wb_(WRITE_BUFFER_INIT_SIZE), 
-    amf0s_(&wb_),
-    s1Timestamp_(0),
-    s1Randomdata_(NULL),
+    windowAckSize_(-1), outChunkSize_(128), streamIndex_(1),
+    rb_(lowFootprint_ ? 0 : RtmpConnection::READ_BUFFER_INIT_SIZE),
+    wb_(lowFootprint_ ? 0 : RtmpConnection::WRITE_BUFFER_INIT_SIZE),
+    amf0s_(&wb_), cw_(&wb_),
     bytesReceived_(0),
     ackBytes_(0),
+    chunksCounted_(0),
+    recvTime_(0),
+    capture_(WireCapture::create(clientAddr)),
+    deferredSend_(false),
+    cork_(false),
+    corked_(false),
+    wheel_(NULL),
+    handshakeDeadline_(0),
+    nextPing_(0),
+    nextAck_(0),
+    pingSent_(0),
+    rtt_(-1),
+    publishStreamId_(-1),
     rcs_state_(RCS_Uninitialized),
     hss_state_(HSS_Uninitialized),
     nes_state_(NES_NoState),
@@ -24,107 +50,715 @@ RtmpConnection::RtmpConnection(int sockfd, struct sockaddr_in clientAddr, RtmpAc
     isConnected_(false) 
 {
     // the default chunk size is 128
+    timer_.setCallback(boost::bind(&RtmpConnection::onTimer, this));
+
+    try
+    {
+        // the connection object itself, the buffers are charged by themselves
+        account_->charge(sizeof(RtmpConnection));
+        rb_.setMemAccount(account_);
+        wb_.setMemAccount(account_);
+        parser_.setMemAccount(account_);
+    }
+    catch(RtmpOutOfMemory& e)
+    {
+        // destructor will not run
+        close(sockfd_);
+        throw;
+    }
+
+    if(actor_)
+    {
+        actor_->setMemAccount(account_);
+    }
+
+    // a quiet client would not read again to see it was evicted
+    if(sockfd_ != -1)
+    {
+        account_->setOnEvict(boost::bind(&RtmpConnection::shutdownSocket, sockfd_));
+    }
+
+    Metrics::add(MET_Connections);
+    RTMP_TRACE4(conn_open, this, sockfd_, clientAddr_.sin_addr.s_addr, ntohs(clientAddr_.sin_port));
 }
 
 RtmpConnection::~RtmpConnection()
 {
-    if(s1Randomdata_)
+    RTMP_TRACE2(conn_close, this, bytesReceived_);
+    Metrics::sub(MET_Connections);
+    account_->release(sizeof(RtmpConnection));
+
+    closeSocket();
+}
+
+void RtmpConnection::shutdownSocket(int sockfd)
+{
+    // the thread or ring that reads it sees the end and disconnects
+    shutdown(sockfd, SHUT_RDWR);
+}
+
+void RtmpConnection::closeSocket()
+{
+    if(sockfd_ == -1)
     {
-        delete[] s1Randomdata_;
+        return;
     }
 
-    if(sockfd_ != -1)
+    // the account may outlive the connection, the descriptor may be reused
+    account_->setOnEvict(boost::function<void()>());
+    close(sockfd_);
+    sockfd_ = -1;
+}
+
+MemAccountPtr RtmpConnection::getMemAccount()
+{
+    return account_;
+}
+
+void RtmpConnection::handleClient(int drainFd, const HandoffFn& handoff, int stopFd)
+{
+    // on the stack of the client thread, not in every connection
+    uint8_t buffer[RtmpConnection::BUFFER_SIZE];
+    // the thread waits in poll() until data comes or a timer is due
+    TimerWheel wheel(RtmpConnection::TIMER_TICK_MILLIS, Utility::getMonotonicMicros());
+    setTimerWheel(&wheel, boost::function<void()>());
+
+    // poll() skips the descriptors that are -1
+    struct pollfd pfds[3];
+    pfds[0].fd = sockfd_;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = drainFd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = stopFd;
+    pfds[2].events = POLLIN;
+    bool draining = false;
+
+    while(!isDisconnected_)
     {
-        close(sockfd_);
-        sockfd_ = -1;
+        pfds[0].revents = 0;
+        pfds[1].revents = 0;
+        pfds[2].revents = 0;
+
+        int ready = poll(pfds, 3, (int)wheel.getNextDelay(Utility::getMonotonicMicros()));
+        if(ready == -1 && errno != EINTR)
+        {
+            RTMP_LOG(LEVERROR, "poll client socket failed: %s\n", strerror(errno));
+            disconnect();
+            break;
+        }
+
+        wheel.advance(Utility::getMonotonicMicros());
+
+        if(pfds[0].revents && !isDisconnected_)
+        {
+            int bytesReceived = recv(sockfd_, buffer, RtmpConnection::BUFFER_SIZE, 0);
+
+            onReceive(buffer, bytesReceived);
+        }
+
+        uncork();
+
+        // the drain stays readable, a connection that can not move yet tries after every read
+        if(pfds[1].revents)
+        {
+            draining = true;
+            pfds[1].fd = -1;
+        }
+
+        if(pfds[2].revents)
+        {
+            RTMP_LOG(LEVWARN, "connection could not be handed off in time\n");
+            disconnect();
+            break;
+        }
+
+        if(draining && handoff && handOff(handoff))
+        {
+            break;
+        }
     }
+
+    setTimerWheel(NULL, boost::function<void()>());
 }
 
-void RtmpConnection::handleClient()
+void RtmpConnection::onReceive(const uint8_t* data, int size)
 {
-    int bytesReceived;
+    if(account_->isEvicted())
+    {
+        RTMP_LOG(LEVWARN, "connection is evicted, it holds %lld bytes\n", (long long)account_->getUsed());
+        disconnect();
+        return;
+    }
+
+    // Error or client close
+    if(size <= 0)
+    {
+        disconnect();
+        return;
+    }
+
+    if(capture_)
+    {
+        capture_->write(data, size);
+    }
+
+    recvTime_ = Utility::getMonotonicMicros();
+    handleRead(data, size); 
+
+    if(lowFootprint_)
+    {
+        compact();
+    }
+}
+
+void RtmpConnection::feed(const uint8_t* data, int size)
+{
+    while(size > 0 && !isDisconnected_)
+    {
+        int n = size < RtmpConnection::BUFFER_SIZE ? size : RtmpConnection::BUFFER_SIZE;
+
+        recvTime_ = Utility::getMonotonicMicros();
+        handleRead(data, n);
+
+        data += n;
+        size -= n;
+    }
+
+    if(lowFootprint_)
+    {
+        compact();
+    }
+}
+
+void RtmpConnection::setTimerWheel(TimerWheel* wheel, const boost::function<void()>& onTimer)
+{
+    timer_.cancel();
+    wheel_ = wheel;
+    onTimer_ = onTimer;
+
+    if(!wheel_)
+    {
+        return;
+    }
+
+    int64_t now = Utility::getMonotonicMicros();
+    // no data yet, the idle time counts from here
+    if(recvTime_ == 0)
+    {
+        recvTime_ = now;
+    }
+
+    if(!isConnected_ && handshakeTimeout_ > 0)
+    {
+        handshakeDeadline_ = now + handshakeTimeout_ * 1000LL;
+    }
+
+    armTimer(now);
+}
+
+int64_t RtmpConnection::getRtt()
+{
+    return rtt_;
+}
+
+void RtmpConnection::armTimer(int64_t now)
+{
+    if(!wheel_ || isDisconnected_)
+    {
+        timer_.cancel();
+        return;
+    }
+
+    int64_t deadlines[4] = {handshakeDeadline_, nextPing_, nextAck_, 0};
+    if(idleTimeout_ > 0)
+    {
+        deadlines[3] = recvTime_ + idleTimeout_ * 1000LL;
+    }
+
+    int64_t at = 0;
+    for(int i = 0; i < 4; i++)
+    {
+        if(deadlines[i] != 0 && (at == 0 || deadlines[i] < at))
+        {
+            at = deadlines[i];
+        }
+    }
 
-    while(true)
+    if(at == 0)
     {
-        bytesReceived = recv(sockfd_, buffer_, RtmpConnection::BUFFER_SIZE, 0);
+        timer_.cancel();
+        return;
+    }
+
+    wheel_->schedule(&timer_, at > now ? (at - now + 999) / 1000 : 0);
+}
 
-        // Error or client close
-        if(bytesReceived <= 0)
+// the idle deadline moves with every read, it is only checked when the timer runs
+void RtmpConnection::onTimer()
+{
+    if(isDisconnected_)
+    {
+        return;
+    }
+
+    int64_t now = Utility::getMonotonicMicros();
+
+    try
+    {
+        if(handshakeDeadline_ != 0 && now >= handshakeDeadline_)
+        {
+            RTMP_LOG(LEVWARN, "client did not connect in %d ms\n", handshakeTimeout_);
+            Metrics::add(MET_TimeoutHandshake);
+            disconnect();
+        }
+        else if(idleTimeout_ > 0 && now >= recvTime_ + idleTimeout_ * 1000LL)
         {
-            //RTMP_LOG("ASIO read error, %d\n", error);
+            RTMP_LOG(LEVWARN, "client sent nothing in %d ms\n", idleTimeout_);
+            Metrics::add(MET_TimeoutIdle);
             disconnect();
-            return;
         }
+        else
+        {
+            if(nextPing_ != 0 && now >= nextPing_)
+            {
+                sendPingRequest(now);
+                nextPing_ = now + pingInterval_ * 1000LL;
+            }
+
+            if(nextAck_ != 0 && now >= nextAck_)
+            {
+                if(windowAckSize_ != -1 && bytesReceived_ != ackBytes_)
+                {
+                    sendAcknowledgement(bytesReceived_);
+                    ackBytes_ = bytesReceived_;
+                }
+                nextAck_ = now + ackInterval_ * 1000LL;
+            }
+        }
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "timer of the client failed: %s\n", e.what());
+        disconnect();
+    }
 
-        handleRead(bytesReceived); 
+    armTimer(now);
+
+    if(lowFootprint_)
+    {
+        compact();
+    }
+
+    if(onTimer_)
+    {
+        onTimer_();
     }
 }
 
-void RtmpConnection::handleRead(int bytes_transferred)
+namespace
 {
-    RTMP_LOG(LEVDEBUG, "RtmpConnection::handleRead, bytes_transferred: %d\n", bytes_transferred); 
 
-    bytesReceived_ += bytes_transferred;
+void writeMessage(StateWriter& w, const RtmpMsgHeaderPtr& mh)
+{
+    w.writeU32(mh ? 1 : 0);
+    if(mh)
+    {
+        w.writeU32(mh->chunkStreamId);
+        w.writeU32(mh->typeId);
+        w.writeU32(mh->streamId);
+        w.writeI64(mh->timestamp);
+        w.writeBytes(mh->body, mh->length);
+    }
+}
+
+RtmpMsgHeaderPtr readMessage(StateReader& r, const MemAccountPtr& account)
+{
+    RtmpMsgHeaderPtr mh;
+    if(r.readU32() == 0)
+    {
+        return mh;
+    }
+
+    mh.reset(new RtmpMsgHeader());
+    mh->chunkStreamId = r.readU32();
+    mh->typeId = r.readU32();
+    mh->streamId = r.readU32();
+    mh->timestamp = r.readI64();
+
+    int size;
+    const uint8_t* body = r.readBytes(size);
+    mh->length = size;
+    mh->unParsedSize = size;
+    mh->allocBody(size, account);
+    mh->appendData(body, size);
+
+    return mh;
+}
+
+}
 
-    if(bytesReceived_ < ackBytes_)
+bool RtmpConnection::isSuspendable()
+{
+    return !isDisconnected_ && isConnected_ && rcs_state_ == RCS_Normal_Exchange
+        && output_.empty() && media_.empty();
+}
+
+bool RtmpConnection::suspend(vector<uint8_t>& state)
+{
+    if(!isSuspendable())
     {
-        bytesReceived_ += 0xffffffff - (int64_t)ackBytes_;
-        ackBytes_ = 0;
+        return false;
     }
 
-    if(windowAckSize_ != -1 && (bytesReceived_ - ackBytes_) >= windowAckSize_ / 2)
+    StateWriter w(state);
+    w.writeU32(STATE_VERSION);
+    w.writeU32(chunkSize_);
+    w.writeU32(windowAckSize_);
+    w.writeU32(outChunkSize_);
+    w.writeU32(streamIndex_);
+    w.writeU32(bytesReceived_);
+    w.writeU32(ackBytes_);
+    w.writeU32(cs_state_);
+
+    w.writeString(ccp_->app);
+    w.writeString(ccp_->flashver);
+    w.writeString(ccp_->swfUrl);
+    w.writeString(ccp_->tcUrl);
+    w.writeString(ccp_->type);
+    w.writeString(ccp_->pageUrl);
+    w.writeU32(ccp_->fpad);
+    w.writeU32(ccp_->audioCodecs);
+    w.writeU32(ccp_->videoCodecs);
+    w.writeU32(ccp_->objectEncoding);
+
+    w.writeU32(publishStreamId_);
+    w.writeString(publishName_);
+    writeMessage(w, metaDataMsg_);
+    writeMessage(w, videoConfig_);
+    writeMessage(w, audioConfig_);
+
+    // a chunk that is not all here yet, and the messages it belongs to
+    parser_.saveState(w);
+    w.writeBytes(rb_.getUnReadBufferNoCopy(), rb_.getUnReadSize());
+
+    return true;
+}
+
+bool RtmpConnection::handOff(const HandoffFn& handoff)
+{
+    vector<uint8_t> state;
+    if(!suspend(state) || !handoff(sockfd_, state))
     {
-        sendAcknowledgement(bytesReceived_);
-        ackBytes_ += windowAckSize_ / 2;
-    } 
+        return false;
+    }
+
+    RTMP_LOG(LEVINFO, "connection handed off with %d bytes of state\n", (int)state.size());
+    Metrics::add(MET_HandoffOut);
+
+    // the other process has its own descriptor of the socket
+    closeSocket();
+    disconnect();
+
+    return true;
+}
+
+void RtmpConnection::resume(const vector<uint8_t>& state)
+{
+    StateReader r(state.empty() ? NULL : &state[0], state.size());
+    if(r.readU32() != STATE_VERSION)
+    {
+        throw RtmpBadProtocalData("unknown connection state version");
+    }
+
+    chunkSize_ = r.readU32();
+    windowAckSize_ = r.readU32();
+    outChunkSize_ = r.readU32();
+    streamIndex_ = r.readU32();
+    bytesReceived_ = r.readU32();
+    ackBytes_ = r.readU32();
+    cs_state_ = (ConnectState)r.readU32();
+
+    ccp_.reset(new ConnectCmd());
+    ccp_->app = r.readString();
+    ccp_->flashver = r.readString();
+    ccp_->swfUrl = r.readString();
+    ccp_->tcUrl = r.readString();
+    ccp_->type = r.readString();
+    ccp_->pageUrl = r.readString();
+    ccp_->fpad = r.readU32() != 0;
+    ccp_->audioCodecs = (AudioCodecConst)r.readU32();
+    ccp_->videoCodecs = (VideoCodecConst)r.readU32();
+    ccp_->objectEncoding = (ObjectEncodingConst)r.readU32();
+
+    publishStreamId_ = r.readU32();
+    publishName_ = r.readString();
+    RtmpMsgHeaderPtr metaDataMsg = readMessage(r, account_);
+    RtmpMsgHeaderPtr videoConfig = readMessage(r, account_);
+    RtmpMsgHeaderPtr audioConfig = readMessage(r, account_);
+
+    parser_.loadState(r);
+    int size;
+    const uint8_t* unread = r.readBytes(size);
+    if(size > 0)
+    {
+        rb_.appendData(unread, size);
+    }
+
+    if(chunkSize_ < 1 || outChunkSize_ < 128 || streamIndex_ < 1)
+    {
+        throw RtmpBadProtocalData("bad sizes in connection state");
+    }
+
+    c1_handled = true;
+    hss_state_ = HSS_HandshakeDone;
+    rcs_state_ = RCS_Normal_Exchange;
+    isConnected_ = true;
+
+    // the actor of this process starts where the one of the old process was
+    if(!actor_->onConnect(ccp_))
+    {
+        throw RtmpInternalError("actor do not allow to connect");
+    }
+
+    for(int id = 1; id < streamIndex_; id++)
+    {
+        if(!actor_->onCreateStream(id))
+        {
+            throw RtmpInternalError("actor onCreateStream failed");
+        }
+    }
+
+    if(publishStreamId_ != -1 && !actor_->onPublish(publishStreamId_, publishName_))
+    {
+        throw RtmpInternalError("error on publish");
+    }
+
+    if(metaDataMsg)
+    {
+        onReadAMF0DataSetDataFrame(metaDataMsg);
+    }
+    if(videoConfig)
+    {
+        onMedia(videoConfig, true);
+    }
+    if(audioConfig)
+    {
+        onMedia(audioConfig, false);
+    }
+    deliverMedia();
+
+    int64_t now = Utility::getMonotonicMicros();
+    handshakeDeadline_ = 0;
+    nextPing_ = pingInterval_ > 0 ? now + pingInterval_ * 1000LL : 0;
+    nextAck_ = ackInterval_ > 0 ? now + ackInterval_ * 1000LL : 0;
+    armTimer(now);
+
+    RTMP_LOG(LEVINFO, "connection resumed, app %s stream %s\n", ccp_->app.c_str(), publishName_.c_str());
+    Metrics::add(MET_HandoffIn);
+}
+
+bool RtmpConnection::isDisconnected()
+{
+    return isDisconnected_;
+}
+
+void RtmpConnection::setDeferredSend(bool deferred)
+{
+    deferredSend_ = deferred;
+}
+
+void RtmpConnection::setCork(bool cork)
+{
+    cork_ = cork;
+}
+
+void RtmpConnection::uncork()
+{
+    if(!corked_)
+    {
+        return;
+    }
+
+    corked_ = false;
+    int off = 0;
+    if(!isDisconnected_ && setsockopt(sockfd_, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) == -1)
+    {
+        RTMP_LOG(LEVERROR, "uncork client socket failed: %s\n", strerror(errno));
+        disconnect();
+    }
+}
+
+bool RtmpConnection::takeOutput(vector<uint8_t>& out)
+{
+    if(output_.empty())
+    {
+        return false;
+    }
+
+    if(out.empty())
+    {
+        out.swap(output_);
+    }
+    else
+    {
+        out.insert(out.end(), output_.begin(), output_.end());
+    }
+    output_.clear();
+
+    return true;
+}
+
+void RtmpConnection::setChunkSizes(int chunkSize, int maxChunkSize)
+{
+    // a message length has 24 bits, a bigger chunk would never be filled
+    if(chunkSize < 128 || maxChunkSize < chunkSize || maxChunkSize > 0xffffff)
+    {
+        throw RtmpInternalError("bad chunk size");
+    }
+
+    announcedChunkSize_ = chunkSize;
+    maxChunkSize_ = maxChunkSize;
+}
+
+void RtmpConnection::setWindowAckSize(int size)
+{
+    if(size <= 0)
+    {
+        throw RtmpInternalError("bad window acknowledgement size");
+    }
+
+    announcedWindowAckSize_ = size;
+}
+
+void RtmpConnection::setTimeouts(int handshakeMillis, int idleMillis)
+{
+    if(handshakeMillis < 0 || idleMillis < 0)
+    {
+        throw RtmpInternalError("bad timeout");
+    }
 
-    rb_.appendData(buffer_, bytes_transferred);
+    handshakeTimeout_ = handshakeMillis;
+    idleTimeout_ = idleMillis;
+}
+
+void RtmpConnection::setPingInterval(int millis)
+{
+    if(millis < 0)
+    {
+        throw RtmpInternalError("bad ping interval");
+    }
+
+    pingInterval_ = millis;
+}
+
+void RtmpConnection::setAckInterval(int millis)
+{
+    if(millis < 0)
+    {
+        throw RtmpInternalError("bad acknowledgement interval");
+    }
+
+    ackInterval_ = millis;
+}
+
+void RtmpConnection::setLowFootprint(bool lowFootprint)
+{
+    lowFootprint_ = lowFootprint;
+}
+
+bool RtmpConnection::isLowFootprint()
+{
+    return lowFootprint_;
+}
+
+// a part of a chunk keeps the read buffer, queued replies keep output_
+void RtmpConnection::compact()
+{
+    rb_.release();
+    wb_.release();
+
+    if(output_.empty())
+    {
+        vector<uint8_t>().swap(output_);
+    }
+
+    vector<RtmpMediaMsg>().swap(media_);
+}
+
+void RtmpConnection::handleRead(const uint8_t* data, int bytes_transferred)
+{
+    RTMP_LOG_RATE(LEVDEBUG, 10, "RtmpConnection::handleRead, bytes_transferred: %d\n", bytes_transferred); 
+
+    Metrics::add(MET_BytesReceived, bytes_transferred);
+    // wraps at 4 GB like the sequence number of an acknowledgement, see onTimer()
+    bytesReceived_ += bytes_transferred;
 
     try{
+        rb_.appendData(data, bytes_transferred);
+
+
         while(rb_.getUnReadSize() > 0)
         {
             rb_.snapStart();
-            parser_.saveContext();
 
-            nextMove();
+            bool moved = false;
+            try
+            {
+                moved = nextMove();
+            }
+            catch(RtmpNoEnoughData& ne)
+            {
+                RTMP_LOG_RATE(LEVDEBUG, 10, "No enough data\n");
+                // no enough data can be caused by buffer limit
+                Metrics::add(MET_ParserRestarts);
+            }
+
+            if(!moved)
+            {
+                rb_.snapStop();
+                break;
+            }
 
             rb_.snapClear();
         }
+
+        deliverMedia();
     }
     catch(RtmpBadProtocalData& e)
     {
         RTMP_LOG(LEVERROR, "Decode rtmp protocol error: %s\n", e.what());
+        Metrics::add(MET_ErrorProtocol);
         disconnect();
         return;
     }
     catch(RtmpNotSupported& se)
     {
         RTMP_LOG(LEVDEBUG, "Not supported: %s\n", se.what());
+        Metrics::add(MET_ErrorUnsupported);
         disconnect();
         return;
     }
     catch(RtmpBadState& bse)
     {
         RTMP_LOG(LEVERROR, "Bad state: %s\n", bse.what());
+        Metrics::add(MET_ErrorState);
         disconnect();
         return;
     }
     catch(RtmpInternalError& re)
     {
         RTMP_LOG(LEVERROR, "Internal Error: %s\n", re.what());
+        Metrics::add(MET_ErrorInternal);
         disconnect();
         return;
     }
-    catch(RtmpNoEnoughData& ne)
-    {
-        RTMP_LOG(LEVDEBUG, "No enough data\n");
-        // no enough data can be caused by buffer limit
-        rb_.snapStop();
-        parser_.restoreContext(); 
-    }
+
+    uint64_t chunks = parser_.getChunkCount();
+    Metrics::add(MET_ChunksReceived, chunks - chunksCounted_);
+    chunksCounted_ = chunks;
 }
 
-void RtmpConnection::nextMove()
+bool RtmpConnection::nextMove()
 {
     switch(rcs_state_)
     {
@@ -133,18 +767,25 @@ void RtmpConnection::nextMove()
             handshake();
             break;
         case RCS_Normal_Exchange:
-            normalExchange();
-            break;
+            return normalExchange();
         case RCS_Closed:
-            return;
+            break;
     }
+
+    return true;
 }
 
-void RtmpConnection::normalExchange()
+bool RtmpConnection::normalExchange()
 {
     RtmpMsgHeaderPtr mh = parser_.parseMsgHeader(chunkSize_);
+    if(!mh)
+    {
+        Metrics::add(MET_ParserRestarts);
+        return false;
+    }
 
     normalExchange(mh);
+    return true;
 }
 
 void RtmpConnection::handshake()
@@ -183,59 +824,59 @@ void RtmpConnection::handleC0()
         throw RtmpBadProtocalData("bad version, not 3");
     }
 
-    wb_.reInit();
-    wb_.writeByte(version);
-    //S0 sent
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
-
-    wb_.reInit();
-    s1Timestamp_ = 0;
-    wb_.writeB(s1Timestamp_); // time
-    wb_.writeB((uint32_t)0); // zero
-
-    s1Randomdata_ = new uint8_t[RtmpConnection::RANDOM_DATA_SIZE];
+    // S0, S1 and, when C1 came with C0, S2 go out in one write
+    uint8_t reply[1 + 2 * RtmpConnection::HANDSHAKE_SIZE];
+    int replySize = 1 + RtmpConnection::HANDSHAKE_SIZE;
 
-    //S1 sent
-    wb_.writeBytes(s1Randomdata_, RtmpConnection::RANDOM_DATA_SIZE);
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
-    hss_state_ = HSS_VersionSent;
+    // S1 time and zero are 0, the random data is not checked by clients
+    reply[0] = version;
+    memset(reply + 1, 0, RtmpConnection::HANDSHAKE_SIZE);
 
-    RTMP_LOG(LEVDEBUG, "Handshake S1 sent\n");
-
-    // after that, try handleC1
-    if(rb_.getUnReadSize() > 4 + 4 + RtmpConnection::RANDOM_DATA_SIZE)
+    if(rb_.getUnReadSize() >= RtmpConnection::HANDSHAKE_SIZE)
+    {
+        readC1(reply + replySize);
+        replySize += RtmpConnection::HANDSHAKE_SIZE;
+        hss_state_ = HSS_AckSent;
+    }
+    else
     {
-        handleC1();
-        hss_state_ = HSS_VersionSent_C1_Read;
+        hss_state_ = HSS_VersionSent;
     }
+
+    writeData(reply, replySize, false);
+    RTMP_TRACE2(handshake, this, hss_state_);
+
+    RTMP_LOG(LEVDEBUG, "Handshake S0 S1 sent, S2 %s\n", hss_state_ == HSS_AckSent ? "sent" : "waits for C1");
 }
 
 void RtmpConnection::handleC1()
 {
     RTMP_LOG(LEVDEBUG, "RtmpConnection::handleC1\n");
-    uint32_t timestamp = rb_.read<uint32_t>(ReadBuffer::BIG); 
-    rb_.read<uint32_t>(ReadBuffer::BIG); // ZERO
-    uint8_t* randomData = rb_.readBytes(RtmpConnection::RANDOM_DATA_SIZE);
+    uint8_t s2[RtmpConnection::HANDSHAKE_SIZE];
 
-    wb_.reInit();
-    wb_.writeB(timestamp);
-    wb_.writeB(Utility::getTimestamp());
-    wb_.writeBytes(randomData, RtmpConnection::RANDOM_DATA_SIZE);
-    
-    // S2 sent
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
+    readC1(s2);
+    writeData(s2, RtmpConnection::HANDSHAKE_SIZE, false);
 
     hss_state_ = HSS_AckSent;
+    RTMP_TRACE2(handshake, this, hss_state_);
 
     RTMP_LOG(LEVDEBUG, "Handshake S2 sent\n");
+}
+
+// S2 echoes C1 with time2 set to now, throws RtmpNoEnoughData before touching s2
+void RtmpConnection::readC1(uint8_t* s2)
+{
+    uint8_t* c1 = rb_.getUnReadBufferNoCopy();
+    rb_.skip(RtmpConnection::HANDSHAKE_SIZE);
 
-    delete[] randomData;
+    uint32_t now = Utility::getTimestamp();
 
-    // after that, try handleC1
-    if(rb_.getUnReadSize() > 4 + 4 + RtmpConnection::RANDOM_DATA_SIZE)
-    {
-        handleC2();
-    }
+    memcpy(s2, c1, 4);
+    s2[4] = now >> 24;
+    s2[5] = now >> 16;
+    s2[6] = now >> 8;
+    s2[7] = now;
+    memcpy(s2 + 8, c1 + 8, RtmpConnection::RANDOM_DATA_SIZE);
 }
 
 void RtmpConnection::onReadConnect(RtmpMsgHeaderPtr& mh)
@@ -249,21 +890,28 @@ void RtmpConnection::onReadConnect(RtmpMsgHeaderPtr& mh)
     ccp_ = parser_.parseConnectCmd(mh);
     if(actor_)
     {
-        if(!actor_->onConnect(ccp_))
+        RTMP_TRACE2(actor_enter, this, "onConnect");
+        bool allowed = actor_->onConnect(ccp_);
+        RTMP_TRACE3(actor_return, this, "onConnect", allowed);
+        if(!allowed)
         {
             throw RtmpInternalError("actor do not allow to connect");
         }
     }
 
-    sentWndAckSize(2500000);
-    sentSetPeerBandwidth(2500000, RLT_Dynamic);
-    outChunkSize_ = 1024;
+    sentWndAckSize(announcedWindowAckSize_);
+    sentSetPeerBandwidth(announcedWindowAckSize_, RLT_Dynamic);
+    outChunkSize_ = announcedChunkSize_;
     sentChunkSize(outChunkSize_);
     sentNetConnectConnectSuccess();
 
     isConnected_ = true;
 
-    actor_->onConnect(ccp_);
+    int64_t now = Utility::getMonotonicMicros();
+    handshakeDeadline_ = 0;
+    nextPing_ = pingInterval_ > 0 ? now + pingInterval_ * 1000LL : 0;
+    nextAck_ = ackInterval_ > 0 ? now + ackInterval_ * 1000LL : 0;
+    armTimer(now);
 }
 
 void RtmpConnection::onReadWndAckSize(RtmpMsgHeaderPtr& mh)
@@ -275,9 +923,37 @@ void RtmpConnection::onReadWndAckSize(RtmpMsgHeaderPtr& mh)
     sentOnBWDone();
 }
 
+// a response to an older ping than the last one is not counted
+void RtmpConnection::onUserControl(RtmpMsgHeaderPtr& mh)
+{
+    UserControlMsgPtr ucp = parser_.parseUserControlMsg(mh);
+
+    if(ucp->eventType == UCMT_PingResponse && pingSent_ != 0 && ucp->value == (uint32_t)(pingSent_ / 1000))
+    {
+        rtt_ = Utility::getMonotonicMicros() - pingSent_;
+        pingSent_ = 0;
+
+        RTMP_LOG(LEVDEBUG, "RtmpConnection::onUserControl, ping rtt %lld us\n", (long long)rtt_);
+        Metrics::add(MET_PingResponses);
+        Metrics::add(MET_PingRttMicros, rtt_);
+        return;
+    }
+
+    RTMP_LOG(LEVDEBUG, "User control event %d is not handled\n", ucp->eventType);
+}
+
 void RtmpConnection::normalExchange(RtmpMsgHeaderPtr& mh)
 {
-    if(mh->typeId == MST_CmdAMF0)
+    countMessage(mh->typeId);
+    RTMP_TRACE6(message, this, mh->chunkStreamId, mh->typeId, mh->length, mh->timestamp, mh->streamId);
+
+    // the actor sees every message in the order it came
+    if(mh->typeId != MST_Audio && mh->typeId != MST_Video)
+    {
+        deliverMedia();
+    }
+
+    if(mh->typeId == MST_CmdAMF0 || mh->typeId == MST_CmdAMF3)
     {
         AMF0Commands cmd = parser_.peekAMF0Cmd(mh); 
         switch(cmd)
@@ -301,11 +977,7 @@ void RtmpConnection::normalExchange(RtmpMsgHeaderPtr& mh)
                 RTMP_LOG(LEVDEBUG, "AMF0 CMD[%d] is not handled\n", cmd);
         }
     }
-    else if(mh->typeId == MST_CmdAMF3)
-    {
-        throw RtmpInternalError("AMF3 command is not supported");
-    }
-    else if(mh->typeId == MST_DataAMF0)
+    else if(mh->typeId == MST_DataAMF0 || mh->typeId == MST_DataAMF3)
     {
         try
         {
@@ -337,13 +1009,13 @@ void RtmpConnection::normalExchange(RtmpMsgHeaderPtr& mh)
     {
         onVideo(mh);
     }
-    else if(mh->typeId = MST_WndAckSize)
+    else if(mh->typeId == MST_WndAckSize)
     {
         onReadWndAckSize(mh);
     }
     else if(mh->typeId == MST_UserControlMsg)
     {
-        throw RtmpNotImplemented("I think client should not send this");
+        onUserControl(mh);
     }
     else
     {
@@ -351,30 +1023,105 @@ void RtmpConnection::normalExchange(RtmpMsgHeaderPtr& mh)
     }
 }
 
-void RtmpConnection::onAudio(RtmpMsgHeaderPtr& mh)
+void RtmpConnection::countMessage(int typeId)
 {
-    RTMP_LOG(LEVDEBUG, "RtmpConnection::onAudio, timestamp %ld\n", mh->timestamp);
-    if(!actor_->onReceiveStream(mh->streamId, false, mh))
+    switch(typeId)
     {
-        throw RtmpInternalError("error on audio");
+        case MST_Audio:
+            Metrics::add(MET_MsgAudio);
+            break;
+        case MST_Video:
+            Metrics::add(MET_MsgVideo);
+            break;
+        case MST_CmdAMF0:
+        case MST_CmdAMF3:
+            Metrics::add(MET_MsgCommand);
+            break;
+        case MST_DataAMF0:
+        case MST_DataAMF3:
+            Metrics::add(MET_MsgData);
+            break;
+        case MST_SetChunkSize:
+        case MST_AbortMsg:
+        case MST_Acknowledgement:
+        case MST_UserControlMsg:
+        case MST_WndAckSize:
+        case MST_SetPeerBandwidth:
+            Metrics::add(MET_MsgControl);
+            break;
+        default:
+            Metrics::add(MET_MsgOther);
+            break;
     }
 }
 
+void RtmpConnection::onAudio(RtmpMsgHeaderPtr& mh)
+{
+    RTMP_LOG_RATE(LEVDEBUG, 10, "RtmpConnection::onAudio, timestamp %ld\n", mh->timestamp);
+    onMedia(mh, false);
+}
+
 void RtmpConnection::onVideo(RtmpMsgHeaderPtr& mh)
 {
-    RTMP_LOG(LEVDEBUG, "RtmpConnection::onVideo, timestamp %ld\n", mh->timestamp);
-    if(!actor_->onReceiveStream(mh->streamId, true, mh))
+    RTMP_LOG_RATE(LEVDEBUG, 10, "RtmpConnection::onVideo, timestamp %ld\n", mh->timestamp);
+    onMedia(mh, true);
+}
+
+// held until the read is parsed or a message of another type comes
+void RtmpConnection::onMedia(RtmpMsgHeaderPtr& mh, bool isVideo)
+{
+    mh->recvTime = recvTime_;
+
+    // AVC and AAC sequence headers, the decoder of a new actor needs them
+    if(mh->length >= 2 && mh->body[1] == 0)
     {
-        throw RtmpInternalError("error on audio");
+        if(isVideo && (mh->body[0] & 0x0f) == 7)
+        {
+            videoConfig_ = mh;
+        }
+        else if(!isVideo && (mh->body[0] >> 4) == 10)
+        {
+            audioConfig_ = mh;
+        }
+    }
+
+    RtmpMediaMsg m;
+    m.streamId = mh->streamId;
+    m.isVideo = isVideo;
+    m.msg = mh;
+    media_.push_back(m);
+}
+
+void RtmpConnection::deliverMedia()
+{
+    if(media_.empty())
+    {
+        return;
+    }
+
+    RTMP_TRACE2(actor_enter, this, "onReceiveStreams");
+    bool ok = actor_->onReceiveStreams(&media_[0], media_.size());
+    RTMP_TRACE3(actor_return, this, "onReceiveStreams", ok);
+
+    // the vector keeps its capacity for the next read
+    media_.clear();
+
+    if(!ok)
+    {
+        throw RtmpInternalError("error on media");
     }
 }
 
 void RtmpConnection::onSetChunkSize(RtmpMsgHeaderPtr& mh)
 {
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
+    int32_t chunkSize = ReadBuffer::read<int32_t>(mh->body, mh->length, ReadBuffer::BIG); 
+    if(chunkSize < 1)
+    {
+        throw RtmpBadProtocalData("bad chunk size");
+    }
 
-    chunkSize_ = readBuffer->read<int32_t>(ReadBuffer::BIG); 
+    chunkSize_ = chunkSize;
+    RTMP_TRACE3(chunk_size, this, 0, chunkSize_);
 }
 
 void RtmpConnection::onReadAMF0DataSetDataFrame(RtmpMsgHeaderPtr& mh)
@@ -382,8 +1129,12 @@ void RtmpConnection::onReadAMF0DataSetDataFrame(RtmpMsgHeaderPtr& mh)
     RTMP_LOG(LEVDEBUG, "RtmpConnection::onReadAMF0DataSetDataFrame\n");
     MetaDataMsgPtr request = parser_.parseMetaData(mh);
     request->timestamp = mh->timestamp;
+    metaDataMsg_ = mh;
 
-    if(!actor_->onMetaData(mh->streamId, request))
+    RTMP_TRACE2(actor_enter, this, "onMetaData");
+    bool ok = actor_->onMetaData(mh->streamId, request);
+    RTMP_TRACE3(actor_return, this, "onMetaData", ok);
+    if(!ok)
     {
         throw RtmpInternalError("error on metadata");
     }
@@ -403,10 +1154,16 @@ void RtmpConnection::onReadPublish(RtmpMsgHeaderPtr& mh)
         name = request->publishingName.substr(0, questionMarkPos);
     } 
 
-    if(!actor_->onPublish(mh->streamId, name))
+    RTMP_TRACE2(actor_enter, this, "onPublish");
+    bool ok = actor_->onPublish(mh->streamId, name);
+    RTMP_TRACE3(actor_return, this, "onPublish", ok);
+    if(!ok)
     {
         throw RtmpInternalError("error on publish");
     }
+
+    publishStreamId_ = mh->streamId;
+    publishName_ = name;
     
     sendOnStatus(mh, request->transactionId, "NetStream.Publish.Start", name + " is now published", "oAAQAAAA");
 }
@@ -414,34 +1171,25 @@ void RtmpConnection::onReadPublish(RtmpMsgHeaderPtr& mh)
 void RtmpConnection::sendOnStatus(RtmpMsgHeaderPtr& mh, int transactionId, string code, string description, string clientId)
 {
     RTMP_LOG(LEVDEBUG, "RtmpConnection::sendOnStatus\n");
-    WriteBufferPtr wp(new WriteBuffer(chunkSize_));
-    AMF0SerializerPtr ap(new AMF0Serializer(wp.get()));
-
-    ap->writeString("onStatus");
-    ap->writeNumber(transactionId);
-    ap->writeNull();
-
-    ap->writeObjectStart();
-    ap->writeObjectKey("level");
-    ap->writeString("status");
-    ap->writeObjectKey("code");
-    ap->writeString(code);
-    ap->writeObjectKey("description");
-    ap->writeString(description);
-    ap->writeObjectKey("clientid");
-    ap->writeString(clientId);
-    ap->writeObjectEnd();
-
-    RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
-    hd->body  = wp->getBuffer();
-    hd->chunkType = 0;
-    hd->chunkStreamId = mh->chunkStreamId;
-    hd->timestamp = 0;
-    hd->length = wp->getBufferCount();
-    hd->typeId = MST_CmdAMF0;
-    hd->streamId = mh->streamId;
-
-    chunkedSentMsg(hd);
+    beginCommand(mh->chunkStreamId, mh->streamId);
+    AMF0ChunkSerializer ap(&cw_);
+
+    ap.writeString("onStatus");
+    ap.writeNumber(transactionId);
+    ap.writeNull();
+
+    ap.writeObjectStart();
+    ap.writeObjectKey("level");
+    ap.writeString("status");
+    ap.writeObjectKey("code");
+    ap.writeString(code);
+    ap.writeObjectKey("description");
+    ap.writeString(description);
+    ap.writeObjectKey("clientid");
+    ap.writeString(clientId);
+    ap.writeObjectEnd();
+
+    endCommand();
 } 
 
 void RtmpConnection::onReadReleaseStream(RtmpMsgHeaderPtr& mh)
@@ -451,24 +1199,15 @@ void RtmpConnection::onReadReleaseStream(RtmpMsgHeaderPtr& mh)
 
     // TODO: Do some logic..
     
-    WriteBufferPtr wp(new WriteBuffer(chunkSize_));
-    AMF0SerializerPtr ap(new AMF0Serializer(wp.get()));
-
-    ap->writeString("_result");
-    ap->writeNumber(request->transactionId);
-    ap->writeNull();
-    ap->writeUndefined();
+    beginCommand(3, 0);
+    AMF0ChunkSerializer ap(&cw_);
 
-    RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
-    hd->body  = wp->getBuffer();
-    hd->chunkType = 0;
-    hd->chunkStreamId = 3;
-    hd->timestamp = 0;
-    hd->length = wp->getBufferCount();
-    hd->typeId = MST_CmdAMF0;
-    hd->streamId = 0;
+    ap.writeString("_result");
+    ap.writeNumber(request->transactionId);
+    ap.writeNull();
+    ap.writeUndefined();
 
-    chunkedSentMsg(hd);
+    endCommand();
 }
 
 void RtmpConnection::onReadFCPublish(RtmpMsgHeaderPtr& mh)
@@ -476,24 +1215,15 @@ void RtmpConnection::onReadFCPublish(RtmpMsgHeaderPtr& mh)
     RTMP_LOG(LEVDEBUG, "RtmpConnection::onReadFCPublish\n");
     FCPublishCmdPtr request = parser_.parseFCPublishCmd(mh);
 
-    WriteBufferPtr wp(new WriteBuffer(chunkSize_));
-    AMF0SerializerPtr ap(new AMF0Serializer(wp.get()));
+    beginCommand(3, 0);
+    AMF0ChunkSerializer ap(&cw_);
 
-    ap->writeString("_result");
-    ap->writeNumber(request->transactionId);
-    ap->writeNull();
-    ap->writeUndefined();
+    ap.writeString("_result");
+    ap.writeNumber(request->transactionId);
+    ap.writeNull();
+    ap.writeUndefined();
 
-    RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
-    hd->body  = wp->getBuffer();
-    hd->chunkType = 0;
-    hd->chunkStreamId = 3;
-    hd->timestamp = 0;
-    hd->length = wp->getBufferCount();
-    hd->typeId = MST_CmdAMF0;
-    hd->streamId = 0;
-
-    chunkedSentMsg(hd);
+    endCommand();
 }
 
 void RtmpConnection::onReadCreateStream(RtmpMsgHeaderPtr& mh)
@@ -501,29 +1231,23 @@ void RtmpConnection::onReadCreateStream(RtmpMsgHeaderPtr& mh)
     RTMP_LOG(LEVDEBUG, "RtmpConnection::onReadCreateStream\n");
     CreateStreamCmdPtr request = parser_.parseCreateStreamCmd(mh);
 
-    if(!actor_->onCreateStream(streamIndex_))
+    RTMP_TRACE2(actor_enter, this, "onCreateStream");
+    bool ok = actor_->onCreateStream(streamIndex_);
+    RTMP_TRACE3(actor_return, this, "onCreateStream", ok);
+    if(!ok)
     {
         throw RtmpInternalError("actor onCreateStream failed");
     }
 
-    WriteBufferPtr wp(new WriteBuffer(chunkSize_));
-    AMF0SerializerPtr ap(new AMF0Serializer(wp.get()));
-
-    ap->writeString("_result");
-    ap->writeNumber(request->transactionId);
-    ap->writeNull();
-    ap->writeNumber((double)streamIndex_);
+    beginCommand(3, 0);
+    AMF0ChunkSerializer ap(&cw_);
 
-    RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
-    hd->body  = wp->getBuffer();
-    hd->chunkType = 0;
-    hd->chunkStreamId = 3;
-    hd->timestamp = 0;
-    hd->length = wp->getBufferCount();
-    hd->typeId = MST_CmdAMF0;
-    hd->streamId = 0;
+    ap.writeString("_result");
+    ap.writeNumber(request->transactionId);
+    ap.writeNull();
+    ap.writeNumber((double)streamIndex_);
 
-    chunkedSentMsg(hd);
+    endCommand();
 
     streamIndex_++;
 }
@@ -531,88 +1255,91 @@ void RtmpConnection::onReadCreateStream(RtmpMsgHeaderPtr& mh)
 void RtmpConnection::sentOnBWDone()
 {
     RTMP_LOG(LEVDEBUG, "RtmpConnection::sentOnBWDone\n");
-    WriteBufferPtr wp(new WriteBuffer(chunkSize_));
-    AMF0SerializerPtr ap(new AMF0Serializer(wp.get()));
+    beginCommand(3, 0);
+    AMF0ChunkSerializer ap(&cw_);
 
-    ap->writeString("onBWDone");
-    ap->writeNumber(0);
-    ap->writeNull();
+    ap.writeString("onBWDone");
+    ap.writeNumber(0);
+    ap.writeNull();
 
-    RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
-    hd->body  = wp->getBuffer();
-    hd->chunkType = 0;
-    hd->chunkStreamId = 3;
-    hd->timestamp = 0;
-    hd->length = wp->getBufferCount();
-    hd->typeId = MST_CmdAMF0;
-    hd->streamId = 0;
-
-    chunkedSentMsg(hd);
+    endCommand();
     cs_state_ = CS_Done;
 }
 
 void RtmpConnection::sentNetConnectConnectSuccess()
 {
     RTMP_LOG(LEVDEBUG, "RtmpConnection::sentNetConnectConnectSuccess\n");
-    WriteBufferPtr wp(new WriteBuffer(chunkSize_));
-    AMF0SerializerPtr ap(new AMF0Serializer(wp.get()));
-
-    ap->writeString("_result");
-    ap->writeNumber(1);
-
-    ap->writeObjectStart();
-    ap->writeObjectKey("fmsVer");
-    ap->writeString("TVie Rtmp/1,0,0,0");
-    ap->writeObjectKey("capalilities");
-    ap->writeNumber(255);
-    ap->writeObjectKey("mode");
-    ap->writeNumber(1);
-    ap->writeObjectEnd();
-
-    ap->writeObjectStart();
-    ap->writeObjectKey("level");
-    ap->writeString("status");
-    ap->writeObjectKey("code");
-    ap->writeString("NetConnection.Connect.Success");
-    ap->writeObjectKey("description");
-    ap->writeString("connection succeeded");
-    ap->writeObjectKey("objectEncoding");
-    ap->writeNumber(0);
-    ap->writeObjectEnd();
+    beginCommand(3, 0);
+    AMF0ChunkSerializer ap(&cw_);
+
+    ap.writeString("_result");
+    ap.writeNumber(1);
+
+    ap.writeObjectStart();
+    ap.writeObjectKey("fmsVer");
+    ap.writeString("TVie Rtmp/1,0,0,0");
+    ap.writeObjectKey("capalilities");
+    ap.writeNumber(255);
+    ap.writeObjectKey("mode");
+    ap.writeNumber(1);
+    ap.writeObjectEnd();
+
+    ap.writeObjectStart();
+    ap.writeObjectKey("level");
+    ap.writeString("status");
+    ap.writeObjectKey("code");
+    ap.writeString("NetConnection.Connect.Success");
+    ap.writeObjectKey("description");
+    ap.writeString("connection succeeded");
+    ap.writeObjectKey("objectEncoding");
+    // replies stay AMF0, Flash accepts them on AMF3 connections too
+    ap.writeNumber(ccp_->objectEncoding == kAMF3 ? kAMF3 : kAMF0);
+    ap.writeObjectEnd();
+
+    endCommand();
+    cs_state_ = CS_SuccessSent;
+}
 
+void RtmpConnection::beginCommand(int chunkStreamId, int streamId)
+{
     RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
-    hd->body  = wp->getBuffer();
     hd->chunkType = 0;
-    hd->chunkStreamId = 3;
+    hd->chunkStreamId = chunkStreamId;
     hd->timestamp = 0;
-    hd->length = wp->getBufferCount();
+    // filled in by endCommand()
+    hd->length = 0;
     hd->typeId = MST_CmdAMF0;
-    hd->streamId = 0;
+    hd->streamId = streamId;
 
-    chunkedSentMsg(hd);
-    cs_state_ = CS_SuccessSent;
+    wb_.reInit();
+    int lengthPos = writeHeader(hd);
+    cw_.begin(outChunkSize_, chunkStreamId, lengthPos);
 }
 
-void RtmpConnection::chunkedSentMsg(RtmpMsgHeaderPtr& mh)
+void RtmpConnection::endCommand()
 {
-    wb_.reInit();
-    writeHeader(mh);
+    cw_.end();
+    writeData(wb_.getBufferPtr(), wb_.getBufferCount(), false);
 
-    int bytesLeft = mh->length;
-    while(bytesLeft)
+    growChunkSize(cw_.getBodySize());
+}
+
+// a message needed more than one chunk, later ones of that size fit in one
+void RtmpConnection::growChunkSize(int messageSize)
+{
+    if(messageSize <= outChunkSize_ || outChunkSize_ >= maxChunkSize_)
     {
-        int chunkSize = (outChunkSize_ > bytesLeft) ? bytesLeft : outChunkSize_;
+        return;
+    }
 
-        wb_.writeBytes(mh->body + mh->length - bytesLeft, chunkSize);
-        
-        bytesLeft -= chunkSize;
-        if(bytesLeft > 0)
-        {
-            wb_.writeByte(0xc3); // type 3 msg
-        }
+    int chunkSize = outChunkSize_;
+    while(chunkSize < messageSize && chunkSize < maxChunkSize_)
+    {
+        chunkSize *= 2;
     }
 
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
+    outChunkSize_ = chunkSize < maxChunkSize_ ? chunkSize : maxChunkSize_;
+    sentChunkSize(outChunkSize_);
 }
 
 void RtmpConnection::sentChunkSize(int chunkSize)
@@ -630,7 +1357,8 @@ void RtmpConnection::sentChunkSize(int chunkSize)
     writeHeader(hd);
     wb_.writeB(chunkSize);
 
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
+    writeData(wb_.getBufferPtr(), wb_.getBufferCount(), false);
+    RTMP_TRACE3(chunk_size, this, 1, chunkSize);
 
     cs_state_ = CS_SetChunkSizeSent;
 }
@@ -650,7 +1378,28 @@ void RtmpConnection::sendAcknowledgement(uint32_t sequenceNumber)
     writeHeader(hd);
     wb_.writeB(sequenceNumber);
 
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
+    writeData(wb_.getBufferPtr(), wb_.getBufferCount(), false);
+}
+
+// the timestamp is echoed in the PingResponse
+void RtmpConnection::sendPingRequest(int64_t now)
+{
+    RTMP_LOG(LEVDEBUG, "RtmpConnection::sendPingRequest\n");
+    RtmpMsgHeaderPtr hd(new RtmpMsgHeader());
+    hd->chunkType = 0;
+    hd->chunkStreamId = 2;
+    hd->timestamp = 0;
+    hd->length = 6;
+    hd->typeId = MST_UserControlMsg;
+    hd->streamId = 0;
+
+    wb_.reInit();
+    writeHeader(hd);
+    wb_.writeB((uint16_t)UCMT_PingRequest);
+    wb_.writeB((uint32_t)(now / 1000));
+
+    writeData(wb_.getBufferPtr(), wb_.getBufferCount(), false);
+    pingSent_ = now;
 }
 
 void RtmpConnection::sentWndAckSize(int size)
@@ -668,7 +1417,7 @@ void RtmpConnection::sentWndAckSize(int size)
     writeHeader(hd);
     wb_.writeB(size);
 
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
+    writeData(wb_.getBufferPtr(), wb_.getBufferCount(), false);
 
     cs_state_ = CS_WindowsAckSizeSent;
 }
@@ -689,11 +1438,11 @@ void RtmpConnection::sentSetPeerBandwidth(int size, RtmpLimitType limitType)
     wb_.writeB(size);
     wb_.writeB((uint8_t)limitType);
 
-    writeData(wb_.getBuffer(), wb_.getBufferCount(), true);
+    writeData(wb_.getBufferPtr(), wb_.getBufferCount(), false);
     cs_state_ = CS_SetPeerBandWidthSent;
 }
 
-void RtmpConnection::writeHeader(RtmpMsgHeaderPtr& hd)
+int RtmpConnection::writeHeader(RtmpMsgHeaderPtr& hd)
 {
     wb_.writeB(hd->chunkType, 2);
     if(hd->chunkStreamId < 64)
@@ -723,6 +1472,7 @@ void RtmpConnection::writeHeader(RtmpMsgHeaderPtr& hd)
         }
     }
 
+    int lengthPos = wb_.getBufferCount();
     wb_.writeB(hd->length, 24);
     wb_.writeB(hd->typeId, 8);
 
@@ -735,40 +1485,51 @@ void RtmpConnection::writeHeader(RtmpMsgHeaderPtr& hd)
     {
         wb_.writeB(hd->timestamp - 0x00ffffff, 32); 
     }
+
+    return lengthPos;
 }
 
 void RtmpConnection::handleC2()
 {
-    RTMP_LOG(LEVDEBUG, "Handshake handle C2");
-    uint32_t timestamp = rb_.read<uint32_t>(ReadBuffer::BIG);
-
-    /* TODO: this also may be not match
-    if(timestamp != s1Timestamp_)
-    {
-        throw RtmpBadProtocalData("C2 timestamp is not match");
-    }
-    */
+    RTMP_LOG(LEVDEBUG, "Handshake handle C2\n");
 
-    rb_.skip(4); // time2
-    uint8_t* randomData = rb_.readBytes(RtmpConnection::RANDOM_DATA_SIZE);
-    /* TODO: should we verify that? spec said we should, but in real world...
-    if(!Utility::compareData(s1Randomdata_, randomData, RtmpConnection::RANDOM_DATA_SIZE))
-    {
-        delete[] randomData;
-        throw RtmpBadProtocalData("C2 random data is not match");
-    }
-    */
-    
-    delete[] randomData;
+    /* TODO: the spec says C2 echoes S1, but in real world time and random
+     * data do not always match, so it is not verified
+     */
+    rb_.skip(RtmpConnection::HANDSHAKE_SIZE);
 
     RTMP_LOG(LEVDEBUG, "Handshake done\n");
     hss_state_ = HSS_HandshakeDone;
+    RTMP_TRACE2(handshake, this, hss_state_);
     rcs_state_ = RCS_Normal_Exchange;
 }
 
 void RtmpConnection::writeData(uint8_t* data, int size, bool delData)
 {
+    if(deferredSend_)
+    {
+        output_.insert(output_.end(), data, data + size);
+        Metrics::add(MET_BytesSent, size);
+
+        if(delData)
+        {
+            delete[] data;
+        }
+        return;
+    }
+
+    // only the first reply of a batch costs a system call more
+    if(cork_ && !corked_)
+    {
+        int on = 1;
+        corked_ = setsockopt(sockfd_, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+    }
+
     int sendSize = send(sockfd_, data, size, 0);
+    if(sendSize > 0)
+    {
+        Metrics::add(MET_BytesSent, sendSize);
+    }
 
     if(delData)
     {
@@ -788,16 +1549,19 @@ void RtmpConnection::disconnect()
         return;
     }
 
+    RTMP_LOG(LEVINFO, "connection closed, memory peak %lld bytes, process %lld bytes\n",
+            (long long)account_->getPeak(), (long long)MemAccount::getStats().globalUsed);
+
     if(actor_)
     {
+        RTMP_TRACE2(actor_enter, this, "onDisconnect");
         actor_->onDisconnect();
+        RTMP_TRACE3(actor_return, this, "onDisconnect", 1);
     }
     
-    if(sockfd_ != -1)
-    {
-        close(sockfd_);
-        sockfd_ = -1;
-    }
+    closeSocket();
 
+    media_.clear();
     isDisconnected_ = true;
+    timer_.cancel();
 }
@@ -10,6 +10,12 @@
 #include "rtmpmsg.h"
 #include "rtmpactor.h"
 #include "amf0.h"
+#include "chunkwriter.h"
+#include "memaccount.h"
+#include "metrics.h"
+#include "wirecapture.h"
+#include "timerwheel.h"
+#include "handoff.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -30,7 +36,6 @@ enum HandshakeState
 {
     HSS_Uninitialized,
     HSS_VersionSent,
-    HSS_VersionSent_C1_Read,
     HSS_AckSent,
     HSS_HandshakeDone
 };
@@ -55,22 +60,83 @@ enum ConnectState
 
 class RtmpServer;
 
+// takes the socket and state of a connection that leaves this process,
+// false if they were not taken. the socket is closed after it returns
+typedef boost::function<bool(int sockfd, const vector<uint8_t>& state)> HandoffFn;
+
 class RtmpConnection
 {
     public:
        RtmpConnection(int sockfd, struct sockaddr_in clientAddr, RtmpActorPtr actor);
        virtual ~RtmpConnection();
-       void handleClient();
+       // once drainFd is readable the connection moves through handoff as
+       // soon as it can, see handOff(). it is closed once stopFd is readable
+       void handleClient(int drainFd = -1, const HandoffFn& handoff = HandoffFn(), int stopFd = -1);
+       MemAccountPtr getMemAccount();
+
+       // what recv() returned, 0 or less closes the connection; for event loops
+       void onReceive(const uint8_t* data, int size);
+       // handles data as if recv() returned it, replays captures without a client
+       void feed(const uint8_t* data, int size);
+       bool isDisconnected();
+       void disconnect();
+
+       // false while the connection can not move to another process: before
+       // connect is done, or with replies not yet sent
+       bool suspend(vector<uint8_t>& state);
+       bool isSuspendable();
+       // suspends and gives the socket to handoff, the actor sees a disconnect
+       bool handOff(const HandoffFn& handoff);
+       // continues what suspend() saved in another process, the actor is
+       // told of the connect, streams, publish, metadata and codec headers.
+       // throws RtmpBadProtocalData on a broken state
+       void resume(const vector<uint8_t>& state);
+
+       // replies are queued instead of sent, the owner sends what takeOutput() returns
+       void setDeferredSend(bool deferred);
+       // appends the queued replies to out, false if there are none
+       bool takeOutput(vector<uint8_t>& out);
+       // TCP_CORK holds the replies to a read or a timer until handleClient()
+       // is done with it, so they leave in full segments. deferred send
+       // already puts them in one send()
+       void setCork(bool cork);
+       // the timeouts, pings and acknowledgements run on wheel, from the
+       // thread that advances it. onTimer runs after each of them, it sends
+       // what they queued in deferred mode. NULL stops them
+       void setTimerWheel(TimerWheel* wheel, const boost::function<void()>& onTimer);
+       // microseconds of the last ping round trip, -1 before the first response
+       int64_t getRtt();
+
+       // SetChunkSize sent after connect, it grows up to maxChunkSize for bigger messages
+       static void setChunkSizes(int chunkSize, int maxChunkSize);
+       // window acknowledgement size and peer bandwidth sent after connect
+       static void setWindowAckSize(int size);
+       // buffers are freed whenever a read leaves nothing pending, for many idle clients
+       static void setLowFootprint(bool lowFootprint);
+       static bool isLowFootprint();
+       // from the start until connect is done, and without any data; 0 turns one off
+       static void setTimeouts(int handshakeMillis, int idleMillis);
+       // PingRequest once connected, 0 turns it off
+       static void setPingInterval(int millis);
+       // Acknowledgement of what came since the last one, the only acks
+       // sent. keep it under the time a client takes to send a window;
+       // 0 turns acks off
+       static void setAckInterval(int millis);
 
     private:
        const static int RANDOM_DATA_SIZE = 1528;
+       // C1, C2, S1 and S2: time, time2 or zero, random data
+       const static int HANDSHAKE_SIZE = 4 + 4 + RANDOM_DATA_SIZE;
        const static int READ_BUFFER_INIT_SIZE = 1024;
        const static int WRITE_BUFFER_INIT_SIZE = 1024;
        const static int BUFFER_SIZE = 40960;
+       // the wheel of a client thread
+       const static int TIMER_TICK_MILLIS = 10;
+       const static uint32_t STATE_VERSION = 1;
+       MemAccountPtr account_;
        int sockfd_;
        struct sockaddr_in clientAddr_;
        bool isDisconnected_;
-       uint8_t buffer_[RtmpConnection::BUFFER_SIZE];
        bool c1_handled;
 
        // will be update if Set chunk size called
@@ -79,16 +145,56 @@ class RtmpConnection
 
        int outChunkSize_;
 
+       // set before the server starts
+       static int announcedChunkSize_;
+       static int maxChunkSize_;
+       static int announcedWindowAckSize_;
+       static bool lowFootprint_;
+       static int handshakeTimeout_;
+       static int idleTimeout_;
+       static int pingInterval_;
+       static int ackInterval_;
+
        int streamIndex_;
 
        ReadBuffer rb_;
        WriteBuffer wb_;
        AMF0Serializer amf0s_;
+       // command replies are serialized through it into wb_
+       ChunkWriter cw_;
 
-       uint32_t s1Timestamp_;
-       uint8_t* s1Randomdata_;
        uint32_t bytesReceived_;
        uint32_t ackBytes_;
+       // parser chunks already added to the metrics
+       uint64_t chunksCounted_;
+       // when the last recv() returned, see RtmpMsgHeader::recvTime
+       int64_t recvTime_;
+       // audio and video of the current read, not yet given to the actor
+       vector<RtmpMediaMsg> media_;
+       WireCapturePtr capture_;
+       bool deferredSend_;
+       vector<uint8_t> output_;
+       bool cork_;
+       // set by the first reply after the last uncork()
+       bool corked_;
+
+       // one timer for the earliest of the deadlines, monotonic microseconds, 0 when not set
+       TimerWheel* wheel_;
+       Timer timer_;
+       boost::function<void()> onTimer_;
+       int64_t handshakeDeadline_;
+       int64_t nextPing_;
+       int64_t nextAck_;
+       // when the unanswered ping went out, its timestamp is this in milliseconds
+       int64_t pingSent_;
+       int64_t rtt_;
+
+       // what a new actor needs after a handoff, see resume()
+       int publishStreamId_;
+       string publishName_;
+       RtmpMsgHeaderPtr metaDataMsg_;
+       RtmpMsgHeaderPtr videoConfig_;
+       RtmpMsgHeaderPtr audioConfig_;
 
        ConnectCmdPtr ccp_;
 
@@ -102,25 +208,41 @@ class RtmpConnection
        RtmpActorPtr actor_;
        bool isConnected_;
 
-       void disconnect();
        void handshake();
        void handleC0();
        void handleC1();
        void handleC2();
-       void handleRead(int bytes_transferred);
-       void nextMove();
-       void normalExchange();
+       void growChunkSize(int messageSize);
+       void readC1(uint8_t* s2);
+       void handleRead(const uint8_t* data, int bytes_transferred);
+       // sends what TCP_CORK held back
+       void uncork();
+       // clears the eviction callback first, see MemAccount::setOnEvict()
+       void closeSocket();
+       static void shutdownSocket(int sockfd);
+       // frees what an idle connection does not need, see setLowFootprint()
+       void compact();
+       void onTimer();
+       // schedules timer_ for the earliest deadline
+       void armTimer(int64_t now);
+       // false when the rest of the buffer is a part of a chunk
+       bool nextMove();
+       bool normalExchange();
        void normalExchange(RtmpMsgHeaderPtr& mh);
+       void countMessage(int typeId);
        void writeData(uint8_t* data, int size, bool del);
 
-       void writeHeader(RtmpMsgHeaderPtr& hd);
+       // returns the offset of the length field in wb_
+       int writeHeader(RtmpMsgHeaderPtr& hd);
+       void beginCommand(int chunkStreamId, int streamId);
+       void endCommand();
        void sentWndAckSize(int size);
        void sentSetPeerBandwidth(int size, RtmpLimitType limitType);
        void sentChunkSize(int chunkSize);
        void sendAcknowledgement(uint32_t sequenceNumber);
+       void sendPingRequest(int64_t now);
        void sentNetConnectConnectSuccess();
        void sentOnBWDone();
-       void chunkedSentMsg(RtmpMsgHeaderPtr& mh);
 
        void onReadReleaseStream(RtmpMsgHeaderPtr& mh);
        void onReadFCPublish(RtmpMsgHeaderPtr& mh);
@@ -128,10 +250,13 @@ class RtmpConnection
        void onReadPublish(RtmpMsgHeaderPtr& mh);
        void onReadConnect(RtmpMsgHeaderPtr& mh);
        void onReadWndAckSize(RtmpMsgHeaderPtr& mh);
+       void onUserControl(RtmpMsgHeaderPtr& mh);
        void onReadAMF0DataSetDataFrame(RtmpMsgHeaderPtr& mh);
        void onSetChunkSize(RtmpMsgHeaderPtr& mh);
        void onAudio(RtmpMsgHeaderPtr& mh);
        void onVideo(RtmpMsgHeaderPtr& mh);
+       void onMedia(RtmpMsgHeaderPtr& mh, bool isVideo);
+       void deliverMedia();
        
        void sendOnStatus(RtmpMsgHeaderPtr& mh, int transactionId, string code, string description, string clientId);
 
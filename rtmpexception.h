@@ -22,6 +22,13 @@ public:
        errorMsg_ = s.str();
    }
 
+protected:
+   // for exceptions thrown on every partial read, nothing to format
+   RtmpException(): errorCode_(-1)
+   {
+   }
+
+public:
    int getErrorCode()
    {
        return errorCode_;
@@ -51,7 +58,7 @@ class RtmpNoEnoughData: public RtmpException
 {
     public:
         RtmpNoEnoughData():
-            RtmpException("", -1)
+            RtmpException()
        {
        }
 };
@@ -110,6 +117,15 @@ class RtmpInternalError: public RtmpException
     }
 };
 
+class RtmpOutOfMemory: public RtmpInternalError
+{
+    public:
+        RtmpOutOfMemory(const char* errorMsg):
+            RtmpInternalError(errorMsg)
+    {
+    }
+};
+
 class RtmpNotImplemented: public RtmpException
 {
     public:
@@ -0,0 +1,1059 @@
+/*
+ * publishes many synthetic or file sourced streams to an rtmp server
+ *
+ * usage: tvie_rtmp_loadgen [options]
+ *   -h host      server address, 127.0.0.1
+ *   -p port      server port, 1935
+ *   -a app       application, live
+ *   -s prefix    streams are published as prefix0, prefix1 ..., load
+ *   -n streams   number of streams, 1
+ *   -t threads   worker threads, 1
+ *   -b kbps      bitrate of the synthetic stream, 1000
+ *   -c size      outgoing chunk size, 128
+ *   -f file.flv  send the tags of an FLV file, looped, instead of synthetic data
+ *   -d seconds   how long to publish, 10
+ *   -r ms        delay between starting two streams, 10
+ *
+ * the synthetic stream only has valid FLV tag headers, a server that
+ * demuxes the payload needs -f
+ *
+ * prints one line per stream and a summary
+ */
+#include "readbuffer.h"
+#include "writebuffer.h"
+#include "chunkwriter.h"
+#include "rtmpparser.h"
+#include "amf0.h"
+#include "amf0value.h"
+#include "utility.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+struct FlvTag
+{
+    uint8_t type;
+    // milliseconds from the start of the loop
+    uint32_t timestamp;
+    vector<uint8_t> body;
+};
+
+/*
+ * what every stream sends, read only once it is built. the tags are sent
+ * in a loop, the timestamps of the next round are shifted by duration
+ */
+class MediaSource
+{
+    public:
+        // body of an AMF0 data message, starts with @setDataFrame
+        vector<uint8_t> metaData;
+        vector<FlvTag> tags;
+        uint32_t duration;
+
+        MediaSource(): duration(0)
+        {
+        }
+
+        void synthesize(int kbps)
+        {
+            const int FPS = 25;
+            const int GOP = 50;
+            // AAC frames of 1024 samples at 44100
+            const double AUDIO_INTERVAL = 1024 * 1000.0 / 44100;
+            const int SECONDS = 10;
+
+            int audioBytes = kbps * 1000 / 8 / 10 * AUDIO_INTERVAL / 1000;
+            int videoBytes = (kbps * 1000 / 8 - kbps * 1000 / 8 / 10) / FPS;
+            if(audioBytes < 4)
+            {
+                audioBytes = 4;
+            }
+            if(videoBytes < 8)
+            {
+                videoBytes = 8;
+            }
+
+            double audioTs = 0;
+            for(int frame = 0; frame < SECONDS * FPS; frame++)
+            {
+                uint32_t ts = frame * 1000 / FPS;
+
+                while(audioTs < ts)
+                {
+                    FlvTag a;
+                    a.type = MST_Audio;
+                    a.timestamp = (uint32_t)audioTs;
+                    a.body.assign(audioBytes, 0);
+                    // AAC, 44k, 16 bits, stereo, raw frame
+                    a.body[0] = 0xaf;
+                    a.body[1] = 0x01;
+                    tags.push_back(a);
+
+                    audioTs += AUDIO_INTERVAL;
+                }
+
+                FlvTag v;
+                v.type = MST_Video;
+                v.timestamp = ts;
+                bool key = frame % GOP == 0;
+                // a key frame carries about a quarter second
+                v.body.assign(key ? videoBytes * 6 : videoBytes, 0);
+                // AVC, NALU
+                v.body[0] = key ? 0x17 : 0x27;
+                v.body[1] = 0x01;
+                tags.push_back(v);
+            }
+
+            duration = SECONDS * 1000;
+
+            WriteBuffer wb(256);
+            AMF0Serializer s(&wb);
+            s.writeString("@setDataFrame");
+            s.writeString("onMetaData");
+            s.writeEcmaArrayStart(6);
+            s.writeObjectKey("width");
+            s.writeNumber(1280);
+            s.writeObjectKey("height");
+            s.writeNumber(720);
+            s.writeObjectKey("framerate");
+            s.writeNumber(FPS);
+            s.writeObjectKey("videodatarate");
+            s.writeNumber(kbps * 0.9);
+            s.writeObjectKey("audiodatarate");
+            s.writeNumber(kbps * 0.1);
+            s.writeObjectKey("audiosamplerate");
+            s.writeNumber(44100);
+            s.writeObjectEnd();
+            metaData.assign(wb.getBufferPtr(), wb.getBufferPtr() + wb.getBufferCount());
+        }
+
+        // throws RtmpBadProtocalData when the file is not FLV
+        void load(const char* path)
+        {
+            FILE* f = fopen(path, "rb");
+            if(!f)
+            {
+                throw RtmpInternalError("open flv failed", errno);
+            }
+
+            vector<uint8_t> data;
+            uint8_t buf[65536];
+            size_t n;
+            while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            {
+                data.insert(data.end(), buf, buf + n);
+            }
+            fclose(f);
+
+            if(data.size() < 13 || memcmp(&data[0], "FLV", 3) != 0)
+            {
+                throw RtmpBadProtocalData("not an flv file");
+            }
+
+            size_t pos = ReadBuffer::read<uint32_t>(&data[5], 4, ReadBuffer::BIG) + 4;
+            uint32_t first = 0;
+            bool hasFirst = false;
+
+            while(pos + 11 <= data.size())
+            {
+                uint8_t type = data[pos] & 0x1f;
+                uint32_t size = ReadBuffer::read<uint32_t>(&data[pos], 4, ReadBuffer::BIG) & 0xffffff;
+                uint32_t ts = (ReadBuffer::read<uint32_t>(&data[pos + 4], 4, ReadBuffer::BIG) >> 8) |
+                    (data[pos + 7] << 24);
+
+                if(pos + 11 + size > data.size())
+                {
+                    break;
+                }
+
+                const uint8_t* body = &data[pos + 11];
+                if(type == MST_DataAMF0)
+                {
+                    if(metaData.empty())
+                    {
+                        WriteBuffer wb(32);
+                        AMF0Serializer s(&wb);
+                        s.writeString("@setDataFrame");
+                        metaData.assign(wb.getBufferPtr(), wb.getBufferPtr() + wb.getBufferCount());
+                        metaData.insert(metaData.end(), body, body + size);
+                    }
+                }
+                else if(type == MST_Audio || type == MST_Video)
+                {
+                    if(!hasFirst)
+                    {
+                        first = ts;
+                        hasFirst = true;
+                    }
+
+                    FlvTag t;
+                    t.type = type;
+                    t.timestamp = ts - first;
+                    t.body.assign(body, body + size);
+                    tags.push_back(t);
+                }
+
+                pos += 11 + size + 4;
+            }
+
+            if(tags.empty())
+            {
+                throw RtmpBadProtocalData("no audio or video in flv file");
+            }
+
+            // a frame after the last one
+            duration = tags.back().timestamp + 40;
+
+            if(metaData.empty())
+            {
+                WriteBuffer wb(64);
+                AMF0Serializer s(&wb);
+                s.writeString("@setDataFrame");
+                s.writeString("onMetaData");
+                s.writeEcmaArrayStart(0);
+                s.writeObjectEnd();
+                metaData.assign(wb.getBufferPtr(), wb.getBufferPtr() + wb.getBufferCount());
+            }
+        }
+};
+
+enum LoadStreamState
+{
+    LSS_Waiting,
+    LSS_Connecting,
+    LSS_Handshake,
+    LSS_Connect,
+    LSS_CreateStream,
+    LSS_Publish,
+    LSS_Publishing,
+    LSS_Done,
+    LSS_Failed
+};
+
+struct LoadStreamReport
+{
+    string name;
+    bool published;
+    string status;
+    string error;
+    // milliseconds from starting the tcp connect, -1 if not reached
+    double tcpMs;
+    double handshakeMs;
+    double connectMs;
+    double publishMs;
+    int64_t sentBytes;
+    int64_t sentMessages;
+    int acks;
+    uint32_t lastAck;
+    // PingRequests answered
+    int pings;
+    // frames that were due while the socket buffer was still full
+    int64_t lateFrames;
+};
+
+/*
+ * one publisher, a state machine driven by poll()
+ *
+ * commands and media are chunked with ChunkWriter and AMF0ChunkSerializer
+ * like the server does, replies are parsed with RtmpParser
+ */
+class LoadStream
+{
+    private:
+        const static int HANDSHAKE_SIZE = 1536;
+        // do not queue more than this, later frames are counted as late
+        const static int MAX_PENDING = 512 * 1024;
+
+        const MediaSource& media_;
+        struct sockaddr_in addr_;
+        string app_;
+        string tcUrl_;
+        int outChunkSize_;
+
+        LoadStreamState state_;
+        int sock_;
+        int64_t startTime_;
+        int64_t publishStart_;
+
+        vector<uint8_t> out_;
+        size_t outPos_;
+
+        ReadBuffer rb_;
+        RtmpParser parser_;
+        int inChunkSize_;
+
+        WriteBuffer wb_;
+        ChunkWriter cw_;
+
+        int rtmpStreamId_;
+        size_t nextTag_;
+        uint32_t loop_;
+
+        LoadStreamReport report_;
+
+        double sinceStart()
+        {
+            return (Utility::getMonotonicMicros() - startTime_) / 1000.0;
+        }
+
+        void queue(const uint8_t* data, int size)
+        {
+            out_.insert(out_.end(), data, data + size);
+            report_.sentBytes += size;
+        }
+
+        int getPending()
+        {
+            return out_.size() - outPos_;
+        }
+
+        void beginMessage(int chunkStreamId, uint32_t timestamp, int typeId, int streamId)
+        {
+            wb_.reInit();
+
+            // type 0 header, the length is filled in by ChunkWriter::end()
+            wb_.writeByte(chunkStreamId);
+            wb_.writeB(timestamp, 24);
+            int lengthPos = wb_.getBufferCount();
+            wb_.writeB(0, 24);
+            wb_.writeByte(typeId);
+            wb_.writeL(streamId, 32);
+
+            cw_.begin(outChunkSize_, chunkStreamId, lengthPos);
+        }
+
+        void endMessage()
+        {
+            cw_.end();
+            queue(wb_.getBufferPtr(), wb_.getBufferCount());
+            report_.sentMessages++;
+        }
+
+        void sendControl(int typeId, uint32_t value)
+        {
+            beginMessage(2, 0, typeId, 0);
+            cw_.writeB(value);
+            endMessage();
+        }
+
+        void sendConnect()
+        {
+            beginMessage(3, 0, MST_CmdAMF0, 0);
+            AMF0ChunkSerializer s(&cw_);
+
+            s.writeString("connect");
+            s.writeNumber(1);
+            s.writeObjectStart();
+            s.writeObjectKey("app");
+            s.writeString(app_);
+            s.writeObjectKey("type");
+            s.writeString("nonprivate");
+            s.writeObjectKey("flashVer");
+            s.writeString("FMLE/3.0 (compatible; tvie_rtmp_loadgen)");
+            s.writeObjectKey("tcUrl");
+            s.writeString(tcUrl_);
+            s.writeObjectEnd();
+
+            endMessage();
+        }
+
+        void sendCommand(const char* name, int transactionId, const string* arg)
+        {
+            beginMessage(3, 0, MST_CmdAMF0, 0);
+            AMF0ChunkSerializer s(&cw_);
+
+            s.writeString(name);
+            s.writeNumber(transactionId);
+            s.writeNull();
+            if(arg)
+            {
+                s.writeString(*arg);
+            }
+
+            endMessage();
+        }
+
+        void sendPublish()
+        {
+            beginMessage(4, 0, MST_CmdAMF0, rtmpStreamId_);
+            AMF0ChunkSerializer s(&cw_);
+
+            s.writeString("publish");
+            s.writeNumber(5);
+            s.writeNull();
+            s.writeString(report_.name);
+            s.writeString(app_);
+
+            endMessage();
+        }
+
+        void sendMetaData()
+        {
+            beginMessage(5, 0, MST_DataAMF0, rtmpStreamId_);
+            cw_.writeBytes(&media_.metaData[0], media_.metaData.size());
+            endMessage();
+        }
+
+        void sendTag(const FlvTag& tag, uint32_t timestamp)
+        {
+            beginMessage(tag.type == MST_Audio ? 4 : 6, timestamp, tag.type, rtmpStreamId_);
+            if(!tag.body.empty())
+            {
+                cw_.writeBytes(&tag.body[0], tag.body.size());
+            }
+            endMessage();
+        }
+
+        void fail(const string& error)
+        {
+            if(state_ == LSS_Failed || state_ == LSS_Done)
+            {
+                return;
+            }
+
+            report_.error = error;
+            state_ = LSS_Failed;
+            closeSocket();
+        }
+
+        void closeSocket()
+        {
+            if(sock_ != -1)
+            {
+                close(sock_);
+                sock_ = -1;
+            }
+        }
+
+        void onConnected()
+        {
+            report_.tcpMs = sinceStart();
+            state_ = LSS_Handshake;
+
+            // C0 and C1
+            uint8_t c01[1 + HANDSHAKE_SIZE];
+            memset(c01, 0, sizeof(c01));
+            c01[0] = 3;
+            queue(c01, sizeof(c01));
+        }
+
+        void onHandshake()
+        {
+            // S0, S1 and S2
+            if(rb_.getUnReadSize() < 1 + 2 * HANDSHAKE_SIZE)
+            {
+                return;
+            }
+
+            uint8_t* s0 = rb_.getUnReadBufferNoCopy();
+            if(s0[0] != 3)
+            {
+                fail("bad handshake version");
+                return;
+            }
+
+            // C2 echoes S1
+            queue(s0 + 1, HANDSHAKE_SIZE);
+            rb_.skip(1 + 2 * HANDSHAKE_SIZE);
+
+            report_.handshakeMs = sinceStart();
+            state_ = LSS_Connect;
+
+            if(outChunkSize_ != 128)
+            {
+                sendControl(MST_SetChunkSize, outChunkSize_);
+            }
+            sendConnect();
+        }
+
+        void onCommand(RtmpMsgHeaderPtr& mh)
+        {
+            int offset = mh->typeId == MST_CmdAMF3 ? 1 : 0;
+            AMF0Reader r(mh->body + offset, mh->length - offset);
+            StrRef name = r.readString();
+            double transactionId = r.readNumber();
+
+            if(name == "_result" && transactionId == 1 && state_ == LSS_Connect)
+            {
+                report_.connectMs = sinceStart();
+                state_ = LSS_CreateStream;
+
+                // what FMLE does, the window makes the server send acknowledgements
+                sendControl(MST_WndAckSize, 2500000);
+                sendCommand("releaseStream", 2, &report_.name);
+                sendCommand("FCPublish", 3, &report_.name);
+                sendCommand("createStream", 4, NULL);
+            }
+            else if(name == "_result" && transactionId == 4 && state_ == LSS_CreateStream)
+            {
+                r.skipValue();
+                rtmpStreamId_ = (int)r.readNumber();
+                state_ = LSS_Publish;
+
+                sendPublish();
+            }
+            else if(name == "onStatus")
+            {
+                AMF0Document doc(mh->body + offset, mh->length - offset);
+                AMF0Value* code = doc.getProperty("code");
+                report_.status = code && code->type == AMF0_String ? code->str.str() : "?";
+
+                if(state_ == LSS_Publish && report_.status == "NetStream.Publish.Start")
+                {
+                    report_.publishMs = sinceStart();
+                    report_.published = true;
+                    publishStart_ = Utility::getMonotonicMicros();
+                    state_ = LSS_Publishing;
+
+                    sendMetaData();
+                }
+                else if(state_ == LSS_Publish)
+                {
+                    fail("publish refused");
+                }
+            }
+            else if(name == "_error")
+            {
+                fail("server returned _error");
+            }
+        }
+
+        // a PingResponse echoes the timestamp of the request
+        void onUserControl(RtmpMsgHeaderPtr& mh)
+        {
+            UserControlMsgPtr ucp = parser_.parseUserControlMsg(mh);
+            if(ucp->eventType != UCMT_PingRequest)
+            {
+                return;
+            }
+
+            beginMessage(2, 0, MST_UserControlMsg, 0);
+            cw_.writeB((uint16_t)UCMT_PingResponse);
+            cw_.writeB(ucp->value);
+            endMessage();
+            report_.pings++;
+        }
+
+        void onMessage(RtmpMsgHeaderPtr& mh)
+        {
+            switch(mh->typeId)
+            {
+                case MST_SetChunkSize:
+                    inChunkSize_ = ReadBuffer::read<int32_t>(mh->body, mh->length, ReadBuffer::BIG);
+                    break;
+                case MST_Acknowledgement:
+                    report_.acks++;
+                    report_.lastAck = ReadBuffer::read<uint32_t>(mh->body, mh->length, ReadBuffer::BIG);
+                    break;
+                case MST_UserControlMsg:
+                    onUserControl(mh);
+                    break;
+                case MST_CmdAMF0:
+                case MST_CmdAMF3:
+                    onCommand(mh);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        void onData()
+        {
+            if(state_ == LSS_Handshake)
+            {
+                onHandshake();
+            }
+
+            while(state_ != LSS_Handshake && state_ != LSS_Failed && rb_.getUnReadSize() > 0)
+            {
+                rb_.snapStart();
+                RtmpMsgHeaderPtr mh = parser_.parseMsgHeader(inChunkSize_);
+                if(!mh)
+                {
+                    rb_.snapStop();
+                    break;
+                }
+                rb_.snapClear();
+
+                onMessage(mh);
+            }
+        }
+
+    public:
+        LoadStream(const MediaSource& media, const struct sockaddr_in& addr, const string& app,
+                const string& tcUrl, const string& name, int chunkSize):
+            media_(media), addr_(addr), app_(app), tcUrl_(tcUrl), outChunkSize_(chunkSize),
+            state_(LSS_Waiting), sock_(-1), startTime_(0), publishStart_(0), outPos_(0),
+            rb_(4096), parser_(&rb_), inChunkSize_(128), wb_(4096), cw_(&wb_),
+            rtmpStreamId_(1), nextTag_(0), loop_(0)
+        {
+            report_.name = name;
+            report_.published = false;
+            report_.tcpMs = -1;
+            report_.handshakeMs = -1;
+            report_.connectMs = -1;
+            report_.publishMs = -1;
+            report_.sentBytes = 0;
+            report_.sentMessages = 0;
+            report_.acks = 0;
+            report_.lastAck = 0;
+            report_.pings = 0;
+            report_.lateFrames = 0;
+        }
+
+        ~LoadStream()
+        {
+            closeSocket();
+        }
+
+        void start()
+        {
+            startTime_ = Utility::getMonotonicMicros();
+
+            if((sock_ = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+            {
+                fail("create socket failed");
+                return;
+            }
+
+            int one = 1;
+            setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(sock_, F_SETFL, fcntl(sock_, F_GETFL) | O_NONBLOCK);
+
+            if(connect(sock_, (struct sockaddr*)&addr_, sizeof(addr_)) == -1 && errno != EINPROGRESS)
+            {
+                fail(string("connect failed: ") + strerror(errno));
+                return;
+            }
+
+            state_ = LSS_Connecting;
+        }
+
+        void stop()
+        {
+            if(state_ != LSS_Failed)
+            {
+                state_ = LSS_Done;
+            }
+
+            closeSocket();
+        }
+
+        bool isActive()
+        {
+            return sock_ != -1;
+        }
+
+        int getSocket()
+        {
+            return sock_;
+        }
+
+        short getEvents()
+        {
+            if(state_ == LSS_Connecting)
+            {
+                return POLLOUT;
+            }
+
+            return POLLIN | (getPending() > 0 ? POLLOUT : 0);
+        }
+
+        // queues every tag that is due, returns when the next one is, in microseconds
+        int64_t pump(int64_t now)
+        {
+            if(state_ != LSS_Publishing)
+            {
+                return -1;
+            }
+
+            while(true)
+            {
+                const FlvTag& tag = media_.tags[nextTag_];
+                uint32_t timestamp = loop_ * media_.duration + tag.timestamp;
+                int64_t due = publishStart_ + (int64_t)timestamp * 1000;
+
+                if(due > now)
+                {
+                    return due;
+                }
+
+                if(getPending() > MAX_PENDING)
+                {
+                    // the server does not keep up, the frame is sent once there is room
+                    report_.lateFrames++;
+                    return now + 1000;
+                }
+
+                sendTag(tag, timestamp);
+
+                if(++nextTag_ == media_.tags.size())
+                {
+                    nextTag_ = 0;
+                    loop_++;
+                }
+            }
+        }
+
+        void onEvents(short revents)
+        {
+            if(state_ == LSS_Connecting)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(sock_, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err)
+                {
+                    fail(string("connect failed: ") + strerror(err));
+                    return;
+                }
+
+                onConnected();
+            }
+
+            if(revents & POLLIN)
+            {
+                uint8_t buf[16384];
+                int n = recv(sock_, buf, sizeof(buf), 0);
+                if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                {
+                    fail(n == 0 ? "server closed the connection" : strerror(errno));
+                    return;
+                }
+
+                if(n > 0)
+                {
+                    try
+                    {
+                        rb_.appendData(buf, n);
+                        onData();
+                    }
+                    catch(RtmpException& e)
+                    {
+                        fail(e.what());
+                        return;
+                    }
+                }
+            }
+            else if(revents & (POLLERR | POLLHUP))
+            {
+                fail("socket error");
+                return;
+            }
+
+            while(getPending() > 0)
+            {
+                int n = send(sock_, &out_[outPos_], getPending(), MSG_NOSIGNAL);
+                if(n < 0)
+                {
+                    if(errno != EAGAIN && errno != EINTR)
+                    {
+                        fail(strerror(errno));
+                    }
+                    break;
+                }
+
+                outPos_ += n;
+            }
+
+            if(outPos_ == out_.size())
+            {
+                out_.clear();
+                outPos_ = 0;
+            }
+            else if(outPos_ > 65536 && outPos_ * 2 > out_.size())
+            {
+                out_.erase(out_.begin(), out_.begin() + outPos_);
+                outPos_ = 0;
+            }
+        }
+
+        LoadStreamReport& getReport()
+        {
+            return report_;
+        }
+};
+
+struct LoadOptions
+{
+    string host;
+    int port;
+    string app;
+    string prefix;
+    int streams;
+    int threads;
+    int kbps;
+    int chunkSize;
+    const char* file;
+    int seconds;
+    int rampMs;
+};
+
+// runs every threads'th stream, starting at first
+static void worker(vector<LoadStream*>* streams, int first, int step, LoadOptions* options)
+{
+    vector<LoadStream*> mine;
+    for(size_t i = first; i < streams->size(); i += step)
+    {
+        mine.push_back((*streams)[i]);
+    }
+
+    int64_t begin = Utility::getMonotonicMicros();
+    int64_t end = begin + (int64_t)options->seconds * 1000000 + (int64_t)options->rampMs * 1000 * streams->size();
+    size_t started = 0;
+
+    vector<struct pollfd> fds;
+    vector<LoadStream*> polled;
+
+    while(true)
+    {
+        int64_t now = Utility::getMonotonicMicros();
+        if(now >= end)
+        {
+            break;
+        }
+
+        // streams are started ramp ms apart over all threads
+        while(started < mine.size() &&
+                begin + (int64_t)(first + started * step) * options->rampMs * 1000 <= now)
+        {
+            mine[started++]->start();
+        }
+
+        int64_t wake = end;
+        if(started < mine.size())
+        {
+            wake = min(wake, begin + (int64_t)(first + started * step) * options->rampMs * 1000);
+        }
+
+        fds.clear();
+        polled.clear();
+        for(size_t i = 0; i < started; i++)
+        {
+            LoadStream* s = mine[i];
+            int64_t due = s->pump(now);
+            if(due > 0)
+            {
+                wake = min(wake, due);
+            }
+
+            if(s->isActive())
+            {
+                struct pollfd p;
+                p.fd = s->getSocket();
+                p.events = s->getEvents();
+                p.revents = 0;
+                fds.push_back(p);
+                polled.push_back(s);
+            }
+        }
+
+        int timeout = (int)((wake - now + 999) / 1000);
+        if(timeout < 0)
+        {
+            timeout = 0;
+        }
+
+        if(fds.empty())
+        {
+            if(started == mine.size())
+            {
+                break;
+            }
+
+            usleep(timeout * 1000);
+            continue;
+        }
+
+        if(poll(&fds[0], fds.size(), timeout) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        for(size_t i = 0; i < fds.size(); i++)
+        {
+            if(fds[i].revents)
+            {
+                polled[i]->onEvents(fds[i].revents);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < mine.size(); i++)
+    {
+        mine[i]->stop();
+    }
+}
+
+static double percentile(vector<double>& v, double p)
+{
+    if(v.empty())
+    {
+        return -1;
+    }
+
+    sort(v.begin(), v.end());
+    size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-a app] [-s prefix] [-n streams] [-t threads]\n"
+            "       [-b kbps] [-c chunk size] [-f file.flv] [-d seconds] [-r ramp ms]\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    LoadOptions o;
+    o.host = "127.0.0.1";
+    o.port = 1935;
+    o.app = "live";
+    o.prefix = "load";
+    o.streams = 1;
+    o.threads = 1;
+    o.kbps = 1000;
+    o.chunkSize = 128;
+    o.file = NULL;
+    o.seconds = 10;
+    o.rampMs = 10;
+
+    int c;
+    while((c = getopt(argc, argv, "h:p:a:s:n:t:b:c:f:d:r:")) != -1)
+    {
+        switch(c)
+        {
+            case 'h': o.host = optarg; break;
+            case 'p': o.port = atoi(optarg); break;
+            case 'a': o.app = optarg; break;
+            case 's': o.prefix = optarg; break;
+            case 'n': o.streams = atoi(optarg); break;
+            case 't': o.threads = atoi(optarg); break;
+            case 'b': o.kbps = atoi(optarg); break;
+            case 'c': o.chunkSize = atoi(optarg); break;
+            case 'f': o.file = optarg; break;
+            case 'd': o.seconds = atoi(optarg); break;
+            case 'r': o.rampMs = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // timestamps are sent without the extended field
+    if(o.streams < 1 || o.threads < 1 || o.chunkSize < 1 || o.chunkSize > 0xffffff ||
+            o.seconds < 1 || o.seconds > 4 * 3600 || o.kbps < 1 || o.rampMs < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Log::setLevel(LEVWARN);
+
+    struct hostent* he = gethostbyname(o.host.c_str());
+    if(!he)
+    {
+        fprintf(stderr, "can not resolve %s\n", o.host.c_str());
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(o.port);
+    memcpy(&addr.sin_addr, he->h_addr_list[0], sizeof(addr.sin_addr));
+
+    MediaSource media;
+    try
+    {
+        if(o.file)
+        {
+            media.load(o.file);
+        }
+        else
+        {
+            media.synthesize(o.kbps);
+        }
+    }
+    catch(RtmpException& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    string tcUrl = "rtmp://" + o.host + ":" + Utility::numToStr(o.port) + "/" + o.app;
+
+    vector<LoadStream*> streams;
+    for(int i = 0; i < o.streams; i++)
+    {
+        streams.push_back(new LoadStream(media, addr, o.app, tcUrl,
+                    o.prefix + Utility::numToStr(i), o.chunkSize));
+    }
+
+    boost::thread_group threads;
+    for(int i = 0; i < o.threads; i++)
+    {
+        threads.create_thread(boost::bind(worker, &streams, i, o.threads, &o));
+    }
+    threads.join_all();
+
+    vector<double> connectMs;
+    vector<double> publishMs;
+    int published = 0;
+    int64_t sentBytes = 0;
+    int64_t acks = 0;
+    int64_t pings = 0;
+    int64_t late = 0;
+
+    for(size_t i = 0; i < streams.size(); i++)
+    {
+        LoadStreamReport& r = streams[i]->getReport();
+
+        printf("stream=%s published=%d status=%s tcp_ms=%.1f handshake_ms=%.1f connect_ms=%.1f "
+                "publish_ms=%.1f sent_bytes=%lld messages=%lld acks=%d last_ack=%u pings=%d late_frames=%lld error=\"%s\"\n",
+                r.name.c_str(), r.published, r.status.empty() ? "-" : r.status.c_str(),
+                r.tcpMs, r.handshakeMs, r.connectMs, r.publishMs,
+                (long long)r.sentBytes, (long long)r.sentMessages, r.acks, r.lastAck, r.pings,
+                (long long)r.lateFrames, r.error.c_str());
+
+        if(r.connectMs >= 0)
+        {
+            connectMs.push_back(r.connectMs);
+        }
+        if(r.published)
+        {
+            published++;
+            publishMs.push_back(r.publishMs);
+        }
+        sentBytes += r.sentBytes;
+        acks += r.acks;
+        pings += r.pings;
+        late += r.lateFrames;
+
+        delete streams[i];
+    }
+
+    printf("summary streams=%d published=%d connect_ms_p50=%.1f connect_ms_p99=%.1f "
+            "publish_ms_p50=%.1f publish_ms_p99=%.1f sent_bytes=%lld acks=%lld pings=%lld late_frames=%lld\n",
+            o.streams, published, percentile(connectMs, 0.5), percentile(connectMs, 0.99),
+            percentile(publishMs, 0.5), percentile(publishMs, 0.99),
+            (long long)sentBytes, (long long)acks, (long long)pings, (long long)late);
+
+    return published == o.streams ? 0 : 2;
+}
@@ -8,6 +8,8 @@
 #include <boost/shared_ptr.hpp>
 #include <vector>
 #include "rtmpexception.h"
+#include "memaccount.h"
+#include "amf0value.h"
 
 using namespace std;
 
@@ -22,14 +24,20 @@ struct RtmpMsgHeader
     uint8_t* body;
     int64_t extendtedTimestamp;
 
-    // contains msg headers not belong to itself
+    // body bytes still to come in later chunks
     int32_t unParsedSize;
-    boost::shared_ptr<RtmpMsgHeader> prevMsgHeader;
+
+    // body bytes charged to the connection
+    MemAccountPtr account;
+    int32_t chargedSize;
+
+    // monotonic microseconds of the recv() that completed the message, audio and video only
+    int64_t recvTime;
 
     RtmpMsgHeader():
         chunkType(0), chunkStreamId(-1), timestamp(-1), length(-1),
         typeId(0), streamId(-1), body(NULL), extendtedTimestamp(-1),
-        unParsedSize(-1), prevMsgHeader()
+        unParsedSize(-1), account(), chargedSize(0), recvTime(0)
     {
     }
 
@@ -37,32 +45,24 @@ struct RtmpMsgHeader
     {
         if(body)
             delete[] body;
+
+        if(account)
+            account->release(chargedSize);
     }
 
-    boost::shared_ptr<RtmpMsgHeader> findPrev(int32_t chunkStreamId)
+    void allocBody(int32_t size, const MemAccountPtr& acc)
     {
-        boost::shared_ptr<RtmpMsgHeader> tmp = prevMsgHeader;
-        while(tmp)
+        if(acc)
         {
-            // find the last un-full message
-            if(tmp->chunkStreamId == chunkStreamId && tmp->unParsedSize > 0)
-            {
-                break;
-            }
-
-            tmp = tmp->prevMsgHeader;
+            acc->charge(size);
+            account = acc;
+            chargedSize = size;
         }
-        
-        return tmp;
-    }
 
-    void appendType3(boost::shared_ptr<RtmpMsgHeader> type3Msg)
-    {
-        memcpy(body + length - unParsedSize, type3Msg->body, type3Msg->length);
-        unParsedSize -= type3Msg->length;
+        body = new uint8_t[size];
     }
 
-    void appendData(uint8_t* data, int len)
+    void appendData(const uint8_t* data, int len)
     {
         memcpy(body + length - unParsedSize, data, len);
         unParsedSize -= len;
@@ -225,18 +225,29 @@ struct WindowAckSizeMsg
 
 typedef boost::shared_ptr<WindowAckSizeMsg> WindowAckSizeMsgPtr;
 
+struct UserControlMsg
+{
+    int eventType;
+    // the stream id, buffer length or ping timestamp, 0 for events without one
+    uint32_t value;
+};
+
+typedef boost::shared_ptr<UserControlMsg> UserControlMsgPtr;
+
 enum AMF0Commands
 {
     AMF0_Connect,
     AMF0_ReleaseStream,
     AMF0_FCPublish,
     AMF0_CreateStream,
-    AMF0_Publish
+    AMF0_Publish,
+    AMF0_UnknownCmd = 0xff
 };
 
 enum AMF0DataTypes
 {
-    AMF0_DATA_SetDataFrame
+    AMF0_DATA_SetDataFrame,
+    AMF0_DATA_Unknown = 0xff
 };
 
 enum RtmpMessages
@@ -254,6 +265,34 @@ enum RtmpMessages
     RMS_Video
 };
 
+enum MetaDataKey
+{
+    MDK_Author,
+    MDK_Copyright,
+    MDK_Description,
+    MDK_Keywords,
+    MDK_Rating,
+    MDK_Title,
+    MDK_Presetname,
+    MDK_Creationdate,
+    MDK_Videodevice,
+    MDK_Framerate,
+    MDK_Width,
+    MDK_Height,
+    MDK_Videocodecid,
+    MDK_Videodatarate,
+    MDK_Avclevel,
+    MDK_Avcprofile,
+    MDK_VideokeyframeFrequency,
+    MDK_Audiodevice,
+    MDK_Audiosamplerate,
+    MDK_Audiochannels,
+    MDK_Audioinputvolume,
+    MDK_Audiocodecid,
+    MDK_Audiodatarate,
+    MDK_Unknown = 0xff
+};
+
 struct MetaDataMsg
 {
     string author;
@@ -285,6 +324,10 @@ struct MetaDataMsg
     int32_t metadata_size;
     int64_t timestamp;
 
+    // every value sent, including keys not known above,
+    // it is decoded from metadata on first use
+    AMF0DocumentPtr document;
+
     MetaDataMsg(): width(-1), audiosamplerate(-1),
     metadata(NULL), metadata_size(0), timestamp(0)
     {
@@ -299,6 +342,22 @@ struct MetaDataMsg
             metadata_size = 0;
         }
     }
+
+    AMF0DocumentPtr getDocument()
+    {
+        if(!document)
+        {
+            document.reset(new AMF0Document(metadata, metadata_size));
+        }
+
+        return document;
+    }
+
+    // NULL when the encoder did not send the key
+    AMF0Value* getProperty(const char* key)
+    {
+        return getDocument()->getProperty(key);
+    }
 };
 
 typedef boost::shared_ptr<MetaDataMsg> MetaDataMsgPtr;
@@ -1,388 +1,412 @@
 #include "rtmpparser.h"
 #include <boost/shared_ptr.hpp>
-#include <boost/algorithm/string.hpp>
 #include "amf0.h"
+#include "amfkeys.h"
 #include "log.h"
 #include "utility.h"
 
 RtmpParser::RtmpParser(ReadBuffer* rb): rb_(rb), 
-    streamContexts_(), savedStreamContexts_(), 
-    msgsBuffer_(), savedMsgsBuffer_()
+    streamContexts_(), chunkCount_(0)
 {
 }
 
 RtmpParser::~RtmpParser()
 {
-    clearStreamContext(streamContexts_);
-    clearStreamContext(savedStreamContexts_);
+    StreamContextMapIt it = streamContexts_.begin();
+
+    for(; it < streamContexts_.end(); it++)
+    {
+        delete it->second;
+    }
 }
 
-void RtmpParser::clearStreamContext(vector< pair<int, StreamContext*> >& context)
+void RtmpParser::setMemAccount(MemAccountPtr account)
 {
-     vector< pair<int, StreamContext*> >::iterator it = context.begin();
-
-     for(; it < context.end(); it++)
-     {
-         delete it->second;
-         it->second = NULL;
-     }
-
-     context.clear();
+    account_ = account;
 }
 
-void RtmpParser::saveContext()
+uint64_t RtmpParser::getChunkCount()
 {
-    clearStreamContext(savedStreamContexts_);
-    copyStreamContext(savedStreamContexts_, streamContexts_);
-
-    savedMsgsBuffer_.clear();
-
-    vector<RtmpMsgHeaderPtr>::iterator it = msgsBuffer_.begin();
-    for(; it < msgsBuffer_.end(); it++)
-    {
-        savedMsgsBuffer_.push_back(*it);
-    } 
+    return chunkCount_;
 }
 
-void RtmpParser::restoreContext()
+StreamContext* RtmpParser::getStreamContext(int streamId)
 {
-    clearStreamContext(streamContexts_);
-    copyStreamContext(streamContexts_, savedStreamContexts_);
-
-    msgsBuffer_.clear();
+    StreamContext* sc = NULL;
+    StreamContextMapIt it = streamContexts_.begin();
 
-    vector<RtmpMsgHeaderPtr>::iterator it = savedMsgsBuffer_.begin();
-    for(; it < savedMsgsBuffer_.end(); it++)
+    for(; it < streamContexts_.end(); it++)
     {
-        msgsBuffer_.push_back(*it);
-    } 
+        if(it->first == streamId)
+        {
+            sc = it->second;
+            break;
+        } 
+    }
+
+    return sc;
 }
 
-void RtmpParser::copyStreamContext(vector< pair<int, StreamContext*> >& dst, 
-        vector< pair<int, StreamContext*> >& src)
+RtmpMsgHeaderPtr RtmpParser::parseMsgHeader(int chunkSize)
 {
-     vector< pair<int, StreamContext*> >::iterator it = src.begin();
+    RTMP_LOG_RATE(LEVDEBUG, 10, "RtmpParser::parseMsgHeader\n");
 
-     for(; it < src.end(); it++)
-     {
-         int streamId = it->first;
-         StreamContext* srcCtx = it->second;
-         
-         pair<int, StreamContext*> p(streamId, new StreamContext(*srcCtx));
+    RtmpMsgHeaderPtr mh;
+    while(!mh)
+    {
+        if(!parseChunk(chunkSize, mh))
+        {
+            break;
+        }
+    }
 
-         dst.push_back(p);
-     }
+    return mh;
 }
 
-RtmpMsgHeaderPtr RtmpParser::parseMsgHeaderOnly()
+static uint32_t readUint(const uint8_t* data, int bytes, ReadBuffer::Mode mode)
 {
-    RtmpMsgHeaderPtr mh(new RtmpMsgHeader());
+    uint32_t v = 0;
+    for(int i = 0; i < bytes; i++)
+    {
+        if(mode == ReadBuffer::BIG)
+        {
+            v |= (uint32_t)data[i] << (8 * (bytes - i - 1));
+        }
+        else
+        {
+            v |= (uint32_t)data[i] << (8 * i);
+        }
+    }
 
-    //Utility::dumpData(rb_->getUnReadBufferNoCopy(),
-    //            rb_->getUnReadSize(), "/tmp/xg");
+    return v;
+}
 
-    uint8_t firstByte = rb_->readByte();
+// the chunk is peeked at, nothing is taken from the buffer or changes in
+// the context until all of it is there
+bool RtmpParser::parseChunk(int chunkSize, RtmpMsgHeaderPtr& msg)
+{
+    // message header size of chunk type 0, 1, 2 and 3
+    static const int MSG_HEADER_SIZE[] = {11, 7, 3, 0};
 
-    mh->chunkType = firstByte >> 6;
-    mh->chunkStreamId = firstByte & ((1 << 6) - 1);
+    int unread = rb_->getUnReadSize();
+    const uint8_t* data = rb_->getUnReadBufferNoCopy();
+    int pos = 1;
 
-    if(mh->chunkType != 0 && mh->chunkType != 1 && mh->chunkType != 2 && mh->chunkType != 3)
+    if(unread < pos)
     {
-        throw RtmpBadProtocalData("chunkType should be 0, 1, 2 or 3");
+        return false;
     }
 
-    if(mh->chunkStreamId == 0)
+    uint8_t chunkType = data[0] >> 6;
+    int32_t chunkStreamId = data[0] & ((1 << 6) - 1);
+
+    if(chunkStreamId == 0)
     {
-        mh->chunkStreamId = rb_->readByte() + 64;
+        pos = 2;
+        if(unread < pos)
+        {
+            return false;
+        }
+        chunkStreamId = data[1] + 64;
     } 
-    else if(mh->chunkStreamId == 1)
+    else if(chunkStreamId == 1)
     {
         // third * 256 + second + 64
-        mh->chunkStreamId = rb_->read<uint16_t>(ReadBuffer::LITTLE) + 64;
+        pos = 3;
+        if(unread < pos)
+        {
+            return false;
+        }
+        chunkStreamId = readUint(data + 1, 2, ReadBuffer::LITTLE) + 64;
     }
 
-    StreamContext* sc = NULL;
-
-    switch(mh->chunkType)
+    if(unread < pos + MSG_HEADER_SIZE[chunkType])
     {
-        case 0:
-            mh->timestamp = rb_->read<uint32_t>(ReadBuffer::BIG, 3);
-            mh->length = rb_->read<uint32_t>(ReadBuffer::BIG, 3);
-            mh->typeId = rb_->readByte();
-            mh->streamId = rb_->read<uint32_t>(ReadBuffer::LITTLE);
-            break;
-        case 1:
-            mh->timestamp = rb_->read<uint32_t>(ReadBuffer::BIG, 3);
-            mh->length = rb_->read<uint32_t>(ReadBuffer::BIG, 3);
-            mh->typeId = rb_->readByte();
-            break;
-        case 2:
-            mh->timestamp = rb_->read<uint32_t>(ReadBuffer::BIG, 3);
-            break;
-        case 3:
-            sc = getStreamContext(mh->chunkStreamId);
-            if(sc != NULL)
-            {
-                if(sc->prevMsg->extendtedTimestamp != -1 &&
-                   sc->prevMsg->extendtedTimestamp == rb_->peek<uint32_t>(ReadBuffer::BIG))
-                {
-                    // RTMP spec says: (Extended Timestamp, Type 3 chunks MUST NOT have this field)
-                    // BUT FMLE sends this!!
-                    //
+        return false;
+    }
 
-                    mh->timestamp = 0x00ffffff;
-                }
-            }
+    StreamContext* sc = getStreamContext(chunkStreamId);
 
-            // no header
-            break;
-        default:
-            throw RtmpBadProtocalData("chunk type should be 0, 1, 2, or 3"); 
+    if(sc == NULL && chunkType != 0)
+    {
+        throw RtmpBadProtocalData("chunk stream does not start with a type 0 chunk");
     }
 
-    if(mh->timestamp == 0x00ffffff)
+    int64_t timestamp = 0;
+    int32_t length = sc ? sc->length : 0;
+    uint8_t typeId = sc ? sc->typeId : 0;
+    int32_t streamId = sc ? sc->streamId : 0;
+    int64_t extendtedTimestamp = -1;
+
+    if(chunkType != 3)
     {
-        mh->extendtedTimestamp = rb_->read<uint32_t>(ReadBuffer::BIG); 
-        mh->timestamp = (uint64_t)0x00ffffff + mh->extendtedTimestamp;
+        timestamp = readUint(data + pos, 3, ReadBuffer::BIG);
     }
 
-    return mh;
-}
+    if(chunkType == 0 || chunkType == 1)
+    {
+        length = readUint(data + pos + 3, 3, ReadBuffer::BIG);
+        typeId = data[pos + 6];
+    }
 
-void RtmpParser::parseMsgHeaderPartial(int& chunkSize, RtmpMsgHeaderPtr& prevMh)
-{
-    RTMP_LOG(LEVDEBUG, "RtmpParser::parseMsgHeaderPartial\n");
-    RtmpMsgHeaderPtr mh = parseMsgHeaderOnly();
+    if(chunkType == 0)
+    {
+        streamId = readUint(data + pos + 7, 4, ReadBuffer::LITTLE);
+    }
 
-    bool isIndependPkt = false;
+    pos += MSG_HEADER_SIZE[chunkType];
 
-    if(mh->chunkType == 3)
+    if(chunkType != 3 && timestamp == 0x00ffffff)
     {
-        do{
-            RtmpMsgHeaderPtr tmp;
-            if(prevMh->chunkStreamId == mh->chunkStreamId)
-            {
-                tmp = prevMh;
-            }
-            else
-            {
-                tmp = prevMh->findPrev(mh->chunkStreamId);
-
-                if(!tmp){
-                    // other type 3 not part of one msg can be found here
-                    // we need to handle that!!
-                    isIndependPkt = true;
-                    break;
-                }
-            }
-            
-            mh->length = (chunkSize > tmp->unParsedSize) ? tmp->unParsedSize : chunkSize;
-            mh->body = rb_->readBytes(mh->length);
+        if(unread < pos + 4)
+        {
+            return false;
+        }
 
-            tmp->appendType3(mh);
-            return;
-        }while(0);
+        extendtedTimestamp = readUint(data + pos, 4, ReadBuffer::BIG);
+        timestamp = (uint64_t)0x00ffffff + extendtedTimestamp;
+        pos += 4;
     }
-
-    if(mh->chunkType != 3 || isIndependPkt)
+    else if(chunkType == 3 && sc->extendtedTimestamp != -1)
     {
-        onMsgHeaderParsed(mh);
-        mh->prevMsgHeader = prevMh;
-
-        RtmpMsgHeaderPtr anotherMsg = parseMsgHeader(chunkSize, &mh);
-
-        // set chunk size impact chunksize immediately
-        if(anotherMsg->typeId == 1)
+        if(unread < pos + 4)
         {
-            chunkSize = ReadBuffer::read<int32_t>(anotherMsg->body, anotherMsg->length, ReadBuffer::BIG);
+            return false;
         }
 
-        msgsBuffer_.push_back(anotherMsg);
-        return;
+        if(readUint(data + pos, 4, ReadBuffer::BIG) == sc->extendtedTimestamp)
+        {
+            // RTMP spec says: (Extended Timestamp, Type 3 chunks MUST NOT have this field)
+            // BUT FMLE sends this!!
+            //
+
+            extendtedTimestamp = sc->extendtedTimestamp;
+            pos += 4;
+        }
     }
-}
 
-StreamContext* RtmpParser::getStreamContext(int streamId)
-{
-    StreamContext* sc = NULL;
-    StreamContextMapIt it = streamContexts_.begin();
+    RtmpMsgHeaderPtr mh = sc ? sc->partial : RtmpMsgHeaderPtr();
 
-    for(; it < streamContexts_.end(); it++)
+    if(mh && chunkType != 3)
     {
-        if(it->first == streamId)
-        {
-            sc = it->second;
-            break;
-        } 
+        // a new message starts, the rest of the old one is not coming
+        RTMP_LOG(LEVWARN, "chunk stream %d dropped a message with %d bytes missing\n",
+                chunkStreamId, mh->unParsedSize);
+        mh.reset();
     }
 
-    return sc;
-}
+    int size = mh ? mh->unParsedSize : length;
+    if(size > chunkSize)
+    {
+        size = chunkSize;
+    }
 
-void RtmpParser::onMsgHeaderParsed(RtmpMsgHeaderPtr& mh)
-{
-    if(mh->typeId == MST_Audio || mh->typeId == MST_Video || mh->chunkType == 2 || mh->chunkType == 3 || mh->typeId == MST_DataAMF0)
+    if(unread < pos + size)
     {
-        StreamContext* sc = getStreamContext(mh->chunkStreamId);
+        return false;
+    }
 
-        if(sc == NULL)
+    // the whole chunk is here, from now on it is taken
+
+    if(sc == NULL)
+    {
+        if((int)streamContexts_.size() >= MAX_CHUNK_STREAMS)
         {
-            pair<int, StreamContext*> p(mh->chunkStreamId, new StreamContext());
-            sc = p.second;
-            sc->prevMsg = mh;
-            streamContexts_.push_back(p);
+            throw RtmpBadProtocalData("too many chunk streams");
         }
 
-        // Determin timedelta
+        pair<int, StreamContext*> p(chunkStreamId, new StreamContext());
+        sc = p.second;
+        streamContexts_.push_back(p);
+    }
 
-        // 3 after 0, then timedelta should be type 0's timestamp
-        if(sc->prevMsg->chunkType == 0 && mh->chunkType == 3)
-        {
-            sc->timestampDelta = sc->prevMsg->timestamp;
-        }
-        else if(mh->chunkType == 1 || mh->chunkType == 2)
-        {
-            sc->timestampDelta = mh->timestamp;
-        }
-        else
+    if(!mh)
+    {
+        // Determin timedelta and timestamp
+        switch(chunkType)
         {
-            //throw RtmpBadProtocalData("can't determin timedelta");
-        }
+            case 0:
+                sc->timestamp = timestamp;
+                break;
+            case 1:
+            case 2:
+                sc->timestampDelta = timestamp;
+                sc->timestamp += sc->timestampDelta;
+                break;
+            default:
+                // 3 after 0, then timedelta should be type 0's timestamp
+                if(sc->chunkType == 0)
+                {
+                    sc->timestampDelta = sc->timestamp;
+                }
+                sc->timestamp += sc->timestampDelta;
 
-        // 2. determin timestamp
-        //    if not type 0, then determin other parameter 
-        if(mh->chunkType == 0)
-        {
-            sc->timestamp = mh->timestamp;
+                if(extendtedTimestamp == -1)
+                {
+                    extendtedTimestamp = sc->extendtedTimestamp;
+                }
+                break;
         }
-        else
-        {
-            sc->timestamp += sc->timestampDelta;
 
-            mh->timestamp = sc->timestamp;
+        sc->length = length;
+        sc->typeId = typeId;
+        sc->streamId = streamId;
+        sc->extendtedTimestamp = extendtedTimestamp;
+        sc->chunkType = chunkType;
 
-            mh->streamId = sc->prevMsg->streamId;
-
-            if(mh->extendtedTimestamp == -1 && mh->chunkType == 3)
-            {
-                mh->extendtedTimestamp = sc->prevMsg->extendtedTimestamp;
-            }
-
-            // type 1 has message length and typeId
-            if(mh->chunkType != 1)
-            {
-                mh->length = sc->prevMsg->length;
-                mh->typeId = sc->prevMsg->typeId;
-            }
-        }
-
-        sc->prevMsg = mh;
+        mh.reset(new RtmpMsgHeader());
+        mh->chunkType = chunkType;
+        mh->chunkStreamId = chunkStreamId;
+        mh->timestamp = sc->timestamp;
+        mh->length = length;
+        mh->typeId = typeId;
+        mh->streamId = streamId;
+        mh->extendtedTimestamp = extendtedTimestamp;
+        mh->unParsedSize = length;
+        mh->allocBody(length, account_);
     }
-    
-    mh->unParsedSize = mh->length;
-}
 
-RtmpMsgHeaderPtr RtmpParser::parseMsgHeader(int chunkSize)
-{
-    RTMP_LOG(LEVDEBUG, "RtmpParser::parseMsgHeader public\n");
-    if(msgsBuffer_.size() > 0)
-    {
-        RTMP_LOG(LEVDEBUG, "RtmpParser::parseMsgHeader public, got msg from buffer\n");
-        RtmpMsgHeaderPtr h = msgsBuffer_[0];
+    mh->appendData(data + pos, size);
+    rb_->skip(pos + size);
+    rb_->snapCommit();
+    chunkCount_++;
 
-        msgsBuffer_.erase(msgsBuffer_.begin());
-        return h;
+    if(mh->unParsedSize > 0)
+    {
+        sc->partial = mh;
     }
     else
     {
-        return parseMsgHeader(chunkSize, NULL);
+        sc->partial.reset();
+        msg = mh;
     }
+
+    return true;
 }
 
-RtmpMsgHeaderPtr RtmpParser::parseMsgHeader(int chunkSize, RtmpMsgHeaderPtr* parsingMsgHeader)
+void RtmpParser::saveState(StateWriter& w)
 {
-    RTMP_LOG(LEVDEBUG, "RtmpParser::parseMsgHeader\n");
-    RtmpMsgHeaderPtr mh;
-    if(parsingMsgHeader == NULL)
+    w.writeU32(streamContexts_.size());
+
+    StreamContextMapIt it = streamContexts_.begin();
+    for(; it < streamContexts_.end(); it++)
     {
-        mh = parseMsgHeaderOnly();
+        StreamContext* sc = it->second;
+        w.writeU32(it->first);
+        w.writeI64(sc->timestamp);
+        w.writeI64(sc->timestampDelta);
+        w.writeU32(sc->length);
+        w.writeU32(sc->typeId);
+        w.writeU32(sc->streamId);
+        w.writeI64(sc->extendtedTimestamp);
+        w.writeU32(sc->chunkType);
 
-        if(mh->length == 528)
+        // the message fields are the context's, only the body so far is new
+        RtmpMsgHeaderPtr& mh = sc->partial;
+        w.writeU32(mh ? 1 : 0);
+        if(mh)
         {
-            int y = 20;
+            w.writeU32(mh->chunkType);
+            w.writeBytes(mh->body, mh->length - mh->unParsedSize);
         }
-
-        onMsgHeaderParsed(mh);
-    }
-    else
-    {
-        mh = *parsingMsgHeader; 
     }
+}
 
-    if(chunkSize >= mh->length)
+void RtmpParser::loadState(StateReader& r)
+{
+    uint32_t count = r.readU32();
+    if(count > (uint32_t)MAX_CHUNK_STREAMS || !streamContexts_.empty())
     {
-        mh->body = rb_->readBytes(mh->length);
-        mh->unParsedSize = 0;
-        return mh;
+        throw RtmpBadProtocalData("bad chunk streams in connection state");
     }
-    else
-    {
-        uint8_t* tmp;
 
-        if(!mh->body)
-        {
-            mh->body = new uint8_t[mh->length];
-        }
+    for(uint32_t i = 0; i < count; i++)
+    {
+        pair<int, StreamContext*> p(r.readU32(), new StreamContext());
+        streamContexts_.push_back(p);
 
-        tmp = rb_->readBytes(chunkSize);
-        mh->appendData(tmp, chunkSize);
-        delete[] tmp;
+        StreamContext* sc = p.second;
+        sc->timestamp = r.readI64();
+        sc->timestampDelta = r.readI64();
+        sc->length = r.readU32();
+        sc->typeId = r.readU32();
+        sc->streamId = r.readU32();
+        sc->extendtedTimestamp = r.readI64();
+        sc->chunkType = r.readU32();
 
-        if(mh->chunkStreamId > 10)
+        if(r.readU32() == 0)
         {
-            throw RtmpBadProtocalData("invalid chunkStreamId");
+            continue;
         }
 
-        int size = chunkSize;
-
-        while(mh->unParsedSize > 0)
+        uint8_t chunkType = r.readU32();
+        int size;
+        const uint8_t* body = r.readBytes(size);
+        if(sc->length < 0 || size > sc->length)
         {
-            parseMsgHeaderPartial(chunkSize, mh);
+            throw RtmpBadProtocalData("bad partial message in connection state");
         }
 
-        return mh;
+        RtmpMsgHeaderPtr mh(new RtmpMsgHeader());
+        mh->chunkType = chunkType;
+        mh->chunkStreamId = p.first;
+        mh->timestamp = sc->timestamp;
+        mh->length = sc->length;
+        mh->typeId = sc->typeId;
+        mh->streamId = sc->streamId;
+        mh->extendtedTimestamp = sc->extendtedTimestamp;
+        mh->unParsedSize = sc->length;
+        mh->allocBody(sc->length, account_);
+        mh->appendData(body, size);
+        sc->partial = mh;
     }
 }
 
-ConnectCmdObjKey RtmpParser::CmdConnectIsKeyValid(string& keyName)
+int RtmpParser::getAMFOffset(RtmpMsgHeaderPtr& mh)
 {
-    ConnectCmdObjKey cckValidEnums[CCK_VALID_KEYS_NUM] = {CCK_App, CCK_Flashver, CCK_SwfUrl, CCK_TcUrl, CCK_Type, CCK_Fpad,
-                                                         CCK_AudioCodecs, CCK_VideoCodecs, CCK_PageUrl, CCK_ObjectEncoding};
-    string cckValidKeys[CCK_VALID_KEYS_NUM] = {"app", "flashver", "swfUrl", "tcUrl", "type", "fpad", "audioCodecs", "videoCodecs", "pageUrl", "objectEncoding"};
-
-    for(int i = 0; i < CCK_VALID_KEYS_NUM; i++)
+    // AMF3 commands and data start with a format byte, the values after it
+    // are AMF0 and switch to AMF3 with the AVM+ marker
+    if((mh->typeId == MST_CmdAMF3 || mh->typeId == MST_DataAMF3) && mh->length > 0)
     {
-        if(boost::iequals(keyName, cckValidKeys[i]))
-        {
-            return cckValidEnums[i];
-        }
+        return 1;
     }
 
-    return CCK_Unknown;
+    return 0;
+}
+
+ConnectCmdObjKey RtmpParser::CmdConnectIsKeyValid(const StrRef& keyName)
+{
+    return AMFKeys::lookupConnectKey(keyName);
 }
 
 WindowAckSizeMsgPtr RtmpParser::parseWindowAckSizeMsg(RtmpMsgHeaderPtr& mh)
 {
     WindowAckSizeMsgPtr acp(new WindowAckSizeMsg());
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
-    acp->windowAckSize = readBuffer->read<int32_t>(ReadBuffer::BIG);
+    acp->windowAckSize = ReadBuffer::read<int32_t>(mh->body, mh->length, ReadBuffer::BIG);
 
     return acp;
 }
 
+UserControlMsgPtr RtmpParser::parseUserControlMsg(RtmpMsgHeaderPtr& mh)
+{
+    if(mh->length < 2)
+    {
+        throw RtmpBadProtocalData("user control message without an event type");
+    }
+
+    UserControlMsgPtr ucp(new UserControlMsg());
+
+    ucp->eventType = ReadBuffer::read<uint16_t>(mh->body, mh->length, ReadBuffer::BIG);
+    ucp->value = 0;
+    if(mh->length >= 6)
+    {
+        ucp->value = ReadBuffer::read<uint32_t>(mh->body + 2, mh->length - 2, ReadBuffer::BIG);
+    }
+
+    return ucp;
+}
+
 AMF0Commands RtmpParser::peekAMF0Cmd(RtmpMsgHeaderPtr& mh)
 {
     if(mh->length < 0)
@@ -390,39 +414,20 @@ AMF0Commands RtmpParser::peekAMF0Cmd(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >= 0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string cmd = ap->parseAsString();    
+        StrRef cmd = ap.readString();    
+        AMF0Commands ret = AMFKeys::lookupCommand(cmd);
 
-        if(cmd.compare("releaseStream") == 0)
+        if(ret == AMF0_UnknownCmd)
         {
-            return AMF0_ReleaseStream;
-        }
-        else if(cmd.compare("FCPublish") == 0)
-        {
-            return AMF0_FCPublish;
-        }
-        else if(cmd.compare("createStream") == 0)
-        {
-            return AMF0_CreateStream;
-        }
-        else if(cmd.compare("publish") == 0)
-        {
-            return AMF0_Publish;
-        }
-        else if(cmd.compare("connect") == 0)
-        {
-            return AMF0_Connect;
-        }
-        else
-        {
-            throw RtmpNotSupported("amf0 command is not supported. CMD: " + cmd);
+            throw RtmpNotSupported("amf0 command is not supported. CMD: " + cmd.str());
         }
+
+        return ret;
     }
     catch(RtmpNoEnoughData& e)
     {
@@ -441,23 +446,20 @@ AMF0DataTypes RtmpParser::peekAMF0DataType(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >= 0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string cmd = ap->parseAsString();    
+        StrRef cmd = ap.readString();    
+        AMF0DataTypes ret = AMFKeys::lookupDataType(cmd);
 
-        if(cmd.compare("@setDataFrame") == 0)
+        if(ret == AMF0_DATA_Unknown)
         {
-            return AMF0_DATA_SetDataFrame;
-        }
-        else
-        {
-            throw RtmpNotSupported(cmd.c_str());
+            throw RtmpNotSupported(cmd.str());
         }
+
+        return ret;
     }
     catch(RtmpNoEnoughData& e)
     {
@@ -476,36 +478,32 @@ ReleaseStreamCmdPtr RtmpParser::parseReleaseStreamCmd(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >=0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
     ReleaseStreamCmdPtr mp(new ReleaseStreamCmd());
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string commandName = ap->parseAsString();
-
-        if(commandName != "releaseStream")
+        if(ap.readString() != "releaseStream")
         {
             throw RtmpBadProtocalData("expect release stream command");
         }
 
-        mp->transactionId = ap->parseAsNumber();
+        mp->transactionId = ap.readNumber();
 
-        AMF0Types t = ap->getNextType(false);
+        AMF0Types t = ap.getNextType(false);
 
         if(t == AMF0_Null)
         {
-            ap->parseNull();
+            ap.readNull();
         }
-        else if(t == AMF0_Object)
+        else if(t == AMF0_Object || t == AMF0_AvmPlusObject)
         {
             // skip the object, we do not care
-            ap->skip(t);
+            ap.skip(t);
         }
 
-        mp->streamName = ap->parseAsString();
+        mp->streamName = ap.readString().str();
         return mp;
     }
     catch(RtmpNoEnoughData& e)
@@ -525,26 +523,22 @@ PublishCmdPtr RtmpParser::parsePublishCmd(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >=0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
     PublishCmdPtr mp(new PublishCmd());
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string commandName = ap->parseAsString();
-
-        if(commandName != "publish")
+        if(ap.readString() != "publish")
         {
             throw RtmpBadProtocalData("expect publish command");
         }
 
-        mp->transactionId = ap->parseAsNumber();
-        ap->parseNull();
+        mp->transactionId = ap.readNumber();
+        ap.readNull();
 
-        mp->publishingName = ap->parseAsString();
-        mp->publishingType = ap->parseAsString();
+        mp->publishingName = ap.readString().str();
+        mp->publishingType = ap.readString().str();
 
         return mp;
     }
@@ -565,36 +559,32 @@ FCPublishCmdPtr RtmpParser::parseFCPublishCmd(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >=0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
     FCPublishCmdPtr mp(new FCPublishCmd());
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string commandName = ap->parseAsString();
-
-        if(commandName != "FCPublish")
+        if(ap.readString() != "FCPublish")
         {
             throw RtmpBadProtocalData("expect FCPublishCmd");
         }
 
-        mp->transactionId = ap->parseAsNumber();
+        mp->transactionId = ap.readNumber();
 
-        AMF0Types t = ap->getNextType(false);
+        AMF0Types t = ap.getNextType(false);
 
         if(t == AMF0_Null)
         {
-            ap->parseNull();
+            ap.readNull();
         }
-        else if(t == AMF0_Object)
+        else if(t == AMF0_Object || t == AMF0_AvmPlusObject)
         {
             // skip the object, we do not care
-            ap->skip(t);
+            ap.skip(t);
         }
 
-        mp->streamName = ap->parseAsString();
+        mp->streamName = ap.readString().str();
         return mp;
     }
     catch(RtmpNoEnoughData& e)
@@ -614,33 +604,29 @@ CreateStreamCmdPtr RtmpParser::parseCreateStreamCmd(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >=0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
     CreateStreamCmdPtr mp(new CreateStreamCmd());
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string commandName = ap->parseAsString();
-
-        if(commandName != "createStream")
+        if(ap.readString() != "createStream")
         {
             throw RtmpBadProtocalData("expect createStream");
         }
 
-        mp->transactionId = ap->parseAsNumber();
+        mp->transactionId = ap.readNumber();
 
-        AMF0Types t = ap->getNextType(false);
+        AMF0Types t = ap.getNextType(false);
 
         if(t == AMF0_Null)
         {
-            ap->parseNull();
+            ap.readNull();
         }
-        else if(t == AMF0_Object)
+        else if(t == AMF0_Object || t == AMF0_AvmPlusObject)
         {
             // skip the object, we do not care
-            ap->skip(t);
+            ap.skip(t);
         }
 
         return mp;
@@ -655,6 +641,51 @@ CreateStreamCmdPtr RtmpParser::parseCreateStreamCmd(RtmpMsgHeaderPtr& mh)
     }
 }
 
+/*
+ * command object values, the reader is AMF0Reader or AMF3Reader
+ */
+template <class Reader>
+static void readConnectValue(ConnectCmd* mp, ConnectCmdObjKey key, const StrRef& keyName, Reader& ap)
+{
+    switch(key)
+    {
+        case CCK_App:
+            mp->app = ap.readString().str();
+            break;
+        case CCK_Flashver:
+            mp->flashver = ap.readString().str();
+            break;
+        case CCK_SwfUrl:
+            mp->swfUrl = ap.readString().str();
+            break;
+        case CCK_TcUrl:
+            mp->tcUrl = ap.readString().str();
+            break;
+        case CCK_Type:
+            mp->type = ap.readString().str();
+            break;
+        case CCK_Fpad:
+            mp->fpad = ap.readBool();
+            break;
+        case CCK_AudioCodecs:
+            mp->audioCodecs = (AudioCodecConst)ap.readNumber();
+            break;
+        case CCK_VideoCodecs:
+            mp->videoCodecs = (VideoCodecConst)ap.readNumber();
+            break;
+        case CCK_PageUrl:
+            mp->pageUrl = ap.readString().str();
+            break;
+        case CCK_ObjectEncoding:
+            mp->objectEncoding = (ObjectEncodingConst)ap.readNumber();
+            break;
+        default:
+            RTMP_LOG(LEVDEBUG, "RtmpParser::parseConnectCmd: not interested key %.*s\n", keyName.len, keyName.data);
+            ap.skipValue();
+            break;
+    }
+}
+
 ConnectCmdPtr RtmpParser::parseConnectCmd(RtmpMsgHeaderPtr& mh)
 {
     if(mh->length < 0)
@@ -662,22 +693,18 @@ ConnectCmdPtr RtmpParser::parseConnectCmd(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >=0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
     ConnectCmdPtr mp(new ConnectCmd());
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     try
     {
-        string commandName = ap->parseAsString();
-
-        if(commandName != "connect")
+        if(ap.readString() != "connect")
         {
             throw RtmpBadProtocalData("expect connect command");
         }
 
-        mp->transactionId = ap->parseAsNumber();  
+        mp->transactionId = ap.readNumber();  
 
         if(mp->transactionId != 1)
         {
@@ -685,72 +712,57 @@ ConnectCmdPtr RtmpParser::parseConnectCmd(RtmpMsgHeaderPtr& mh)
         }
 
         // parse command object
-        AMF0Types t = ap->getNextType(false);
+        AMF0Types t = ap.getNextType(false);
+
+        if(t == AMF0_AvmPlusObject)
+        {
+            // sent by Flash when objectEncoding is 3
+            AMF3Reader& a3 = ap.beginAMF3();
+            AMF3ObjectCursor oc;
+            StrRef keyName;
+
+            if(!a3.readObjectStart(oc))
+            {
+                throw RtmpBadProtocalData("RtmpParser::parseConnectCmd, Expect Command Object");
+            }
+
+            while(a3.nextProperty(oc, keyName))
+            {
+                readConnectValue(mp.get(), CmdConnectIsKeyValid(keyName), keyName, a3);
+            }
+            ap.endAMF3();
+
+            return mp;
+        }
 
         if(t != AMF0_Object)
         {
             throw RtmpBadProtocalData("RtmpParser::parseConnectCmd, Expect Command Object");
         } 
-        ap->skipObjectStart();
+        ap.skipObjectStart();
 
         bool parseKey = true;
-        string keyName;
-        ConnectCmdObjKey key;
-        while(!ap->isFinished())
+        StrRef keyName;
+        ConnectCmdObjKey key = CCK_Unknown;
+        while(!ap.isFinished())
         {
-            t = ap->getNextType(true);
+            t = ap.getNextType(true);
 
             if(t == AMF0_ObjectEnd)
             {
                 // done
-                ap->skipObjectEnd();
+                ap.skipObjectEnd();
                 break;
             }
 
             if(parseKey)
             {
-                keyName = ap->parseObjectKey();
+                keyName = ap.readObjectKey();
                 key = CmdConnectIsKeyValid(keyName);
             }
             else
             {
-                switch(key)
-                {
-                    case CCK_App:
-                        mp->app = ap->parseAsString();
-                        break;
-                    case CCK_Flashver:
-                        mp->flashver = ap->parseAsString();
-                        break;
-                    case CCK_SwfUrl:
-                        mp->swfUrl = ap->parseAsString();
-                        break;
-                    case CCK_TcUrl:
-                        mp->tcUrl = ap->parseAsString();
-                        break;
-                    case CCK_Type:
-                        mp->type = ap->parseAsString();
-                        break;
-                    case CCK_Fpad:
-                        mp->fpad = ap->parseAsBool();
-                        break;
-                    case CCK_AudioCodecs:
-                        mp->audioCodecs = (AudioCodecConst)ap->parseAsNumber();
-                        break;
-                    case CCK_VideoCodecs:
-                        mp->videoCodecs = (VideoCodecConst)ap->parseAsNumber();
-                        break;
-                    case CCK_PageUrl:
-                        mp->pageUrl = ap->parseAsString();
-                        break;
-                    case CCK_ObjectEncoding:
-                        mp->objectEncoding = (ObjectEncodingConst)ap->parseAsNumber();
-                        break;
-                    default:
-                        RTMP_LOG(LEVDEBUG, "RtmpParser::parseConnectCmd: not interested key %s\n", keyName.c_str());
-                        ap->skip(t);
-                        break;
-                }
+                readConnectValue(mp.get(), key, keyName, ap);
             }
 
             parseKey = !parseKey;
@@ -768,6 +780,106 @@ ConnectCmdPtr RtmpParser::parseConnectCmd(RtmpMsgHeaderPtr& mh)
     }
 }
 
+/*
+ * onMetaData values, the reader is AMF0Reader or AMF3Reader
+ */
+template <class Reader>
+static void readMetaDataValue(MetaDataMsg* mp, MetaDataKey key, const StrRef& keyName, Reader& ap)
+{
+    switch(key)
+    {
+        case MDK_Author:
+            mp->author = ap.readString().str();
+            break;
+        case MDK_Copyright:
+            mp->copyright = ap.readString().str();
+            break;
+        case MDK_Description:
+            mp->description = ap.readString().str();
+            break;
+        case MDK_Keywords:
+            mp->keywords = ap.readString().str();
+            break;
+        case MDK_Rating:
+            mp->rating = ap.readString().str();
+            break;
+        case MDK_Title:
+            mp->title = ap.readString().str();
+            break;
+        case MDK_Presetname:
+            mp->presetname = ap.readString().str();
+            break;
+        case MDK_Creationdate:
+            mp->creationdate = ap.readString().str();
+            break;
+        case MDK_Videodevice:
+            mp->videodevice = ap.readString().str();
+            break;
+        case MDK_Framerate:
+            mp->framerate = (int)ap.readNumber();
+            break;
+        case MDK_Width:
+            mp->width = ap.readNumber();
+            break;
+        case MDK_Height:
+            mp->height = ap.readNumber();
+            break;
+        case MDK_Videocodecid:
+            if(ap.isNextNumber())
+            {
+                // ffmpeg sent this as number
+                mp->videocodecid = Utility::numToStr(ap.readNumber());
+            }
+            else
+            {
+                mp->videocodecid = ap.readString().str();
+            }
+            break;
+        case MDK_Videodatarate:
+            mp->videodatarate = ap.readNumber();
+            break;
+        case MDK_Avclevel:
+            mp->avclevel = (int)ap.readNumber();
+            break;
+        case MDK_Avcprofile:
+            mp->avcprofile = (int)ap.readNumber();
+            break;
+        case MDK_VideokeyframeFrequency:
+            mp->videokeyframe_frequency = (int)ap.readNumber();
+            break;
+        case MDK_Audiodevice:
+            mp->audiodevice = ap.readString().str();
+            break;
+        case MDK_Audiosamplerate:
+            mp->audiosamplerate = ap.readNumber();
+            break;
+        case MDK_Audiochannels:
+            mp->audiochannels = (int)ap.readNumber();
+            break;
+        case MDK_Audioinputvolume:
+            mp->audioinputvolume = (int)ap.readNumber();
+            break;
+        case MDK_Audiocodecid:
+            if(ap.isNextNumber())
+            {
+                // ffmpeg sent this as number
+                mp->audiocodecid = Utility::numToStr(ap.readNumber());
+            }
+            else
+            {
+                mp->audiocodecid = ap.readString().str();
+            }
+            break;
+        case MDK_Audiodatarate:
+            mp->audiodatarate = ap.readNumber();
+            break;
+        default:
+            ap.skipValue();
+            RTMP_LOG(LEVDEBUG, "onMetaData: key %.*s only kept in raw metadata\n", keyName.len, keyName.data);
+            break;
+    }
+}
+
 MetaDataMsgPtr RtmpParser::parseMetaData(RtmpMsgHeaderPtr& mh)
 {
     if(mh->length < 0)
@@ -775,178 +887,83 @@ MetaDataMsgPtr RtmpParser::parseMetaData(RtmpMsgHeaderPtr& mh)
         throw RtmpBadProtocalData("body length should >=0");
     }
 
-    ReadBufferPtr readBuffer(new ReadBuffer(mh->length));
-    readBuffer->appendData(mh->body, mh->length);
-
     MetaDataMsgPtr mp(new MetaDataMsg());
-    AMF0ParserPtr ap(new AMF0Parser(readBuffer));
+    int offset = getAMFOffset(mh);
+    AMF0Reader ap(mh->body + offset, mh->length - offset);
 
     bool parseKey = true;
-    string keyName;
+    StrRef keyName;
+    MetaDataKey key = MDK_Unknown;
     try
     {
-        string dataName = ap->parseAsString();
-
-        if(dataName != "@setDataFrame")
+        if(ap.readString() != "@setDataFrame")
         {
             throw RtmpBadProtocalData("expect @setDataFrame");
         }
 
-        // set raw data
-        mp->metadata = readBuffer->getUnReadBuffer();
-        mp->metadata_size = readBuffer->getUnReadSize();
+        // set raw data, the actor keeps it
+        mp->metadata_size = ap.getUnReadSize();
+        mp->metadata = new uint8_t[mp->metadata_size];
+        memcpy(mp->metadata, ap.getPtr(), mp->metadata_size);
 
-        if(ap->parseAsString() != "onMetaData")
+        if(ap.readString() != "onMetaData")
         {
             throw RtmpBadProtocalData("expect onMetaData");
         }
 
         // parse command object
-        AMF0Types t = ap->getNextType(false);
+        AMF0Types t = ap.getNextType(false);
 
         if(t == AMF0_Object)
         {
-            ap->skipObjectStart();
+            ap.skipObjectStart();
         }
         else if(t == AMF0_EcmaArray)
         {
-            ap->skipEcmaArrayStart();
+            ap.skipEcmaArrayStart();
+        }
+        else if(t == AMF0_AvmPlusObject)
+        {
+            AMF3Reader& a3 = ap.beginAMF3();
+            AMF3ObjectCursor oc;
+
+            if(!a3.readObjectStart(oc))
+            {
+                throw RtmpBadProtocalData("RtmpParser::parseMetaData, Expect Command Object or ECMA array");
+            }
+
+            while(a3.nextProperty(oc, keyName))
+            {
+                readMetaDataValue(mp.get(), AMFKeys::lookupMetaDataKey(keyName), keyName, a3);
+            }
+            ap.endAMF3();
+
+            return mp;
         }
         else
         {
             throw RtmpBadProtocalData("RtmpParser::parseMetaData, Expect Command Object or ECMA array");
         }
 
-        while(!ap->isFinished())
+        while(!ap.isFinished())
         {
-            t = ap->getNextType(true);
+            t = ap.getNextType(true);
 
             if(t == AMF0_ObjectEnd)
             {
                 // done
-                ap->skipObjectEnd();
+                ap.skipObjectEnd();
                 break;
             }
 
             if(parseKey)
             {
-                keyName = ap->parseObjectKey();
+                keyName = ap.readObjectKey();
+                key = AMFKeys::lookupMetaDataKey(keyName);
             }
             else
             {
-                if(keyName == "author")
-                {
-                    mp->author = ap->parseAsString();
-                }
-                else if(keyName == "copyright")
-                {
-                    mp->copyright = ap->parseAsString();
-                }
-                else if(keyName == "description")
-                {
-                    mp->description = ap->parseAsString();
-                }
-                else if(keyName == "keywords")
-                {
-                    mp->keywords = ap->parseAsString();
-                }
-                else if(keyName == "rating")
-                {
-                    mp->rating = ap->parseAsString();
-                }
-                else if(keyName == "title")
-                {
-                    mp->title = ap->parseAsString();
-                }
-                else if(keyName == "presetname")
-                {
-                    mp->presetname = ap->parseAsString();
-                }
-                else if(keyName == "creationdate")
-                {
-                    mp->creationdate = ap->parseAsString();
-                }
-                else if(keyName == "videodevice")
-                {
-                    mp->videodevice = ap->parseAsString();
-                }
-                else if(keyName == "framerate")
-                {
-                    mp->framerate = (int)ap->parseAsNumber();
-                }
-                else if(keyName == "width")
-                {
-                    mp->width = ap->parseAsNumber();
-                }
-                else if(keyName == "height")
-                {
-                    mp->height = ap->parseAsNumber();
-                }
-                else if(keyName == "videocodecid")
-                {
-                    if(t == AMF0_Number)
-                    {
-                        // ffmpeg sent this as number
-                        mp->videocodecid = Utility::numToStr(ap->parseAsNumber());
-                    }
-                    else
-                    {
-                        mp->videocodecid = ap->parseAsString();
-                    }
-                }
-                else if(keyName == "videodatarate")
-                {
-                    mp->videodatarate = ap->parseAsNumber();
-                }
-                else if(keyName == "avclevel")
-                {
-                    mp->avclevel = (int)ap->parseAsNumber();
-                }
-                else if(keyName == "avcprofile")
-                {
-                    mp->avcprofile = (int)ap->parseAsNumber();
-                }
-                else if(keyName == "videokeyframe_frequency")
-                {
-                    mp->videokeyframe_frequency = (int)ap->parseAsNumber();
-                }
-                else if(keyName == "audiodevice")
-                {
-                    mp->audiodevice = ap->parseAsString();
-                }
-                else if(keyName == "audiosamplerate")
-                {
-                    mp->audiosamplerate = ap->parseAsNumber();
-                }
-                else if(keyName == "audiochannels")
-                {
-                    mp->audiochannels = (int)ap->parseAsNumber();
-                }
-                else if(keyName == "audioinputvolume")
-                {
-                    mp->audioinputvolume = (int)ap->parseAsNumber();
-                }
-                else if(keyName == "audiocodecid")
-                {
-                    if(t == AMF0_Number)
-                    {
-                        // ffmpeg sent this as number
-                        mp->audiocodecid = Utility::numToStr(ap->parseAsNumber());
-                    }
-                    else
-                    {
-                        mp->audiocodecid = ap->parseAsString();
-                    }
-                }
-                else if(keyName == "audiodatarate")
-                {
-                    mp->audiodatarate = ap->parseAsNumber();
-                }
-                else
-                {
-                    ap->skip(t);
-                    RTMP_LOG(LEVWARN, "onMetaData: ignore unknown key %s\n", keyName.c_str());
-                }
+                readMetaDataValue(mp.get(), key, keyName, ap);
             }
 
             parseKey = !parseKey;
@@ -960,7 +977,7 @@ MetaDataMsgPtr RtmpParser::parseMetaData(RtmpMsgHeaderPtr& mh)
     }
     catch(RtmpInvalidAMFData& ae)
     {
-        throw RtmpBadProtocalData(("parseMetaData, data is corrupted. key: " + keyName).c_str());
+        throw RtmpBadProtocalData(("parseMetaData, data is corrupted. key: " + keyName.str()).c_str());
     }
 }
 
@@ -4,28 +4,33 @@
 #include "rtmpmsg.h"
 #include "readbuffer.h"
 #include "writebuffer.h"
+#include "strref.h"
+#include "handoff.h"
 #include <vector>
 #include <utility>
 
 using namespace std;
 
+// what a chunk stream's last message header left behind, type 1, 2 and 3
+// chunk headers leave out the fields they share with it
 struct StreamContext
 {
     int64_t timestamp;
-    int32_t timestampDelta;
+    int64_t timestampDelta;
+    int32_t length;
+    uint8_t typeId;
+    int32_t streamId;
+    int64_t extendtedTimestamp;
+    // chunk type of the header that started the last message
+    uint8_t chunkType;
 
-    RtmpMsgHeaderPtr prevMsg;
+    // the message being assembled, empty between messages
+    RtmpMsgHeaderPtr partial;
 
-    StreamContext():timestamp(-1), timestampDelta(-1)
+    StreamContext():timestamp(0), timestampDelta(0), length(0), typeId(0),
+        streamId(0), extendtedTimestamp(-1), chunkType(0)
     {
     }
-
-    StreamContext(StreamContext& sc)
-    {
-        timestampDelta = sc.timestampDelta;
-        timestamp = sc.timestamp;
-        prevMsg = sc.prevMsg;
-    }
 };
 
 class RtmpParser
@@ -34,27 +39,36 @@ class RtmpParser
         ReadBuffer* rb_;
 
         vector< pair<int, StreamContext*> > streamContexts_;
-        vector< pair<int, StreamContext*> > savedStreamContexts_;
-        vector<RtmpMsgHeaderPtr> msgsBuffer_;
-        vector<RtmpMsgHeaderPtr> savedMsgsBuffer_;
+        MemAccountPtr account_;
+        // chunks taken from the buffer
+        uint64_t chunkCount_;
 
-        RtmpMsgHeaderPtr parseMsgHeaderOnly();
-        void parseMsgHeaderPartial(int& chunkSize, RtmpMsgHeaderPtr& prevMh);
+        // a peer can open up to 65599 chunk streams, real ones use a handful
+        const static int MAX_CHUNK_STREAMS = 64;
 
-        RtmpMsgHeaderPtr parseMsgHeader(int chunkSize, RtmpMsgHeaderPtr* parseMsgHeader);
-        void             onMsgHeaderParsed(RtmpMsgHeaderPtr& mh);
+        // false when the buffer ends before the chunk does
+        bool parseChunk(int chunkSize, RtmpMsgHeaderPtr& msg);
         StreamContext* getStreamContext(int streamId);
-        void clearStreamContext(vector< pair<int, StreamContext*> >& context);
-        void copyStreamContext(vector< pair<int, StreamContext*> >& dst, 
-                vector< pair<int, StreamContext*> >& src);
+        int getAMFOffset(RtmpMsgHeaderPtr& mh);
 
     public:
         RtmpParser(ReadBuffer* rb);
         ~RtmpParser();
+        void setMemAccount(MemAccountPtr account);
+        uint64_t getChunkCount();
+        // parses chunks until a message is complete, empty when the buffer
+        // ends first. each chunk is taken from the buffer only once all of
+        // it is there, and the buffer's snap is moved past it, so a message
+        // that spans several reads is never parsed again from its start
         RtmpMsgHeaderPtr parseMsgHeader(int chunkSize);
+        // the chunk stream contexts and the messages they are assembling,
+        // for a connection that moves to another process
+        void saveState(StateWriter& w);
+        void loadState(StateReader& r);
         ConnectCmdPtr    parseConnectCmd(RtmpMsgHeaderPtr& mh);
         WindowAckSizeMsgPtr parseWindowAckSizeMsg(RtmpMsgHeaderPtr& mh);
-        ConnectCmdObjKey CmdConnectIsKeyValid(string& keyName);
+        UserControlMsgPtr parseUserControlMsg(RtmpMsgHeaderPtr& mh);
+        ConnectCmdObjKey CmdConnectIsKeyValid(const StrRef& keyName);
         AMF0Commands     peekAMF0Cmd(RtmpMsgHeaderPtr& mh);
         AMF0DataTypes peekAMF0DataType(RtmpMsgHeaderPtr& mh);
         ReleaseStreamCmdPtr parseReleaseStreamCmd(RtmpMsgHeaderPtr& mh);
@@ -62,8 +76,6 @@ class RtmpParser
         CreateStreamCmdPtr parseCreateStreamCmd(RtmpMsgHeaderPtr& mh);
         PublishCmdPtr parsePublishCmd(RtmpMsgHeaderPtr& mh);
         MetaDataMsgPtr parseMetaData(RtmpMsgHeaderPtr& mh);
-        void saveContext();
-        void restoreContext();
 };
 
 typedef vector< pair<int, StreamContext*> >::iterator StreamContextMapIt;
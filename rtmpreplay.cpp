@@ -0,0 +1,196 @@
+/*
+ * feeds captured client traffic through RtmpConnection and RtmpParser
+ *
+ * usage: tvie_rtmp_replay [-p] [-n times] capture...
+ *   -p  keep the original pacing, otherwise as fast as possible
+ *   -n  replay every capture that many times
+ *
+ * captures are written by the server after WireCapture::enable(dir), which
+ * tvie_rtmp calls when TVIE_RTMP_CAPTURE names a directory
+ */
+#include "rtmpconnection.h"
+#include "wirecapture.h"
+#include "utility.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// takes everything the server publishes, no ffmpeg
+class ReplayActor : public RtmpActor
+{
+    public:
+        int64_t audio;
+        int64_t video;
+        int64_t mediaBytes;
+
+        ReplayActor(): audio(0), video(0), mediaBytes(0)
+        {
+        }
+
+        bool onConnect(ConnectCmdPtr cmd)
+        {
+            return true;
+        }
+
+        void onDisconnect()
+        {
+        }
+
+        bool onPublish(int streamId, string publishUrl)
+        {
+            return true;
+        }
+
+        bool onCreateStream(int nextStreamId)
+        {
+            return true;
+        }
+
+        bool onMetaData(int streamId, MetaDataMsgPtr metaData)
+        {
+            return true;
+        }
+
+        bool onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg)
+        {
+            if(isVideo)
+            {
+                video++;
+            }
+            else
+            {
+                audio++;
+            }
+
+            mediaBytes += msg->length;
+            return true;
+        }
+};
+
+// the replies of the server are read and thrown away
+static void drain(int sock)
+{
+    uint8_t buf[65536];
+
+    while(read(sock, buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+static void replay(const string& path, vector<WireSegment>& segments, bool paced)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        throw RtmpInternalError("socketpair failed", errno);
+    }
+
+    boost::thread drainer(boost::bind(drain, sv[0]));
+
+    ReplayActor* actor = new ReplayActor();
+    RtmpActorPtr actorPtr(actor);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+
+    int64_t bytes = 0;
+    int64_t start = Utility::getMonotonicMicros();
+    int64_t due = start;
+
+    {
+        RtmpConnection rc(sv[1], addr, actorPtr);
+
+        for(size_t i = 0; i < segments.size() && !rc.isDisconnected(); i++)
+        {
+            WireSegment& s = segments[i];
+
+            if(paced)
+            {
+                due += s.delta;
+                int64_t now = Utility::getMonotonicMicros();
+                if(due > now)
+                {
+                    usleep(due - now);
+                }
+            }
+
+            if(!s.data.empty())
+            {
+                rc.feed(&s.data[0], s.data.size());
+            }
+            bytes += s.data.size();
+        }
+    }
+
+    int64_t elapsed = Utility::getMonotonicMicros() - start;
+
+    // the connection closed its end, the drainer sees EOF
+    drainer.join();
+    close(sv[0]);
+
+    double seconds = elapsed / 1000000.0;
+    printf("%s: %d segments %lld bytes audio %lld video %lld media %lld bytes in %.3f s, %.1f MB/s\n",
+            path.c_str(), (int)segments.size(), (long long)bytes,
+            (long long)actor->audio, (long long)actor->video, (long long)actor->mediaBytes,
+            seconds, seconds > 0 ? bytes / seconds / 1000000 : 0.0);
+}
+
+int main(int argc, char* argv[])
+{
+    bool paced = false;
+    int times = 1;
+    int c;
+
+    while((c = getopt(argc, argv, "pn:")) != -1)
+    {
+        switch(c)
+        {
+            case 'p':
+                paced = true;
+                break;
+            case 'n':
+                times = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p] [-n times] capture...\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-p] [-n times] capture...\n", argv[0]);
+        return 1;
+    }
+
+    // connection logs would be the bottleneck
+    Log::setLevel(LEVWARN);
+
+    try
+    {
+        for(int i = optind; i < argc; i++)
+        {
+            vector<WireSegment> segments;
+            WireCaptureReader::load(argv[i], segments);
+
+            for(int t = 0; t < times; t++)
+            {
+                replay(argv[i], segments, paced);
+            }
+        }
+    }
+    catch(RtmpException& e)
+    {
+        fprintf(stderr, "replay failed: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,14 +1,37 @@
 #include "rtmpserver.h"
 #include "rtmpconnection.h"
 #include "log.h"
-#include "boost/make_shared.hpp"
+#include "trace.h"
+#include "uringworker.h"
+#include "queuedactor.h"
+#include "reaper.h"
+#include "utility.h"
+#include "metrics.h"
+#include <sys/eventfd.h>
 
 RtmpServer::RtmpServer(int listenPort, createActorFn fn):
     listenPort_(listenPort),
     cafn_(fn),
     serverSock_(-1),
-    clientThreads_()    
+    clients_(new ClientThreads()),
+    backend_(IOB_Threads),
+    workers_(1),
+    nextWorker_(0),
+    draining_(false)
 {
+    clients_->nextId = 0;
+    clients_->live = 0;
+
+    if((drainFd_ = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        throw RtmpInternalError("create eventfd failed", errno);
+    }
+
+    if((stopFd_ = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        close(drainFd_);
+        throw RtmpInternalError("create eventfd failed", errno);
+    }
 }
 
 RtmpServer::~RtmpServer()
@@ -18,6 +41,59 @@ RtmpServer::~RtmpServer()
         close(serverSock_);
         serverSock_ = -1;
     }
+
+    close(drainFd_);
+    close(stopFd_);
+}
+
+void RtmpServer::setUpgradePath(const string& path)
+{
+    upgradePath_ = path;
+}
+
+void RtmpServer::setTcpTuning(const TcpTuning& tuning)
+{
+    tuning_ = tuning;
+}
+
+void RtmpServer::setIoBackend(RtmpIoBackend backend, int workers)
+{
+    backend_ = backend;
+    workers_ = workers > 0 ? workers : 1;
+}
+
+void RtmpServer::setActorThreads(int threads)
+{
+    executor_.reset(new ActorExecutor(threads));
+}
+
+RtmpActorPtr RtmpServer::createActor()
+{
+    RtmpActorPtr actor(cafn_());
+
+    if(executor_)
+    {
+        actor.reset(new QueuedActor(actor, executor_->createQueue()));
+    }
+
+    return actor;
+}
+
+bool RtmpServer::admitClient(int clientSock)
+{
+    if(MemAccount::canAccept())
+    {
+        return true;
+    }
+
+    MemStats stats = MemAccount::getStats();
+    RTMP_LOG(LEVWARN, "refuse client, process holds %lld bytes, limit is %lld\n",
+            (long long)stats.globalUsed, (long long)stats.globalLimit);
+    MemAccount::onRefused();
+    RTMP_TRACE1(conn_refuse, clientSock);
+    close(clientSock);
+
+    return false;
 }
 
 void RtmpServer::prepare()
@@ -34,6 +110,8 @@ void RtmpServer::prepare()
         throw RtmpInternalError("set socket option failed");
     }
 
+    tuning_.applyListener(serverSock_);
+
     serverAddr_.sin_family = AF_INET;
     serverAddr_.sin_port = htons(listenPort_);
     serverAddr_.sin_addr.s_addr = INADDR_ANY;
@@ -52,54 +130,367 @@ void RtmpServer::prepare()
     RTMP_LOG(LEVINFO, "Server listen on port %d\n", listenPort_);
 }
 
-void RtmpServer::cleanClientThread()
+int RtmpServer::getClientCount()
+{
+    return clients_->live.load();
+}
+
+int RtmpServer::getClientThreadCount()
+{
+    boost::lock_guard<boost::mutex> lk(clients_->mt);
+    return clients_->threads.size();
+}
+
+// on the reaper thread, the client thread has posted it on its way out
+void RtmpServer::reapClient(ClientThreadsPtr clients, uint64_t id)
+{
+    boost::thread* th = NULL;
+    {
+        boost::lock_guard<boost::mutex> lk(clients->mt);
+        map<uint64_t, boost::thread*>::iterator it = clients->threads.find(id);
+        if(it == clients->threads.end())
+        {
+            return;
+        }
+
+        th = it->second;
+        clients->threads.erase(it);
+    }
+
+    th->join();
+    delete th;
+}
+
+void RtmpServer::clientCycle(int clientSock, struct sockaddr_in clientAddr, uint64_t id, vector<uint8_t> state)
+{
+    // the server may be gone once live is lowered
+    ClientThreadsPtr clients = clients_;
+
+    RTMP_LOG(LEVINFO, "%s client, address is %s:%d\n", state.empty() ? "New" : "Handed off",
+            inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+
+    try
+    {
+        RtmpConnection rc(clientSock, clientAddr, createActor()); 
+        rc.setCork(tuning_.cork);
+
+        if(!state.empty())
+        {
+            rc.resume(state);
+            // the copy is not needed while the client is served
+            vector<uint8_t>().swap(state);
+        }
+
+        rc.handleClient(drainFd_, boost::bind(&RtmpServer::handOffClient, this, _1, _2), stopFd_); 
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "client cycle error: %s\n", e.what());
+    }
+
+    Reaper::post(boost::bind(&RtmpServer::reapClient, clients, id));
+    clients->live--;
+}
+
+void RtmpServer::spawnClient(int clientSock, struct sockaddr_in clientAddr, const vector<uint8_t>& state)
+{
+    // registered before the thread can post itself to the reaper
+    boost::lock_guard<boost::mutex> lk(clients_->mt);
+    uint64_t id = clients_->nextId++;
+    clients_->live++;
+    clients_->threads[id] = new boost::thread(boost::bind(&RtmpServer::clientCycle, this, clientSock, clientAddr, id, state));
+}
+
+bool RtmpServer::takeOver()
+{
+    int sock = HandoffChannel::connect(upgradePath_);
+    if(sock == -1)
+    {
+        return false;
+    }
+
+    HandoffChannelPtr channel(new HandoffChannel(sock));
+
+    HandoffKind kind;
+    int fd;
+    vector<uint8_t> data;
+    if(!channel->receive(kind, fd, data) || kind != HOK_Listen || fd == -1)
+    {
+        throw RtmpInternalError("the old server did not hand off its listening socket");
+    }
+
+    serverSock_ = fd;
+    tuning_.applyListener(serverSock_);
+    previous_ = channel;
+    RTMP_LOG(LEVINFO, "took over the listening socket of the server on %s\n", upgradePath_.c_str());
+
+    return true;
+}
+
+// until the old server is done draining and closes the channel
+void RtmpServer::receiveClients(HandoffChannelPtr channel)
+{
+    try
+    {
+        HandoffKind kind;
+        int fd;
+        vector<uint8_t> state;
+
+        while(channel->receive(kind, fd, state))
+        {
+            if(kind != HOK_Client || fd == -1)
+            {
+                RTMP_LOG(LEVERROR, "unexpected handoff record %d\n", kind);
+                if(fd != -1)
+                {
+                    close(fd);
+                }
+                continue;
+            }
+
+            if(!uringWorkers_.empty())
+            {
+                uringWorkers_[nextWorker_++ % uringWorkers_.size()]->adopt(fd, state);
+                continue;
+            }
+
+            struct sockaddr_in clientAddr;
+            socklen_t clientAddrLen = sizeof(clientAddr);
+            memset(&clientAddr, 0, sizeof(clientAddr));
+            getpeername(fd, (struct sockaddr*)&clientAddr, &clientAddrLen);
+
+            tuning_.applyClient(fd);
+            spawnClient(fd, clientAddr, state);
+        }
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "receive handed off clients failed: %s\n", e.what());
+    }
+
+    RTMP_LOG(LEVINFO, "the old server is done\n");
+}
+
+// one upgrade per process, the next server waits on a path of its own
+void RtmpServer::waitUpgrade(int upgradeSock)
+{
+    int sock = -1;
+    try
+    {
+        sock = HandoffChannel::accept(upgradeSock);
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "%s\n", e.what());
+    }
+
+    close(upgradeSock);
+
+    if(sock == -1)
+    {
+        return;
+    }
+
+    HandoffChannelPtr channel(new HandoffChannel(sock));
+    try
+    {
+        channel->send(HOK_Listen, serverSock_, vector<uint8_t>());
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "upgrade failed: %s\n", e.what());
+        return;
+    }
+
+    RTMP_LOG(LEVINFO, "a new server took over the listening socket, draining\n");
+
+    {
+        boost::lock_guard<boost::mutex> lk(nextMt_);
+        next_ = channel;
+    }
+    draining_ = true;
+
+    uint64_t one = 1;
+    if(write(drainFd_, &one, sizeof(one)) == -1)
+    {
+        RTMP_LOG(LEVERROR, "signal drain failed: %s\n", strerror(errno));
+    }
+
+    for(size_t i = 0; i < uringWorkers_.size(); i++)
+    {
+        uringWorkers_[i]->drain();
+    }
+
+    // the new server binds the metrics port once this one closed it
+    Metrics::stop();
+}
+
+// from client threads and io_uring workers
+bool RtmpServer::handOffClient(int clientSock, const vector<uint8_t>& state)
 {
-    boost::posix_time::time_duration timeout = boost::posix_time::milliseconds(0);
-    list< boost::shared_ptr<boost::thread> >::iterator it = clientThreads_.begin();
+    HandoffChannelPtr next;
+    {
+        boost::lock_guard<boost::mutex> lk(nextMt_);
+        next = next_;
+    }
 
-    for(; it != clientThreads_.end();)
+    if(!next)
+    {
+        return false;
+    }
+
+    try
+    {
+        next->send(HOK_Client, clientSock, state);
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG_RATE(LEVERROR, 1, "hand off client failed: %s\n", e.what());
+        return false;
+    }
+
+    return true;
+}
+
+// client threads use this server, it returns only once none is left
+void RtmpServer::finishDrain()
+{
+    int64_t deadline = Utility::getMonotonicMicros() + DRAIN_TIMEOUT_MILLIS * 1000LL;
+    while(getClientCount() > 0 && Utility::getMonotonicMicros() < deadline)
     {
-        // the thread is finished
-        if((*it)->timed_join(timeout))
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+
+    int left = getClientCount();
+    if(left > 0)
+    {
+        RTMP_LOG(LEVWARN, "drain timed out, close %d clients\n", left);
+
+        uint64_t one = 1;
+        if(write(stopFd_, &one, sizeof(one)) == -1)
         {
-            it = clientThreads_.erase(it);
+            RTMP_LOG(LEVERROR, "signal stop failed: %s\n", strerror(errno));
         }
-        else
+
+        while(getClientCount() > 0)
         {
-            it++;
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
         }
     }
+
+    RTMP_LOG(LEVINFO, "drained\n");
 }
 
-void RtmpServer::clientCycle(int clientSock, struct sockaddr_in clientAddr)
+void RtmpServer::startUring()
 {
-    RTMP_LOG(LEVINFO, "New client connected, address is %s:%d\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
-    RtmpConnection rc(clientSock, clientAddr, RtmpActorPtr(cafn_())); 
+    // rings are created here so that a failure reaches the caller
+    for(int i = 0; i < workers_; i++)
+    {
+        UringWorkerPtr worker(new UringWorker(serverSock_, boost::bind(&RtmpServer::createActor, this)));
+        worker->setHandoff(boost::bind(&RtmpServer::handOffClient, this, _1, _2));
+        worker->setTcpTuning(tuning_);
+        uringWorkers_.push_back(worker);
+    }
+
+    RTMP_LOG(LEVINFO, "serving clients with io_uring on %d threads\n", workers_);
+
+    if(previous_)
+    {
+        boost::thread(boost::bind(&RtmpServer::receiveClients, this, previous_)).detach();
+    }
 
-    rc.handleClient(); 
+    boost::thread_group threads;
+    for(int i = 0; i < workers_; i++)
+    {
+        threads.create_thread(boost::bind(&UringWorker::run, uringWorkers_[i].get()));
+    }
+    threads.join_all();
 }
 
 void RtmpServer::start()
 {
-    prepare();
+    bool tookOver = false;
+    if(!upgradePath_.empty())
+    {
+        try
+        {
+            tookOver = takeOver();
+        }
+        catch(RtmpException& e)
+        {
+            RTMP_LOG(LEVWARN, "can not take over from %s: %s\n", upgradePath_.c_str(), e.what());
+        }
+    }
+
+    if(!tookOver)
+    {
+        prepare();
+    }
+
+    if(!upgradePath_.empty())
+    {
+        // replaces the file of the old server, which is already reached.
+        // serving goes on without upgrades when it can not be made
+        try
+        {
+            int upgradeSock = HandoffChannel::listen(upgradePath_);
+            boost::thread(boost::bind(&RtmpServer::waitUpgrade, this, upgradeSock)).detach();
+        }
+        catch(RtmpException& e)
+        {
+            RTMP_LOG(LEVWARN, "no upgrades, listen on %s failed: %s\n", upgradePath_.c_str(), e.what());
+        }
+    }
+
+    if(backend_ == IOB_Uring)
+    {
+        if(IoUring::isSupported())
+        {
+            startUring();
+            return;
+        }
+
+        RTMP_LOG(LEVWARN, "io_uring is not supported, a thread serves each client\n");
+    }
+
+    if(previous_)
+    {
+        boost::thread(boost::bind(&RtmpServer::receiveClients, this, previous_)).detach();
+    }
+
+    // accept() returns now and then to see whether a newer server took over.
+    // the listening socket is shared with it, so it is not made non-blocking
+    struct timeval tv;
+    tv.tv_sec = ACCEPT_TIMEOUT_MILLIS / 1000;
+    tv.tv_usec = (ACCEPT_TIMEOUT_MILLIS % 1000) * 1000;
+    setsockopt(serverSock_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     socklen_t clientAddrLen = sizeof(struct sockaddr_in);
     struct sockaddr_in clientAddr;
     int clientSock;
 
-    while(true)
+    while(!draining_)
     {
+        clientAddrLen = sizeof(struct sockaddr_in);
         if((clientSock = accept(serverSock_, (struct sockaddr *)&clientAddr, &clientAddrLen))
            == -1)
         {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                continue;
+            }
             throw RtmpInternalError("accept client failed", errno);
         }
 
-        cleanClientThread();
+        if(!admitClient(clientSock))
+        {
+            continue;
+        }
 
-        clientThreads_.push_back(
-                boost::make_shared<boost::thread>(boost::bind(&RtmpServer::clientCycle, this, clientSock, clientAddr))
-                );
+        tuning_.applyClient(clientSock);
+        spawnClient(clientSock, clientAddr, vector<uint8_t>());
     }
+
+    finishDrain();
 }
 
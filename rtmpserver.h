@@ -5,10 +5,14 @@
 #include <boost/asio.hpp>
 #include "rtmpconnection.h"
 #include "rtmpactor.h"
+#include "actorexecutor.h"
+#include "handoff.h"
+#include "tcptuning.h"
 #include <vector>
 #include <boost/date_time.hpp>
 #include <boost/thread.hpp>
-#include <list>
+#include <boost/atomic.hpp>
+#include <map>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -30,24 +34,101 @@ typedef boost::shared_ptr< vector<RtmpActorPtr> > RtmpActorsPtr;
 
 typedef RtmpActor* (*createActorFn)();
 
+class UringWorker;
+typedef boost::shared_ptr<UringWorker> UringWorkerPtr;
+
+enum RtmpIoBackend
+{
+    // a thread per client, blocking recv() and send()
+    IOB_Threads,
+    // a few threads serve every client with io_uring, see UringWorker
+    IOB_Uring
+};
+
 class RtmpServer
 {
     private:
+        // the threads of IOB_Threads clients. a thread hands its id to the
+        // Reaper as it ends, which joins it. the tasks may outlive the server
+        struct ClientThreads
+        {
+            boost::mutex mt;
+            map<uint64_t, boost::thread*> threads;
+            uint64_t nextId;
+            // clients still being served, their threads are not done
+            boost::atomic<int> live;
+        };
+        typedef boost::shared_ptr<ClientThreads> ClientThreadsPtr;
+
         int listenPort_;
         createActorFn cafn_;
         int serverSock_;
         struct sockaddr_in serverAddr_;
-        list< boost::shared_ptr<boost::thread> > clientThreads_;
+        ClientThreadsPtr clients_;
+        RtmpIoBackend backend_;
+        int workers_;
+        ActorExecutorPtr executor_;
+        TcpTuning tuning_;
+        vector<UringWorkerPtr> uringWorkers_;
+        size_t nextWorker_;
+
+        // connections that can not move by then are left behind
+        const static int DRAIN_TIMEOUT_MILLIS = 30000;
+        // how often a blocked accept() looks for a drain
+        const static int ACCEPT_TIMEOUT_MILLIS = 1000;
+
+        string upgradePath_;
+        // from the server this one replaced, and to the one that replaces it
+        HandoffChannelPtr previous_;
+        HandoffChannelPtr next_;
+        // next_ is set by waitUpgrade() and read by every client
+        boost::mutex nextMt_;
+        boost::atomic<bool> draining_;
+        // readable once draining_ is set, client threads poll it
+        int drainFd_;
+        // readable once the drain timed out, the clients left close
+        int stopFd_;
 
     public:
         RtmpServer(int listenPort, createActorFn fn);
         ~RtmpServer();
+        // IOB_Uring falls back to IOB_Threads when the kernel does not support it
+        void setIoBackend(RtmpIoBackend backend, int workers);
+        // actor callbacks run on these threads, a queue per connection
+        // keeps them in order, see QueuedActor
+        void setActorThreads(int threads);
+        // options of the listening socket and of every client, before start()
+        void setTcpTuning(const TcpTuning& tuning);
+        // start() first takes the listening socket and the clients of a server
+        // started with the same path, then waits on path for one to replace it.
+        // a replaced server stops accepting, hands off what it can and returns
+        // from start() once no client is left or DRAIN_TIMEOUT_MILLIS passed.
+        // off unless set, a path that can not be listened on is logged
+        void setUpgradePath(const string& path);
         void start();   
 
+        // clients served by a thread of their own, IOB_Threads only
+        int getClientCount();
+        // threads that have not been joined yet, done or not
+        int getClientThreadCount();
+
+        // false if the process is over its memory limit, the socket is closed then
+        static bool admitClient(int clientSock);
+
     private:
-        void clientCycle(int clientSock, struct sockaddr_in clientAddr);
+        RtmpActorPtr createActor();
+        void clientCycle(int clientSock, struct sockaddr_in clientAddr, uint64_t id, vector<uint8_t> state);
+        // state is empty for a new client
+        void spawnClient(int clientSock, struct sockaddr_in clientAddr, const vector<uint8_t>& state);
         void prepare();
-        void cleanClientThread();
+        // false when no server listens on the upgrade path
+        bool takeOver();
+        void receiveClients(HandoffChannelPtr channel);
+        void waitUpgrade(int upgradeSock);
+        bool handOffClient(int clientSock, const vector<uint8_t>& state);
+        void finishDrain();
+        static void reapClient(ClientThreadsPtr clients, uint64_t id);
+        void startUring();
 };
 
 
@@ -0,0 +1,51 @@
+#ifndef STR_REF_H
+#define STR_REF_H
+
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+using namespace std;
+
+// non-owning view of characters inside a message body
+struct StrRef
+{
+    const char* data;
+    int len;
+
+    StrRef(): data(NULL), len(0)
+    {
+    }
+
+    StrRef(const char* d, int l): data(d), len(l)
+    {
+    }
+
+    bool equals(const char* s, int slen) const
+    {
+        return len == slen && memcmp(data, s, len) == 0;
+    }
+
+    bool iequals(const char* s, int slen) const
+    {
+        return len == slen && strncasecmp(data, s, len) == 0;
+    }
+
+    bool operator==(const char* s) const
+    {
+        return equals(s, strlen(s));
+    }
+
+    bool operator!=(const char* s) const
+    {
+        return !equals(s, strlen(s));
+    }
+
+    // materialize, only for values that are kept
+    string str() const
+    {
+        return string(data, len);
+    }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "tcptuning.h"
+#include "log.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <string.h>
+
+namespace
+{
+
+void setOption(int sock, int level, int name, int value, const char* what)
+{
+    if(setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+    {
+        RTMP_LOG_RATE(LEVWARN, 1, "set %s to %d failed: %s\n", what, value, strerror(errno));
+    }
+}
+
+}
+
+TcpTuning::TcpTuning():
+    noDelay(false),
+    cork(false),
+    recvBuffer(0),
+    sendBuffer(0),
+    deferAcceptSeconds(0),
+    notSentLowat(0),
+    busyPollMicros(0)
+{
+}
+
+void TcpTuning::applyListener(int sock) const
+{
+    // accepted sockets inherit the buffer sizes
+    if(recvBuffer > 0)
+    {
+        setOption(sock, SOL_SOCKET, SO_RCVBUF, recvBuffer, "SO_RCVBUF");
+    }
+    if(sendBuffer > 0)
+    {
+        setOption(sock, SOL_SOCKET, SO_SNDBUF, sendBuffer, "SO_SNDBUF");
+    }
+    if(deferAcceptSeconds > 0)
+    {
+        setOption(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, deferAcceptSeconds, "TCP_DEFER_ACCEPT");
+    }
+}
+
+void TcpTuning::applyClient(int sock) const
+{
+    if(noDelay)
+    {
+        setOption(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+
+    // accepted sockets have them from the listener, one handed off by
+    // another server may not
+    if(recvBuffer > 0)
+    {
+        setOption(sock, SOL_SOCKET, SO_RCVBUF, recvBuffer, "SO_RCVBUF");
+    }
+    if(sendBuffer > 0)
+    {
+        setOption(sock, SOL_SOCKET, SO_SNDBUF, sendBuffer, "SO_SNDBUF");
+    }
+
+#ifdef TCP_NOTSENT_LOWAT
+    if(notSentLowat > 0)
+    {
+        setOption(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notSentLowat, "TCP_NOTSENT_LOWAT");
+    }
+#endif
+
+#ifdef SO_BUSY_POLL
+    if(busyPollMicros > 0)
+    {
+        setOption(sock, SOL_SOCKET, SO_BUSY_POLL, busyPollMicros, "SO_BUSY_POLL");
+    }
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef TCP_TUNING_H
+#define TCP_TUNING_H
+
+/*
+ * socket options of a listener and the clients it accepts, see
+ * RtmpServer::setTcpTuning(). the defaults leave the kernel's values.
+ * an option the kernel refuses is logged and the socket is used as it is
+ */
+struct TcpTuning
+{
+    // small replies are not held back until the last segment is acked
+    bool noDelay;
+    // the replies to one read leave in full segments, see RtmpConnection::setCork()
+    bool cork;
+    // bytes, 0 keeps the kernel's size. set on the listener too, so the
+    // window scale of a new connection is chosen for it
+    int recvBuffer;
+    int sendBuffer;
+    // accept() waits up to this long for the first bytes, C0 and C1 then
+    // come with the accepted socket
+    int deferAcceptSeconds;
+    // poll() sees the socket writable only below this much unsent data,
+    // for sockets that send more than replies
+    int notSentLowat;
+    // microseconds a blocking read spins on the device queue before it
+    // sleeps, more than net.core.busy_read needs CAP_NET_ADMIN
+    int busyPollMicros;
+
+    TcpTuning();
+
+    // before listen(), or on a listening socket taken over from another server
+    void applyListener(int sock) const;
+    void applyClient(int sock) const;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "timerwheel.h"
+#include "rtmpexception.h"
+
+Timer::Timer():
+    wheel_(NULL),
+    expires_(0)
+{
+    prev = NULL;
+    next = NULL;
+}
+
+Timer::~Timer()
+{
+    cancel();
+}
+
+void Timer::setCallback(const boost::function<void()>& callback)
+{
+    callback_ = callback;
+}
+
+bool Timer::isArmed()
+{
+    return wheel_ != NULL;
+}
+
+void Timer::cancel()
+{
+    if(!wheel_)
+    {
+        return;
+    }
+
+    TimerWheel::unlink(this);
+    wheel_->count_--;
+    wheel_ = NULL;
+}
+
+TimerWheel::TimerWheel(int tickMillis, int64_t nowMicros):
+    tickMillis_(tickMillis),
+    startMicros_(nowMicros),
+    now_(0),
+    count_(0)
+{
+    if(tickMillis < 1)
+    {
+        throw RtmpInvalidArg("tickMillis");
+    }
+
+    for(int level = 0; level < LEVELS; level++)
+    {
+        for(int slot = 0; slot < SLOTS; slot++)
+        {
+            slots_[level][slot].prev = &slots_[level][slot];
+            slots_[level][slot].next = &slots_[level][slot];
+        }
+    }
+}
+
+// timers still armed are disarmed, their owners may outlive the wheel
+TimerWheel::~TimerWheel()
+{
+    for(int level = 0; level < LEVELS; level++)
+    {
+        for(int slot = 0; slot < SLOTS; slot++)
+        {
+            TimerLink* head = &slots_[level][slot];
+            while(head->next != head)
+            {
+                Timer* t = static_cast<Timer*>(head->next);
+                unlink(t);
+                t->wheel_ = NULL;
+            }
+        }
+    }
+}
+
+void TimerWheel::unlink(TimerLink* link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = NULL;
+    link->next = NULL;
+}
+
+void TimerWheel::append(TimerLink* head, TimerLink* link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+void TimerWheel::schedule(Timer* t, int64_t delayMillis)
+{
+    t->cancel();
+
+    // never on the tick that is running
+    uint64_t ticks = delayMillis > 0 ? (delayMillis + tickMillis_ - 1) / tickMillis_ : 1;
+    uint64_t span = ((uint64_t)1 << (LEVELS * SLOT_BITS)) - 1;
+    if(ticks > span)
+    {
+        ticks = span;
+    }
+
+    t->expires_ = now_ + ticks;
+    t->wheel_ = this;
+    count_++;
+
+    insert(t);
+}
+
+// the lowest level whose span holds the delay, the slot by the absolute tick
+void TimerWheel::insert(Timer* t)
+{
+    uint64_t delta = t->expires_ - now_;
+    int level = 0;
+
+    while(level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    append(&slots_[level][(t->expires_ >> (SLOT_BITS * level)) & SLOT_MASK], t);
+}
+
+void TimerWheel::cascade(int level)
+{
+    TimerLink* head = &slots_[level][(now_ >> (SLOT_BITS * level)) & SLOT_MASK];
+
+    while(head->next != head)
+    {
+        Timer* t = static_cast<Timer*>(head->next);
+        unlink(t);
+        insert(t);
+    }
+}
+
+void TimerWheel::runSlot(TimerLink* head)
+{
+    if(head->next == head)
+    {
+        return;
+    }
+
+    // moved out first, a timer armed by a callback waits for a later tick
+    TimerLink due;
+    due.next = head->next;
+    due.prev = head->prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    head->next = head;
+    head->prev = head;
+
+    while(due.next != &due)
+    {
+        Timer* t = static_cast<Timer*>(due.next);
+        unlink(t);
+        t->wheel_ = NULL;
+        count_--;
+
+        // the callback may destroy the timer
+        boost::function<void()> callback = t->callback_;
+        if(callback)
+        {
+            callback();
+        }
+    }
+}
+
+void TimerWheel::advance(int64_t nowMicros)
+{
+    if(nowMicros < startMicros_)
+    {
+        return;
+    }
+
+    uint64_t target = (nowMicros - startMicros_) / ((int64_t)tickMillis_ * 1000);
+
+    while(now_ < target)
+    {
+        if(count_ == 0)
+        {
+            now_ = target;
+            break;
+        }
+
+        now_++;
+
+        // when a level wraps, the next slot of the level above moves down
+        int index = now_ & SLOT_MASK;
+        for(int level = 1; index == 0 && level < LEVELS; level++)
+        {
+            cascade(level);
+            index = (now_ >> (SLOT_BITS * level)) & SLOT_MASK;
+        }
+
+        runSlot(&slots_[0][now_ & SLOT_MASK]);
+    }
+}
+
+// the next tick with timers on the lowest level, or the next cascade
+int64_t TimerWheel::getNextDelay(int64_t nowMicros)
+{
+    if(count_ == 0)
+    {
+        return -1;
+    }
+
+    uint64_t tick = now_ + 1;
+    while((tick & SLOT_MASK) != 0)
+    {
+        TimerLink* head = &slots_[0][tick & SLOT_MASK];
+        if(head->next != head)
+        {
+            break;
+        }
+        tick++;
+    }
+
+    int64_t at = startMicros_ + (int64_t)tick * tickMillis_ * 1000;
+    return at <= nowMicros ? 0 : (at - nowMicros + 999) / 1000;
+}
+
+int TimerWheel::getCount()
+{
+    return count_;
+}
+
+int TimerWheel::getTickMillis()
+{
+    return tickMillis_;
+}
@@ -0,0 +1,90 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <boost/function.hpp>
+
+class TimerWheel;
+
+// a node of the circular lists of a wheel slot
+struct TimerLink
+{
+    TimerLink* prev;
+    TimerLink* next;
+};
+
+/*
+ * runs once on the thread that advances its wheel, owned by whoever arms
+ * it. running, cancelling and destroying it unlink it from the wheel
+ */
+class Timer : private TimerLink
+{
+    private:
+        TimerWheel* wheel_;
+        // in ticks of the wheel
+        uint64_t expires_;
+        boost::function<void()> callback_;
+
+        Timer(const Timer&);
+        Timer& operator=(const Timer&);
+
+        friend class TimerWheel;
+
+    public:
+        Timer();
+        ~Timer();
+
+        void setCallback(const boost::function<void()>& callback);
+        bool isArmed();
+        void cancel();
+};
+
+/*
+ * hierarchical timing wheel, every level has SLOTS lists and covers
+ * SLOTS times the span of the one below. arming and cancelling is O(1),
+ * a timer moves down a level at most LEVELS - 1 times before it runs
+ *
+ * not thread safe, one wheel per event loop
+ */
+class TimerWheel
+{
+    private:
+        const static int LEVELS = 4;
+        const static int SLOT_BITS = 8;
+        const static int SLOTS = 1 << SLOT_BITS;
+        const static uint64_t SLOT_MASK = SLOTS - 1;
+
+        TimerLink slots_[LEVELS][SLOTS];
+        int tickMillis_;
+        int64_t startMicros_;
+        // the last tick that ran
+        uint64_t now_;
+        int count_;
+
+        TimerWheel(const TimerWheel&);
+        TimerWheel& operator=(const TimerWheel&);
+
+        void insert(Timer* t);
+        void cascade(int level);
+        void runSlot(TimerLink* head);
+        static void unlink(TimerLink* link);
+        static void append(TimerLink* head, TimerLink* link);
+
+        friend class Timer;
+
+    public:
+        // timers run up to tickMillis late
+        TimerWheel(int tickMillis, int64_t nowMicros);
+        ~TimerWheel();
+
+        // delays past the last level are cut to what it covers
+        void schedule(Timer* t, int64_t delayMillis);
+        // runs every timer that is due at nowMicros
+        void advance(int64_t nowMicros);
+        // milliseconds until advance() may have something to run, -1 if nothing is armed
+        int64_t getNextDelay(int64_t nowMicros);
+        int getCount();
+        int getTickMillis();
+};
+
+#endif
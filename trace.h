@@ -0,0 +1,48 @@
+#ifndef RTMP_TRACE_H
+#define RTMP_TRACE_H
+
+/*
+ * static tracepoints, provider tvie_rtmp
+ *
+ * with -DHAVE_SYS_SDT_H (the Makefile and cmake set it when sys/sdt.h is
+ * installed) every probe is a nop plus an ELF note until bpftrace, perf or
+ * systemtap attaches to it; without it the macros expand to nothing and
+ * the arguments are not evaluated
+ *
+ *   bpftrace -e 'usdt:./tvie_rtmp_test:tvie_rtmp:message { @[arg2] = count(); }'
+ *
+ * conn is the RtmpConnection pointer, push the PushSession pointer
+ *
+ *   conn_open(conn, fd, ipv4 network order, port)
+ *   conn_refuse(fd)                      process is over its memory limit
+ *   conn_close(conn, bytes received)
+ *   handshake(conn, state)               HandShakeState after each step
+ *   message(conn, csid, type, length, timestamp, stream id)
+ *   chunk_size(conn, outgoing, size)     outgoing is 0 for the peer's size
+ *   actor_enter(conn, callback name)
+ *   actor_return(conn, callback name, result)   1 when there is none
+ *   push_write(push, stream index, size, dts)
+ *   push_write_done(push, result, microseconds)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define RTMP_TRACE1(name, a)                    DTRACE_PROBE1(tvie_rtmp, name, a)
+#define RTMP_TRACE2(name, a, b)                 DTRACE_PROBE2(tvie_rtmp, name, a, b)
+#define RTMP_TRACE3(name, a, b, c)              DTRACE_PROBE3(tvie_rtmp, name, a, b, c)
+#define RTMP_TRACE4(name, a, b, c, d)           DTRACE_PROBE4(tvie_rtmp, name, a, b, c, d)
+#define RTMP_TRACE6(name, a, b, c, d, e, f)     DTRACE_PROBE6(tvie_rtmp, name, a, b, c, d, e, f)
+
+#else
+
+#define RTMP_TRACE1(name, a)
+#define RTMP_TRACE2(name, a, b)
+#define RTMP_TRACE3(name, a, b, c)
+#define RTMP_TRACE4(name, a, b, c, d)
+#define RTMP_TRACE6(name, a, b, c, d, e, f)
+
+#endif
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "amf0.h"
 #include "log.h"
+#include "metrics.h"
 #include "rtmpactor.h"
 #include "rtmpconnection.h"
 #include "rtmpexception.h"
@@ -0,0 +1,488 @@
+#include "uringworker.h"
+#include "rtmpconnection.h"
+#include "log.h"
+#include "utility.h"
+#include <boost/bind.hpp>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+UringWorker::UringWorker(int listenSock, boost::function<RtmpActorPtr()> createActor):
+    ring_(RING_ENTRIES, BUFFER_COUNT, BUFFER_SIZE),
+    listenSock_(listenSock),
+    createActor_(createActor),
+    nextId_(1),
+    wheel_(TIMER_TICK_MILLIS, Utility::getMonotonicMicros()),
+    timeoutAt_(0),
+    timeoutsPending_(0),
+    wakeValue_(0),
+    drainRequested_(false),
+    draining_(false),
+    handoffFailed_(false)
+{
+    memset(&timeout_, 0, sizeof(timeout_));
+
+    if((wakeFd_ = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        throw RtmpInternalError("create eventfd failed", errno);
+    }
+
+    drainTimer_.setCallback(boost::bind(&UringWorker::onDrainTimeout, this));
+}
+
+UringWorker::~UringWorker()
+{
+    map<uint64_t, UringClient*>::iterator it = clients_.begin();
+    for(; it != clients_.end(); it++)
+    {
+        delete it->second;
+    }
+
+    for(size_t i = 0; i < adopted_.size(); i++)
+    {
+        close(adopted_[i].first);
+    }
+
+    close(wakeFd_);
+}
+
+void UringWorker::setHandoff(const HandoffFn& handoff)
+{
+    handoff_ = handoff;
+}
+
+void UringWorker::setTcpTuning(const TcpTuning& tuning)
+{
+    tuning_ = tuning;
+}
+
+void UringWorker::drain()
+{
+    drainRequested_ = true;
+
+    uint64_t one = 1;
+    if(write(wakeFd_, &one, sizeof(one)) == -1)
+    {
+        RTMP_LOG(LEVERROR, "wake io_uring worker failed: %s\n", strerror(errno));
+    }
+}
+
+void UringWorker::adopt(int clientSock, const vector<uint8_t>& state)
+{
+    {
+        boost::lock_guard<boost::mutex> lk(mt_);
+        adopted_.push_back(make_pair(clientSock, state));
+    }
+
+    uint64_t one = 1;
+    if(write(wakeFd_, &one, sizeof(one)) == -1)
+    {
+        RTMP_LOG(LEVERROR, "wake io_uring worker failed: %s\n", strerror(errno));
+    }
+}
+
+uint64_t UringWorker::userData(UringClient* c, UringOp op)
+{
+    return (c ? c->id << OP_BITS : 0) | op;
+}
+
+void UringWorker::touch(UringClient* c)
+{
+    if(!c->touched)
+    {
+        c->touched = true;
+        touched_.push_back(c);
+    }
+}
+
+void UringWorker::armTimeout()
+{
+    int64_t now = Utility::getMonotonicMicros();
+    int64_t delay = wheel_.getNextDelay(now);
+    if(delay < 0)
+    {
+        return;
+    }
+
+    int64_t at = now + delay * 1000;
+    if(timeoutsPending_ > 0 && timeoutAt_ <= at)
+    {
+        return;
+    }
+
+    timeout_.tv_sec = delay / 1000;
+    timeout_.tv_nsec = (delay % 1000) * 1000000;
+    ring_.prepTimeout(&timeout_, userData(NULL, UOP_Timeout));
+    timeoutAt_ = at;
+    timeoutsPending_++;
+}
+
+void UringWorker::run()
+{
+    ring_.prepAcceptMultishot(listenSock_, userData(NULL, UOP_Accept));
+    ring_.prepRead(wakeFd_, &wakeValue_, sizeof(wakeValue_), userData(NULL, UOP_Wake));
+
+    while(true)
+    {
+        for(size_t i = 0; i < touched_.size(); i++)
+        {
+            touched_[i]->touched = false;
+            flush(touched_[i]);
+        }
+        touched_.clear();
+
+        // what is still in flight is dropped with the ring
+        if(draining_ && clients_.empty())
+        {
+            RTMP_LOG(LEVINFO, "io_uring worker drained\n");
+            return;
+        }
+
+        armTimeout();
+        ring_.submit(1);
+        wheel_.advance(Utility::getMonotonicMicros());
+
+        struct io_uring_cqe* cqe;
+        while((cqe = ring_.peekCqe()))
+        {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_.advance();
+
+            UringOp op = (UringOp)(data & ((1 << OP_BITS) - 1));
+            if((data >> OP_BITS) == 0)
+            {
+                switch(op)
+                {
+                    case UOP_Accept:
+                        onAccept(res, flags);
+                        break;
+                    case UOP_Timeout:
+                        // the ones still in flight end at some unknown later time
+                        timeoutsPending_--;
+                        timeoutAt_ = timeoutsPending_ > 0 ? INT64_MAX : 0;
+                        break;
+                    case UOP_Wake:
+                        onWake(res);
+                        break;
+                    default:
+                        // the cancel of the accept
+                        break;
+                }
+                continue;
+            }
+
+            map<uint64_t, UringClient*>::iterator it = clients_.find(data >> OP_BITS);
+            if(it == clients_.end())
+            {
+                RTMP_LOG(LEVERROR, "completion for unknown client %llu\n", (unsigned long long)(data >> OP_BITS));
+                continue;
+            }
+
+            UringClient* c = it->second;
+            switch(op)
+            {
+                case UOP_Recv:
+                    onRecv(c, res, flags);
+                    break;
+                case UOP_Send:
+                    onSend(c, res);
+                    break;
+                case UOP_Cancel:
+                    c->inFlight--;
+                    touch(c);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+void UringWorker::onWake(int)
+{
+    ring_.prepRead(wakeFd_, &wakeValue_, sizeof(wakeValue_), userData(NULL, UOP_Wake));
+
+    vector< pair<int, vector<uint8_t> > > adopted;
+    {
+        boost::lock_guard<boost::mutex> lk(mt_);
+        adopted.swap(adopted_);
+    }
+
+    for(size_t i = 0; i < adopted.size(); i++)
+    {
+        addClient(adopted[i].first, &adopted[i].second);
+    }
+
+    if(!drainRequested_ || draining_)
+    {
+        return;
+    }
+
+    // another process accepts from now on
+    draining_ = true;
+    ring_.prepCancel(userData(NULL, UOP_Accept), userData(NULL, UOP_Cancel));
+    wheel_.schedule(&drainTimer_, DRAIN_TIMEOUT_MILLIS);
+
+    map<uint64_t, UringClient*>::iterator it = clients_.begin();
+    for(; it != clients_.end(); it++)
+    {
+        touch(it->second);
+    }
+}
+
+void UringWorker::onDrainTimeout()
+{
+    RTMP_LOG(LEVWARN, "%d connections could not be handed off in time\n", (int)clients_.size());
+
+    map<uint64_t, UringClient*>::iterator it = clients_.begin();
+    for(; it != clients_.end(); it++)
+    {
+        it->second->conn->disconnect();
+        touch(it->second);
+    }
+}
+
+void UringWorker::onAccept(int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE) && !draining_)
+    {
+        ring_.prepAcceptMultishot(listenSock_, userData(NULL, UOP_Accept));
+    }
+
+    if(res < 0)
+    {
+        if(!draining_)
+        {
+            RTMP_LOG_RATE(LEVERROR, 1, "accept client failed: %s\n", strerror(-res));
+        }
+        return;
+    }
+
+    int clientSock = res;
+    if(!RtmpServer::admitClient(clientSock))
+    {
+        return;
+    }
+
+    addClient(clientSock, NULL);
+}
+
+void UringWorker::addClient(int clientSock, const vector<uint8_t>* state)
+{
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
+    memset(&clientAddr, 0, sizeof(clientAddr));
+    getpeername(clientSock, (struct sockaddr*)&clientAddr, &clientAddrLen);
+    tuning_.applyClient(clientSock);
+
+    RTMP_LOG(LEVINFO, "%s client, address is %s:%d\n", state ? "Handed off" : "New",
+            inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+
+    UringClient* c = new UringClient();
+    c->id = nextId_++;
+    c->fd = clientSock;
+    c->receiving = false;
+    c->sending = false;
+    c->outSent = 0;
+    c->inFlight = 0;
+    c->closing = false;
+    c->touched = false;
+    c->moving = false;
+
+    try
+    {
+        c->conn.reset(new RtmpConnection(clientSock, clientAddr, createActor_()));
+        c->conn->setDeferredSend(true);
+        c->conn->setTimerWheel(&wheel_, boost::bind(&UringWorker::touch, this, c));
+
+        if(state)
+        {
+            c->conn->resume(*state);
+        }
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "client cycle error: %s\n", e.what());
+        // a constructed connection closes the socket itself
+        if(!c->conn)
+        {
+            close(clientSock);
+        }
+        delete c;
+        return;
+    }
+
+    clients_[c->id] = c;
+    touch(c);
+}
+
+void UringWorker::onRecv(UringClient* c, int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE))
+    {
+        // armed again by flush() unless the connection is closing
+        c->receiving = false;
+        c->inFlight--;
+    }
+
+    if(flags & IORING_CQE_F_BUFFER)
+    {
+        int bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(res > 0 && !c->closing)
+        {
+            deliver(c, ring_.getBuffer(bufferId), res);
+        }
+        ring_.recycleBuffer(bufferId);
+    }
+    else if(res == -ENOBUFS)
+    {
+        // every buffer was in use, they are back once this batch is handled
+        RTMP_LOG_RATE(LEVWARN, 1, "io_uring receive buffers ran out\n");
+    }
+    else if(!c->closing && res != -ECANCELED)
+    {
+        // res is 0 when the client closed
+        deliver(c, NULL, res);
+    }
+
+    touch(c);
+}
+
+void UringWorker::onSend(UringClient* c, int res)
+{
+    c->sending = false;
+    c->inFlight--;
+
+    if(res < 0)
+    {
+        if(!c->closing)
+        {
+            RTMP_LOG(LEVERROR, "send data failed: %s\n", strerror(-res));
+            c->conn->disconnect();
+        }
+    }
+    else
+    {
+        c->outSent += res;
+    }
+
+    touch(c);
+}
+
+void UringWorker::deliver(UringClient* c, const uint8_t* data, int size)
+{
+    try
+    {
+        c->conn->onReceive(data, size);
+    }
+    catch(RtmpException& e)
+    {
+        RTMP_LOG(LEVERROR, "client cycle error: %s\n", e.what());
+        c->conn->disconnect();
+    }
+}
+
+void UringWorker::flush(UringClient* c)
+{
+    if(!c->closing && c->conn->isDisconnected())
+    {
+        c->closing = true;
+
+        // the pending receive holds the socket open until it is cancelled
+        if(c->receiving)
+        {
+            ring_.prepCancel(userData(c, UOP_Recv), userData(c, UOP_Cancel));
+            c->inFlight++;
+        }
+    }
+
+    if(c->closing)
+    {
+        if(c->inFlight == 0)
+        {
+            clients_.erase(c->id);
+            delete c;
+        }
+        return;
+    }
+
+    // data that comes until the cancel completes is still handled here
+    if(draining_ && !c->moving && !handoffFailed_ && c->conn->isSuspendable())
+    {
+        c->moving = true;
+        if(c->receiving)
+        {
+            ring_.prepCancel(userData(c, UOP_Recv), userData(c, UOP_Cancel));
+            c->inFlight++;
+        }
+    }
+
+    if(!c->receiving && !c->moving)
+    {
+        ring_.prepRecvMultishot(c->fd, userData(c, UOP_Recv));
+        c->receiving = true;
+        c->inFlight++;
+    }
+
+    c->conn->takeOutput(c->next);
+
+    if(!c->sending)
+    {
+        if(c->outSent == c->out.size())
+        {
+            c->out.clear();
+            c->outSent = 0;
+            c->out.swap(c->next);
+
+            // an idle client keeps no send buffers
+            if(RtmpConnection::isLowFootprint())
+            {
+                vector<uint8_t>().swap(c->next);
+                if(c->out.empty())
+                {
+                    vector<uint8_t>().swap(c->out);
+                }
+            }
+        }
+
+        if(c->outSent < c->out.size())
+        {
+            ring_.prepSend(c->fd, &c->out[c->outSent], c->out.size() - c->outSent, userData(c, UOP_Send));
+            c->sending = true;
+            c->inFlight++;
+        }
+    }
+
+    if(c->moving && c->inFlight == 0 && c->outSent == c->out.size() && c->next.empty())
+    {
+        moveClient(c);
+    }
+}
+
+bool UringWorker::moveClient(UringClient* c)
+{
+    // what came before the cancel completed left replies to send first
+    if(!c->conn->isSuspendable())
+    {
+        c->moving = false;
+        touch(c);
+        return false;
+    }
+
+    if(c->conn->handOff(handoff_))
+    {
+        clients_.erase(c->id);
+        delete c;
+        return true;
+    }
+
+    // the rest are served here until they end or the drain times out
+    RTMP_LOG(LEVERROR, "hand off failed, connections stay in this process\n");
+    handoffFailed_ = true;
+    c->moving = false;
+    touch(c);
+
+    return false;
+}
@@ -0,0 +1,134 @@
+#ifndef URING_WORKER_H
+#define URING_WORKER_H
+
+#include "iouring.h"
+#include "rtmpserver.h"
+#include "timerwheel.h"
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+
+using namespace std;
+
+/*
+ * serves many connections on one thread with io_uring
+ *
+ * a multishot accept on the shared listening socket, a multishot receive
+ * per connection that picks from the ring's provided buffers, and the
+ * replies of every connection handled in a loop go out in one submission
+ *
+ * drain() stops accepting, hands every connection off once it can move and
+ * ends run() when none are left, see RtmpServer::setUpgradePath()
+ */
+class UringWorker
+{
+    private:
+        // the low bits of the user data tell the operation, the rest is the client id
+        enum UringOp
+        {
+            UOP_Accept,
+            UOP_Recv,
+            UOP_Send,
+            UOP_Cancel,
+            UOP_Timeout,
+            UOP_Wake
+        };
+        const static int OP_BITS = 3;
+
+        const static int RING_ENTRIES = 1024;
+        const static int BUFFER_COUNT = 512;
+        const static int BUFFER_SIZE = 16384;
+        const static int TIMER_TICK_MILLIS = 10;
+        // connections that can not move by then are closed
+        const static int DRAIN_TIMEOUT_MILLIS = 30000;
+
+        struct UringClient
+        {
+            uint64_t id;
+            int fd;
+            RtmpConnectionPtr conn;
+            bool receiving;
+            bool sending;
+            // being sent, from outSent on
+            vector<uint8_t> out;
+            size_t outSent;
+            // replies queued while a send is in flight
+            vector<uint8_t> next;
+            // operations that will still complete
+            int inFlight;
+            bool closing;
+            bool touched;
+            // the receive is cancelled, the connection is handed off once nothing is in flight
+            bool moving;
+        };
+
+        IoUring ring_;
+        int listenSock_;
+        boost::function<RtmpActorPtr()> createActor_;
+        uint64_t nextId_;
+        map<uint64_t, UringClient*> clients_;
+        vector<UringClient*> touched_;
+        // the timers of every connection, a ring timeout wakes the loop for them
+        TimerWheel wheel_;
+        struct __kernel_timespec timeout_;
+        // when the earliest timeout in flight ends, monotonic microseconds
+        int64_t timeoutAt_;
+        int timeoutsPending_;
+
+        // drain() and adopt() wake the loop through it
+        int wakeFd_;
+        uint64_t wakeValue_;
+        boost::mutex mt_;
+        vector< pair<int, vector<uint8_t> > > adopted_;
+        boost::atomic<bool> drainRequested_;
+        bool draining_;
+        bool handoffFailed_;
+        HandoffFn handoff_;
+        TcpTuning tuning_;
+        Timer drainTimer_;
+
+        UringWorker(const UringWorker&);
+        UringWorker& operator=(const UringWorker&);
+
+        uint64_t userData(UringClient* c, UringOp op);
+        void touch(UringClient* c);
+        // a timeout for the next timer unless one in flight ends first
+        void armTimeout();
+
+        void onAccept(int res, unsigned flags);
+        // state is NULL for a new client, else what suspend() saved in another process
+        void addClient(int clientSock, const vector<uint8_t>* state);
+        void onWake(int res);
+        void onDrainTimeout();
+        // true if c was handed off and freed
+        bool moveClient(UringClient* c);
+        void onRecv(UringClient* c, int res, unsigned flags);
+        void onSend(UringClient* c, int res);
+        void deliver(UringClient* c, const uint8_t* data, int size);
+        // queues sends, receives and cancels, frees closed clients
+        void flush(UringClient* c);
+
+    public:
+        // throws RtmpInternalError if the ring can not be created
+        UringWorker(int listenSock, boost::function<RtmpActorPtr()> createActor);
+        ~UringWorker();
+
+        // returns once a drain is done
+        void run();
+
+        // where drained connections go, before run()
+        void setHandoff(const HandoffFn& handoff);
+        // for accepted and adopted clients, before run(). cork is left out,
+        // the replies of a loop already go out in one send
+        void setTcpTuning(const TcpTuning& tuning);
+        // from any thread
+        void drain();
+        // serves a connection another process handed off, from any thread
+        void adopt(int clientSock, const vector<uint8_t>& state);
+};
+
+typedef boost::shared_ptr<UringWorker> UringWorkerPtr;
+
+#endif
@@ -0,0 +1 @@
+g++ -g -Wall -O0 test.cpp ../../amf0.cpp ../../amf3.cpp ../../chunkwriter.cpp ../../amf0value.cpp ../../arena.cpp ../../readbuffer.cpp ../../writebuffer.cpp ../../utility.cpp ../../memaccount.cpp ../../log.cpp -lboost_thread -lpthread
@@ -0,0 +1,48 @@
+#include "../../amf0.h"
+#include "../../amf0value.h"
+#include <stdio.h>
+
+int main(int argc, char* argv[])
+{
+    WriteBuffer wb(64);
+    AMF0Serializer as(&wb);
+
+    as.writeString("publish");
+    as.writeNumber(5);
+    as.writeNull();
+    as.writeString("stream?token=1");
+
+    AMF0Reader ar(wb.getBufferPtr(), wb.getBufferCount());
+
+    StrRef cmd = ar.readString();
+    double transactionId = ar.readNumber();
+    ar.readNull();
+    StrRef name = ar.readString();
+
+    printf("%.*s %g %.*s %d\n", cmd.len, cmd.data, transactionId, name.len, name.data, ar.isFinished());
+
+    WriteBuffer meta(64);
+    AMF0Serializer ms(&meta);
+
+    ms.writeString("onMetaData");
+    ms.writeEcmaArrayStart(2);
+    ms.writeObjectKey("width");
+    ms.writeNumber(1280);
+    ms.writeObjectKey("encoder");
+    ms.writeString("custom");
+    ms.writeObjectEnd();
+
+    AMF0Document doc(meta.getBufferPtr(), meta.getBufferCount());
+    AMF0Value* encoder = doc.getProperty("encoder");
+
+    WriteBuffer copy(64);
+    AMF0Serializer cs(&copy);
+    for(int i = 0; i < doc.getCount(); i++)
+    {
+        cs.writeValue(doc.get(i));
+    }
+
+    printf("%d %g %.*s %d\n", doc.getCount(), doc.getProperty("width")->number,
+            encoder->str.len, encoder->str.data,
+            memcmp(copy.getBufferPtr(), meta.getBufferPtr(), meta.getBufferCount()) == 0);
+}
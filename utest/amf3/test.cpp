@@ -0,0 +1,52 @@
+#include "../../amf0.h"
+#include <stdio.h>
+
+int main(int argc, char* argv[])
+{
+    // connect as Flash sends it with objectEncoding 3
+    WriteBuffer wb(64);
+    AMF0Serializer as(&wb);
+    AMF3Serializer a3s(&wb);
+
+    as.writeString("connect");
+    as.writeNumber(1);
+    as.writeAvmPlusObject();
+    a3s.writeObjectStart();
+    a3s.writeObjectKey("app");
+    a3s.writeString("live");
+    a3s.writeObjectKey("tcUrl");
+    a3s.writeString("rtmp://localhost/live");
+    a3s.writeObjectKey("objectEncoding");
+    a3s.writeNumber(3);
+    a3s.writeObjectKey("swfUrl");
+    // sent as a reference
+    a3s.writeString("live");
+    a3s.writeObjectEnd();
+
+    AMF0Reader ar(wb.getBufferPtr(), wb.getBufferCount());
+
+    StrRef cmd = ar.readString();
+    double transactionId = ar.readNumber();
+    printf("%.*s %g\n", cmd.len, cmd.data, transactionId);
+
+    AMF3Reader& a3 = ar.beginAMF3();
+    AMF3ObjectCursor oc;
+    StrRef key;
+
+    a3.readObjectStart(oc);
+    while(a3.nextProperty(oc, key))
+    {
+        if(a3.isNextNumber())
+        {
+            printf("%.*s=%g\n", key.len, key.data, a3.readNumber());
+        }
+        else
+        {
+            StrRef v = a3.readString();
+            printf("%.*s=%.*s\n", key.len, key.data, v.len, v.data);
+        }
+    }
+    ar.endAMF3();
+
+    printf("%d\n", ar.isFinished());
+}
@@ -0,0 +1 @@
+g++ -g -Wall -O0 test.cpp ../../rtmpconnection.cpp ../../rtmpparser.cpp ../../amf0.cpp ../../amf3.cpp ../../chunkwriter.cpp ../../amf0value.cpp ../../amfkeys.cpp ../../arena.cpp ../../readbuffer.cpp ../../writebuffer.cpp ../../utility.cpp ../../memaccount.cpp ../../log.cpp ../../metrics.cpp ../../latency.cpp ../../wirecapture.cpp ../../timerwheel.cpp ../../handoff.cpp -lboost_thread -lboost_system -lpthread
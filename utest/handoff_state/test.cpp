@@ -0,0 +1,166 @@
+#include "../../rtmpconnection.h"
+#include "../../amf0.h"
+#include <stdio.h>
+
+class RecordingActor : public RtmpActor
+{
+    public:
+        vector<RtmpMsgHeaderPtr> media;
+        string published;
+
+        bool onConnect(ConnectCmdPtr cmd) { return true; }
+        void onDisconnect() {}
+        bool onPublish(int streamId, string publishUrl) { published = publishUrl; return true; }
+        bool onCreateStream(int nextStreamId) { return true; }
+        bool onMetaData(int streamId, MetaDataMsgPtr metaData) { return true; }
+
+        bool onReceiveStream(int streamId, bool isVideo, RtmpMsgHeaderPtr msg)
+        {
+            media.push_back(msg);
+            return true;
+        }
+};
+
+// a type 0 header, type 3 headers every 128 bytes
+void writeMessage(vector<uint8_t>& out, int chunkStreamId, int typeId, int streamId, const uint8_t* data, int len)
+{
+    uint8_t header[12] = {(uint8_t)chunkStreamId, 0, 0, 0, (uint8_t)(len >> 16), (uint8_t)(len >> 8),
+        (uint8_t)len, (uint8_t)typeId, (uint8_t)streamId, 0, 0, 0};
+    out.insert(out.end(), header, header + 12);
+
+    for(int offset = 0; offset < len; offset += 128)
+    {
+        if(offset > 0)
+        {
+            out.push_back(0xc0 | chunkStreamId);
+        }
+
+        int n = len - offset < 128 ? len - offset : 128;
+        out.insert(out.end(), data + offset, data + offset + n);
+    }
+}
+
+void writeCommand(vector<uint8_t>& out, int chunkStreamId, int streamId, WriteBuffer& wb)
+{
+    writeMessage(out, chunkStreamId, MST_CmdAMF0, streamId, wb.getBufferPtr(), wb.getBufferCount());
+    wb.reInit();
+}
+
+// replies are queued, there is no socket to send them on
+void feed(RtmpConnection& conn, const vector<uint8_t>& data, int from, int to)
+{
+    conn.onReceive(&data[from], to - from);
+
+    vector<uint8_t> replies;
+    conn.takeOutput(replies);
+}
+
+bool resumes(const vector<uint8_t>& state)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    RtmpConnection conn(-1, addr, RtmpActorPtr(new RecordingActor()));
+    conn.setDeferredSend(true);
+
+    try
+    {
+        conn.resume(state);
+    }
+    catch(RtmpBadProtocalData& e)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    vector<uint8_t> session(1 + 1536 * 2, 0);
+    session[0] = 3;
+
+    WriteBuffer wb(256);
+    AMF0Serializer s(&wb);
+    s.writeString("connect");
+    s.writeNumber(1);
+    s.writeObjectStart();
+    s.writeObjectKey("app");
+    s.writeString("live");
+    s.writeObjectEnd();
+    writeCommand(session, 3, 0, wb);
+    s.writeString("createStream");
+    s.writeNumber(2);
+    s.writeNull();
+    writeCommand(session, 3, 0, wb);
+    s.writeString("publish");
+    s.writeNumber(3);
+    s.writeNull();
+    s.writeString("cam");
+    s.writeString("live");
+    writeCommand(session, 4, 1, wb);
+
+    // video on chunk stream 6 and audio on 7, their chunks interleaved
+    vector<uint8_t> video(300);
+    vector<uint8_t> audio(200);
+    for(size_t i = 0; i < video.size(); i++)
+    {
+        video[i] = i * 7;
+    }
+    for(size_t i = 0; i < audio.size(); i++)
+    {
+        audio[i] = i * 13;
+    }
+    video[0] = 0x27;
+    audio[0] = 0xaf;
+    audio[1] = 1;
+
+    vector<uint8_t> v;
+    vector<uint8_t> a;
+    writeMessage(v, 6, MST_Video, 1, &video[0], video.size());
+    writeMessage(a, 7, MST_Audio, 1, &audio[0], audio.size());
+
+    // v: 12 + 128 | 1 + 128 | 1 + 44, a: 12 + 128 | 1 + 72
+    vector<uint8_t> media;
+    media.insert(media.end(), v.begin(), v.begin() + 140);
+    media.insert(media.end(), a.begin(), a.begin() + 140);
+    media.insert(media.end(), v.begin() + 140, v.begin() + 269);
+    media.insert(media.end(), a.begin() + 140, a.end());
+    media.insert(media.end(), v.begin() + 269, v.end());
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    RecordingActor* oldActor = new RecordingActor();
+    RtmpConnection oldConn(-1, addr, RtmpActorPtr(oldActor));
+    oldConn.setDeferredSend(true);
+    feed(oldConn, session, 0, session.size());
+
+    // the second video chunk is cut in its middle
+    int cut = 140 + 140 + 60;
+    feed(oldConn, media, 0, cut);
+
+    vector<uint8_t> state;
+    bool suspended = oldConn.suspend(state);
+
+    RecordingActor* newActor = new RecordingActor();
+    RtmpConnection newConn(-1, addr, RtmpActorPtr(newActor));
+    newConn.setDeferredSend(true);
+    newConn.resume(state);
+    feed(newConn, media, cut, media.size());
+
+    printf("%d %d %s %d\n", suspended, (int)oldActor->media.size(), newActor->published.c_str(),
+            (int)newActor->media.size());
+
+    for(size_t i = 0; i < newActor->media.size(); i++)
+    {
+        RtmpMsgHeaderPtr& mh = newActor->media[i];
+        vector<uint8_t>& body = mh->typeId == MST_Video ? video : audio;
+        printf("%d %d %d\n", mh->typeId, mh->length,
+                mh->length == (int)body.size() && memcmp(mh->body, &body[0], body.size()) == 0);
+    }
+
+    vector<uint8_t> truncated(state.begin(), state.begin() + state.size() / 2);
+    vector<uint8_t> wrongVersion(state);
+    wrongVersion[3] ^= 0xff;
+
+    printf("%d %d %d\n", resumes(state), resumes(truncated), resumes(wrongVersion));
+}
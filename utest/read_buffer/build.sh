@@ -1,2 +1,2 @@
 rm ../../*.gch -f
-g++ -g -Wall -O0 test.cpp ../../readbuffer.cpp ../../rtmpexception.h
+g++ -g -Wall -O0 test.cpp ../../readbuffer.cpp ../../memaccount.cpp ../../log.cpp ../../rtmpexception.h -lboost_thread -lpthread
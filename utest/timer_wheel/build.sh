@@ -0,0 +1 @@
+g++ -g -Wall -O0 test.cpp ../../timerwheel.cpp -lboost_system
@@ -0,0 +1,135 @@
+#include "../../timerwheel.h"
+#include <stdio.h>
+#include <boost/bind.hpp>
+
+const int TICK = 10;
+
+// microseconds of the wheel when it has advanced n ticks
+int64_t at(int64_t ticks)
+{
+    return ticks * TICK * 1000;
+}
+
+void count(int* runs)
+{
+    (*runs)++;
+}
+
+void cancelOther(int* runs, Timer* other)
+{
+    (*runs)++;
+    other->cancel();
+}
+
+void destroyOther(int* runs, Timer* other)
+{
+    (*runs)++;
+    delete other;
+}
+
+void rearm(int* runs, TimerWheel* wheel, Timer* self)
+{
+    (*runs)++;
+    wheel->schedule(self, 0);
+}
+
+// runs on the tick of its delay, not one before
+void fires(int64_t ticks)
+{
+    TimerWheel wheel(TICK, 0);
+    int runs = 0;
+    Timer t;
+    t.setCallback(boost::bind(count, &runs));
+    wheel.schedule(&t, ticks * TICK);
+
+    wheel.advance(at(ticks - 1));
+    int early = runs;
+    wheel.advance(at(ticks));
+
+    printf("%lld %d %d %d\n", (long long)ticks, early, runs, wheel.getCount());
+}
+
+int main(int argc, char* argv[])
+{
+    // the first tick of every level and the last of the one below
+    fires(1);
+    fires(255);
+    fires(256);
+    fires(257);
+    fires(65535);
+    fires(65536);
+    fires(65537);
+
+    // past the last level, it must not come back around where level 3 wraps
+    {
+        TimerWheel wheel(TICK, 0);
+        int runs = 0;
+        Timer t;
+        t.setCallback(boost::bind(count, &runs));
+        wheel.schedule(&t, (((int64_t)1 << 32) + ((int64_t)1 << 24)) * TICK);
+
+        wheel.advance(at(((int64_t)1 << 24) + 1));
+        printf("capped %d %d %d\n", runs, wheel.getCount(), t.isArmed());
+    }
+
+    // a callback cancels and destroys timers due on the same tick
+    {
+        TimerWheel wheel(TICK, 0);
+        int runs = 0;
+        Timer a;
+        Timer b;
+        Timer* c = new Timer();
+        Timer* d = new Timer();
+        a.setCallback(boost::bind(cancelOther, &runs, &b));
+        b.setCallback(boost::bind(count, &runs));
+        c->setCallback(boost::bind(destroyOther, &runs, d));
+        d->setCallback(boost::bind(count, &runs));
+        wheel.schedule(&a, TICK);
+        wheel.schedule(&b, TICK);
+        wheel.schedule(c, TICK);
+        wheel.schedule(d, TICK);
+
+        wheel.advance(at(1));
+        printf("cancelled %d %d %d\n", runs, wheel.getCount(), b.isArmed());
+        delete c;
+    }
+
+    // a callback arms its own timer again, it runs on the next tick
+    {
+        TimerWheel wheel(TICK, 0);
+        int runs = 0;
+        Timer t;
+        t.setCallback(boost::bind(rearm, &runs, &wheel, &t));
+        wheel.schedule(&t, TICK);
+
+        wheel.advance(at(1));
+        int first = runs;
+        wheel.advance(at(5));
+        printf("rearmed %d %d %d\n", first, runs, wheel.getCount());
+        t.cancel();
+    }
+
+    // in milliseconds, rounded up
+    {
+        TimerWheel wheel(TICK, 0);
+        int runs = 0;
+        int64_t empty = wheel.getNextDelay(0);
+
+        Timer t;
+        t.setCallback(boost::bind(count, &runs));
+        wheel.schedule(&t, 50);
+        int64_t armed = wheel.getNextDelay(0);
+        int64_t later = wheel.getNextDelay(at(2) + 500);
+        int64_t due = wheel.getNextDelay(at(6));
+
+        // on level 1 only the next cascade is known
+        Timer far;
+        far.setCallback(boost::bind(count, &runs));
+        wheel.schedule(&far, 300 * TICK);
+        t.cancel();
+        int64_t cascade = wheel.getNextDelay(0);
+
+        printf("next %lld %lld %lld %lld %lld\n", (long long)empty, (long long)armed,
+                (long long)later, (long long)due, (long long)cascade);
+    }
+}
@@ -1 +1 @@
-g++ -g -Wall -O0 test.cpp ../../writebuffer.cpp ../../rtmpexception.h
+g++ -g -Wall -O0 test.cpp ../../writebuffer.cpp ../../memaccount.cpp ../../log.cpp ../../rtmpexception.h -lboost_thread -lpthread
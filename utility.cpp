@@ -1,5 +1,6 @@
 #include "utility.h"
 #include <sys/time.h>
+#include <time.h>
 #include <stdio.h>
 #include <iostream>
 #include <sstream>
@@ -13,6 +14,15 @@ uint32_t Utility::getTimestamp()
     return tv.tv_sec;
 }
 
+int64_t Utility::getMonotonicMicros()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 bool Utility::compareData(uint8_t* data1, uint8_t* data2, int size)
 {
     for(int i = 0; i < size; i++)
@@ -8,6 +8,8 @@ class Utility
 {
 public:
     static uint32_t getTimestamp();
+    // microseconds from CLOCK_MONOTONIC
+    static int64_t getMonotonicMicros();
     static bool compareData(uint8_t* data1, uint8_t* data2, int size);
     static void reverseBytes(uint8_t* bytes, int size);
     static bool dumpData(uint8_t* bytes, int size, char* fileName);
@@ -0,0 +1,192 @@
+#include "wirecapture.h"
+#include "rtmpexception.h"
+#include "utility.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+string WireCapture::directory_;
+
+WireCapture::WireCapture(const string& path):
+    file_(NULL), lastTime_(Utility::getMonotonicMicros())
+{
+    // what clients send may hold stream keys, only the owner reads it. an
+    // existing file is never followed or overwritten
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd == -1)
+    {
+        throw RtmpInternalError("open capture file failed", errno);
+    }
+
+    if(!(file_ = fdopen(fd, "wb")))
+    {
+        int err = errno;
+        close(fd);
+        throw RtmpInternalError("open capture file failed", err);
+    }
+
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t start = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    uint8_t header[4 + 1 + 8];
+    memcpy(header, "TVRC", 4);
+    header[4] = VERSION;
+    for(int i = 0; i < 8; i++)
+    {
+        header[5 + i] = start >> ((7 - i) * 8);
+    }
+
+    fwrite(header, 1, sizeof(header), file_);
+}
+
+WireCapture::~WireCapture()
+{
+    if(file_)
+    {
+        fclose(file_);
+        file_ = NULL;
+    }
+}
+
+void WireCapture::writeVarint(uint64_t v)
+{
+    uint8_t buf[10];
+    int n = 0;
+
+    do
+    {
+        buf[n] = v & 0x7f;
+        v >>= 7;
+        if(v)
+        {
+            buf[n] |= 0x80;
+        }
+        n++;
+    } while(v);
+
+    fwrite(buf, 1, n, file_);
+}
+
+void WireCapture::write(const uint8_t* data, int size)
+{
+    int64_t now = Utility::getMonotonicMicros();
+
+    writeVarint(now - lastTime_);
+    writeVarint(size);
+    fwrite(data, 1, size, file_);
+
+    lastTime_ = now;
+}
+
+void WireCapture::enable(const string& dir)
+{
+    directory_ = dir;
+}
+
+WireCapturePtr WireCapture::create(const struct sockaddr_in& clientAddr)
+{
+    if(directory_.empty())
+    {
+        return WireCapturePtr();
+    }
+
+    timeval tv;
+    gettimeofday(&tv, NULL);
+
+    char name[128];
+    snprintf(name, sizeof(name), "/%s_%d_%lld%06ld.rtmpcap", inet_ntoa(clientAddr.sin_addr),
+            ntohs(clientAddr.sin_port), (long long)tv.tv_sec, (long)tv.tv_usec);
+
+    try
+    {
+        return WireCapturePtr(new WireCapture(directory_ + name));
+    }
+    catch(RtmpInternalError& e)
+    {
+        RTMP_LOG(LEVWARN, "capture disabled for the connection: %s\n", e.what());
+        return WireCapturePtr();
+    }
+}
+
+namespace
+{
+
+bool readVarint(FILE* file, uint64_t& v)
+{
+    v = 0;
+
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+        int c = fgetc(file);
+        if(c == EOF)
+        {
+            if(shift == 0)
+            {
+                return false;
+            }
+
+            throw RtmpBadProtocalData("capture is truncated");
+        }
+
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+        {
+            return true;
+        }
+    }
+
+    throw RtmpBadProtocalData("bad varint in capture");
+}
+
+}
+
+void WireCaptureReader::load(const string& path, vector<WireSegment>& segments)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file)
+    {
+        throw RtmpInternalError("open capture file failed", errno);
+    }
+
+    try
+    {
+        uint8_t header[4 + 1 + 8];
+        if(fread(header, 1, sizeof(header), file) != sizeof(header) ||
+                memcmp(header, "TVRC", 4) != 0 || header[4] != WireCapture::VERSION)
+        {
+            throw RtmpBadProtocalData("not a capture file");
+        }
+
+        uint64_t delta;
+        while(readVarint(file, delta))
+        {
+            uint64_t size;
+            if(!readVarint(file, size) || size > 0x7fffffff)
+            {
+                throw RtmpBadProtocalData("bad segment size in capture");
+            }
+
+            segments.push_back(WireSegment());
+            WireSegment& s = segments.back();
+            s.delta = delta;
+            s.data.resize(size);
+
+            if(size > 0 && fread(&s.data[0], 1, size, file) != size)
+            {
+                throw RtmpBadProtocalData("capture is truncated");
+            }
+        }
+    }
+    catch(RtmpException& e)
+    {
+        fclose(file);
+        throw;
+    }
+
+    fclose(file);
+}
@@ -0,0 +1,65 @@
+#ifndef WIRE_CAPTURE_H
+#define WIRE_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <boost/shared_ptr.hpp>
+
+using namespace std;
+
+/*
+ * records what a client sends, one segment per recv()
+ *
+ * file layout:
+ *   "TVRC", version byte, start time as 8 bytes big endian unix microseconds
+ *   then per segment: varint microseconds since the previous segment,
+ *   varint size, the bytes
+ */
+class WireCapture
+{
+    public:
+        const static uint8_t VERSION = 1;
+
+    private:
+        FILE* file_;
+        int64_t lastTime_;
+
+        static string directory_;
+
+        WireCapture(const WireCapture&);
+        WireCapture& operator=(const WireCapture&);
+
+        void writeVarint(uint64_t v);
+
+    public:
+        WireCapture(const string& path);
+        ~WireCapture();
+
+        void write(const uint8_t* data, int size);
+
+        // every new connection is captured into dir, empty turns it off
+        static void enable(const string& dir);
+        // NULL when capturing is off or the file can not be created
+        static boost::shared_ptr<WireCapture> create(const struct sockaddr_in& clientAddr);
+};
+
+typedef boost::shared_ptr<WireCapture> WireCapturePtr;
+
+struct WireSegment
+{
+    // microseconds since the previous segment
+    int64_t delta;
+    vector<uint8_t> data;
+};
+
+class WireCaptureReader
+{
+    public:
+        // throws RtmpBadProtocalData if the file is not a capture
+        static void load(const string& path, vector<WireSegment>& segments);
+};
+
+#endif
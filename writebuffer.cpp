@@ -10,8 +10,14 @@ WriteBuffer::WriteBuffer(int32_t size)
     }
 
     size_ = size;
-    buffer_ = new uint8_t[size_]; 
-    memset(buffer_, 0, size_);
+    buffer_ = NULL;
+
+    // allocated by the first write when 0
+    if(size_ > 0)
+    {
+        buffer_ = new uint8_t[size_]; 
+        memset(buffer_, 0, size_);
+    }
 
     bi_ = 0;
     bits_left_ = 8;
@@ -19,15 +25,35 @@ WriteBuffer::WriteBuffer(int32_t size)
 
 WriteBuffer::~WriteBuffer()
 {
+    if(account_)
+    {
+        account_->release(size_);
+    }
+
     delete[] buffer_;
     bi_ = 0;
     bits_left_ = 0;
     size_ = 0;
 }
 
+void WriteBuffer::setMemAccount(MemAccountPtr account)
+{
+    if(account)
+    {
+        account->charge(size_);
+    }
+
+    if(account_)
+    {
+        account_->release(size_);
+    }
+
+    account_ = account;
+}
+
 void WriteBuffer::writeBytes(uint8_t* data, int size)
 {
-    while(size > size_ - bi_ + 1)
+    while(size > size_ - bi_)
     {
         realloc();
     }
@@ -50,14 +76,39 @@ void WriteBuffer::writeBytes(uint8_t* data, int size)
 
 void WriteBuffer::realloc()
 {
-    uint8_t* buf = new uint8_t[size_ * 2];
-    memset(buf, 0, size_ * 2);
-    memcpy(buf, buffer_, bi_);
+    int32_t size = size_ > 0 ? size_ * 2 : WriteBuffer::FIRST_SIZE;
+
+    if(account_)
+    {
+        account_->charge(size);
+        account_->release(size_);
+    }
+
+    uint8_t* buf = new uint8_t[size];
+    memset(buf, 0, size);
+    if(buffer_)
+    {
+        memcpy(buf, buffer_, bi_);
+    }
 
     delete[] buffer_;
     buffer_ = buf;
 
-    size_ *= 2;
+    size_ = size;
+}
+
+void WriteBuffer::release()
+{
+    if(account_)
+    {
+        account_->release(size_);
+    }
+
+    delete[] buffer_;
+    buffer_ = NULL;
+    size_ = 0;
+    bi_ = 0;
+    bits_left_ = 8;
 }
 
 void WriteBuffer::realloc_for_write()
@@ -101,7 +152,10 @@ void WriteBuffer::writeByte(uint8_t s)
 
 void WriteBuffer::reInit()
 {
-    memset(buffer_, 0, size_);
+    if(buffer_)
+    {
+        memset(buffer_, 0, size_);
+    }
     bi_ = 0;
     bits_left_ = 8;
 }
@@ -3,16 +3,22 @@
 
 #include <stdint.h>
 #include "rtmpexception.h"
+#include "memaccount.h"
 #include <boost/shared_ptr.hpp>
 
 class WriteBuffer
 {
     private:
+      // what a buffer created with size 0 starts with
+      const static int32_t FIRST_SIZE = 256;
+
       uint8_t* buffer_;
       int32_t bi_;
       int32_t bits_left_;
       int32_t size_;
 
+      MemAccountPtr account_;
+
       /*
        * realloc buffer if needed
        */
@@ -23,12 +29,17 @@ class WriteBuffer
       WriteBuffer(int32_t size);
       ~WriteBuffer();
 
+      // charge the allocated size to account from now on
+      void setMemAccount(MemAccountPtr account);
+
       void writeBytes(uint8_t* data, int size);
 
       void writeByte(uint8_t s, int bits);
       void writeByte(uint8_t s);
 
       void reInit();
+      // frees the storage, what was written is dropped
+      void release();
       uint8_t* getBuffer();
       uint8_t* getBufferPtr();
       int getBufferCount();